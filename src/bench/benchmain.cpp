@@ -0,0 +1,111 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: benchmain.cpp
+// Entry point for ariel_bench
+
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <tbb/tbb.h>
+#include "kernelbench.hpp"
+#include "scalingbench.hpp"
+
+using namespace std;
+
+int main(int argc, char** argv){
+    string filter = "";
+    string csvfile = "";
+    string scratch = ".";
+    int repetitions = 5;
+    int threads = tbb::task_scheduler_init::automatic;
+    vector<string> resolutions = utilityCore::tokenizeString("32,64,128", ",");
+    vector<string> densities = utilityCore::tokenizeString("0.5", ",");
+    vector<string> scalingScenes;
+    vector<string> threadCounts;
+    int frames = 10;
+    bool strong = true;
+    bool weak = true;
+
+    for(int i=1; i<argc; i++){
+        string header; string data;
+        istringstream liness(argv[i]);
+        getline(liness, header, '='); getline(liness, data, '=');
+        if(strcmp(header.c_str(), "-filter")==0){
+            filter = data;
+        }else if(strcmp(header.c_str(), "-repetitions")==0){
+            repetitions = atoi(data.c_str());
+        }else if(strcmp(header.c_str(), "-resolutions")==0){
+            resolutions = utilityCore::tokenizeString(data, ",");
+        }else if(strcmp(header.c_str(), "-densities")==0){
+            densities = utilityCore::tokenizeString(data, ",");
+        }else if(strcmp(header.c_str(), "-threads")==0){
+            threads = atoi(data.c_str());
+        }else if(strcmp(header.c_str(), "-csv")==0){
+            csvfile = data;
+        }else if(strcmp(header.c_str(), "-scratch")==0){
+            scratch = data;
+        }else if(strcmp(header.c_str(), "-scaling")==0){
+            scalingScenes = utilityCore::tokenizeString(data, ",");
+        }else if(strcmp(header.c_str(), "-threadcounts")==0){
+            threadCounts = utilityCore::tokenizeString(data, ",");
+        }else if(strcmp(header.c_str(), "-frames")==0){
+            frames = atoi(data.c_str());
+        }else if(strcmp(header.c_str(), "-strong")==0){
+            strong = atoi(data.c_str())!=0;
+        }else if(strcmp(header.c_str(), "-weak")==0){
+            weak = atoi(data.c_str())!=0;
+        }else{
+            cout << "Warning: unknown argument " << argv[i] << endl;
+        }
+    }
+
+    //scene runs set up their own scheduler per thread count, so none may be active around them
+    if(scalingScenes.empty()==false){
+        vector<int> counts;
+        for(unsigned int t=0; t<threadCounts.size(); t++){
+            if(atoi(threadCounts[t].c_str())>0){
+                counts.push_back(atoi(threadCounts[t].c_str()));
+            }
+        }
+        if(counts.empty()==true){
+            int hardware = tbb::task_scheduler_init::default_num_threads();
+            for(int t=1; t<hardware; t*=2){
+                counts.push_back(t);
+            }
+            counts.push_back(hardware);
+        }
+        benchCore::ScalingBench scaling(scalingScenes, frames, counts);
+        scaling.Run(strong, weak);
+        if(csvfile.empty()==false){
+            scaling.WriteCSV(csvfile);
+        }
+        return 0;
+    }
+
+    tbb::task_scheduler_init init(threads);
+    benchCore::BenchmarkRunner runner(filter, repetitions);
+    for(unsigned int r=0; r<resolutions.size(); r++){
+        int resolution = atoi(resolutions[r].c_str());
+        if(resolution<=0){
+            cout << "Warning: skipping resolution " << resolutions[r] << endl;
+            continue;
+        }
+        for(unsigned int d=0; d<densities.size(); d++){
+            float density = (float)atof(densities[d].c_str());
+            if(density<=0.0f){
+                cout << "Warning: skipping density " << densities[d] << endl;
+                continue;
+            }
+            benchCore::KernelBench bench(resolution, density);
+            bench.Run(&runner);
+        }
+        benchCore::KernelBench::RunGeometry(&runner, resolution, scratch);
+    }
+
+    if(csvfile.empty()==false){
+        runner.WriteCSV(csvfile);
+    }
+    return 0;
+}
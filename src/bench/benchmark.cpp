@@ -0,0 +1,67 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: benchmark.cpp
+// Implements benchmark.hpp
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <algorithm>
+#include "benchmark.hpp"
+
+namespace benchCore {
+
+BenchmarkRunner::BenchmarkRunner(const std::string& filter, const int& repetitions){
+    m_filter = filter;
+    m_repetitions = std::max(1, repetitions);
+}
+
+BenchmarkRunner::~BenchmarkRunner(){
+}
+
+bool BenchmarkRunner::IsSelected(const std::string& name){
+    return m_filter.empty() || name.find(m_filter)!=std::string::npos;
+}
+
+void BenchmarkRunner::AddResult(const std::string& name, const std::string& fixture,
+                                const std::string& unit, const unsigned long long& items,
+                                std::vector<double>& times){
+    std::sort(times.begin(), times.end());
+    BenchmarkResult result;
+    result.m_name = name;
+    result.m_fixture = fixture;
+    result.m_unit = unit;
+    result.m_items = items;
+    result.m_repetitions = times.size();
+    result.m_minSeconds = times[0];
+    result.m_medianSeconds = times[times.size()/2];
+    m_results.push_back(result);
+
+    double rate = result.m_medianSeconds>0.0 ? (double)items/result.m_medianSeconds : 0.0;
+    std::cout << std::left << std::setw(28) << name << std::setw(16) << fixture
+              << std::right << std::fixed << std::setprecision(3)
+              << std::setw(12) << result.m_medianSeconds*1000.0 << " ms median"
+              << std::setw(12) << result.m_minSeconds*1000.0 << " ms min"
+              << std::setw(14) << rate/1.0e6 << " M" << unit << "/s" << std::endl;
+}
+
+bool BenchmarkRunner::WriteCSV(const std::string& filename){
+    std::ofstream file(filename.c_str());
+    if(file.is_open()==false){
+        std::cout << "Warning: Unable to write " << filename << std::endl;
+        return false;
+    }
+    file << "benchmark,fixture,unit,items,repetitions,min_seconds,median_seconds,items_per_second"
+         << std::endl;
+    for(unsigned int r=0; r<m_results.size(); r++){
+        const BenchmarkResult& result = m_results[r];
+        double rate = result.m_medianSeconds>0.0 ?
+                      (double)result.m_items/result.m_medianSeconds : 0.0;
+        file << result.m_name << "," << result.m_fixture << "," << result.m_unit << ","
+             << result.m_items << "," << result.m_repetitions << "," << result.m_minSeconds
+             << "," << result.m_medianSeconds << "," << rate << std::endl;
+    }
+    return true;
+}
+}
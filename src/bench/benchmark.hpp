@@ -0,0 +1,95 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: benchmark.hpp
+// Minimal timing harness for ariel_bench, repeats a kernel and reports throughput
+
+#ifndef BENCHMARK_HPP
+#define BENCHMARK_HPP
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <tbb/tbb.h>
+
+namespace benchCore {
+//====================================
+// Struct and Class Declarations
+//====================================
+
+struct BenchmarkResult{
+    std::string             m_name;
+    std::string             m_fixture; //resolution and density the kernel ran on
+    std::string             m_unit; //what m_items counts
+    unsigned long long      m_items; //work done by one run
+    int                     m_repetitions;
+    double                  m_minSeconds;
+    double                  m_medianSeconds;
+};
+
+//Swallows everything written to it
+class NullBuffer: public std::streambuf{
+    protected:
+        int overflow(int c){
+            return c;
+        }
+};
+
+//Every benchmark runs once untimed to warm caches and the TBB pool, then m_repetitions timed
+//runs. Setup runs before every run and is never timed. Throughput is items over the median run.
+//Kernels log to std::cout, so it is silenced while setup and the kernel run
+class BenchmarkRunner{
+    public:
+        BenchmarkRunner(const std::string& filter, const int& repetitions);
+        ~BenchmarkRunner();
+
+        //true if name contains the filter, or there is no filter
+        bool IsSelected(const std::string& name);
+
+        template <typename S, typename F> void Run(const std::string& name,
+                                                   const std::string& fixture,
+                                                   const std::string& unit,
+                                                   const unsigned long long& items,
+                                                   const S& setup, const F& fn);
+
+        bool WriteCSV(const std::string& filename);
+
+    private:
+        void AddResult(const std::string& name, const std::string& fixture,
+                       const std::string& unit, const unsigned long long& items,
+                       std::vector<double>& times);
+
+        std::string                                         m_filter;
+        int                                                 m_repetitions;
+        std::vector<BenchmarkResult>                        m_results;
+        NullBuffer                                          m_silence;
+};
+
+//====================================
+// Template Implementations
+//====================================
+
+template <typename S, typename F> void BenchmarkRunner::Run(const std::string& name,
+                                                            const std::string& fixture,
+                                                            const std::string& unit,
+                                                            const unsigned long long& items,
+                                                            const S& setup, const F& fn){
+    if(IsSelected(name)==false){
+        return;
+    }
+    std::streambuf* output = std::cout.rdbuf(&m_silence);
+    setup();
+    fn();
+    std::vector<double> times;
+    for(int r=0; r<m_repetitions; r++){
+        setup();
+        tbb::tick_count start = tbb::tick_count::now();
+        fn();
+        times.push_back((tbb::tick_count::now()-start).seconds());
+    }
+    std::cout.rdbuf(output);
+    AddResult(name, fixture, unit, items, times);
+}
+}
+
+#endif
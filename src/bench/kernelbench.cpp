@@ -0,0 +1,235 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: kernelbench.cpp
+// Implements kernelbench.hpp
+
+#include <sstream>
+#include <cstdio>
+#include "kernelbench.hpp"
+#include "../sim/particlegridoperations.inl"
+#include "../sim/particleresampler.inl"
+#include "../sim/solver.inl"
+#include "../math/random.inl"
+#include "../geom/spheregen.hpp"
+
+namespace benchCore {
+
+//sim step size, only the resampler reads it
+#define KERNEL_BENCH_STEP_SIZE 0.005f
+//rays per Bvh::Traverse run
+#define KERNEL_BENCH_RAYS (1<<18)
+
+KernelBench::KernelBench(const int& resolution, const float& density){
+    m_resolution = resolution;
+    m_density = density;
+    std::ostringstream fixture;
+    fixture << resolution << "^3/d" << density;
+    m_fixture = fixture.str();
+    m_sink = 0;
+
+    //a fresh scene has no geometry, so nothing is emitted and every solid query is empty
+    m_scene = new sceneCore::Scene();
+    fluidCore::SimSettings settings = fluidCore::CreateSimSettings();
+    //every solve then starts from zero pressure, so repeated solves do equal work
+    settings.m_warmStart = false;
+    m_sim = new fluidCore::FlipSim(glm::vec3(resolution), density, KERNEL_BENCH_STEP_SIZE,
+                                   m_scene, settings, false);
+    m_sim->ComputeMaxDensity();
+    FillDamBreak();
+    PrepareStep();
+    m_positions = m_sim->m_particles.m_p;
+    m_velocities = m_sim->m_particles.m_u;
+}
+
+KernelBench::~KernelBench(){
+    delete m_sim;
+    delete m_scene;
+}
+
+//Liquid block over the lower left of the box with a swirl, so the splat and the solve see
+//velocity gradients and a free surface
+void KernelBench::FillDamBreak(){
+    float maxd = (float)m_resolution;
+    float h = m_density/maxd;
+    int nx = (int)(0.5f/h); int ny = (int)(0.6f/h); int nz = (int)(0.9f/h);
+    fluidCore::ParticleSet* particles = &m_sim->m_particles;
+    ReserveParticleSet(particles, nx*ny*nz);
+    for(int i=0; i<nx; i++){
+        for(int j=0; j<ny; j++){
+            for(int k=0; k<nz; k++){
+                unsigned int n = (i*ny+j)*nz+k;
+                glm::vec3 jitter = mathCore::RandomVec3(RANDOM_STREAM_SEED, 0, n, 0) - 0.5f;
+                glm::vec3 p = glm::vec3(0.05f) + (glm::vec3(i,j,k) + 0.5f + 0.5f*jitter)*h;
+                glm::vec3 u = glm::vec3(-(p.y-0.35f), p.x-0.3f, 0.0f) - glm::vec3(0,0.5f,0);
+                fluidCore::Particle particle = fluidCore::CreateParticle(p, u, glm::vec3(0.0f),
+                                                                         0.0f);
+                particle.m_type = FLUID;
+                particle.m_mass = 1.0f;
+                particle.m_invalid = false;
+                particle.m_id = n;
+                AppendParticle(particles, particle);
+            }
+        }
+    }
+}
+
+//Same order as FlipSim::Step up to the velocity extrapolation
+void KernelBench::PrepareStep(){
+    fluidCore::FlipSim* sim = m_sim;
+    fluidCore::ParticleSet* particles = &sim->m_particles;
+    NullBuffer silence;
+    std::streambuf* output = std::cout.rdbuf(&silence);
+    sim->m_pgrid->Sort(particles);
+    sim->ComputeDensity();
+    fluidCore::TransferParticlesToMACGrid(sim->m_pgrid, particles, &sim->m_mgrid,
+                                          sim->m_settings, &sim->m_floatPool);
+    sim->m_pgrid->MarkCellTypes(particles, sim->m_mgrid.m_A, sim->m_mgrid.m_L, sim->m_density);
+    fluidCore::BuildTileMask(&sim->m_tiles, sim->m_pgrid->GetFluidTiles());
+    sim->StorePreviousGrid();
+    fluidCore::EnforceBoundaryVelocity(&sim->m_mgrid);
+    sim->Project();
+    fluidCore::EnforceBoundaryVelocity(&sim->m_mgrid);
+    sim->ExtrapolateVelocity();
+    std::cout.rdbuf(output);
+}
+
+void KernelBench::RestoreParticles(){
+    fluidCore::ParticleSet* particles = &m_sim->m_particles;
+    std::copy(m_positions.begin(), m_positions.end(), particles->m_p.begin());
+    std::copy(m_velocities.begin(), m_velocities.end(), particles->m_u.begin());
+}
+
+void KernelBench::Run(BenchmarkRunner* runner){
+    fluidCore::FlipSim* sim = m_sim;
+    fluidCore::ParticleSet* particles = &sim->m_particles;
+    fluidCore::ParticleGrid* pgrid = sim->m_pgrid;
+    fluidCore::MacGrid* mgrid = &sim->m_mgrid;
+    unsigned int particleCount = fluidCore::GetParticleCount(particles);
+    unsigned long long cells = (unsigned long long)m_resolution*m_resolution*m_resolution;
+    float maxd = (float)m_resolution;
+    std::vector<unsigned int> liquid(particleCount);
+    for(unsigned int p=0; p<particleCount; p++){
+        liquid[p] = p;
+    }
+    unsigned long long* sink = &m_sink;
+    std::cout << particleCount << " particles, " << sim->CountFluidCells() << " fluid cells"
+              << " at " << m_fixture << std::endl;
+
+    runner->Run("ParticleGrid::Sort", m_fixture, "particles", particleCount, [](){}, [=](){
+        pgrid->Sort(particles);
+    });
+
+    //the neighbor pattern of ComputeDensity and the resampler
+    runner->Run("ForEachCellNeighbor", m_fixture, "particles", particleCount, [](){}, [=](){
+        tbb::enumerable_thread_specific<unsigned long long> counts(0);
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
+            [&](const tbb::blocked_range<unsigned int>& r){
+                unsigned long long& count = counts.local();
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    glm::vec3 cell = glm::floor(glm::clamp(particles->m_p[i]*maxd,
+                                                           glm::vec3(0.0f),
+                                                           glm::vec3(maxd-1.0f)));
+                    pgrid->ForEachCellNeighbor(cell, glm::vec3(1), [&](const unsigned int& n){
+                        count += n;
+                    });
+                }
+            }
+        );
+        *sink += counts.combine(std::plus<unsigned long long>());
+    });
+
+    runner->Run("SplatParticlesToMACGrid", m_fixture, "particles", particleCount, [](){},
+                [=](){
+        fluidCore::SplatParticlesToMACGrid(pgrid, particles, mgrid);
+    });
+
+    runner->Run("ComputeDensity", m_fixture, "particles", particleCount, [](){}, [=](){
+        sim->ComputeDensity();
+    });
+
+    //after the first run only the occupied tiles are reset and rewritten, as in every substep
+    runner->Run("MarkCellTypes", m_fixture, "particles", particleCount, [](){}, [=](){
+        pgrid->MarkCellTypes(particles, mgrid->m_A, mgrid->m_L, sim->m_density);
+    });
+
+    //D is left negated by the step's own solve and no solve writes it, so every run solves
+    //the same system from zero pressure
+    fluidCore::Grid<float>* preconditioner = sim->m_floatPool.Acquire(mgrid->m_dimensions,
+                                                                      0.0f);
+    fluidCore::BuildPreconditioner(preconditioner, *mgrid, sim->m_subcell, &sim->m_tiles);
+    runner->Run("SolveConjugateGradient", m_fixture, "cells", cells, [](){}, [=](){
+        fluidCore::SolveConjugateGradient(*mgrid, preconditioner, NULL, sim->m_subcell,
+                                          &sim->m_tiles, sim->m_settings, &sim->m_floatPool,
+                                          false);
+    });
+    sim->m_floatPool.Release(preconditioner);
+
+    runner->Run("ExtrapolateVelocity", m_fixture, "cells", cells, [](){}, [=](){
+        sim->ExtrapolateVelocity();
+    });
+
+    float h = m_density/maxd;
+    runner->Run("ResampleParticles", m_fixture, "particles", particleCount,
+                [=](){ RestoreParticles(); }, [=](){
+        fluidCore::ResampleParticles(pgrid, NULL, particles, sim->m_scene, 1, sim->m_stepsize,
+                                     h, sim->m_dimensions);
+    });
+    RestoreParticles();
+
+    runner->Run("LevelSet(ParticleSet)", m_fixture, "particles", particleCount, [](){},
+                [&](){
+        fluidCore::LevelSet levelSet(particles, liquid, maxd);
+    });
+}
+
+void KernelBench::RunGeometry(BenchmarkRunner* runner, const int& resolution,
+                              const std::string& scratchDirectory){
+    std::string fixture = utilityCore::convertIntToString(resolution)+"^3";
+    float maxd = (float)resolution;
+    spaceCore::Bvh<objCore::Obj> mesh;
+    geomCore::SphereGen sphere(4*resolution);
+    sphere.Tesselate(&mesh.m_basegeom, glm::vec3(0.5f*maxd), 0.3f*maxd);
+    mesh.BuildBvh(24);
+    unsigned int polys = mesh.m_basegeom.m_numberOfPolys;
+    std::cout << polys << " polys at " << fixture << std::endl;
+
+    //rays from random points in the box in random directions, as the inside tests cast them
+    tbb::atomic<unsigned long long> hits;
+    hits = 0;
+    spaceCore::Bvh<objCore::Obj>* bvh = &mesh;
+    runner->Run("Bvh::Traverse", fixture, "rays", KERNEL_BENCH_RAYS, [](){}, [&](){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,KERNEL_BENCH_RAYS),
+            [&](const tbb::blocked_range<unsigned int>& r){
+                unsigned long long count = 0;
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    glm::vec3 origin = mathCore::RandomVec3(RANDOM_STREAM_SEED, 1, i, 0)*maxd;
+                    glm::vec3 direction = mathCore::RandomVec3(RANDOM_STREAM_SEED, 1, i, 1) -
+                                          0.5f;
+                    rayCore::Ray ray(origin, glm::normalize(direction+glm::vec3(1.0e-6f)), 0);
+                    spaceCore::HitCountTraverseAccumulator traverser(origin);
+                    bvh->Traverse(ray, traverser);
+                    count += traverser.m_numberOfHits;
+                }
+                hits += count;
+            }
+        );
+    });
+
+    std::string filename = scratchDirectory+"/ariel_bench_sphere_"+
+                           utilityCore::convertIntToString(resolution)+".obj";
+    if(mesh.m_basegeom.WriteObj(filename)==true){
+        objCore::Obj read;
+        runner->Run("Obj::ReadObj", fixture, "polys", polys, [&](){ read.ClearGeometry(); },
+                    [&](){
+            read.ReadObj(filename, false);
+        });
+        std::remove(filename.c_str());
+    }
+
+    runner->Run("LevelSet(Obj)", fixture, "polys", polys, [](){}, [&](){
+        fluidCore::LevelSet levelSet(&mesh.m_basegeom, glm::mat4(1.0f));
+    });
+    mesh.Release(true);
+}
+}
@@ -0,0 +1,54 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: kernelbench.hpp
+// Synthetic fixtures that time the sim's hot kernels without a scene file
+
+#ifndef KERNELBENCH_HPP
+#define KERNELBENCH_HPP
+
+#include <string>
+#include <vector>
+#include "benchmark.hpp"
+#include "../sim/flip.hpp"
+
+namespace benchCore {
+//====================================
+// Class Declarations
+//====================================
+
+//A cubic sim of the given resolution holding a dam break block of liquid, advanced to the middle
+//of a step so every kernel sees the state it sees in FlipSim::Step. Density is the sim's particle
+//spacing in cells, 0.5 gives 8 particles per liquid cell. Runs are reproducible, the particles
+//are jittered by the hashed random streams
+class KernelBench{
+    public:
+        KernelBench(const int& resolution, const float& density);
+        ~KernelBench();
+
+        void Run(BenchmarkRunner* runner);
+
+        //Mesh kernels on a sphere tesselated to the resolution, the obj file is written to and
+        //removed from scratchDirectory
+        static void RunGeometry(BenchmarkRunner* runner, const int& resolution,
+                                const std::string& scratchDirectory);
+
+    private:
+        void FillDamBreak();
+        void PrepareStep();
+        void RestoreParticles();
+
+        int                                     m_resolution;
+        float                                   m_density;
+        std::string                             m_fixture;
+        sceneCore::Scene*                       m_scene;
+        fluidCore::FlipSim*                     m_sim;
+        //particle state after PrepareStep, restored before kernels that move particles
+        std::vector<glm::vec3>                  m_positions;
+        std::vector<glm::vec3>                  m_velocities;
+        //results kept so the compiler can't drop the work
+        unsigned long long                      m_sink;
+};
+}
+
+#endif
@@ -0,0 +1,206 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: scalingbench.cpp
+// Implements scalingbench.hpp
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <tbb/tbb.h>
+#include "scalingbench.hpp"
+#include "benchmark.hpp"
+#include "../sim/flip.hpp"
+#include "../scene/sceneloader.hpp"
+#include "../utilities/profiler.hpp"
+
+namespace benchCore {
+
+//name of the whole step in ScalingRun::m_stages
+#define SCALING_FRAME_STAGE "Frame"
+
+ScalingBench::ScalingBench(const std::vector<std::string>& scenes, const int& frames,
+                           const std::vector<int>& threadCounts){
+    m_scenes = scenes;
+    m_frames = std::max(1, frames);
+    m_threadCounts = threadCounts;
+}
+
+ScalingBench::~ScalingBench(){
+}
+
+void ScalingBench::Run(const bool& strong, const bool& weak){
+    for(unsigned int s=0; s<m_scenes.size(); s++){
+        if(strong==true){
+            std::vector<ScalingRun> runs;
+            for(unsigned int t=0; t<m_threadCounts.size(); t++){
+                runs.push_back(RunScene(m_scenes[s], m_threadCounts[t], 1.0f));
+            }
+            PrintTable(runs, false);
+            m_strongRuns.insert(m_strongRuns.end(), runs.begin(), runs.end());
+        }
+        if(weak==true){
+            std::vector<ScalingRun> runs;
+            for(unsigned int t=0; t<m_threadCounts.size(); t++){
+                float scale = (float)std::pow((double)m_threadCounts[t]/m_threadCounts[0],
+                                              1.0/3.0);
+                runs.push_back(RunScene(m_scenes[s], m_threadCounts[t], scale));
+            }
+            PrintTable(runs, true);
+            m_weakRuns.insert(m_weakRuns.end(), runs.begin(), runs.end());
+        }
+    }
+}
+
+//The scene is loaded fresh for every run so no state carries between thread counts. Exports
+//are off, the driver only measures the step
+ScalingRun ScalingBench::RunScene(const std::string& scene, const int& threads,
+                                  const float& scale){
+    std::cout << "Running " << scene << " on " << threads << " threads at " << scale
+              << "x resolution..." << std::endl;
+    tbb::task_scheduler_init init(threads);
+    NullBuffer silence;
+    std::streambuf* output = std::cout.rdbuf(&silence);
+
+    sceneCore::SceneLoader* loader = new sceneCore::SceneLoader(scene);
+    if(scale!=1.0f){
+        loader->ScaleResolution(scale);
+    }
+    fluidCore::SimSettings settings = loader->GetSimSettings();
+    settings.m_deterministic = true;
+    fluidCore::FlipSim* sim = new fluidCore::FlipSim(loader->GetDimensions(),
+                                                     loader->GetDensity(),
+                                                     loader->GetStepsize(), loader->GetScene(),
+                                                     settings, false);
+    sim->Init();
+
+    utilityCore::Profiler* profiler = utilityCore::GetProfiler();
+    profiler->ResetTotals();
+    profiler->KeepTotals(true);
+    tbb::tick_count start = tbb::tick_count::now();
+    for(int f=0; f<m_frames; f++){
+        sim->Step(false, false, false);
+    }
+    double seconds = (tbb::tick_count::now()-start).seconds();
+    profiler->KeepTotals(false);
+
+    ScalingRun run;
+    run.m_scene = scene;
+    run.m_threads = threads;
+    run.m_scale = scale;
+    run.m_dimensions = loader->GetDimensions();
+    run.m_stages.push_back(std::make_pair(std::string(SCALING_FRAME_STAGE),
+                                          seconds*1000.0/m_frames));
+    std::vector<std::pair<std::string, double> > stages = profiler->GetStageTotals();
+    for(unsigned int s=0; s<stages.size(); s++){
+        run.m_stages.push_back(std::make_pair(stages[s].first, stages[s].second/m_frames));
+    }
+    run.m_pcgIterations = 0.0;
+    std::vector<std::pair<std::string, double> > counters = profiler->GetCounterTotals();
+    for(unsigned int c=0; c<counters.size(); c++){
+        if(counters[c].first=="pcg_iterations"){
+            run.m_pcgIterations = counters[c].second/m_frames;
+        }
+    }
+
+    sceneCore::Scene* s = loader->GetScene();
+    delete sim;
+    delete loader;
+    delete s;
+    std::cout.rdbuf(output);
+    return run;
+}
+
+double ScalingBench::GetStageTime(const ScalingRun& run, const std::string& stage){
+    for(unsigned int s=0; s<run.m_stages.size(); s++){
+        if(run.m_stages[s].first==stage){
+            return run.m_stages[s].second;
+        }
+    }
+    return 0.0;
+}
+
+void ScalingBench::PrintTable(const std::vector<ScalingRun>& runs, const bool& weak){
+    if(runs.empty()==true){
+        return;
+    }
+    //stages in order of first appearance over all runs
+    std::vector<std::string> stages;
+    for(unsigned int r=0; r<runs.size(); r++){
+        for(unsigned int s=0; s<runs[r].m_stages.size(); s++){
+            if(std::find(stages.begin(), stages.end(), runs[r].m_stages[s].first)==
+               stages.end()){
+                stages.push_back(runs[r].m_stages[s].first);
+            }
+        }
+    }
+
+    const ScalingRun& base = runs[0];
+    std::cout << std::endl << (weak ? "Weak" : "Strong") << " scaling: " << base.m_scene
+              << ", ms per frame and efficiency against " << base.m_threads << " threads"
+              << std::endl;
+    std::cout << std::left << std::setw(28) << "threads" << std::right;
+    for(unsigned int r=0; r<runs.size(); r++){
+        std::cout << std::setw(18) << runs[r].m_threads;
+    }
+    std::cout << std::endl << std::left << std::setw(28) << "grid" << std::right;
+    for(unsigned int r=0; r<runs.size(); r++){
+        std::ostringstream grid;
+        grid << runs[r].m_dimensions.x << "x" << runs[r].m_dimensions.y << "x"
+             << runs[r].m_dimensions.z;
+        std::cout << std::setw(18) << grid.str();
+    }
+    std::cout << std::endl << std::left << std::setw(28) << "pcg iterations" << std::right
+              << std::fixed << std::setprecision(1);
+    for(unsigned int r=0; r<runs.size(); r++){
+        std::cout << std::setw(18) << runs[r].m_pcgIterations;
+    }
+    std::cout << std::endl;
+    for(unsigned int s=0; s<stages.size(); s++){
+        std::cout << std::left << std::setw(28) << stages[s] << std::right;
+        double baseTime = GetStageTime(base, stages[s]);
+        for(unsigned int r=0; r<runs.size(); r++){
+            double time = GetStageTime(runs[r], stages[s]);
+            //strong efficiency is speedup over the thread ratio, weak is time held constant
+            double efficiency = 0.0;
+            if(time>0.0){
+                efficiency = weak ? baseTime/time :
+                             baseTime*base.m_threads/(time*runs[r].m_threads);
+            }
+            std::cout << std::setw(11) << std::setprecision(2) << time << std::setw(6)
+                      << std::setprecision(0) << efficiency*100.0 << "%";
+        }
+        std::cout << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+bool ScalingBench::WriteCSV(const std::string& filename){
+    std::ofstream file(filename.c_str());
+    if(file.is_open()==false){
+        std::cout << "Warning: Unable to write " << filename << std::endl;
+        return false;
+    }
+    file << "mode,scene,threads,scale,dim_x,dim_y,dim_z,stage,ms_per_frame" << std::endl;
+    for(int w=0; w<2; w++){
+        const std::vector<ScalingRun>& runs = w==0 ? m_strongRuns : m_weakRuns;
+        for(unsigned int r=0; r<runs.size(); r++){
+            const ScalingRun& run = runs[r];
+            for(unsigned int s=0; s<run.m_stages.size(); s++){
+                file << (w==0 ? "strong" : "weak") << "," << run.m_scene << ","
+                     << run.m_threads << "," << run.m_scale << "," << run.m_dimensions.x << ","
+                     << run.m_dimensions.y << "," << run.m_dimensions.z << ","
+                     << run.m_stages[s].first << "," << run.m_stages[s].second << std::endl;
+            }
+            file << (w==0 ? "strong" : "weak") << "," << run.m_scene << "," << run.m_threads
+                 << "," << run.m_scale << "," << run.m_dimensions.x << ","
+                 << run.m_dimensions.y << "," << run.m_dimensions.z << ",pcg_iterations,"
+                 << run.m_pcgIterations << std::endl;
+        }
+    }
+    return true;
+}
+}
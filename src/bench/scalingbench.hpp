@@ -0,0 +1,57 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: scalingbench.hpp
+// Runs scene files headless across TBB thread counts and tabulates per stage scaling
+
+#ifndef SCALINGBENCH_HPP
+#define SCALINGBENCH_HPP
+
+#include <string>
+#include <vector>
+#include "../utilities/utilities.h"
+
+namespace benchCore {
+//====================================
+// Struct and Class Declarations
+//====================================
+
+//One headless run of one scene. Stage times are milliseconds per frame, the first entry is the
+//whole step as timed by the driver
+struct ScalingRun{
+    std::string                                         m_scene;
+    int                                                 m_threads;
+    float                                               m_scale; //resolution factor
+    glm::vec3                                           m_dimensions;
+    std::vector<std::pair<std::string, double> >        m_stages;
+    double                                              m_pcgIterations; //per frame
+};
+
+//Strong scaling runs every scene as written at each thread count. Weak scaling grows the
+//resolution by the cube root of the thread count so cells per thread stay fixed. Runs use the
+//deterministic solver reductions, so every thread count does the same number of PCG iterations
+//and the tables compare equal work
+class ScalingBench{
+    public:
+        ScalingBench(const std::vector<std::string>& scenes, const int& frames,
+                     const std::vector<int>& threadCounts);
+        ~ScalingBench();
+
+        void Run(const bool& strong, const bool& weak);
+        bool WriteCSV(const std::string& filename);
+
+    private:
+        ScalingRun RunScene(const std::string& scene, const int& threads, const float& scale);
+        //rows are stages, columns are thread counts. Efficiency is against the lowest count
+        void PrintTable(const std::vector<ScalingRun>& runs, const bool& weak);
+        double GetStageTime(const ScalingRun& run, const std::string& stage);
+
+        std::vector<std::string>                            m_scenes;
+        int                                                 m_frames;
+        std::vector<int>                                    m_threadCounts;
+        std::vector<ScalingRun>                             m_strongRuns;
+        std::vector<ScalingRun>                             m_weakRuns;
+};
+}
+
+#endif
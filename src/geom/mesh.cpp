@@ -57,10 +57,13 @@ HOST DEVICE unsigned int MeshContainer::GetID(){
 }
 
 HOST DEVICE spaceCore::Bvh<objCore::Obj>* MeshContainer::GetMeshFrame(const float& frame){
+    return m_meshFrames[GetMeshFrameIndex(frame)];
+}
+
+HOST DEVICE unsigned int MeshContainer::GetMeshFrameIndex(const float& frame){
     float clampedFrame = (frame - float(m_frameOffset)) / float(m_frameInterval);
     clampedFrame = glm::clamp(clampedFrame, 0.0f, float(m_numberOfFrames-1));
-    unsigned int lowerFrame = glm::floor(clampedFrame);
-    return m_meshFrames[lowerFrame];
+    return glm::floor(clampedFrame);
 }
 
 HOST DEVICE spaceCore::Aabb MeshContainer::GetAabb(const float& frame){
@@ -239,10 +242,13 @@ HOST DEVICE float AnimatedMeshContainer::GetInterpolationWeight(const float& fra
 
 HOST DEVICE spaceCore::Bvh<objCore::InterpolatedObj>* AnimatedMeshContainer::GetMeshFrame(
                                                                             const float& frame){
+    return m_meshFrames[GetMeshFrameIndex(frame)];
+}
+
+HOST DEVICE unsigned int AnimatedMeshContainer::GetMeshFrameIndex(const float& frame){
     float clampedFrame = (frame - float(m_frameOffset)) / float(m_frameInterval);
     clampedFrame = glm::clamp(clampedFrame, 0.0f, float(m_numberOfFrames-1));
-    unsigned int lowerFrame = glm::floor(clampedFrame);
-    return m_meshFrames[lowerFrame];
+    return glm::floor(clampedFrame);
 }
 
 HOST DEVICE void AnimatedMeshContainer::Intersect(const rayCore::Ray& r, 
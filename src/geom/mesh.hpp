@@ -71,6 +71,8 @@ class MeshContainer: public virtual GeomInterface {
         HOST DEVICE bool GetTransforms(const float& frame, glm::mat4& transform,
                                        glm::mat4& inversetransform);
         HOST DEVICE spaceCore::Bvh<objCore::Obj>* GetMeshFrame(const float& frame);
+        //index into m_meshFrames of the mesh GetMeshFrame returns
+        HOST DEVICE unsigned int GetMeshFrameIndex(const float& frame);
         HOST DEVICE bool IsDynamic();
         HOST DEVICE bool IsInFrame(const float& frame);
         
@@ -106,6 +108,7 @@ class AnimatedMeshContainer: public virtual GeomInterface {
         HOST DEVICE bool GetTransforms(const float& frame, glm::mat4& transform,
                                        glm::mat4& inversetransform);
         HOST DEVICE spaceCore::Bvh<objCore::InterpolatedObj>* GetMeshFrame(const float& frame);
+        HOST DEVICE unsigned int GetMeshFrameIndex(const float& frame);
         HOST DEVICE float GetInterpolationWeight(const float& frame);
         HOST DEVICE bool IsDynamic();
         HOST DEVICE bool IsInFrame(const float& frame);
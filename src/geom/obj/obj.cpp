@@ -6,10 +6,201 @@
 
 #include <tbb/tbb.h>
 #include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <sys/stat.h>
 #include "obj.hpp"
+#include "../../utilities/mappedfile.hpp"
+#include "../../utilities/bakecache.hpp"
+
+//Text is parsed in chunks of about this many bytes, split on line ends
+#define OBJ_PARSE_CHUNK_SIZE (1<<20)
+
+//Binary sidecar written next to the obj as filename.objcache
+#define OBJ_CACHE_MAGIC 0x4843424f //"OBCH"
+#define OBJ_CACHE_VERSION 1
 
 namespace objCore {
 
+//====================================
+// Parse Helpers
+//====================================
+
+//Line kinds the parser cares about, everything else is skipped
+enum objline {OBJ_LINE_OTHER=0, OBJ_LINE_VERTEX=1, OBJ_LINE_NORMAL=2, OBJ_LINE_UV=3,
+              OBJ_LINE_FACE=4};
+
+struct ObjChunk{
+    const char*     m_begin;
+    const char*     m_end;
+    unsigned int    m_counts[5]; //lines of each objline kind, turned into offsets after counting
+};
+
+struct ObjCacheHeader{
+    unsigned int        m_magic;
+    unsigned int        m_version;
+    unsigned long long  m_sourceSize; //source obj size and mtime, a mismatch means stale
+    long long           m_sourceTime;
+    unsigned int        m_numberOfVertices;
+    unsigned int        m_numberOfNormals;
+    unsigned int        m_numberOfUVs;
+    unsigned int        m_numberOfPolys;
+};
+
+static inline bool IsSpace(const char& c){
+    return c==' ' || c=='\t' || c=='\r';
+}
+
+static inline const char* SkipSpaces(const char* c, const char* end){
+    while(c<end && IsSpace(*c)){
+        c++;
+    }
+    return c;
+}
+
+static inline const char* SkipLine(const char* c, const char* end){
+    while(c<end && *c!='\n'){
+        c++;
+    }
+    return c<end ? c+1 : end;
+}
+
+//Classifies the line at c and returns where its first argument starts. Lines with a keyword
+//but no arguments are skipped, like the tokenized reader did
+static inline objline ClassifyLine(const char* c, const char* end, const char*& args){
+    c = SkipSpaces(c, end);
+    const char* keyword = c;
+    while(c<end && IsSpace(*c)==false && *c!='\n'){
+        c++;
+    }
+    unsigned int length = c-keyword;
+    args = SkipSpaces(c, end);
+    if(args>=end || *args=='\n' || length==0 || length>2){
+        return OBJ_LINE_OTHER;
+    }
+    if(keyword[0]=='v'){
+        if(length==1){
+            return OBJ_LINE_VERTEX;
+        }else if(keyword[1]=='n'){
+            return OBJ_LINE_NORMAL;
+        }else if(keyword[1]=='t'){
+            return OBJ_LINE_UV;
+        }
+    }else if(keyword[0]=='f' && length==1){
+        return OBJ_LINE_FACE;
+    }
+    return OBJ_LINE_OTHER;
+}
+
+//Allocation free atof replacement. Parses until the first character that can't be part of a
+//decimal float and leaves value at 0 if there are no digits, like atof
+static inline const char* ParseFloat(const char* c, const char* end, float& value){
+    static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                                    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+                                    1e21, 1e22};
+    c = SkipSpaces(c, end);
+    bool negative = false;
+    if(c<end && (*c=='-' || *c=='+')){
+        negative = *c=='-';
+        c++;
+    }
+    unsigned long long mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    while(c<end && *c>='0' && *c<='9'){
+        if(digits<19){
+            mantissa = mantissa*10 + (*c-'0');
+            digits += mantissa>0;
+        }else{
+            exponent++;
+        }
+        c++;
+    }
+    if(c<end && *c=='.'){
+        c++;
+        while(c<end && *c>='0' && *c<='9'){
+            if(digits<19){
+                mantissa = mantissa*10 + (*c-'0');
+                digits += mantissa>0;
+                exponent--;
+            }
+            c++;
+        }
+    }
+    if(c<end && (*c=='e' || *c=='E')){
+        const char* e = c+1;
+        bool negativeExponent = false;
+        if(e<end && (*e=='-' || *e=='+')){
+            negativeExponent = *e=='-';
+            e++;
+        }
+        if(e<end && *e>='0' && *e<='9'){
+            int explicitExponent = 0;
+            while(e<end && *e>='0' && *e<='9'){
+                explicitExponent = glm::min(explicitExponent*10 + (*e-'0'), 10000);
+                e++;
+            }
+            exponent += negativeExponent ? -explicitExponent : explicitExponent;
+            c = e;
+        }
+    }
+    double result = (double)mantissa;
+    if(exponent<0){
+        result = -exponent<=22 ? result/powers[-exponent] : result*std::pow(10.0, exponent);
+    }else if(exponent>0){
+        result = exponent<=22 ? result*powers[exponent] : result*std::pow(10.0, exponent);
+    }
+    value = (float)(negative ? -result : result);
+    return c;
+}
+
+static inline const char* ParseUnsigned(const char* c, const char* end, unsigned int& value){
+    value = 0;
+    while(c<end && *c>='0' && *c<='9'){
+        value = value*10 + (*c-'0');
+        c++;
+    }
+    return c;
+}
+
+//Parses one "v", "v/t", "v//n" or "v/t/n" face corner. Empty fields are dropped the way
+//tokenizing on "/" did, so "v//n" reports two fields
+static inline const char* ParseFaceCorner(const char* c, const char* end, unsigned int* fields,
+                                          unsigned int& fieldCount){
+    fieldCount = 0;
+    while(c<end && IsSpace(*c)==false && *c!='\n'){
+        if(*c=='/'){
+            c++;
+        }else{
+            unsigned int value = 0;
+            const char* next = ParseUnsigned(c, end, value);
+            if(next==c){
+                //unexpected character, skip the rest of the corner
+                while(c<end && IsSpace(*c)==false && *c!='\n' && *c!='/'){
+                    c++;
+                }
+            }else{
+                c = next;
+            }
+            if(fieldCount<3){
+                fields[fieldCount++] = value;
+            }
+        }
+    }
+    return c;
+}
+
+static long long GetFileTime(const std::string& filename, unsigned long long& size){
+    struct stat info;
+    if(stat(filename.c_str(), &info)!=0){
+        size = 0;
+        return -1;
+    }
+    size = (unsigned long long)info.st_size;
+    return (long long)info.st_mtime;
+}
+
 //====================================
 // Obj Class
 //====================================
@@ -48,6 +239,42 @@ Obj::~Obj(){
     }
 }
 
+void Obj::ClearGeometry(){
+    delete [] m_vertices;
+    delete [] m_normals;
+    delete [] m_uvs;
+    delete [] m_polyVertexIndices;
+    delete [] m_polyNormalIndices;
+    delete [] m_polyUVIndices;
+    m_vertices = NULL;
+    m_normals = NULL;
+    m_uvs = NULL;
+    m_polyVertexIndices = NULL;
+    m_polyNormalIndices = NULL;
+    m_polyUVIndices = NULL;
+    m_numberOfVertices = 0;
+    m_numberOfNormals = 0;
+    m_numberOfUVs = 0;
+    m_numberOfPolys = 0;
+}
+
+//Bytes held by the geometry arrays
+unsigned long long Obj::GetMemoryUsage(){
+    return (unsigned long long)m_numberOfVertices*sizeof(glm::vec3) + 
+           (unsigned long long)m_numberOfNormals*sizeof(glm::vec3) +
+           (unsigned long long)m_numberOfUVs*sizeof(glm::vec2) + 
+           (unsigned long long)m_numberOfPolys*3*sizeof(glm::uvec4);
+}
+
+unsigned long long Obj::GetContentHash(){
+    unsigned long long hash = utilityCore::HashValue(0, m_numberOfVertices);
+    hash = utilityCore::HashValue(hash, m_numberOfPolys);
+    hash = utilityCore::HashCombine(hash, utilityCore::HashBytes(m_vertices, 
+                                          sizeof(glm::vec3)*m_numberOfVertices));
+    return utilityCore::HashCombine(hash, utilityCore::HashBytes(m_polyVertexIndices, 
+                                          sizeof(glm::uvec4)*m_numberOfPolys));
+}
+
 void Obj::BakeTransform(const glm::mat4& transform){
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_numberOfVertices),
         [=](const tbb::blocked_range<unsigned int>& r){
@@ -66,7 +293,85 @@ void Obj::BakeTransform(const glm::mat4& transform){
 }
 
 bool Obj::ReadObj(const std::string& filename){
-    PrereadObj(filename);
+    return ReadObj(filename, false);
+}
+
+//With useCache, a valid filename.objcache is loaded instead of parsing the text and is written
+//out after a text parse so later runs can skip it
+bool Obj::ReadObj(const std::string& filename, const bool& useCache){
+    if(useCache==true && ReadCache(filename)==true){
+        std::cout << "Read obj from cache " << filename << ".objcache" << std::endl;
+        return true;
+    }
+    if(ReadObjText(filename)==false){
+        std::cout << "Error: Unable to read obj " << filename << std::endl;
+        return false;
+    }
+    CreateDefaultUVsAndNormals();
+    if(useCache==true){
+        WriteCache(filename);
+    }
+
+    std::cout << "Read obj from " << filename << std::endl;
+    // std::cout << m_numberOfVertices << " vertices" << std::endl;
+    // std::cout << m_numberOfNormals << " normals" << std::endl;
+    // std::cout << m_numberOfUVs << " uvs" << std::endl;
+    // std::cout << m_numberOfPolys << " polys" << std::endl;
+
+    return true;
+}
+
+//Single read of a memory mapped file. Chunks are counted in parallel, prefix summed into write
+//offsets, then parsed in parallel straight into the final arrays
+bool Obj::ReadObjText(const std::string& filename){
+    utilityCore::MappedFile file;
+    if(file.Open(filename)==false){
+        return false;
+    }
+    const char* data = file.GetData();
+    const char* dataEnd = data + file.GetSize();
+
+    //split on line ends
+    std::vector<ObjChunk> chunks;
+    const char* c = data;
+    while(c<dataEnd){
+        ObjChunk chunk;
+        chunk.m_begin = c;
+        c = (size_t)(dataEnd-c)>OBJ_PARSE_CHUNK_SIZE ? c+OBJ_PARSE_CHUNK_SIZE : dataEnd;
+        c = c<dataEnd ? SkipLine(c, dataEnd) : dataEnd;
+        chunk.m_end = c;
+        std::memset(chunk.m_counts, 0, sizeof(chunk.m_counts));
+        chunks.push_back(chunk);
+    }
+    unsigned int chunkCount = chunks.size();
+    ObjChunk* chunkData = chunks.data();
+
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,chunkCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                const char* line = chunkData[i].m_begin;
+                const char* end = chunkData[i].m_end;
+                while(line<end){
+                    const char* args;
+                    chunkData[i].m_counts[ClassifyLine(line, end, args)]++;
+                    line = SkipLine(args, end);
+                }
+            }
+        }
+    );
+
+    unsigned int totals[5] = {0, 0, 0, 0, 0};
+    for(unsigned int i=0; i<chunkCount; i++){
+        for(unsigned int n=0; n<5; n++){
+            unsigned int count = chunks[i].m_counts[n];
+            chunks[i].m_counts[n] = totals[n];
+            totals[n] += count;
+        }
+    }
+    m_numberOfVertices = totals[OBJ_LINE_VERTEX];
+    m_numberOfNormals = totals[OBJ_LINE_NORMAL];
+    m_numberOfUVs = totals[OBJ_LINE_UV];
+    m_numberOfPolys = totals[OBJ_LINE_FACE];
 
     m_vertices = new glm::vec3[m_numberOfVertices];
     m_normals = new glm::vec3[m_numberOfNormals];
@@ -75,65 +380,77 @@ bool Obj::ReadObj(const std::string& filename){
     m_polyNormalIndices = new glm::uvec4[m_numberOfPolys];
     m_polyUVIndices = new glm::uvec4[m_numberOfPolys];
 
-    unsigned int currentVertex = 0;
-    unsigned int currentNormal = 0;
-    unsigned int currentUV = 0;
-    unsigned int currentFace = 0;
-
-    //Load loop
-    std::ifstream fp_in;
-    char* fname = (char*)filename.c_str();
-    fp_in.open(fname);
-    if(fp_in.is_open()){
-        while(fp_in.good()){
-            std::string line;
-            getline(fp_in, line);
-            if(!line.empty()){
-                std::vector<std::string> tokens = utilityCore::tokenizeString(line, " ");
-                if(tokens.size()>1){
-                    if(tokens[0].compare("v")==0){
-                        m_vertices[currentVertex] = glm::vec3(atof(tokens[1].c_str()),
-                                                              atof(tokens[2].c_str()),
-                                                              atof(tokens[3].c_str()));
-                        currentVertex++;
-                    }else if(tokens[0].compare("vn")==0){
-                        m_normals[currentNormal] = glm::vec3(atof(tokens[1].c_str()),
-                                                             atof(tokens[2].c_str()),
-                                                             atof(tokens[3].c_str()));
-                        currentNormal++;
-                    }else if(tokens[0].compare("vt")==0){
-                        m_uvs[currentUV] = glm::vec2(atof(tokens[1].c_str()),
-                                                     atof(tokens[2].c_str()));
-                        currentUV++;
-                    }else if(tokens[0].compare("f")==0){
-                        glm::vec4 vertices(0);
-                        glm::vec4 normals(0);
-                        glm::vec4 uvs(0);
-                        unsigned int loops = std::min(4, (int)tokens.size()-1)+1;
-                        for(unsigned int i=1; i<loops; i++){
-                            std::vector<std::string> faceindices =
-                                                     utilityCore::tokenizeString(tokens[i], "/");
-                            vertices[i-1] = atoi(faceindices[0].c_str());
-                            if(faceindices.size()==2 && m_numberOfNormals>1){
-                                normals[i-1] = atoi(faceindices[1].c_str());
-                            }else if(faceindices.size()==2 && m_numberOfUVs>1){
-                                uvs[i-1] = atoi(faceindices[1].c_str());
-                            }else if(faceindices.size()==3){
-                                uvs[i-1] = atoi(faceindices[1].c_str());
-                                normals[i-1] = atoi(faceindices[2].c_str());
+    glm::vec3* vertices = m_vertices;
+    glm::vec3* normals = m_normals;
+    glm::vec2* uvs = m_uvs;
+    glm::uvec4* polyVertices = m_polyVertexIndices;
+    glm::uvec4* polyNormals = m_polyNormalIndices;
+    glm::uvec4* polyUVs = m_polyUVIndices;
+    bool hasNormals = m_numberOfNormals>1;
+    bool hasUVs = m_numberOfUVs>1;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,chunkCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                unsigned int* offsets = chunkData[i].m_counts;
+                const char* line = chunkData[i].m_begin;
+                const char* end = chunkData[i].m_end;
+                while(line<end){
+                    const char* a;
+                    objline kind = ClassifyLine(line, end, a);
+                    if(kind==OBJ_LINE_VERTEX || kind==OBJ_LINE_NORMAL){
+                        glm::vec3 v;
+                        a = ParseFloat(a, end, v.x);
+                        a = ParseFloat(a, end, v.y);
+                        a = ParseFloat(a, end, v.z);
+                        if(kind==OBJ_LINE_VERTEX){
+                            vertices[offsets[OBJ_LINE_VERTEX]++] = v;
+                        }else{
+                            normals[offsets[OBJ_LINE_NORMAL]++] = v;
+                        }
+                    }else if(kind==OBJ_LINE_UV){
+                        glm::vec2 uv;
+                        a = ParseFloat(a, end, uv.x);
+                        a = ParseFloat(a, end, uv.y);
+                        uvs[offsets[OBJ_LINE_UV]++] = uv;
+                    }else if(kind==OBJ_LINE_FACE){
+                        glm::uvec4 fv(0);
+                        glm::uvec4 fn(0);
+                        glm::uvec4 fuv(0);
+                        for(unsigned int corner=0; corner<4; corner++){
+                            a = SkipSpaces(a, end);
+                            if(a>=end || *a=='\n'){
+                                break;
+                            }
+                            unsigned int fields[3];
+                            unsigned int fieldCount;
+                            a = ParseFaceCorner(a, end, fields, fieldCount);
+                            if(fieldCount==0){
+                                continue;
+                            }
+                            fv[corner] = fields[0];
+                            if(fieldCount==2 && hasNormals){
+                                fn[corner] = fields[1];
+                            }else if(fieldCount==2 && hasUVs){
+                                fuv[corner] = fields[1];
+                            }else if(fieldCount==3){
+                                fuv[corner] = fields[1];
+                                fn[corner] = fields[2];
                             }
                         }
-                        m_polyVertexIndices[currentFace] = vertices;
-                        m_polyNormalIndices[currentFace] = normals;
-                        m_polyUVIndices[currentFace] = uvs;
-                        currentFace++;
+                        unsigned int face = offsets[OBJ_LINE_FACE]++;
+                        polyVertices[face] = fv;
+                        polyNormals[face] = fn;
+                        polyUVs[face] = fuv;
                     }
-                }               
+                    line = SkipLine(a, end);
+                }
             }
         }
-    } 
-    fp_in.close();
+    );
+    return true;
+}
 
+void Obj::CreateDefaultUVsAndNormals(){
     if(m_numberOfUVs==0){
         std::cout << "No UVs found, creating default UVs..." << std::endl;
         delete [] m_uvs;
@@ -164,16 +481,88 @@ bool Obj::ReadObj(const std::string& filename){
             m_polyNormalIndices[i] = glm::uvec4(i+1,i+1,i+1,i+1);
         }
     }
+}
 
-    std::cout << "Read obj from " << filename << std::endl;
-    // std::cout << m_numberOfVertices << " vertices" << std::endl;
-    // std::cout << m_numberOfNormals << " normals" << std::endl;
-    // std::cout << m_numberOfUVs << " uvs" << std::endl;
-    // std::cout << m_numberOfPolys << " polys" << std::endl;
-
+//Cache layout is the header followed by the six arrays as stored in memory. Anything that
+//doesn't match the source file or the expected size is ignored and rebuilt
+bool Obj::ReadCache(const std::string& filename){
+    unsigned long long sourceSize;
+    long long sourceTime = GetFileTime(filename, sourceSize);
+    utilityCore::MappedFile cache;
+    if(sourceTime<0 || cache.Open(filename+".objcache")==false || 
+       cache.GetSize()<sizeof(ObjCacheHeader)){
+        return false;
+    }
+    ObjCacheHeader header;
+    std::memcpy(&header, cache.GetData(), sizeof(ObjCacheHeader));
+    if(header.m_magic!=OBJ_CACHE_MAGIC || header.m_version!=OBJ_CACHE_VERSION ||
+       header.m_sourceSize!=sourceSize || header.m_sourceTime!=sourceTime){
+        return false;
+    }
+    size_t expected = sizeof(ObjCacheHeader) + 
+                      sizeof(glm::vec3)*((size_t)header.m_numberOfVertices + 
+                                         header.m_numberOfNormals) +
+                      sizeof(glm::vec2)*header.m_numberOfUVs + 
+                      sizeof(glm::uvec4)*3*(size_t)header.m_numberOfPolys;
+    if(cache.GetSize()!=expected){
+        return false;
+    }
+    m_numberOfVertices = header.m_numberOfVertices;
+    m_numberOfNormals = header.m_numberOfNormals;
+    m_numberOfUVs = header.m_numberOfUVs;
+    m_numberOfPolys = header.m_numberOfPolys;
+    m_vertices = new glm::vec3[m_numberOfVertices];
+    m_normals = new glm::vec3[m_numberOfNormals];
+    m_uvs = new glm::vec2[m_numberOfUVs];
+    m_polyVertexIndices = new glm::uvec4[m_numberOfPolys];
+    m_polyNormalIndices = new glm::uvec4[m_numberOfPolys];
+    m_polyUVIndices = new glm::uvec4[m_numberOfPolys];
+    const char* c = cache.GetData() + sizeof(ObjCacheHeader);
+    void* arrays[6] = {m_vertices, m_normals, m_uvs, m_polyVertexIndices, m_polyNormalIndices,
+                       m_polyUVIndices};
+    size_t sizes[6] = {sizeof(glm::vec3)*m_numberOfVertices, sizeof(glm::vec3)*m_numberOfNormals,
+                       sizeof(glm::vec2)*m_numberOfUVs, sizeof(glm::uvec4)*m_numberOfPolys,
+                       sizeof(glm::uvec4)*m_numberOfPolys, sizeof(glm::uvec4)*m_numberOfPolys};
+    for(unsigned int i=0; i<6; i++){
+        std::memcpy(arrays[i], c, sizes[i]);
+        c += sizes[i];
+    }
     return true;
 }
 
+void Obj::WriteCache(const std::string& filename){
+    ObjCacheHeader header;
+    header.m_magic = OBJ_CACHE_MAGIC;
+    header.m_version = OBJ_CACHE_VERSION;
+    header.m_sourceTime = GetFileTime(filename, header.m_sourceSize);
+    header.m_numberOfVertices = m_numberOfVertices;
+    header.m_numberOfNormals = m_numberOfNormals;
+    header.m_numberOfUVs = m_numberOfUVs;
+    header.m_numberOfPolys = m_numberOfPolys;
+    //write to a temporary name first so an interrupted run never leaves a truncated cache
+    std::string cacheName = filename+".objcache";
+    std::string tempName = cacheName+".tmp";
+    std::ofstream outputFile(tempName.c_str(), std::ios::out | std::ios::binary);
+    if(outputFile.is_open()==false){
+        std::cout << "Warning: Unable to write obj cache " << cacheName << std::endl;
+        return;
+    }
+    outputFile.write((const char*)&header, sizeof(ObjCacheHeader));
+    outputFile.write((const char*)m_vertices, sizeof(glm::vec3)*m_numberOfVertices);
+    outputFile.write((const char*)m_normals, sizeof(glm::vec3)*m_numberOfNormals);
+    outputFile.write((const char*)m_uvs, sizeof(glm::vec2)*m_numberOfUVs);
+    outputFile.write((const char*)m_polyVertexIndices, sizeof(glm::uvec4)*m_numberOfPolys);
+    outputFile.write((const char*)m_polyNormalIndices, sizeof(glm::uvec4)*m_numberOfPolys);
+    outputFile.write((const char*)m_polyUVIndices, sizeof(glm::uvec4)*m_numberOfPolys);
+    outputFile.close();
+    if(outputFile.fail()==true){
+        std::remove(tempName.c_str());
+        return;
+    }
+    std::remove(cacheName.c_str());
+    std::rename(tempName.c_str(), cacheName.c_str());
+}
+
 bool Obj::WriteObj(const std::string& filename){
     std::ofstream outputFile(filename.c_str());
     if(outputFile.is_open()){
@@ -227,39 +616,6 @@ bool Obj::WriteObj(const std::string& filename){
     }
 }
 
-void Obj::PrereadObj(const std::string& filename){
-    std::ifstream fp_in;
-    unsigned int vertexCount = 0;
-    unsigned int normalCount = 0;
-    unsigned int uvCount = 0;
-    unsigned int faceCount = 0;
-    char* fname = (char*)filename.c_str();
-    fp_in.open(fname);
-    if(fp_in.is_open()){
-        while(fp_in.good()){
-            std::string line;
-            getline(fp_in, line);
-            if(!line.empty()){
-                std::string header = utilityCore::getFirstNCharactersOfString(line, 2);
-                if(header.compare("v ")==0){
-                    vertexCount++;
-                }else if(header.compare("vt")==0){
-                    uvCount++;
-                }else if(header.compare("vn")==0){
-                    normalCount++;
-                }else if(header.compare("f ")==0){
-                    faceCount++;
-                }
-            }
-        }
-    } 
-    fp_in.close();
-    m_numberOfVertices = vertexCount;
-    m_numberOfNormals = normalCount;
-    m_numberOfUVs = uvCount;
-    m_numberOfPolys = faceCount;
-}
-
 /*Return the requested face from the mesh, unless the index is out of range, 
 in which case return a face of area zero*/
 HOST DEVICE Poly Obj::GetPoly(const unsigned int& polyIndex){
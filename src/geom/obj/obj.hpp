@@ -98,6 +98,13 @@ class Obj {
         void BakeTransform(const glm::mat4& transform);
 
         bool ReadObj(const std::string& filename);
+        bool ReadObj(const std::string& filename, const bool& useCache);
+        //frees all geometry, the obj reads as empty until the next ReadObj
+        void ClearGeometry();
+        unsigned long long GetMemoryUsage();
+        //Hash of the vertex positions and poly vertex indices, everything the bvh and the
+        //voxelizers read
+        unsigned long long GetContentHash();
         bool WriteObj(const std::string& filename);
 
         HOST DEVICE Poly GetPoly(const unsigned int& polyIndex);
@@ -135,7 +142,10 @@ class Obj {
         bool            m_keep;
         
     private:
-        void PrereadObj(const std::string& filename);
+        bool ReadObjText(const std::string& filename);
+        bool ReadCache(const std::string& filename);
+        void WriteCache(const std::string& filename);
+        void CreateDefaultUVsAndNormals();
         HOST DEVICE rayCore::Intersection TriangleTest(const unsigned int& polyIndex, 
                                                        const rayCore::Ray& r, 
                                                        const bool& checkQuad);
@@ -11,6 +11,13 @@
 #include "../utilities/utilities.h"
 
 namespace fluidCore {
+//====================================
+// Enums
+//====================================
+
+//GRID_LINEAR stores cells in one flat k-fastest array, GRID_BRICKED stores cells in 8^3 bricks
+enum GridLayout {GRID_LINEAR=0, GRID_BRICKED=1};
+
 //====================================
 // Class Declarations
 //====================================
@@ -19,6 +26,7 @@ template <typename T> class Grid{
     public:
         //Initializers
         Grid(const glm::vec3& dimensions, const T& background);
+        Grid(const glm::vec3& dimensions, const T& background, const GridLayout& layout);
         ~Grid();
 
         //Cell accessors and setters and whatever
@@ -29,12 +37,36 @@ template <typename T> class Grid{
         void SetCell(const int& x, const int& y, const int& z, const T& value);
 
         void Clear();
+        void Copy(Grid<T>* grid);
+
+        //Raw storage access for unit-stride inner loops. For GRID_LINEAR grids cell (x,y,z)
+        //lives at GetRawData()[x*GetStrideX() + y*GetStrideY() + z]
+        T* GetRawData();
+        unsigned int GetIndex(const int& x, const int& y, const int& z);
+        unsigned int GetStrideX();
+        unsigned int GetStrideY();
+        unsigned int GetNumberOfCells();
+        glm::vec3 GetDimensions();
+        T GetBackground();
+        GridLayout GetLayout();
 
     protected:
-        T***        m_rawgrid;
-        T           m_background;
+        void Fill(const T& value);
+        //Calls fn(begin, end) in parallel over raw cell ranges covering the grid. With NUMA
+        //placement each node's arena covers the x slab of tile rows it owns
+        template <typename F> void ForEachCellRange(const F& fn);
+
+        T*              m_rawgrid;
+        T               m_background;
+
+        glm::vec3       m_dimensions;
+        GridLayout      m_layout;
 
-        glm::vec3   m_dimensions;
+        //allocated cells per axis, dimensions+1 for linear grids, padded to bricks otherwise
+        unsigned int    m_size[3];
+        unsigned int    m_strideX;
+        unsigned int    m_strideY;
+        unsigned int    m_numberOfCells;
 };
 }
 
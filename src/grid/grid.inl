@@ -5,36 +5,60 @@
 // Implements grid.hpp
 
 #include "gridutils.inl"
+#include "../utilities/numa.hpp"
 
 namespace fluidCore{
 
-template <typename T> Grid<T>::Grid(const glm::vec3& dimensions, const T& background){
+template <typename T> Grid<T>::Grid(const glm::vec3& dimensions, const T& background):
+    Grid(dimensions, background, GRID_LINEAR){
+}
+
+template <typename T> Grid<T>::Grid(const glm::vec3& dimensions, const T& background,
+                                    const GridLayout& layout){
     m_dimensions = dimensions;
     m_background = background;
-    m_rawgrid = CreateGrid<T>(m_dimensions.x+1, m_dimensions.y+1, m_dimensions.z+1);
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,(int)m_dimensions.x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(unsigned int j=0; j<(int)m_dimensions.y+1; ++j){
-                    for(unsigned int k=0; k<(int)m_dimensions.z+1; ++k){
-                        m_rawgrid[i][j][k] = m_background;
-                    }
-                }
-            }
+    m_layout = layout;
+    for(unsigned int i=0; i<3; i++){
+        m_size[i] = (unsigned int)m_dimensions[i]+1;
+        if(m_layout==GRID_BRICKED){
+            m_size[i] = (m_size[i]+GRID_BRICK_MASK) & ~GRID_BRICK_MASK;
         }
-    );
+    }
+    if(m_layout==GRID_BRICKED){
+        //for bricked grids the strides step between whole bricks
+        unsigned int brickCells = GRID_BRICK_SIZE*GRID_BRICK_SIZE*GRID_BRICK_SIZE;
+        m_strideY = (m_size[2]>>GRID_BRICK_SHIFT) * brickCells;
+        m_strideX = (m_size[1]>>GRID_BRICK_SHIFT) * m_strideY;
+    }else{
+        m_strideY = m_size[2];
+        m_strideX = m_size[1] * m_strideY;
+    }
+    m_numberOfCells = m_size[0] * m_size[1] * m_size[2];
+    m_rawgrid = CreateGrid<T>(m_numberOfCells);
+    Fill(m_background);
 }
 
 template <typename T> Grid<T>::~Grid(){
-    DeleteGrid<T>(m_rawgrid, m_dimensions.x+1, m_dimensions.y+1, m_dimensions.z+1);
+    DeleteGrid<T>(m_rawgrid, m_numberOfCells);
+}
+
+template <typename T> inline unsigned int Grid<T>::GetIndex(const int& x, const int& y,
+                                                            const int& z){
+    if(m_layout==GRID_BRICKED){
+        unsigned int brick = (x>>GRID_BRICK_SHIFT)*m_strideX + (y>>GRID_BRICK_SHIFT)*m_strideY +
+                             ((z>>GRID_BRICK_SHIFT)<<(3*GRID_BRICK_SHIFT));
+        return brick + (((x&GRID_BRICK_MASK)<<(2*GRID_BRICK_SHIFT)) |
+                        ((y&GRID_BRICK_MASK)<<GRID_BRICK_SHIFT) | (z&GRID_BRICK_MASK));
+    }
+    return x*m_strideX + y*m_strideY + z;
 }
 
 template <typename T> T Grid<T>::GetCell(const glm::vec3& index){
     return GetCell((int)index.x, (int)index.y, (int)index.z);
 }
 
-template <typename T> T Grid<T>::GetCell(const int& x, const int& y, const int& z){
-    T cell = m_rawgrid[x][y][z];
+template <typename T> inline T Grid<T>::GetCell(const int& x, const int& y, const int& z){
+    T cell = m_rawgrid[GetIndex(x,y,z)];
     return cell;
 }
 
@@ -42,23 +66,92 @@ template <typename T> void Grid<T>::SetCell(const glm::vec3& index, const T& val
     SetCell((int)index.x, (int)index.y, (int)index.z, value);
 }
 
-template <typename T> void Grid<T>::SetCell(const int& x, const int& y, const int& z, 
-                                            const T& value){
-    m_rawgrid[x][y][z] = value;
+template <typename T> inline void Grid<T>::SetCell(const int& x, const int& y, const int& z,
+                                                   const T& value){
+    m_rawgrid[GetIndex(x,y,z)] = value;
 }
 
 template <typename T> void Grid<T>::Clear(){
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,(int)m_dimensions.x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                for(unsigned int j=0; j<(int)m_dimensions.y+1; ++j){
-                    for(unsigned int k=0; k<(int)m_dimensions.z+1; ++k){
-                        m_rawgrid[i][j][k] = m_background;
-                    }
-                }
-            }
+    Fill(m_background);
+}
+
+//grids must have matching dimensions and layouts
+template <typename T> void Grid<T>::Copy(Grid<T>* grid){
+    T* source = grid->GetRawData();
+    T* target = m_rawgrid;
+    ForEachCellRange([=](const unsigned int& begin, const unsigned int& end){
+        for(unsigned int i=begin; i!=end; ++i){
+            target[i] = source[i];
         }
-    );  
+    });
+}
+
+template <typename T> void Grid<T>::Fill(const T& value){
+    //contiguous slabs are written by the same thread, which also keeps first touch local
+    T* target = m_rawgrid;
+    ForEachCellRange([=](const unsigned int& begin, const unsigned int& end){
+        for(unsigned int i=begin; i!=end; ++i){
+            target[i] = value;
+        }
+    });
+}
+
+//Slabs follow TileMask's tile rows, so the node that first touches a slab is the one whose
+//arena runs the tile passes over it. A tile row is GRID_BRICK_SIZE x layers, which for bricked
+//grids is exactly one x stride
+template <typename T> template <typename F> void Grid<T>::ForEachCellRange(const F& fn){
+    utilityCore::NumaTopology* numa = utilityCore::GetNumaTopology();
+    if(numa->IsEnabled()==false){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_numberOfCells),
+            [&](const tbb::blocked_range<unsigned int>& r){
+                fn(r.begin(), r.end());
+            }
+        );
+        return;
+    }
+    unsigned int rows = ((unsigned int)m_dimensions.x+GRID_BRICK_MASK)>>GRID_BRICK_SHIFT;
+    unsigned int rowCells = m_layout==GRID_BRICKED ? m_strideX : m_strideX*GRID_BRICK_SIZE;
+    unsigned int cells = m_numberOfCells;
+    int nodes = numa->GetNodeCount();
+    numa->ForEachNode([&](const int& node){
+        unsigned int first; unsigned int last;
+        numa->GetNodeRange(node, rows, &first, &last);
+        //the last node also takes the trailing face layer and any brick padding
+        unsigned int end = node==nodes-1 ? cells : glm::min(last*rowCells, cells);
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(glm::min(first*rowCells, end), end),
+            [&](const tbb::blocked_range<unsigned int>& r){
+                fn(r.begin(), r.end());
+            }
+        );
+    });
+}
+
+template <typename T> T* Grid<T>::GetRawData(){
+    return m_rawgrid;
+}
+
+template <typename T> unsigned int Grid<T>::GetStrideX(){
+    return m_strideX;
+}
+
+template <typename T> unsigned int Grid<T>::GetStrideY(){
+    return m_strideY;
+}
+
+template <typename T> unsigned int Grid<T>::GetNumberOfCells(){
+    return m_numberOfCells;
+}
+
+template <typename T> glm::vec3 Grid<T>::GetDimensions(){
+    return m_dimensions;
+}
+
+template <typename T> T Grid<T>::GetBackground(){
+    return m_background;
+}
+
+template <typename T> GridLayout Grid<T>::GetLayout(){
+    return m_layout;
 }
 }
 
@@ -0,0 +1,45 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: gridpool.hpp
+// Pool of scratch grids owned by the sim and reused across solver iterations and steps
+
+#ifndef GRIDPOOL_HPP
+#define GRIDPOOL_HPP
+
+#include <vector>
+#include <tbb/tbb.h>
+#include <tbb/mutex.h>
+#include "grid.hpp"
+
+namespace fluidCore {
+//====================================
+// Class Declarations
+//====================================
+
+//Grids are first touched by the parallel fill in the Grid constructor, so pages land next to
+//the threads that sweep them, and reuse never faults them in again. Acquire and Release are
+//thread safe, the grids themselves are not shared
+template <typename T> class GridPool{
+    public:
+        GridPool();
+        ~GridPool();
+
+        //returns a linear grid filled with background, reusing a released one when it matches
+        Grid<T>* Acquire(const glm::vec3& dimensions, const T& background);
+        //same as Acquire but skips the fill, for callers that overwrite every cell
+        Grid<T>* AcquireUninitialized(const glm::vec3& dimensions, const T& background);
+        void Release(Grid<T>* grid);
+        void FreeReleased();
+
+    private:
+        Grid<T>* Find(const glm::vec3& dimensions, const T& background);
+
+        tbb::mutex                  m_lock;
+        std::vector<Grid<T>*>       m_released;
+};
+}
+
+#include "gridpool.inl"
+
+#endif
@@ -0,0 +1,71 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: gridpool.inl
+// Implements gridpool.hpp
+
+namespace fluidCore{
+
+template <typename T> GridPool<T>::GridPool(){
+}
+
+//grids still acquired belong to their users and are not freed here
+template <typename T> GridPool<T>::~GridPool(){
+    FreeReleased();
+}
+
+template <typename T> Grid<T>* GridPool<T>::Acquire(const glm::vec3& dimensions, 
+                                                    const T& background){
+    Grid<T>* grid = Find(dimensions, background);
+    if(grid==NULL){
+        return new Grid<T>(dimensions, background);
+    }
+    grid->Clear();
+    return grid;
+}
+
+template <typename T> Grid<T>* GridPool<T>::AcquireUninitialized(const glm::vec3& dimensions,
+                                                                 const T& background){
+    Grid<T>* grid = Find(dimensions, background);
+    if(grid==NULL){
+        return new Grid<T>(dimensions, background);
+    }
+    return grid;
+}
+
+template <typename T> void GridPool<T>::Release(Grid<T>* grid){
+    if(grid==NULL){
+        return;
+    }
+    m_lock.lock();
+    m_released.push_back(grid);
+    m_lock.unlock();
+}
+
+template <typename T> void GridPool<T>::FreeReleased(){
+    m_lock.lock();
+    for(unsigned int i=0; i<m_released.size(); i++){
+        delete m_released[i];
+    }
+    m_released.clear();
+    m_lock.unlock();
+}
+
+//Most recently released grids are tried first since they are the most likely to be in cache
+template <typename T> Grid<T>* GridPool<T>::Find(const glm::vec3& dimensions, 
+                                                 const T& background){
+    Grid<T>* grid = NULL;
+    m_lock.lock();
+    for(int i=(int)m_released.size()-1; i>=0; i--){
+        Grid<T>* candidate = m_released[i];
+        if(candidate->GetDimensions()==dimensions && candidate->GetLayout()==GRID_LINEAR &&
+           candidate->GetBackground()==background){
+            grid = candidate;
+            m_released.erase(m_released.begin()+i);
+            break;
+        }
+    }
+    m_lock.unlock();
+    return grid;
+}
+}
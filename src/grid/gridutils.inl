@@ -7,6 +7,9 @@
 #ifndef GRIDUTILS_INL
 #define GRIDUTILS_INL
 
+#include <tbb/cache_aligned_allocator.h>
+#include "../utilities/memorytracker.hpp"
+
 #define FOR_EACH_CELL(x, y, z) \
     for(int i = 0; i < x; i++) \
         for(int j = 0; j < y; j++) \
@@ -27,25 +30,22 @@
         for(int j = 0; j < y; j++) \
             for(int k = 0; k < z+1; k++) 
 
-template <class T> T *** CreateGrid(unsigned int x, unsigned int y, unsigned int z){
-    T *** field = new T **[x];
-    for(int i=0; i<x; i++){
-        field[i] = new T*[y];
-        for(int j=0; j<y; j++){
-            field[i][j] = new T[z];
-        }
-    }   
+//bricked grids store cells in GRID_BRICK_SIZE^3 blocks, GRID_BRICK_SIZE must be a power of two
+#define GRID_BRICK_SHIFT 3
+#define GRID_BRICK_SIZE (1<<GRID_BRICK_SHIFT)
+#define GRID_BRICK_MASK (GRID_BRICK_SIZE-1)
+
+//grid storage is a single cache line aligned block so rows are contiguous in memory. Every block
+//is counted under MEMORY_GRIDS
+template <class T> T * CreateGrid(unsigned int count){
+    T * field = tbb::cache_aligned_allocator<T>().allocate(count);
+    utilityCore::GetMemoryTracker()->Allocate(MEMORY_GRIDS, (size_t)count*sizeof(T));
     return field;
 }
 
-template <class T> void DeleteGrid(T ***ptr, unsigned int x, unsigned int y, unsigned int z){
-    for(int i=0; i<x; i++){
-        for(int j=0; j<y; j++){
-            delete [] ptr[i][j];
-        } 
-        delete [] ptr[i];
-    }
-    delete [] ptr;
+template <class T> void DeleteGrid(T *ptr, unsigned int count){
+    tbb::cache_aligned_allocator<T>().deallocate(ptr, count);
+    utilityCore::GetMemoryTracker()->Release(MEMORY_GRIDS, (size_t)count*sizeof(T));
 }
 
 #endif
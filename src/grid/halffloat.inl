@@ -0,0 +1,117 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: halffloat.inl
+// IEEE fp16 storage conversions for compact grids, arithmetic always happens on the widened floats
+
+#ifndef HALFFLOAT_INL
+#define HALFFLOAT_INL
+
+#include <cstring>
+//MSVC never defines __F16C__, but /arch:AVX2 and up only target cpus that have F16C
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define ARIEL_F16C
+#endif
+#if defined(ARIEL_F16C)
+#include <immintrin.h>
+#endif
+
+namespace fluidCore {
+//====================================
+// Struct and Function Declarations
+//====================================
+
+//Forward declarations for externed inlineable methods
+extern inline unsigned short FloatToHalf(const float& value);
+extern inline float HalfToFloat(const unsigned short& value);
+extern inline void FloatsToHalves(const float* values, unsigned short* halves,
+                                  const unsigned int& count);
+extern inline void HalvesToFloats(const unsigned short* halves, float* values,
+                                  const unsigned int& count);
+
+//====================================
+// Function Implementations
+//====================================
+
+//Rounds to nearest even. Values past the fp16 range become infinities, NaNs stay NaNs and values
+//under 2^-14 become denormals. Matches F16C's conversion bit for bit
+unsigned short FloatToHalf(const float& value){
+#if defined(ARIEL_F16C)
+    return _cvtss_sh(value, 0);
+#else
+    unsigned int f;
+    std::memcpy(&f, &value, sizeof(float));
+    unsigned int sign = f & 0x80000000u;
+    f ^= sign;
+    unsigned short h;
+    if(f>=0x47800000u){
+        h = f>0x7f800000u ? 0x7e00 : 0x7c00;
+    }else if(f<0x38800000u){
+        //adding 0.5 lines the denormal's bits up at the bottom of the mantissa, and the float
+        //add rounds them to nearest even
+        float shifted;
+        std::memcpy(&shifted, &f, sizeof(float));
+        shifted += 0.5f;
+        std::memcpy(&f, &shifted, sizeof(float));
+        h = (unsigned short)(f-0x3f000000u);
+    }else{
+        unsigned int odd = (f>>13)&1;
+        f += 0xc8000fffu + odd; //rebias the exponent from 127 to 15 and round
+        h = (unsigned short)(f>>13);
+    }
+    return h | (unsigned short)(sign>>16);
+#endif
+}
+
+float HalfToFloat(const unsigned short& value){
+#if defined(ARIEL_F16C)
+    return _cvtsh_ss(value);
+#else
+    unsigned int f = (unsigned int)(value&0x7fff)<<13;
+    unsigned int exponent = f&0x0f800000u;
+    f += 0x38000000u; //rebias the exponent from 15 to 127
+    if(exponent==0x0f800000u){
+        f += 0x38000000u; //infinities and NaNs
+    }else if(exponent==0){
+        //denormals, renormalized by a float subtract
+        f += 0x00800000u;
+        float renormalized;
+        std::memcpy(&renormalized, &f, sizeof(float));
+        renormalized -= 6.10351562e-05f;
+        std::memcpy(&f, &renormalized, sizeof(float));
+    }
+    f |= (unsigned int)(value&0x8000)<<16;
+    float result;
+    std::memcpy(&result, &f, sizeof(float));
+    return result;
+#endif
+}
+
+void FloatsToHalves(const float* values, unsigned short* halves, const unsigned int& count){
+    unsigned int i = 0;
+#if defined(ARIEL_F16C)
+    for(; i+8<=count; i+=8){
+        __m128i packed = _mm256_cvtps_ph(_mm256_loadu_ps(values+i), 0);
+        _mm_storeu_si128((__m128i*)(halves+i), packed);
+    }
+#endif
+    for(; i<count; i++){
+        halves[i] = FloatToHalf(values[i]);
+    }
+}
+
+void HalvesToFloats(const unsigned short* halves, float* values, const unsigned int& count){
+    unsigned int i = 0;
+#if defined(ARIEL_F16C)
+    for(; i+8<=count; i+=8){
+        __m128i packed = _mm_loadu_si128((const __m128i*)(halves+i));
+        _mm256_storeu_ps(values+i, _mm256_cvtph_ps(packed));
+    }
+#endif
+    for(; i<count; i++){
+        values[i] = HalfToFloat(halves[i]);
+    }
+}
+}
+
+#endif
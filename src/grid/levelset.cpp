@@ -4,34 +4,46 @@
 // File: levelset.cpp
 // Implements levelset.hpp
 
+#include <sstream>
+#include <cstdio>
+#include <cstring>
 #include <openvdb/tools/ParticlesToLevelSet.h>
 #include <openvdb/tools/VolumeToSpheres.h>
 #include <openvdb/tools/VolumeToMesh.h>
+#include <openvdb/tools/GridTransformer.h>
 #include <openvdb/util/NullInterrupter.h>
+#include <openvdb/io/Stream.h>
 #include "levelset.hpp"
 
 namespace fluidCore{
 
 LevelSet::LevelSet(){
+    InitAccessors();
     openvdb::initialize();
     m_vdbgrid = openvdb::FloatGrid::create(0.0f);
 }
 
 LevelSet::~LevelSet(){
+    //accessors detach from the tree, so drop them while it is still alive
+    m_accessors.clear();
+    delete m_writeAccessor;
     m_vdbgrid->clear();
     m_vdbgrid.reset();
 }
 
 LevelSet::LevelSet(objCore::Obj* mesh){
+    InitAccessors();
     LevelSetFromMesh(mesh, glm::mat4());
 }
 
 LevelSet::LevelSet(objCore::Obj* mesh, const glm::mat4& m){
+    InitAccessors();
     LevelSetFromMesh(mesh, m);
 }
 
 LevelSet::LevelSet(objCore::InterpolatedObj* animmesh, const float& interpolation, 
                    const glm::mat4& m){
+    InitAccessors();
     LevelSetFromAnimMesh(animmesh, interpolation, m);
 }
 
@@ -42,126 +54,173 @@ void LevelSet::LevelSetFromAnimMesh(objCore::InterpolatedObj* animmesh, const fl
     objCore::Obj* o0 = animmesh->m_obj0;
     objCore::Obj* o1 = animmesh->m_obj1;
     //copy vertices into vdb format
-    std::vector<openvdb::Vec3s> vdbpoints;
-    for(unsigned int i=0; i<o0->m_numberOfVertices; i++){
-        glm::vec3 vertex = o0->m_vertices[i] * (1.0f-interpolation) + 
-                           o1->m_vertices[i] * interpolation;
-        vertex = glm::vec3(m * glm::vec4(vertex, 1.0f));
-        openvdb::Vec3s vdbvertex(vertex.x, vertex.y, vertex.z);
-        vdbpoints.push_back(transform->worldToIndex(vdbvertex));
-    }
-    //copy faces into vdb format
-    std::vector<openvdb::Vec4I> vdbpolys;
-    for(unsigned int i=0; i<o0->m_numberOfPolys; i++){
-        glm::uvec4 poly = o0->m_polyVertexIndices[i];
-        openvdb::Vec4I vdbpoly(poly[0]-1, poly[1]-1, poly[2]-1, poly[3]-1);
-        if(poly[0]==poly[3] || poly[3]<0){
-            vdbpoly[3] = openvdb::util::INVALID_IDX;
+    std::vector<openvdb::Vec3s> vdbpoints(o0->m_numberOfVertices);
+    openvdb::Vec3s* points = vdbpoints.data();
+    const openvdb::math::Transform* xform = transform.get();
+    float weight = interpolation;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,o0->m_numberOfVertices),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                glm::vec3 vertex = o0->m_vertices[i] * (1.0f-weight) + o1->m_vertices[i] * weight;
+                vertex = glm::vec3(m * glm::vec4(vertex, 1.0f));
+                points[i] = xform->worldToIndex(openvdb::Vec3s(vertex.x, vertex.y, vertex.z));
+            }
         }
-        vdbpolys.push_back(vdbpoly);
-    }   
+    );
+    //copy faces into vdb format
+    std::vector<openvdb::Vec4I> vdbpolys(o0->m_numberOfPolys);
+    CopyPolysToVDB(o0, vdbpolys);
      //call vdb tools for creating level set
     openvdb::tools::MeshToVolume<openvdb::FloatGrid> sdfmaker(transform);
     sdfmaker.convertToLevelSet(vdbpoints, vdbpolys);
     m_vdbgrid = sdfmaker.distGridPtr();
-    //cleanup
-    vdbpoints.clear();
-    vdbpolys.clear();
 }
 
 void LevelSet::LevelSetFromMesh(objCore::Obj* mesh, const glm::mat4& m){
     openvdb::math::Transform::Ptr transform=openvdb::math::Transform::createLinearTransform(.25f);
     //copy vertices into vdb format
-    std::vector<openvdb::Vec3s> vdbpoints;
-    for(unsigned int i=0; i<mesh->m_numberOfVertices; i++){
-        glm::vec3 vertex = mesh->m_vertices[i];
-        vertex = glm::vec3(m * glm::vec4(vertex, 1.0f));
-        openvdb::Vec3s vdbvertex(vertex.x, vertex.y, vertex.z);
-        vdbpoints.push_back(transform->worldToIndex(vdbvertex));
-    }
-    //copy faces into vdb format
-    std::vector<openvdb::Vec4I> vdbpolys;
-    for(unsigned int i=0; i<mesh->m_numberOfPolys; i++){
-        glm::uvec4 poly = mesh->m_polyVertexIndices[i];
-        openvdb::Vec4I vdbpoly(poly[0]-1, poly[1]-1, poly[2]-1, poly[3]-1);
-        if(poly[0]==poly[3] || poly[3]==0){
-            vdbpoly[3] = openvdb::util::INVALID_IDX;
+    std::vector<openvdb::Vec3s> vdbpoints(mesh->m_numberOfVertices);
+    openvdb::Vec3s* points = vdbpoints.data();
+    const openvdb::math::Transform* xform = transform.get();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,mesh->m_numberOfVertices),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                glm::vec3 vertex = glm::vec3(m * glm::vec4(mesh->m_vertices[i], 1.0f));
+                points[i] = xform->worldToIndex(openvdb::Vec3s(vertex.x, vertex.y, vertex.z));
+            }
         }
-        vdbpolys.push_back(vdbpoly);
-    }   
+    );
+    //copy faces into vdb format
+    std::vector<openvdb::Vec4I> vdbpolys(mesh->m_numberOfPolys);
+    CopyPolysToVDB(mesh, vdbpolys);
      //call vdb tools for creating level set
     openvdb::tools::MeshToVolume<openvdb::FloatGrid> sdfmaker(transform);
     sdfmaker.convertToLevelSet(vdbpoints, vdbpolys);
     m_vdbgrid = sdfmaker.distGridPtr();
-    //cleanup
-    vdbpoints.clear();
-    vdbpolys.clear();
 }
 
-LevelSet::LevelSet(std::vector<Particle*>& particles, float maxdimension){
-    m_vdbgrid = openvdb::createLevelSet<openvdb::FloatGrid>();
+//Obj indices are 1 based with w==0 or w==x marking a triangle, vdb wants 0 based with an invalid w
+void LevelSet::CopyPolysToVDB(objCore::Obj* mesh, std::vector<openvdb::Vec4I>& vdbpolys){
+    openvdb::Vec4I* polys = vdbpolys.data();
+    const glm::uvec4* indices = mesh->m_polyVertexIndices;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,vdbpolys.size()),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                glm::uvec4 poly = indices[i];
+                openvdb::Vec4I vdbpoly(poly[0]-1, poly[1]-1, poly[2]-1, poly[3]-1);
+                if(poly[0]==poly[3] || poly[3]==0){
+                    vdbpoly[3] = openvdb::util::INVALID_IDX;
+                }
+                polys[i] = vdbpoly;
+            }
+        }
+    );
+}
+
+LevelSet::LevelSet(ParticleSet* particles, const std::vector<unsigned int>& indices, 
+                   float maxdimension):
+    LevelSet(particles, indices, maxdimension, CreateSurfacingSettings()){
+}
+
+LevelSet::LevelSet(ParticleSet* particles, const std::vector<unsigned int>& indices, 
+                   float maxdimension, const SurfacingSettings& settings):
+    LevelSet(particles, indices, maxdimension, settings, NULL, std::vector<unsigned int>(), 
+             0.0f){
+}
+
+LevelSet::LevelSet(ParticleSet* particles, const std::vector<unsigned int>& indices, 
+                   float maxdimension, const SurfacingSettings& settings, ParticleSet* fill,
+                   const std::vector<unsigned int>& fillIndices, const float& fillRadius){
+    InitAccessors();
+    m_vdbgrid = openvdb::createLevelSet<openvdb::FloatGrid>(settings.m_voxelSize, 
+                                                            settings.m_halfBandWidth);
     openvdb::tools::ParticlesToLevelSet<openvdb::FloatGrid> raster(*m_vdbgrid);
-    raster.setGrainSize(1);
-    raster.setRmin(.01f);
+    raster.setGrainSize(settings.m_grainSize);
+    raster.setRmin(settings.m_minRadius);
 
-    ParticleList plist(particles, maxdimension);
-    // raster.rasterizeSpheres(plist);
-    raster.rasterizeTrails(plist);
+    ParticleList plist(particles, indices, maxdimension, settings.m_particleRadius);
+    if(settings.m_raster==SURFACING_RASTER_SPHERES){
+        raster.rasterizeSpheres(plist);
+    }else{
+        raster.rasterizeTrails(plist);
+    }
+    if(fill!=NULL && fillIndices.empty()==false){
+        ParticleList flist(fill, fillIndices, maxdimension, fillRadius);
+        raster.rasterizeSpheres(flist);
+    }
     raster.finalize();
 }
 
-void LevelSet::WriteObjToFile(std::string filename){
-    openvdb::tools::VolumeToMesh vdbmesher(0,.05f);
+void LevelSet::Mesh(const float& adaptivity, std::vector<glm::vec3>& points, 
+                    std::vector<glm::uvec4>& faces){
+    openvdb::tools::VolumeToMesh vdbmesher(0, adaptivity);
     vdbmesher(*GetVDBGrid());
 
-    //get all mesh points and dump to glm::vec3 std::vector
-    unsigned int vdbPointsCount = vdbmesher.pointListSize();
-    openvdb::tools::PointList& vdbPoints = vdbmesher.pointList();
-    
-    std::vector<glm::vec3> points;
-    points.reserve(vdbPointsCount);
-    for(unsigned int i=0; i<vdbPointsCount; i++){
-        glm::vec3 v(vdbPoints[i][0], vdbPoints[i][1], vdbPoints[i][2]);
-        points.push_back(v);
+    unsigned int pointsCount = vdbmesher.pointListSize();
+    points.resize(pointsCount);
+    if(pointsCount>0){
+        const openvdb::Vec3s* vdbPoints = &vdbmesher.pointList()[0];
+        glm::vec3* target = points.data();
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,pointsCount),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    target[i] = glm::vec3(vdbPoints[i][0], vdbPoints[i][1], vdbPoints[i][2]);
+                }
+            }
+        );
     }
 
-    //get all mesh faces and dump to glm::vec4 std::vector
-    unsigned int vdbFacesCount = vdbmesher.polygonPoolListSize();
-    openvdb::tools::PolygonPoolList& vdbFaces = vdbmesher.polygonPoolList();
-
-    unsigned int facesCount = 0;
-    for(unsigned int i=0; i<vdbFacesCount; i++){
-        facesCount = facesCount + vdbFaces[i].numQuads() + vdbFaces[i].numTriangles();
+    //pools are few and large, so their offsets are summed serially and pools are copied in
+    //parallel, quads of a pool before its triangles as before
+    unsigned int poolsCount = vdbmesher.polygonPoolListSize();
+    std::vector<unsigned int> offsets(poolsCount+1, 0);
+    for(unsigned int i=0; i<poolsCount; i++){
+        openvdb::tools::PolygonPool& pool = vdbmesher.polygonPoolList()[i];
+        offsets[i+1] = offsets[i] + pool.numQuads() + pool.numTriangles();
+    }
+    faces.resize(offsets[poolsCount]);
+    if(poolsCount>0){
+        openvdb::tools::PolygonPool* pools = &vdbmesher.polygonPoolList()[0];
+        const unsigned int* offset = offsets.data();
+        glm::uvec4* target = faces.data();
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,poolsCount),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    openvdb::tools::PolygonPool& pool = pools[i];
+                    unsigned int f = offset[i];
+                    for(unsigned int j=0; j<pool.numQuads(); j++){
+                        openvdb::Vec4I q = pool.quad(j);
+                        target[f++] = glm::uvec4(q[0]+1, q[1]+1, q[2]+1, q[3]+1);
+                    }
+                    for(unsigned int j=0; j<pool.numTriangles(); j++){
+                        openvdb::Vec3I t = pool.triangle(j);
+                        target[f++] = glm::uvec4(t[0]+1, t[1]+1, t[2]+1, 0);
+                    }
+                }
+            }
+        );
     }
+}
 
+void LevelSet::WriteObjToFile(std::string filename){
+    WriteObjToFile(filename, CreateSurfacingSettings().m_adaptivity);
+}
+
+void LevelSet::WriteObjToFile(std::string filename, const float& adaptivity){
+    std::vector<glm::vec3> points;
     std::vector<glm::uvec4> faces;
-    faces.reserve(facesCount);
-
-    for(unsigned int i=0; i<vdbFacesCount; i++){
-        unsigned int count = vdbFaces[i].numQuads();
-        for(unsigned int j=0; j<count; j++){
-            openvdb::Vec4I vdbface = vdbFaces[i].quad(j);
-            glm::uvec4 f(vdbface[0]+1, vdbface[1]+1, vdbface[2]+1, vdbface[3]+1);
-            faces.push_back(f);
-        }
-        count = vdbFaces[i].numTriangles();
-        for(unsigned int j=0; j<count; j++){
-            openvdb::Vec3I vdbface = vdbFaces[i].triangle(j);
-            glm::uvec4 f(vdbface[0]+1, vdbface[1]+1, vdbface[2]+1, 0);
-            faces.push_back(f);
-        }
-    }
+    Mesh(adaptivity, points, faces);
 
     //pack points and faces into objcontainer and write
     objCore::Obj* mesh = new objCore::Obj();
     mesh->m_numberOfVertices = points.size();
-    mesh->m_vertices = &points[0];
+    mesh->m_vertices = points.empty() ? NULL : &points[0];
     mesh->m_numberOfNormals = 0;
     mesh->m_normals = NULL;
     mesh->m_numberOfUVs = 0;
     mesh->m_uvs = NULL;
     mesh->m_numberOfPolys = faces.size();
-    mesh->m_polyVertexIndices = &faces[0];
+    mesh->m_polyVertexIndices = faces.empty() ? NULL : &faces[0];
     mesh->m_polyNormalIndices = NULL;
     mesh->m_polyUVIndices = NULL;
     
@@ -172,24 +231,116 @@ void LevelSet::WriteObjToFile(std::string filename){
     delete mesh;
 }
 
-void LevelSet::ProjectPointsToSurface(std::vector<Particle*>& particles, const float& pscale){
-    unsigned int pointsCount = particles.size();
+//Vertices are 12 bytes and faces 13 as triangles or 17 as quads, so a prefix sum of face sizes
+//places every record in the file before any of it is encoded. Records are copied as the host
+//stores them, which is little endian on every platform the sim builds for
+bool LevelSet::WritePlyToFile(std::string filename, const float& adaptivity){
+    std::vector<glm::vec3> points;
+    std::vector<glm::uvec4> faces;
+    Mesh(adaptivity, points, faces);
+    unsigned int pointsCount = points.size();
+    unsigned int facesCount = faces.size();
+
+    std::ostringstream header;
+    header << "ply\nformat binary_little_endian 1.0\n"
+           << "element vertex " << pointsCount << "\n"
+           << "property float x\nproperty float y\nproperty float z\n"
+           << "element face " << facesCount << "\n"
+           << "property list uchar int vertex_indices\nend_header\n";
+    std::string headerString = header.str();
+
+    const glm::uvec4* face = faces.data();
+    std::vector<size_t> faceOffsets(facesCount+1, 0);
+    size_t* faceOffset = faceOffsets.data();
+    size_t faceBytes = tbb::parallel_scan(tbb::blocked_range<unsigned int>(0,facesCount), 
+                                          (size_t)0,
+        [=](const tbb::blocked_range<unsigned int>& r, size_t sum, const bool isFinal)->size_t{
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                if(isFinal==true){
+                    faceOffset[i] = sum;
+                }
+                sum += face[i].w==0 ? 1+3*sizeof(int) : 1+4*sizeof(int);
+            }
+            return sum;
+        },
+        std::plus<size_t>()
+    );
+
+    size_t vertexStart = headerString.size();
+    size_t faceStart = vertexStart + (size_t)pointsCount*3*sizeof(float);
+    std::vector<char> buffer(faceStart + faceBytes);
+    std::memcpy(buffer.data(), headerString.data(), headerString.size());
+    char* vertexData = buffer.data() + vertexStart;
+    char* faceData = buffer.data() + faceStart;
+    const glm::vec3* point = points.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,pointsCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                float xyz[3] = {point[i].x, point[i].y, point[i].z};
+                std::memcpy(vertexData + (size_t)i*sizeof(xyz), xyz, sizeof(xyz));
+            }
+        }
+    );
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,facesCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                char* record = faceData + faceOffset[i];
+                unsigned char corners = face[i].w==0 ? 3 : 4;
+                int indices[4] = {(int)face[i].x-1, (int)face[i].y-1, (int)face[i].z-1, 
+                                  (int)face[i].w-1};
+                record[0] = (char)corners;
+                std::memcpy(record+1, indices, corners*sizeof(int));
+            }
+        }
+    );
+
+    FILE* file = fopen(filename.c_str(), "wb");
+    if(file==NULL){
+        std::cout << "Error: Unable to write to " << filename << std::endl;
+        return false;
+    }
+    bool written = fwrite(buffer.data(), 1, buffer.size(), file)==buffer.size();
+    written = fclose(file)==0 && written;
+    if(written==false){
+        std::cout << "Error: Unable to write to " << filename << std::endl;
+        return false;
+    }
+    std::cout << "Wrote ply file to " << filename << std::endl;
+    return true;
+}
+
+void LevelSet::ProjectPointsToSurface(ParticleSet* particles, 
+                                      const std::vector<unsigned int>& indices, 
+                                      const float& pscale){
+    unsigned int pointsCount = indices.size();
     std::vector<openvdb::Vec3R> vdbpoints(pointsCount);
     std::vector<float> distances;
     distances.reserve(pointsCount);
-    for(unsigned int i=0; i<pointsCount; i++){
-        glm::vec3 p = particles[i]->m_p * pscale;
-        openvdb::Vec3s vdbvertex(p.x, p.y, p.z);
-        vdbpoints[i] = vdbvertex;
-    }
+    openvdb::Vec3R* points = vdbpoints.data();
+    const glm::vec3* positions = particles->m_p.data();
+    const unsigned int* index = indices.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,pointsCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                glm::vec3 p = positions[index[i]] * pscale;
+                points[i] = openvdb::Vec3R(p.x, p.y, p.z);
+            }
+        }
+    );
     openvdb::tools::ClosestSurfacePoint<openvdb::FloatGrid> csp;
     openvdb::util::NullInterrupter n;
     csp.initialize(*m_vdbgrid, 0.0f, &n);
     csp.searchAndReplace(vdbpoints, distances);
-    for(unsigned int i=0; i<pointsCount; i++){
-        vdbpoints[i] = vdbpoints[i]/pscale;
-        particles[i]->m_p = glm::vec3(vdbpoints[i][0], vdbpoints[i][1], vdbpoints[i][2]);
-    }
+    glm::vec3* projected = particles->m_p.data();
+    float scale = pscale;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,pointsCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                openvdb::Vec3R p = points[i]/scale;
+                projected[index[i]] = glm::vec3(p[0], p[1], p[2]);
+            }
+        }
+    );
 }
 
 void LevelSet::WriteVDBGridToFile(std::string filename){
@@ -200,60 +351,186 @@ void LevelSet::WriteVDBGridToFile(std::string filename){
     file.close();
 }
 
+void LevelSet::WriteVDBGridToBuffer(std::vector<char>& buffer){
+    std::ostringstream stream(std::ios_base::binary);
+    openvdb::GridPtrVec grids;
+    grids.push_back(m_vdbgrid);
+    openvdb::io::Stream(stream).write(grids);
+    std::string bytes = stream.str();
+    buffer.assign(bytes.begin(), bytes.end());
+}
+
+//Keeps the current grid if the buffer holds no float grid
+bool LevelSet::ReadVDBGridFromBuffer(const char* data, const size_t& bytes){
+    std::istringstream stream(std::string(data, bytes), std::ios_base::binary);
+    openvdb::GridPtrVecPtr grids = openvdb::io::Stream(stream, false).getGrids();
+    if(grids==NULL || grids->empty()==true){
+        return false;
+    }
+    openvdb::FloatGrid::Ptr grid = openvdb::gridPtrCast<openvdb::FloatGrid>((*grids)[0]);
+    if(grid==NULL){
+        return false;
+    }
+    m_vdbgrid = grid;
+    InvalidateAccessors();
+    return true;
+}
+
 float LevelSet::GetInterpolatedCell(const glm::vec3& index){
     return GetInterpolatedCell(index.x, index.y, index.z);
 }
 
 float LevelSet::GetInterpolatedCell(const float& x, const float& y, const float& z){
+    openvdb::Vec3d p = m_vdbgrid->transform().worldToIndex(openvdb::Vec3d(x,y,z));
     float value;
-    m_getInterpolatedCellLock.lock();
-    {
-        openvdb::Vec3f p(x,y,z);
-        openvdb::tools::GridSampler<openvdb::FloatTree, openvdb::tools::BoxSampler> interpolator(
-                                                                        m_vdbgrid->constTree(), 
-                                                                        m_vdbgrid->transform());
-        value = interpolator.wsSample(p);
-    }
-    m_getInterpolatedCellLock.unlock();
+    openvdb::tools::BoxSampler::sample(GetAccessor(), p, value);
     return value;
 }
 
+void LevelSet::SampleMany(const std::vector<glm::vec3>& points, std::vector<float>& out){
+    unsigned int pointsCount = points.size();
+    out.resize(pointsCount);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,pointsCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            openvdb::FloatGrid::ConstAccessor& accessor = GetAccessor();
+            const openvdb::math::Transform& transform = m_vdbgrid->transform();
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                glm::vec3 w = points[i];
+                openvdb::Vec3d p = transform.worldToIndex(openvdb::Vec3d(w.x, w.y, w.z));
+                openvdb::tools::BoxSampler::sample(accessor, p, out[i]);
+            }
+        }
+    );
+}
+
+float LevelSet::GetVoxelSize(){
+    return m_vdbgrid->transform().voxelSize()[0];
+}
+
 float LevelSet::GetCell(const glm::vec3& index){
     return GetCell((int)index.x, (int)index.y, (int)index.z);
 }
 
 float LevelSet::GetCell(const int& x, const int& y, const int& z){
-    openvdb::Coord coord = openvdb::Coord(x,y,z);
-    openvdb::FloatGrid::Accessor accessor = m_vdbgrid->getAccessor();
-    float cell = accessor.getValue(coord);
-    return cell;
+    return GetAccessor().getValue(openvdb::Coord(x,y,z));
 }
 
 void LevelSet::SetCell(const glm::vec3& index, const float& value){
     SetCell((int)index.x, (int)index.y, (int)index.z, value);
 }
 
+//Writes never free tree nodes, so read accessors cached by other threads stay valid
 void LevelSet::SetCell(const int& x, const int& y, const int& z, const float& value){
     m_setCellLock.lock();
     {
-        openvdb::Coord coord = openvdb::Coord(x,y,z);
-        openvdb::FloatGrid::Accessor accessor = m_vdbgrid->getAccessor();
-        accessor.setValue(coord, value);
+        if(m_writeAccessor==NULL || m_writeGeneration!=m_generation || 
+           m_writeAccessor->getTree()!=&m_vdbgrid->tree()){
+            delete m_writeAccessor;
+            m_writeAccessor = new openvdb::FloatGrid::Accessor(m_vdbgrid->tree());
+            m_writeGeneration = m_generation;
+        }
+        m_writeAccessor->setValue(openvdb::Coord(x,y,z), value);
     }
     m_setCellLock.unlock();
 }
 
+void LevelSet::InitAccessors(){
+    m_generation = 1;
+    m_writeAccessor = NULL;
+    m_writeGeneration = 0;
+}
+
+//Bumping the generation makes every thread rebuild its accessor on its next read
+void LevelSet::InvalidateAccessors(){
+    m_generation++;
+}
+
+//Returns the calling thread's accessor, rebuilt if the grid was replaced or changed in place
+openvdb::FloatGrid::ConstAccessor& LevelSet::GetAccessor(){
+    LevelSetAccessor& local = m_accessors.local();
+    if(local.m_accessor==NULL || local.m_generation!=m_generation || 
+       local.m_accessor->getTree()!=&m_vdbgrid->constTree()){
+        delete local.m_accessor;
+        local.m_accessor = new openvdb::FloatGrid::ConstAccessor(m_vdbgrid->constTree());
+        local.m_generation = m_generation;
+    }
+    return *local.m_accessor;
+}
+
 openvdb::FloatGrid::Ptr& LevelSet::GetVDBGrid(){
     return m_vdbgrid;
 }
 
+size_t LevelSet::GetMemoryUsage(){
+    return (size_t)m_vdbgrid->memUsage();
+}
+
 void LevelSet::Merge(LevelSet& ls){
     openvdb::FloatGrid::Ptr objectSDF = ls.GetVDBGrid()->deepCopy();
     openvdb::tools::csgUnion(*m_vdbgrid, *objectSDF);
     objectSDF->clear();
+    InvalidateAccessors();
 }
     
+//Resamples every level set into this grid's transform in parallel, then unions them pairwise as a
+//tree so independent unions run concurrently
+void LevelSet::MergeAll(const std::vector<LevelSet*>& levelSets){
+    unsigned int count = levelSets.size();
+    if(count==0){
+        return;
+    }
+    std::vector<openvdb::FloatGrid::Ptr> grids(count);
+    openvdb::FloatGrid::Ptr* g = grids.data();
+    LevelSet* const* sources = levelSets.data();
+    const openvdb::math::Transform* target = &m_vdbgrid->transform();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,count),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                openvdb::FloatGrid::Ptr source = sources[i]->GetVDBGrid();
+                if(source->transform()==*target){
+                    g[i] = source->deepCopy();
+                }else{
+                    g[i] = openvdb::FloatGrid::create(source->background());
+                    g[i]->setTransform(target->copy());
+                    g[i]->setGridClass(openvdb::GRID_LEVEL_SET);
+                    openvdb::tools::resampleToMatch<openvdb::tools::BoxSampler>(*source, *g[i]);
+                }
+            }
+        }
+    );
+    for(unsigned int stride=1; stride<count; stride*=2){
+        unsigned int pairs = (count+2*stride-1)/(2*stride);
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,pairs,1),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                    unsigned int i = p*2*stride;
+                    if(i+stride<count){
+                        openvdb::tools::csgUnion(*g[i], *g[i+stride]);
+                        g[i+stride].reset();
+                    }
+                }
+            }
+        );
+    }
+    openvdb::tools::csgUnion(*m_vdbgrid, *grids[0]);
+    InvalidateAccessors();
+}
+
 void LevelSet::Copy(LevelSet& ls){
     m_vdbgrid = ls.GetVDBGrid()->deepCopy();
+    InvalidateAccessors();
+}
+
+//Distances are unchanged by a rigid m, so the grid data stays valid and only the index to world
+//map changes. glm's column major m[i][j] is openvdb's row vector M[i][j]
+void LevelSet::SetPlacement(const glm::mat4& m){
+    glm::mat4 indexToWorld = m * utilityCore::buildScale(glm::vec3(GetVoxelSize()));
+    openvdb::Mat4d placement;
+    for(unsigned int i=0; i<4; i++){
+        for(unsigned int j=0; j<4; j++){
+            placement[i][j] = indexToWorld[i][j];
+        }
+    }
+    m_vdbgrid->setTransform(openvdb::math::Transform::createLinearTransform(placement));
 }
 }
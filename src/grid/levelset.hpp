@@ -13,6 +13,7 @@
 #include <openvdb/tools/LevelSetSphere.h>
 #include <openvdb/tools/Composite.h>
 #include "macgrid.inl"
+#include "surfacingsettings.inl"
 #include "../geom/geomlist.hpp"
 
 namespace fluidCore {
@@ -24,52 +25,62 @@ class ParticleList{ //used for VDB particle to level set construction
     public:
         ParticleList(){ }
 
-        ParticleList(std::vector<Particle*> plist, float maxdimension){
-            m_particles = plist;
+        //rasterizes the particles at the given indices of a ParticleSet
+        ParticleList(ParticleSet* particles, const std::vector<unsigned int>& indices, 
+                     float maxdimension, float radius){
+            m_particles = particles;
+            m_indices = indices;
             m_maxdimension = maxdimension;
+            m_radius = radius;
         }
 
         ~ParticleList(){ }
 
         int size() const { 
-            return m_particles.size(); 
+            return m_indices.size(); 
         }
 
         void getPos(size_t n, openvdb::Vec3R& pos) const {
-            pos = openvdb::Vec3f(m_particles[n]->m_p.x*m_maxdimension, 
-                                 m_particles[n]->m_p.y*m_maxdimension, 
-                                 m_particles[n]->m_p.z*m_maxdimension);
+            glm::vec3 p = m_particles->m_p[m_indices[n]];
+            pos = openvdb::Vec3f(p.x*m_maxdimension, p.y*m_maxdimension, p.z*m_maxdimension);
         }
 
         void getPosRad(size_t n, openvdb::Vec3R& pos, openvdb::Real& rad) const {
-            pos = openvdb::Vec3f(m_particles[n]->m_p.x*m_maxdimension, 
-                                 m_particles[n]->m_p.y*m_maxdimension, 
-                                 m_particles[n]->m_p.z*m_maxdimension);
-            rad = m_particles[n]->m_density;
-            rad = .5f;
-            if(m_particles[n]->m_invalid){
-                rad = 0.0f;
-            }
+            unsigned int i = m_indices[n];
+            glm::vec3 p = m_particles->m_p[i];
+            pos = openvdb::Vec3f(p.x*m_maxdimension, p.y*m_maxdimension, p.z*m_maxdimension);
+            rad = m_particles->m_invalid[i] ? 0.0f : m_radius;
         }
 
         void getPosRadVel(size_t n, openvdb::Vec3R& pos, openvdb::Real& rad, 
                           openvdb::Vec3R& vel) const {
-            pos = openvdb::Vec3f(m_particles[n]->m_p.x*m_maxdimension, 
-                                 m_particles[n]->m_p.y*m_maxdimension, 
-                                 m_particles[n]->m_p.z*m_maxdimension);
-            rad = m_particles[n]->m_density;
-            rad = .5f;
-            vel = openvdb::Vec3f(m_particles[n]->m_u.x, m_particles[n]->m_u.y, 
-                                 m_particles[n]->m_u.z);
-            if(m_particles[n]->m_invalid){
-                rad = 0.0f;
-            }
+            unsigned int i = m_indices[n];
+            glm::vec3 p = m_particles->m_p[i];
+            glm::vec3 u = m_particles->m_u[i];
+            pos = openvdb::Vec3f(p.x*m_maxdimension, p.y*m_maxdimension, p.z*m_maxdimension);
+            rad = m_particles->m_invalid[i] ? 0.0f : m_radius;
+            vel = openvdb::Vec3f(u.x, u.y, u.z);
         }
 
         void getAtt(size_t n, openvdb::Index32& att) const { att = n; }
     private:
-        std::vector<Particle*>      m_particles;
+        ParticleSet*                m_particles;
+        std::vector<unsigned int>   m_indices;
         float                       m_maxdimension;
+        float                       m_radius; //world units, same for every particle
+};
+
+//Per thread cached read accessor. Copies start empty so an accessor is never shared between
+//threads or deleted twice
+struct LevelSetAccessor{
+    LevelSetAccessor(): m_accessor(NULL), m_generation(0){ }
+    LevelSetAccessor(const LevelSetAccessor&): m_accessor(NULL), m_generation(0){ }
+    ~LevelSetAccessor(){ 
+        delete m_accessor; 
+    }
+
+    openvdb::FloatGrid::ConstAccessor*  m_accessor;
+    unsigned int                        m_generation; //grid generation the accessor was made for
 };
 
 class LevelSet{
@@ -81,7 +92,15 @@ class LevelSet{
         LevelSet(objCore::Obj* mesh, const glm::mat4& m);
         LevelSet(objCore::InterpolatedObj* animmesh, const float& interpolation, 
                  const glm::mat4& m);
-        LevelSet(std::vector<Particle*>& particles, float maxdimension);
+        LevelSet(ParticleSet* particles, const std::vector<unsigned int>& indices, 
+                 float maxdimension);
+        LevelSet(ParticleSet* particles, const std::vector<unsigned int>& indices, 
+                 float maxdimension, const SurfacingSettings& settings);
+        //Also rasterizes the fill particles as spheres of fillRadius, for liquid the sim holds
+        //on its grid instead of as particles. fill may be NULL
+        LevelSet(ParticleSet* particles, const std::vector<unsigned int>& indices, 
+                 float maxdimension, const SurfacingSettings& settings, ParticleSet* fill,
+                 const std::vector<unsigned int>& fillIndices, const float& fillRadius);
         ~LevelSet();
 
         //Cell accessors and setters and whatever
@@ -93,26 +112,55 @@ class LevelSet{
 
         float GetInterpolatedCell(const glm::vec3& index);
         float GetInterpolatedCell(const float& x, const float& y, const float& z);
+        //interpolated samples at world space points, in parallel
+        void SampleMany(const std::vector<glm::vec3>& points, std::vector<float>& out);
+        float GetVoxelSize();
 
+        //callers that change the grid in place through GetVDBGrid must call InvalidateAccessors
         openvdb::FloatGrid::Ptr& GetVDBGrid();
+        void InvalidateAccessors();
+        //bytes held by the VDB tree
+        size_t GetMemoryUsage();
 
         void Merge(LevelSet& ls);
+        //union with level sets that may be placed differently, resampled into this grid first
+        void MergeAll(const std::vector<LevelSet*>& levelSets);
         void Copy(LevelSet& ls);
+        //moves the grid into world space by a rigid transform, voxel size is kept
+        void SetPlacement(const glm::mat4& m);
 
-        void ProjectPointsToSurface(std::vector<Particle*>& particles, const float& pscale);
+        void ProjectPointsToSurface(ParticleSet* particles, 
+                                    const std::vector<unsigned int>& indices, const float& pscale);
 
+        //Zero isosurface in world space. Faces index points from 1 like Obj's, triangles have a
+        //w of 0. Both copies out of the mesher run in parallel
+        void Mesh(const float& adaptivity, std::vector<glm::vec3>& points, 
+                  std::vector<glm::uvec4>& faces);
         void WriteObjToFile(std::string filename);
+        void WriteObjToFile(std::string filename, const float& adaptivity);
+        //binary little endian ply, encoded in parallel chunks and written in one pass
+        bool WritePlyToFile(std::string filename, const float& adaptivity);
         void WriteVDBGridToFile(std::string filename);
+        //the grid in openvdb's stream format, for keeping inside other files
+        void WriteVDBGridToBuffer(std::vector<char>& buffer);
+        bool ReadVDBGridFromBuffer(const char* data, const size_t& bytes);
 
     protected:
         void LevelSetFromAnimMesh(objCore::InterpolatedObj* animmesh, const float& interpolation, 
                                   const glm::mat4& m);
         void LevelSetFromMesh(objCore::Obj* mesh, const glm::mat4& m);
-
-        openvdb::FloatGrid::Ptr     m_vdbgrid;
-
-        tbb::mutex                  m_getInterpolatedCellLock;
-        tbb::mutex                  m_setCellLock;
+        void CopyPolysToVDB(objCore::Obj* mesh, std::vector<openvdb::Vec4I>& vdbpolys);
+        void InitAccessors();
+        openvdb::FloatGrid::ConstAccessor& GetAccessor();
+
+        openvdb::FloatGrid::Ptr                                 m_vdbgrid;
+
+        //reads go through lock free per thread accessors, writes share one accessor under a lock
+        tbb::enumerable_thread_specific<LevelSetAccessor>       m_accessors;
+        tbb::atomic<unsigned int>                               m_generation;
+        openvdb::FloatGrid::Accessor*                           m_writeAccessor;
+        unsigned int                                            m_writeGeneration;
+        tbb::mutex                                              m_setCellLock;
 };
 }
 
@@ -8,6 +8,8 @@
 #define MACGRID_INL
 
 #include "grid.hpp"
+#include "particleset.inl"
+#include "halffloat.inl"
 #include "../utilities/utilities.h"
 
 enum geomtype {SOLID=2, FLUID=1, AIR=0};
@@ -19,56 +21,54 @@ namespace fluidCore {
 
 //A macgrid in this simulator is built up entirely out of VDB volumes
 struct MacGrid{
-    glm::vec3       m_dimensions;
+    glm::vec3               m_dimensions;
 
     //face velocities
-    Grid<float>*    m_u_x;
-    Grid<float>*    m_u_y;
-    Grid<float>*    m_u_z; 
+    Grid<float>*            m_u_x;
+    Grid<float>*            m_u_y;
+    Grid<float>*            m_u_z; 
     //technically this is the part that is an actual MAC grid, the rest is other useful stuff
 
-    Grid<float>*    m_D; //divergence 
-    Grid<float>*    m_P; //pressure
-    Grid<int>*      m_A; //cell type
-    Grid<float>*    m_L; //internal lightweight SDF for project step
+    Grid<float>*            m_D; //divergence 
+    Grid<float>*            m_P; //pressure
+    Grid<unsigned char>*    m_A; //cell type, one geomtype per byte
+    Grid<float>*            m_L; //internal lightweight SDF for project step
+    Grid<unsigned short>*   m_N; //packed neighbor cell types for the solver, see solver.inl
 };
 
-struct Particle{
-    glm::vec3       m_p; //position
-    glm::vec3       m_u; //velocity
-    glm::vec3       m_n; //normal
-    float           m_density;
-    float           m_mass;
-    int             m_type;
-    glm::vec3       m_t; 
-    glm::vec3       m_t2;
-    glm::vec3       m_ut; //copy of previous velocity used for bound check correction
-    glm::vec3       m_pt; //copy of previous position used for bound checks
-    bool            m_invalid;
-    bool            m_temp2;
-    bool            m_temp;
+//Pre-projection face velocities kept for the FLIP delta. Compact storage holds them as fp16 in
+//the m_h grids and leaves the m_u grids NULL, samples are widened before the delta is taken
+struct VelocityHistory{
+    glm::vec3               m_dimensions;
+    bool                    m_compact;
+
+    Grid<float>*            m_u_x;
+    Grid<float>*            m_u_y;
+    Grid<float>*            m_u_z;
+    Grid<unsigned short>*   m_h_x;
+    Grid<unsigned short>*   m_h_y;
+    Grid<unsigned short>*   m_h_z;
 };
 
 //Forward declarations for externed inlineable methods
-extern inline Particle CreateParticle(const glm::vec3& position, const glm::vec3& velocity, 
-                                      const glm::vec3& normal, const float& density);
 extern inline MacGrid CreateMacgrid(const glm::vec3& dimensions);
 extern inline void ClearMacgrid(MacGrid& m);
+extern inline size_t GetMacgridBytes(MacGrid& m);
+extern inline VelocityHistory CreateVelocityHistory(const glm::vec3& dimensions, 
+                                                    const bool& compact);
+extern inline void ClearVelocityHistory(VelocityHistory& h);
+extern inline size_t GetVelocityHistoryBytes(VelocityHistory& h);
+extern inline void AddVelocityHistoryChunk(utilityCore::Checkpoint* checkpoint, 
+                                           const std::string& tag, VelocityHistory& h,
+                                           const int& axis);
+extern inline bool GetVelocityHistoryChunk(utilityCore::Checkpoint* checkpoint, 
+                                           const std::string& tag, VelocityHistory& h,
+                                           const int& axis);
 
 //====================================
 // Function Implementations
 //====================================
 
-Particle CreateParticle(const glm::vec3& position, const glm::vec3& velocity, 
-                        const glm::vec3& normal, const float& density){
-    Particle p;
-    p.m_p = position;
-    p.m_u = velocity;
-    p.m_n = normal;
-    p.m_density= density;
-    return p;
-}
-
 MacGrid CreateMacgrid(const glm::vec3& dimensions){
     int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
     MacGrid m;
@@ -78,8 +78,9 @@ MacGrid CreateMacgrid(const glm::vec3& dimensions){
     m.m_u_z = new Grid<float>(glm::vec3(x,y,z+1), 0.0f);
     m.m_D = new Grid<float>(glm::vec3(x,y,z), 0.0f);
     m.m_P = new Grid<float>(glm::vec3(x,y,z), 0.0f);
-    m.m_A = new Grid<int>(glm::vec3(x,y,z), 0);
+    m.m_A = new Grid<unsigned char>(glm::vec3(x,y,z), AIR);
     m.m_L = new Grid<float>(glm::vec3(x,y,z), 1.6f);
+    m.m_N = new Grid<unsigned short>(glm::vec3(x,y,z), 0);
     return m;
 }
 
@@ -89,6 +90,86 @@ void ClearMacgrid(MacGrid& m){
     delete m.m_u_z;
     delete m.m_D;
     delete m.m_P;
+    delete m.m_A;
+    delete m.m_L;
+    delete m.m_N;
+}
+
+size_t GetMacgridBytes(MacGrid& m){
+    size_t floats = (size_t)m.m_u_x->GetNumberOfCells() + m.m_u_y->GetNumberOfCells() + 
+                    m.m_u_z->GetNumberOfCells() + m.m_D->GetNumberOfCells() + 
+                    m.m_P->GetNumberOfCells() + m.m_L->GetNumberOfCells();
+    return floats*sizeof(float) + (size_t)m.m_A->GetNumberOfCells()*sizeof(unsigned char) + 
+           (size_t)m.m_N->GetNumberOfCells()*sizeof(unsigned short);
+}
+
+VelocityHistory CreateVelocityHistory(const glm::vec3& dimensions, const bool& compact){
+    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
+    VelocityHistory h;
+    h.m_dimensions = dimensions;
+    h.m_compact = compact;
+    h.m_u_x = NULL; h.m_u_y = NULL; h.m_u_z = NULL;
+    h.m_h_x = NULL; h.m_h_y = NULL; h.m_h_z = NULL;
+    if(compact==true){
+        h.m_h_x = new Grid<unsigned short>(glm::vec3(x+1,y,z), 0);
+        h.m_h_y = new Grid<unsigned short>(glm::vec3(x,y+1,z), 0);
+        h.m_h_z = new Grid<unsigned short>(glm::vec3(x,y,z+1), 0);
+    }else{
+        h.m_u_x = new Grid<float>(glm::vec3(x+1,y,z), 0.0f);
+        h.m_u_y = new Grid<float>(glm::vec3(x,y+1,z), 0.0f);
+        h.m_u_z = new Grid<float>(glm::vec3(x,y,z+1), 0.0f);
+    }
+    return h;
+}
+
+void ClearVelocityHistory(VelocityHistory& h){
+    delete h.m_u_x;
+    delete h.m_u_y;
+    delete h.m_u_z;
+    delete h.m_h_x;
+    delete h.m_h_y;
+    delete h.m_h_z;
+}
+
+size_t GetVelocityHistoryBytes(VelocityHistory& h){
+    if(h.m_compact==true){
+        return ((size_t)h.m_h_x->GetNumberOfCells() + h.m_h_y->GetNumberOfCells() + 
+                h.m_h_z->GetNumberOfCells())*sizeof(unsigned short);
+    }
+    return ((size_t)h.m_u_x->GetNumberOfCells() + h.m_u_y->GetNumberOfCells() + 
+            h.m_u_z->GetNumberOfCells())*sizeof(float);
+}
+
+//Faces are always saved as floats, so checkpoints move freely between storage modes
+void AddVelocityHistoryChunk(utilityCore::Checkpoint* checkpoint, const std::string& tag,
+                             VelocityHistory& h, const int& axis){
+    if(h.m_compact==false){
+        Grid<float>* faces[3] = {h.m_u_x, h.m_u_y, h.m_u_z};
+        checkpoint->AddChunk(tag, faces[axis]->GetRawData(), 
+                             faces[axis]->GetNumberOfCells()*sizeof(float));
+        return;
+    }
+    Grid<unsigned short>* faces[3] = {h.m_h_x, h.m_h_y, h.m_h_z};
+    std::vector<float> widened(faces[axis]->GetNumberOfCells());
+    HalvesToFloats(faces[axis]->GetRawData(), widened.data(), widened.size());
+    checkpoint->AddArray(tag, widened);
+}
+
+bool GetVelocityHistoryChunk(utilityCore::Checkpoint* checkpoint, const std::string& tag,
+                             VelocityHistory& h, const int& axis){
+    if(h.m_compact==false){
+        Grid<float>* faces[3] = {h.m_u_x, h.m_u_y, h.m_u_z};
+        return checkpoint->GetArray(tag, faces[axis]->GetRawData(), 
+                                    faces[axis]->GetNumberOfCells());
+    }
+    Grid<unsigned short>* faces[3] = {h.m_h_x, h.m_h_y, h.m_h_z};
+    std::vector<float> widened;
+    if(checkpoint->GetArray(tag, widened)==false || 
+       widened.size()!=faces[axis]->GetNumberOfCells()){
+        return false;
+    }
+    FloatsToHalves(widened.data(), faces[axis]->GetRawData(), widened.size());
+    return true;
 }
 }
 
@@ -0,0 +1,67 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: neighborlist.cpp
+// Implements neighborlist.hpp
+
+#include "neighborlist.hpp"
+
+namespace fluidCore{
+
+NeighborList::NeighborList(){
+    m_valid = false;
+    m_radius = 0.0f;
+    m_skin = 0.0f;
+    m_displacement = 0.0f;
+}
+
+NeighborList::~NeighborList(){
+}
+
+void NeighborList::Build(ParticleGrid* pgrid, ParticleSet* particles, const float& maxd, 
+                         const float& radius, const float& skin){
+    Build(pgrid, particles, maxd, radius, skin, [](const unsigned int&, const unsigned int&){});
+}
+
+void NeighborList::Invalidate(){
+    m_valid = false;
+}
+
+size_t NeighborList::GetMemoryUsage(){
+    size_t bytes = (m_offsets.capacity() + m_neighbors.capacity())*sizeof(unsigned int) +
+                   m_reference.capacity()*sizeof(glm::vec3) +
+                   m_blocks.capacity()*sizeof(std::vector<unsigned int>);
+    for(unsigned int b=0; b<m_blocks.size(); b++){
+        bytes += m_blocks[b].capacity()*sizeof(unsigned int);
+    }
+    return bytes;
+}
+
+bool NeighborList::IsValid(ParticleSet* particles){
+    unsigned int particleCount = GetParticleCount(particles);
+    if(m_valid==false || particleCount!=m_reference.size()){
+        m_valid = false;
+        return false;
+    }
+    const glm::vec3* pos = particles->m_p.data();
+    const glm::vec3* reference = m_reference.data();
+    float moved = tbb::parallel_reduce(tbb::blocked_range<unsigned int>(0,particleCount), 0.0f,
+        [=](const tbb::blocked_range<unsigned int>& r, float value)->float{
+            for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                value = glm::max(value, mathCore::Sqrlength(pos[p], reference[p]));
+            }
+            return value;
+        },
+        [](const float& a, const float& b)->float{
+            return glm::max(a, b);
+        }
+    );
+    m_displacement = glm::sqrt(moved);
+    m_valid = m_displacement<0.5f*m_skin;
+    return m_valid;
+}
+
+bool NeighborList::Covers(const unsigned int& p, const glm::vec3& point, const float& reach){
+    return glm::length(point-m_reference[p]) + m_displacement + reach <= m_radius;
+}
+}
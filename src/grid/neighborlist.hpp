@@ -0,0 +1,69 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: neighborlist.hpp
+// Per particle Verlet neighbor lists in CSR form, reused across passes while particles move less
+// than the skin
+
+#ifndef NEIGHBORLIST_HPP
+#define NEIGHBORLIST_HPP
+
+#include <tbb/tbb.h>
+#include "../utilities/utilities.h"
+#include "../math/kernels.inl"
+#include "particlegrid.hpp"
+
+namespace fluidCore {
+//====================================
+// Class Declarations
+//====================================
+
+//Build walks the same 27 cell neighborhood as ParticleGrid::ForEachCellNeighbor once per
+//particle and keeps the neighbors closer than the radius, in the grid's visit order. A pass whose
+//kernel reaches no further than the radius less the skin sees every neighbor it would have
+//gathered from the grid for as long as no particle has moved further than half the skin. Solid
+//particles get empty lists, but appear in other particles' lists
+class NeighborList{
+    public:
+        NeighborList();
+        ~NeighborList();
+
+        //Radius and skin are in the particle set's normalized units. The grid must have just
+        //sorted the set. fn(particle, neighbor) is called for every particle the grid gathers,
+        //before the radius test, so a pass with a wider kernel can ride along with the build
+        template <typename F> void Build(ParticleGrid* pgrid, ParticleSet* particles, 
+                                         const float& maxd, const float& radius, 
+                                         const float& skin, const F& fn);
+        void Build(ParticleGrid* pgrid, ParticleSet* particles, const float& maxd, 
+                   const float& radius, const float& skin);
+        void Invalidate();
+
+        //Measures how far particles moved since the build, false once any moved further than
+        //half the skin or the particle count changed
+        bool IsValid(ParticleSet* particles);
+        //True if a query at point on behalf of particle p with the given kernel reach is still
+        //covered by p's list, going by the displacement of the last IsValid
+        bool Covers(const unsigned int& p, const glm::vec3& point, const float& reach);
+
+        template <typename F> void ForEachNeighbor(const unsigned int& p, const F& fn);
+
+        //heap held by the lists and the build scratch, by capacity
+        size_t GetMemoryUsage();
+
+    private:
+        bool                                        m_valid;
+        float                                       m_radius;
+        float                                       m_skin;
+        float                                       m_displacement;
+        //particle p's neighbors are m_neighbors[m_offsets[p]] through m_offsets[p+1]-1
+        std::vector<unsigned int>                   m_offsets;
+        std::vector<unsigned int>                   m_neighbors;
+        std::vector<glm::vec3>                      m_reference; //positions at the build
+        //per block build output, kept so rebuilds don't allocate
+        std::vector<std::vector<unsigned int> >     m_blocks;
+};
+}
+
+#include "neighborlist.inl"
+
+#endif
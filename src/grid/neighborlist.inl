@@ -0,0 +1,84 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: neighborlist.inl
+// Implements the templated build and visitor in neighborlist.hpp
+
+//particles per build block, each block gathers into its own buffer
+#define NEIGHBOR_LIST_BLOCK 1024
+
+namespace fluidCore{
+
+template <typename F> void NeighborList::Build(ParticleGrid* pgrid, ParticleSet* particles, 
+                                               const float& maxd, const float& radius, 
+                                               const float& skin, const F& fn){
+    unsigned int particleCount = GetParticleCount(particles);
+    unsigned int blockCount = (particleCount+NEIGHBOR_LIST_BLOCK-1)/NEIGHBOR_LIST_BLOCK;
+    m_radius = radius;
+    m_skin = skin;
+    m_displacement = 0.0f;
+    m_offsets.resize(particleCount+1);
+    m_reference.resize(particleCount);
+    if(m_blocks.size()<blockCount){
+        m_blocks.resize(blockCount);
+    }
+    const glm::vec3* pos = particles->m_p.data();
+    const int* type = particles->m_type.data();
+    unsigned int* offsets = m_offsets.data();
+    glm::vec3* reference = m_reference.data();
+    std::vector<unsigned int>* blocks = m_blocks.data();
+    float r2 = radius*radius;
+
+    //gather, with offsets holding each particle's count for now
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,blockCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                std::vector<unsigned int>& block = blocks[b];
+                block.clear();
+                unsigned int end = glm::min(particleCount, (b+1)*NEIGHBOR_LIST_BLOCK);
+                for(unsigned int p=b*NEIGHBOR_LIST_BLOCK; p<end; p++){
+                    reference[p] = pos[p];
+                    unsigned int count = block.size();
+                    if(type[p]!=SOLID){
+                        glm::vec3 cell = glm::floor(glm::clamp(pos[p]*maxd, glm::vec3(0.0f), 
+                                                               glm::vec3(maxd-1.0f)));
+                        glm::vec3 point = pos[p];
+                        pgrid->ForEachCellNeighbor(cell, glm::vec3(1), 
+                                                   [&](const unsigned int& np){
+                            fn(p, np);
+                            if(mathCore::Sqrlength(point, pos[np])<r2){
+                                block.push_back(np);
+                            }
+                        });
+                    }
+                    offsets[p+1] = block.size()-count;
+                }
+            }
+        }
+    );
+    offsets[0] = 0;
+    for(unsigned int p=0; p<particleCount; p++){
+        offsets[p+1] += offsets[p];
+    }
+    m_neighbors.resize(offsets[particleCount]);
+    unsigned int* neighbors = m_neighbors.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,blockCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                std::copy(blocks[b].begin(), blocks[b].end(), 
+                          neighbors+offsets[b*NEIGHBOR_LIST_BLOCK]);
+            }
+        }
+    );
+    m_valid = true;
+}
+
+template <typename F> inline void NeighborList::ForEachNeighbor(const unsigned int& p, 
+                                                                const F& fn){
+    const unsigned int* neighbors = m_neighbors.data();
+    unsigned int end = m_offsets[p+1];
+    for(unsigned int a=m_offsets[p]; a<end; a++){
+        fn(neighbors[a]);
+    }
+}
+}
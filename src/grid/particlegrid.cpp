@@ -8,6 +8,17 @@
 
 namespace fluidCore{
 
+//Spreads the low 21 bits of v out to every third bit
+static unsigned long long SpreadMortonBits(unsigned long long v){
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
 ParticleGrid::ParticleGrid(const glm::vec3& dim){
     Init((int)dim.x, (int)dim.y, (int)dim.z);
 }
@@ -17,157 +28,300 @@ ParticleGrid::ParticleGrid(const int& x, const int& y, const int& z){
 }
 
 ParticleGrid::~ParticleGrid(){
-    delete m_grid;
+    delete [] m_cellCounts;
 }
 
 void ParticleGrid::Init(const int& x, const int& y, const int& z){
     m_dimensions = glm::vec3(x,y,z);
-    m_grid = new Grid<int>(glm::vec3(x,y,z), -1);
-}
-
-std::vector<Particle*> ParticleGrid::GetCellNeighbors(const glm::vec3& index,
-                                                      const glm::vec3& numberOfNeighbors){
-    //loop through neighbors, for each neighbor, check if cell has particles and push back contents
-    std::vector<Particle*> neighbors;
-    for( int sx=index.x-numberOfNeighbors.x; sx<=index.x+numberOfNeighbors.x; sx++ ){
-        for( int sy=index.y-numberOfNeighbors.y; sy<=index.y+numberOfNeighbors.y; sy++ ) {
-            for( int sz=index.z-numberOfNeighbors.z; sz<=index.z+numberOfNeighbors.z; sz++ ) {
-                if( sx < 0 || sx > m_dimensions.x-1 || sy < 0 || sy > m_dimensions.y-1 || 
-                    sz < 0 || sz > m_dimensions.z-1 ){
-                    continue;
-                }
-                int cellindex = m_grid->GetCell(glm::vec3(sx, sy, sz));
-                if(cellindex>=0){
-                    int cellparticlecount = m_cells[cellindex].size();
-                    for(int a=0; a<cellparticlecount; a++){
-                        neighbors.push_back(m_cells[cellindex][a]);
+    m_numberOfCells = x*y*z;
+    m_cellStart.resize(m_numberOfCells+1, 0);
+    m_cellCounts = new tbb::atomic<unsigned int>[m_numberOfCells];
+    m_particles = NULL;
+    m_tiles[0] = (x+GRID_BRICK_MASK)>>GRID_BRICK_SHIFT;
+    m_tiles[1] = (y+GRID_BRICK_MASK)>>GRID_BRICK_SHIFT;
+    m_tiles[2] = (z+GRID_BRICK_MASK)>>GRID_BRICK_SHIFT;
+    m_fluidTiles.assign(m_tiles[0]*m_tiles[1]*m_tiles[2], 0);
+    //the grids start out at their own backgrounds, so the first call resets everything
+    InvalidateCellTypes();
+}
+
+unsigned int ParticleGrid::GetCellIndex(const int& x, const int& y, const int& z){
+    return (x*(int)m_dimensions.y + y)*(int)m_dimensions.z + z;
+}
+
+unsigned int ParticleGrid::GetCellStart(const unsigned int& cell){
+    return m_cellStart[cell];
+}
+
+unsigned int ParticleGrid::GetCellCount(const unsigned int& cell){
+    return m_cellStart[cell+1] - m_cellStart[cell];
+}
+
+unsigned int* ParticleGrid::GetSortedIndices(){
+    return m_indices.data();
+}
+
+std::vector<unsigned int>& ParticleGrid::GetOccupiedCells(){
+    return m_occupiedCells;
+}
+
+std::vector<unsigned char>& ParticleGrid::GetFluidTiles(){
+    return m_fluidTiles;
+}
+
+size_t ParticleGrid::GetMemoryUsage(){
+    return (m_cellStart.capacity() + m_indices.capacity() + m_particleCells.capacity() + 
+            m_mortonCells.capacity() + m_occupiedCells.capacity() + 
+            m_markedTiles.capacity())*sizeof(unsigned int) + 
+           m_numberOfCells*sizeof(tbb::atomic<unsigned int>) + m_fluidTiles.capacity();
+}
+
+void ParticleGrid::InvalidateCellTypes(){
+    unsigned int tileCount = m_tiles[0]*m_tiles[1]*m_tiles[2];
+    m_markedTiles.resize(tileCount);
+    for(unsigned int t=0; t<tileCount; t++){
+        m_markedTiles[t] = t;
+    }
+}
+
+//A cell holding a solid particle is SOLID and its SDF is 1, as is a cell holding anything but
+//liquid. Any other cell is FLUID exactly where its SDF is negative, so L<0 and FLUID always
+//agree. Empty cells are AIR at the SDF of no particles
+void ParticleGrid::MarkCellTypes(ParticleSet* particles, Grid<unsigned char>* A, Grid<float>* L,
+                                 const float& density){
+    int x = m_dimensions.x; int y = m_dimensions.y; int z = m_dimensions.z;
+    int tx = m_tiles[0]; int ty = m_tiles[1]; int tz = m_tiles[2];
+    float n0 = 1.0f/(density*density*density);
+    float air = 0.2f*n0;
+    unsigned char* a = A->GetRawData();
+    float* l = L->GetRawData();
+    unsigned int asx = A->GetStrideX(); unsigned int asy = A->GetStrideY();
+    unsigned int lsx = L->GetStrideX(); unsigned int lsy = L->GetStrideY();
+
+    const unsigned int* marked = m_markedTiles.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,m_markedTiles.size()),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int t=r.begin(); t!=r.end(); ++t){
+                unsigned int tile = marked[t];
+                int ti = tile/(ty*tz); int tj = (tile/tz)%ty; int tk = tile%tz;
+                int iend = glm::min((ti+1)<<GRID_BRICK_SHIFT, x);
+                int jend = glm::min((tj+1)<<GRID_BRICK_SHIFT, y);
+                int kend = glm::min((tk+1)<<GRID_BRICK_SHIFT, z);
+                for(int i=ti<<GRID_BRICK_SHIFT; i<iend; ++i){
+                    for(int j=tj<<GRID_BRICK_SHIFT; j<jend; ++j){
+                        for(int k=tk<<GRID_BRICK_SHIFT; k<kend; ++k){
+                            a[i*asx + j*asy + k] = AIR;
+                            l[i*lsx + j*lsy + k] = air;
+                        }
                     }
-                }   
+                }
             }
         }
-    }
-    return neighbors;
-}
-
-std::vector<Particle*> ParticleGrid::GetWallNeighbors(const glm::vec3& index, 
-                                                      const glm::vec3& numberOfNeighbors){
-    std::vector<Particle*> neighbors;
-    for( int sx=index.x-numberOfNeighbors.x; sx<=index.x+numberOfNeighbors.x-1; sx++ ){
-        for( int sy=index.y-numberOfNeighbors.y; sy<=index.y+numberOfNeighbors.y-1; sy++ ) {
-            for( int sz=index.z-numberOfNeighbors.z; sz<=index.z+numberOfNeighbors.z-1; sz++ ) {
-                if( sx < 0 || sx > m_dimensions.x-1 || sy < 0 || sy > m_dimensions.y-1 || 
-                    sz < 0 || sz > m_dimensions.z-1 ){
-                    continue;
-                }
-                int cellindex = m_grid->GetCell(glm::vec3(sx, sy, sz));
-                if(cellindex>=0){
-                    int cellparticlecount = m_cells[cellindex].size();
-                    for(int a=0; a<cellparticlecount; a++){
-                        neighbors.push_back(m_cells[cellindex][a]);
+    );
+
+    //each task owns one x row of tiles. Occupied cells are in index order, so a row's cells are
+    //one run of the list and every tile flag is written by a single thread
+    unsigned int tileCount = tx*ty*tz;
+    std::vector<unsigned char> written(tileCount, 0);
+    m_fluidTiles.assign(tileCount, 0);
+    unsigned char* w = &written[0];
+    unsigned char* f = &m_fluidTiles[0];
+    const unsigned int* cells = m_occupiedCells.data();
+    const unsigned int* cellsEnd = cells + m_occupiedCells.size();
+    const unsigned int* start = m_cellStart.data();
+    const unsigned int* indices = m_indices.data();
+    unsigned int rowCells = (unsigned int)(y*z)<<GRID_BRICK_SHIFT;
+    tbb::parallel_for(tbb::blocked_range<int>(0,tx),
+        [=](const tbb::blocked_range<int>& r){
+            for(int ti=r.begin(); ti!=r.end(); ++ti){
+                const unsigned int* first = std::lower_bound(cells, cellsEnd, ti*rowCells);
+                const unsigned int* last = std::lower_bound(first, cellsEnd, (ti+1)*rowCells);
+                for(const unsigned int* c=first; c!=last; ++c){
+                    unsigned int cell = *c;
+                    int i = cell/(y*z); int j = (cell/z)%y; int k = cell%z;
+                    bool solid = false;
+                    bool mixed = false;
+                    float accm = 0.0f;
+                    for(unsigned int n=start[cell]; n<start[cell+1] && solid==false; n++){
+                        unsigned int p = indices[n];
+                        solid = particles->m_type[p]==SOLID;
+                        mixed = mixed || particles->m_type[p]!=FLUID;
+                        accm += particles->m_density[p];
+                    }
+                    float sdf = mixed ? 1.0f : air-accm;
+                    unsigned char type = solid ? SOLID : (sdf<0.0f ? FLUID : AIR);
+                    a[i*asx + j*asy + k] = type;
+                    l[i*lsx + j*lsy + k] = sdf;
+                    unsigned int tile = (ti*ty + (j>>GRID_BRICK_SHIFT))*tz + (k>>GRID_BRICK_SHIFT);
+                    w[tile] = 1;
+                    if(type==FLUID){
+                        f[tile] = 1;
                     }
-                }   
+                }
             }
         }
-    }
-    return neighbors;
-}
-
-float ParticleGrid::CellSDF(const int& i, const int& j, const int& k, const float& density, 
-                            const geomtype& type){
-    float accm = 0.0f;
-    int cellindex = m_grid->GetCell(i,j,k);
-    if(cellindex>=0){
-        for( int a=0; a<m_cells[cellindex].size(); a++ ) { 
-            if( m_cells[cellindex][a]->m_type == type) {
-                accm += m_cells[cellindex][a]->m_density;
-            } else {
-                return 1.0f;
-            }
+    );
+
+    m_markedTiles.clear();
+    for(unsigned int t=0; t<tileCount; t++){
+        if(written[t]!=0){
+            m_markedTiles.push_back(t);
         }
     }
-    float n0 = 1.0f/(density*density*density);
-    return 0.2f*n0-accm;
 }
 
-void ParticleGrid::BuildSDF(MacGrid& mgrid, const float& density){
+void ParticleGrid::Sort(ParticleSet* particles){
+    m_particles = particles;
+    unsigned int particlecount = GetParticleCount(particles);
+    unsigned int cellcount = m_numberOfCells;
+    m_particleCells.resize(particlecount);
+    m_indices.resize(particlecount);
+
     int x = m_dimensions.x; int y = m_dimensions.y; int z = m_dimensions.z;
-    mgrid.m_L->Clear();
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.y), m_dimensions.z);
+
+    glm::vec3* positions = particles->m_p.data();
+    unsigned int* keys = m_particleCells.data();
+    unsigned int* indices = m_indices.data();
+    unsigned int* start = m_cellStart.data();
+    tbb::atomic<unsigned int>* counts = m_cellCounts;
+
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cellcount),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(int j = 0; j < y; ++j){
-                    for(int k = 0; k < z; ++k){
-                        mgrid.m_L->SetCell(i, j, k, CellSDF(i, j, k, density, FLUID));
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                counts[c] = 0;
+            }
+        }
+    );
+
+    //key each particle by the cell it falls in and histogram the keys
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                glm::vec3 pos = positions[p];
+                int i = (int)glm::max(0.0f, glm::min(x-1.0f, int(maxd)*pos.x));
+                int j = (int)glm::max(0.0f, glm::min(y-1.0f, int(maxd)*pos.y));
+                int k = (int)glm::max(0.0f, glm::min(z-1.0f, int(maxd)*pos.z));
+                unsigned int key = (i*y + j)*z + k;
+                keys[p] = key;
+                counts[key].fetch_and_increment();
+            }
+        }
+    );
+
+    //exclusive prefix sum of the histogram gives each cell's offset into the sorted indices.
+    //The running count of occupied cells rides in the high 32 bits, so the same scan lists them
+    m_occupiedCells.resize(glm::min(particlecount, cellcount));
+    unsigned int* occupied = m_occupiedCells.data();
+    unsigned long long total = tbb::parallel_scan(tbb::blocked_range<unsigned int>(0,cellcount),
+        0ull, [=](const tbb::blocked_range<unsigned int>& r, unsigned long long sum, 
+                  bool isFinal)->unsigned long long{
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                unsigned int count = counts[c];
+                if(isFinal){
+                    start[c] = (unsigned int)sum;
+                    if(count>0){
+                        occupied[sum>>32] = c;
                     }
                 }
-            }   
+                sum += count + (count>0 ? 1ull<<32 : 0ull);
+            }
+            return sum;
+        },
+        std::plus<unsigned long long>()
+    );
+    start[cellcount] = particlecount;
+    m_occupiedCells.resize((unsigned int)(total>>32));
+
+    //scatter, reusing the histogram as per cell write cursors
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cellcount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                counts[c] = start[c];
+            }
+        }
+    );
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                indices[counts[keys[p]].fetch_and_increment()] = p;
+            }
         }
     );
-}
 
-void ParticleGrid::MarkCellTypes(std::vector<Particle*>& particles, Grid<int>* A, 
-                                 const float& density){
-    int x = m_dimensions.x; int y = m_dimensions.y; int z = m_dimensions.z;
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+    //scatter order within a cell depends on scheduling, so put each cell back in index order to
+    //keep neighbor sums deterministic
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cellcount),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(int j = 0; j < y; ++j){
-                    for(int k = 0; k < z; ++k){
-                        A->SetCell(i,j,k, AIR);
-                        int cellindex = m_grid->GetCell(i,j,k);
-                        if(cellindex>=0 && cellindex<m_cells.size()){
-                            for( int a=0; a<m_cells[cellindex].size(); a++ ) { 
-                                if( m_cells[cellindex][a]->m_type == SOLID ) {
-                                    A->SetCell(i,j,k, SOLID);
-                                }
-                            }
-                        }
-                        if( A->GetCell(i,j,k) != SOLID ){
-                            bool isfluid = CellSDF(i, j, k, density, FLUID) < 0.0 ;
-                            if(isfluid){
-                                A->SetCell(i,j,k, FLUID);
-                            }else{
-                                A->SetCell(i,j,k, AIR);
-                            }
-                        }
-                    }
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                if(start[c+1]-start[c]>1){
+                    std::sort(indices+start[c], indices+start[c+1]);
                 }
             }
         }
     );
 }
 
-void ParticleGrid::Sort(std::vector<Particle*>& particles){
-    // clear existing cells
-    int cellcount = m_cells.size();
-    for(int i=0; i<cellcount; i++){
-        m_cells[i].clear();
-    }
+void ParticleGrid::ReorderParticles(ParticleSet* particles, const unsigned int& begin, 
+                                    const unsigned int& end){
+    ReorderParticles(particles, begin, end, REORDER_CURVE_LINEAR);
+}
 
-    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.y), m_dimensions.z);
+void ParticleGrid::ReorderParticles(ParticleSet* particles, const unsigned int& begin, 
+                                    const unsigned int& end, const int& curve){
+    //sorted indices are already grouped by cell, so the subsequence that falls in
+    //[begin, end) is that range's cell order. Assumes the set was just sorted
+    std::vector<unsigned int> order;
+    order.reserve(end-begin);
+    if(curve==REORDER_CURVE_MORTON){
+        BuildMortonCells();
+        for(unsigned int c=0; c<m_numberOfCells; c++){
+            unsigned int cell = m_mortonCells[c];
+            for(unsigned int a=m_cellStart[cell]; a<m_cellStart[cell+1]; a++){
+                if(m_indices[a]>=begin && m_indices[a]<end){
+                    order.push_back(m_indices[a]);
+                }
+            }
+        }
+    }else{
+        unsigned int particlecount = m_indices.size();
+        for(unsigned int i=0; i<particlecount; i++){
+            if(m_indices[i]>=begin && m_indices[i]<end){
+                order.push_back(m_indices[i]);
+            }
+        }
+    }
+    PermuteParticleSet(particles, order, begin);
+    Sort(particles);
+}
 
-    int particlecount = particles.size();
-    int cellscount = m_cells.size();
-    // cout << particlecount << endl;
-    for(int i=0; i<particlecount; i++){
-        Particle* p = particles[i];
-
-        glm::vec3 pos = p->m_p;
-        pos.x = (int)glm::max(0.0f, glm::min((int)maxd-1.0f, int(maxd)*pos.x));
-        pos.y = (int)glm::max(0.0f, glm::min((int)maxd-1.0f, int(maxd)*pos.y));
-        pos.z = (int)glm::max(0.0f, glm::min((int)maxd-1.0f, int(maxd)*pos.z));
-        
-        int cellindex = m_grid->GetCell(pos);
-        
-        if(cellindex>=0){ //if grid has value here, a cell already exists for it
-            m_cells[cellindex].push_back(p);
-        }else{ //if grid has no value, create new cell and push index to grid
-            std::vector<Particle*> cell;
-            cell.push_back(p);
-            m_cells.push_back(cell);
-            m_grid->SetCell(pos, cellscount);
-            cellscount++;
+//Keyed sort of every cell by its Morton code, which also handles grids that are not a power of
+//two along some axis. Done once, the grid's dimensions never change
+void ParticleGrid::BuildMortonCells(){
+    if(m_mortonCells.size()==m_numberOfCells){
+        return;
+    }
+    int x = m_dimensions.x; int y = m_dimensions.y; int z = m_dimensions.z;
+    std::vector<std::pair<unsigned long long, unsigned int> > keys(m_numberOfCells);
+    std::pair<unsigned long long, unsigned int>* key = keys.data();
+    tbb::parallel_for(tbb::blocked_range<int>(0,x),
+        [=](const tbb::blocked_range<int>& r){
+            for(int i=r.begin(); i!=r.end(); ++i){
+                for(int j=0; j<y; j++){
+                    for(int k=0; k<z; k++){
+                        unsigned int cell = (i*y + j)*z + k;
+                        key[cell].first = SpreadMortonBits(i)<<2 | SpreadMortonBits(j)<<1 | 
+                                          SpreadMortonBits(k);
+                        key[cell].second = cell;
+                    }
+                }
+            }
         }
+    );
+    tbb::parallel_sort(keys.begin(), keys.end());
+    m_mortonCells.resize(m_numberOfCells);
+    for(unsigned int c=0; c<m_numberOfCells; c++){
+        m_mortonCells[c] = keys[c].second;
     }
 }
 }
@@ -9,9 +9,13 @@
 
 #include <tbb/tbb.h>
 #include "../utilities/utilities.h"
+#include "../utilities/profiler.hpp"
 #include "macgrid.inl"
 #include "gridutils.inl"
 
+//Cell orders particle storage can be permuted into
+enum reordercurve {REORDER_CURVE_LINEAR=0, REORDER_CURVE_MORTON=1};
+
 namespace fluidCore {
 //====================================
 // Class Declarations
@@ -25,27 +29,72 @@ class ParticleGrid{
         ~ParticleGrid();
 
         //Sorting tools
-        void Sort(std::vector<Particle*>& particles);
-        std::vector<Particle*> GetCellNeighbors(const glm::vec3& index, 
-                                                const glm::vec3& numberOfNeighbors);
-        std::vector<Particle*> GetWallNeighbors(const glm::vec3& index, 
-                                                const glm::vec3& numberOfNeighbors);
+        //Counting sort of particle indices by linear cell index. Cells refer to the last sorted
+        //ParticleSet, and particles within a cell stay in ascending index order. The offset
+        //scan also lists the occupied cells
+        void Sort(ParticleSet* particles);
+        //Permutes particles [begin, end) of the set into cell order and re-sorts. Cells are
+        //visited in linear index order, or along a Morton curve for REORDER_CURVE_MORTON so
+        //that neighbors along every axis stay close in memory
+        void ReorderParticles(ParticleSet* particles, const unsigned int& begin, 
+                              const unsigned int& end);
+        void ReorderParticles(ParticleSet* particles, const unsigned int& begin, 
+                              const unsigned int& end, const int& curve);
 
-        void MarkCellTypes(std::vector<Particle*>& particles, Grid<int>* A, 
-                           const float& density);
-        float CellSDF(const int& i, const int& j, const int& k, const float& density, 
-                      const geomtype& type);
+        //Neighbor visitors, fn(particleIndex) is called for every particle in the
+        //neighborhood. Nothing is allocated, so these are safe to call per particle
+        template <typename F> void ForEachCellNeighbor(const glm::vec3& index, 
+                                                       const glm::vec3& numberOfNeighbors, 
+                                                       const F& fn);
+        template <typename F> void ForEachWallNeighbor(const glm::vec3& index, 
+                                                       const glm::vec3& numberOfNeighbors, 
+                                                       const F& fn);
 
-        void BuildSDF(MacGrid& mgrid, const float& density);
+        unsigned int GetCellIndex(const int& x, const int& y, const int& z);
+        unsigned int GetCellStart(const unsigned int& cell);
+        unsigned int GetCellCount(const unsigned int& cell);
+        unsigned int* GetSortedIndices();
+        //cells holding a particle as of the last sort, in ascending index order
+        std::vector<unsigned int>& GetOccupiedCells();
+        //heap held by the sort, by capacity
+        size_t GetMemoryUsage();
+
+        //Writes cell types to A and the liquid level set to L in one pass over the occupied
+        //cells. Empty cells are air, and every cell outside the tiles the last call wrote still
+        //is, so only those tiles are reset first
+        void MarkCellTypes(ParticleSet* particles, Grid<unsigned char>* A, Grid<float>* L,
+                           const float& density);
+        //the next MarkCellTypes resets every tile, for when A or L were written elsewhere
+        void InvalidateCellTypes();
+        //per GRID_BRICK_SIZE^3 tile, set where the last MarkCellTypes marked a fluid cell
+        std::vector<unsigned char>& GetFluidTiles();
 
     private:
         void Init(const int& x, const int& y, const int& z);
+        void BuildMortonCells();
+        template <typename F> void ForEachInBox(const int& x0, const int& x1, const int& y0, 
+                                                const int& y1, const int& z0, const int& z1, 
+                                                const F& fn);
 
         glm::vec3                                   m_dimensions;
-        Grid<int>*                                  m_grid;
-        std::vector< std::vector<Particle*> >       m_cells;
+        unsigned int                                m_numberOfCells;
+        //cell c holds m_indices[m_cellStart[c]] through m_indices[m_cellStart[c+1]-1]
+        std::vector<unsigned int>                   m_cellStart;
+        std::vector<unsigned int>                   m_indices;
+        std::vector<unsigned int>                   m_particleCells;
+        //linear cell indices in Morton order, built on the first Morton reorder
+        std::vector<unsigned int>                   m_mortonCells;
+        std::vector<unsigned int>                   m_occupiedCells;
+        int                                         m_tiles[3]; //tile count per axis
+        std::vector<unsigned char>                  m_fluidTiles;
+        //tiles the last MarkCellTypes wrote anything but air to
+        std::vector<unsigned int>                   m_markedTiles;
+        tbb::atomic<unsigned int>*                  m_cellCounts;
+        ParticleSet*                                m_particles;
         
 };
 }
 
+#include "particlegrid.inl"
+
 #endif
@@ -0,0 +1,53 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: particlegrid.inl
+// Implements the templated neighbor visitors in particlegrid.hpp
+
+namespace fluidCore{
+
+//Cells along z are adjacent in the offset table, so each (x,y) column of the neighborhood is a
+//single contiguous span of sorted indices
+template <typename F> inline void ParticleGrid::ForEachInBox(const int& x0, const int& x1, 
+                                                             const int& y0, const int& y1, 
+                                                             const int& z0, const int& z1, 
+                                                             const F& fn){
+    int dx = (int)m_dimensions.x; int dy = (int)m_dimensions.y; int dz = (int)m_dimensions.z;
+    int xmin = glm::max(x0, 0); int xmax = glm::min(x1, dx-1);
+    int ymin = glm::max(y0, 0); int ymax = glm::min(y1, dy-1);
+    int zmin = glm::max(z0, 0); int zmax = glm::min(z1, dz-1);
+    if(zmin>zmax){
+        return;
+    }
+    const unsigned int* start = m_cellStart.data();
+    const unsigned int* indices = m_indices.data();
+    for(int sx=xmin; sx<=xmax; sx++){
+        for(int sy=ymin; sy<=ymax; sy++){
+            unsigned int row = (sx*dy + sy)*dz;
+            unsigned int end = start[row+zmax+1];
+            for(unsigned int a=start[row+zmin]; a<end; a++){
+                fn(indices[a]);
+            }
+        }
+    }
+}
+
+template <typename F> inline void ParticleGrid::ForEachCellNeighbor(const glm::vec3& index, 
+                                                        const glm::vec3& numberOfNeighbors, 
+                                                        const F& fn){
+    utilityCore::GetProfiler()->AddCount(PROFILE_NEIGHBOR_QUERIES, 1);
+    int x = (int)(index.x-numberOfNeighbors.x); int y = (int)(index.y-numberOfNeighbors.y); 
+    int z = (int)(index.z-numberOfNeighbors.z);
+    ForEachInBox(x, (int)(index.x+numberOfNeighbors.x), y, (int)(index.y+numberOfNeighbors.y),
+                 z, (int)(index.z+numberOfNeighbors.z), fn);
+}
+
+template <typename F> inline void ParticleGrid::ForEachWallNeighbor(const glm::vec3& index, 
+                                                        const glm::vec3& numberOfNeighbors, 
+                                                        const F& fn){
+    int x = (int)(index.x-numberOfNeighbors.x); int y = (int)(index.y-numberOfNeighbors.y); 
+    int z = (int)(index.z-numberOfNeighbors.z);
+    ForEachInBox(x, (int)(index.x+numberOfNeighbors.x-1), y, (int)(index.y+numberOfNeighbors.y-1),
+                 z, (int)(index.z+numberOfNeighbors.z-1), fn);
+}
+}
@@ -0,0 +1,339 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: particleset.inl
+// Structure-of-arrays particle storage shared by the sim, scene, exporters and viewer
+
+#ifndef PARTICLESET_INL
+#define PARTICLESET_INL
+
+#include <vector>
+#include <tbb/tbb.h>
+#include "../utilities/utilities.h"
+#include "../utilities/checkpoint.hpp"
+
+namespace fluidCore {
+//====================================
+// Struct and Function Declarations
+//====================================
+
+//Single particle value, used for emitting particles and for moving one particle in or out of a
+//ParticleSet. Nothing in the sim stores these, hot loops go through the ParticleSet arrays
+struct Particle{
+    glm::vec3       m_p; //position
+    glm::vec3       m_u; //velocity
+    glm::vec3       m_n; //normal
+    float           m_density;
+    float           m_mass;
+    int             m_type;
+    bool            m_invalid;
+    unsigned int    m_id;
+    int             m_birthFrame;
+};
+
+//Particle i lives at index i of every persistent array. The scratch arrays are empty until a
+//pass asks for them through GetParticleScratch, and keep their capacity between steps
+struct ParticleSet{
+    std::vector<glm::vec3>      m_p; //position
+    std::vector<glm::vec3>      m_u; //velocity
+    std::vector<glm::vec3>      m_n; //normal
+    std::vector<float>          m_density;
+    std::vector<float>          m_mass;
+    std::vector<int>            m_type;
+    std::vector<unsigned char>  m_invalid; //not vector<bool> so threads can write neighbors
+    std::vector<unsigned int>   m_id; //stable for liquids across sorts and restarts
+    std::vector<int>            m_birthFrame; //frame the particle was emitted on
+
+    //scratch
+    std::vector<glm::vec3>      m_t;
+    std::vector<glm::vec3>      m_t2;
+    std::vector<glm::vec3>      m_ut; //copy of previous velocity used for bound check correction
+    std::vector<glm::vec3>      m_pt; //copy of previous position used for bound checks
+};
+
+//Forward declarations for externed inlineable methods
+extern inline Particle CreateParticle(const glm::vec3& position, const glm::vec3& velocity,
+                                      const glm::vec3& normal, const float& density);
+extern inline unsigned int GetParticleCount(ParticleSet* set);
+extern inline size_t GetParticleSetBytes(ParticleSet* set);
+extern inline void ResizeParticleSet(ParticleSet* set, const unsigned int& count);
+extern inline void ReserveParticleSet(ParticleSet* set, const unsigned int& count);
+extern inline void ClearParticleSet(ParticleSet* set);
+extern inline void AppendParticle(ParticleSet* set, const Particle& p);
+extern inline Particle GetParticle(ParticleSet* set, const unsigned int& i);
+extern inline void SetParticle(ParticleSet* set, const unsigned int& i, const Particle& p);
+extern inline glm::vec3* GetParticleScratch(ParticleSet* set, std::vector<glm::vec3>& scratch);
+extern inline void CopyParticles(ParticleSet* target, const unsigned int& offset, 
+                                 ParticleSet* source);
+extern inline void CopyParticleSubset(ParticleSet* target, const unsigned int& offset, 
+                                      ParticleSet* source, 
+                                      const std::vector<unsigned int>& indices);
+extern inline void PermuteParticleSet(ParticleSet* set, const std::vector<unsigned int>& order,
+                                      const unsigned int& begin);
+extern inline void AddParticleSetChunks(utilityCore::Checkpoint* checkpoint, 
+                                        const std::string& prefix, ParticleSet* set);
+extern inline bool GetParticleSetChunks(utilityCore::Checkpoint* checkpoint, 
+                                        const std::string& prefix, ParticleSet* set);
+template <typename T> void PermuteParticleArray(std::vector<T>& array, 
+                                                const std::vector<unsigned int>& order,
+                                                const unsigned int& begin);
+template <typename T> void GatherParticleArray(std::vector<T>& target, const unsigned int& offset,
+                                               const std::vector<T>& source, 
+                                               const std::vector<unsigned int>& indices);
+
+//====================================
+// Function Implementations
+//====================================
+
+Particle CreateParticle(const glm::vec3& position, const glm::vec3& velocity,
+                        const glm::vec3& normal, const float& density){
+    Particle p;
+    p.m_p = position;
+    p.m_u = velocity;
+    p.m_n = normal;
+    p.m_density= density;
+    p.m_id = 0;
+    p.m_birthFrame = 0;
+    return p;
+}
+
+unsigned int GetParticleCount(ParticleSet* set){
+    return set->m_p.size();
+}
+
+//Heap held by every array, scratch included, by capacity rather than size
+size_t GetParticleSetBytes(ParticleSet* set){
+    size_t vectors = set->m_p.capacity() + set->m_u.capacity() + set->m_n.capacity() + 
+                     set->m_t.capacity() + set->m_t2.capacity() + set->m_ut.capacity() + 
+                     set->m_pt.capacity();
+    return vectors*sizeof(glm::vec3) + set->m_density.capacity()*sizeof(float) + 
+           set->m_mass.capacity()*sizeof(float) + set->m_type.capacity()*sizeof(int) + 
+           set->m_invalid.capacity()*sizeof(unsigned char) + 
+           set->m_id.capacity()*sizeof(unsigned int) + 
+           set->m_birthFrame.capacity()*sizeof(int);
+}
+
+//Scratch arrays that are already in use are resized along with the persistent arrays
+void ResizeParticleSet(ParticleSet* set, const unsigned int& count){
+    set->m_p.resize(count);
+    set->m_u.resize(count);
+    set->m_n.resize(count);
+    set->m_density.resize(count);
+    set->m_mass.resize(count);
+    set->m_type.resize(count);
+    set->m_invalid.resize(count);
+    set->m_id.resize(count);
+    set->m_birthFrame.resize(count);
+    std::vector<glm::vec3>* scratch[4] = {&set->m_t, &set->m_t2, &set->m_ut, &set->m_pt};
+    for(unsigned int i=0; i<4; i++){
+        if(scratch[i]->empty()==false){
+            scratch[i]->resize(count);
+        }
+    }
+}
+
+void ReserveParticleSet(ParticleSet* set, const unsigned int& count){
+    set->m_p.reserve(count);
+    set->m_u.reserve(count);
+    set->m_n.reserve(count);
+    set->m_density.reserve(count);
+    set->m_mass.reserve(count);
+    set->m_type.reserve(count);
+    set->m_invalid.reserve(count);
+    set->m_id.reserve(count);
+    set->m_birthFrame.reserve(count);
+}
+
+void ClearParticleSet(ParticleSet* set){
+    ResizeParticleSet(set, 0);
+}
+
+void AppendParticle(ParticleSet* set, const Particle& p){
+    set->m_p.push_back(p.m_p);
+    set->m_u.push_back(p.m_u);
+    set->m_n.push_back(p.m_n);
+    set->m_density.push_back(p.m_density);
+    set->m_mass.push_back(p.m_mass);
+    set->m_type.push_back(p.m_type);
+    set->m_invalid.push_back(p.m_invalid);
+    set->m_id.push_back(p.m_id);
+    set->m_birthFrame.push_back(p.m_birthFrame);
+    std::vector<glm::vec3>* scratch[4] = {&set->m_t, &set->m_t2, &set->m_ut, &set->m_pt};
+    for(unsigned int i=0; i<4; i++){
+        if(scratch[i]->empty()==false){
+            scratch[i]->push_back(glm::vec3(0.0f));
+        }
+    }
+}
+
+Particle GetParticle(ParticleSet* set, const unsigned int& i){
+    Particle p;
+    p.m_p = set->m_p[i];
+    p.m_u = set->m_u[i];
+    p.m_n = set->m_n[i];
+    p.m_density = set->m_density[i];
+    p.m_mass = set->m_mass[i];
+    p.m_type = set->m_type[i];
+    p.m_invalid = set->m_invalid[i]!=0;
+    p.m_id = set->m_id[i];
+    p.m_birthFrame = set->m_birthFrame[i];
+    return p;
+}
+
+void SetParticle(ParticleSet* set, const unsigned int& i, const Particle& p){
+    set->m_p[i] = p.m_p;
+    set->m_u[i] = p.m_u;
+    set->m_n[i] = p.m_n;
+    set->m_density[i] = p.m_density;
+    set->m_mass[i] = p.m_mass;
+    set->m_type[i] = p.m_type;
+    set->m_invalid[i] = p.m_invalid;
+    set->m_id[i] = p.m_id;
+    set->m_birthFrame[i] = p.m_birthFrame;
+}
+
+//Allocates one of the set's scratch arrays on first use and returns its raw storage
+glm::vec3* GetParticleScratch(ParticleSet* set, std::vector<glm::vec3>& scratch){
+    unsigned int count = GetParticleCount(set);
+    if(scratch.size()!=count){
+        scratch.resize(count);
+    }
+    if(count==0){
+        return NULL;
+    }
+    return &scratch[0];
+}
+
+//Copies the persistent arrays of source into target starting at particle offset. target must
+//already hold offset+GetParticleCount(source) particles
+void CopyParticles(ParticleSet* target, const unsigned int& offset, ParticleSet* source){
+    std::copy(source->m_p.begin(), source->m_p.end(), target->m_p.begin()+offset);
+    std::copy(source->m_u.begin(), source->m_u.end(), target->m_u.begin()+offset);
+    std::copy(source->m_n.begin(), source->m_n.end(), target->m_n.begin()+offset);
+    std::copy(source->m_density.begin(), source->m_density.end(), 
+              target->m_density.begin()+offset);
+    std::copy(source->m_mass.begin(), source->m_mass.end(), target->m_mass.begin()+offset);
+    std::copy(source->m_type.begin(), source->m_type.end(), target->m_type.begin()+offset);
+    std::copy(source->m_invalid.begin(), source->m_invalid.end(), 
+              target->m_invalid.begin()+offset);
+    std::copy(source->m_id.begin(), source->m_id.end(), target->m_id.begin()+offset);
+    std::copy(source->m_birthFrame.begin(), source->m_birthFrame.end(), 
+              target->m_birthFrame.begin()+offset);
+}
+
+//Gathers source[indices[i]] into target[offset+i], target must already have room
+template <typename T> void GatherParticleArray(std::vector<T>& target, const unsigned int& offset,
+                                               const std::vector<T>& source, 
+                                               const std::vector<unsigned int>& indices){
+    unsigned int count = indices.size();
+    if(count==0){
+        return;
+    }
+    const T* from = source.data();
+    T* to = target.data()+offset;
+    const unsigned int* index = indices.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,count),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                to[i] = from[index[i]];
+            }
+        }
+    );
+}
+
+//Like CopyParticles, but only for the source particles listed in indices
+void CopyParticleSubset(ParticleSet* target, const unsigned int& offset, ParticleSet* source,
+                        const std::vector<unsigned int>& indices){
+    GatherParticleArray(target->m_p, offset, source->m_p, indices);
+    GatherParticleArray(target->m_u, offset, source->m_u, indices);
+    GatherParticleArray(target->m_n, offset, source->m_n, indices);
+    GatherParticleArray(target->m_density, offset, source->m_density, indices);
+    GatherParticleArray(target->m_mass, offset, source->m_mass, indices);
+    GatherParticleArray(target->m_type, offset, source->m_type, indices);
+    GatherParticleArray(target->m_invalid, offset, source->m_invalid, indices);
+    GatherParticleArray(target->m_id, offset, source->m_id, indices);
+    GatherParticleArray(target->m_birthFrame, offset, source->m_birthFrame, indices);
+}
+
+//Gathers array[order[i]] into array[begin+i]. order must be a permutation of
+//[begin, begin+order.size())
+template <typename T> void PermuteParticleArray(std::vector<T>& array, 
+                                                const std::vector<unsigned int>& order,
+                                                const unsigned int& begin){
+    unsigned int count = order.size();
+    if(array.empty()==true || count==0){
+        return;
+    }
+    std::vector<T> permuted(count);
+    T* source = array.data();
+    T* target = permuted.data();
+    const unsigned int* o = order.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,count),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                target[i] = source[o[i]];
+            }
+        }
+    );
+    std::copy(permuted.begin(), permuted.end(), array.begin()+begin);
+}
+
+//Moves particles within [begin, begin+order.size()) so particle begin+i becomes the old
+//particle order[i]. Scratch arrays in use are moved too
+void PermuteParticleSet(ParticleSet* set, const std::vector<unsigned int>& order, 
+                        const unsigned int& begin){
+    PermuteParticleArray(set->m_p, order, begin);
+    PermuteParticleArray(set->m_u, order, begin);
+    PermuteParticleArray(set->m_n, order, begin);
+    PermuteParticleArray(set->m_density, order, begin);
+    PermuteParticleArray(set->m_mass, order, begin);
+    PermuteParticleArray(set->m_type, order, begin);
+    PermuteParticleArray(set->m_invalid, order, begin);
+    PermuteParticleArray(set->m_id, order, begin);
+    PermuteParticleArray(set->m_birthFrame, order, begin);
+    PermuteParticleArray(set->m_t, order, begin);
+    PermuteParticleArray(set->m_t2, order, begin);
+    PermuteParticleArray(set->m_ut, order, begin);
+    PermuteParticleArray(set->m_pt, order, begin);
+}
+
+//Stores the persistent arrays as chunks named prefix_array, scratch is not saved
+void AddParticleSetChunks(utilityCore::Checkpoint* checkpoint, const std::string& prefix,
+                          ParticleSet* set){
+    checkpoint->AddArray(prefix+"_p", set->m_p);
+    checkpoint->AddArray(prefix+"_u", set->m_u);
+    checkpoint->AddArray(prefix+"_n", set->m_n);
+    checkpoint->AddArray(prefix+"_density", set->m_density);
+    checkpoint->AddArray(prefix+"_mass", set->m_mass);
+    checkpoint->AddArray(prefix+"_type", set->m_type);
+    checkpoint->AddArray(prefix+"_invalid", set->m_invalid);
+    checkpoint->AddArray(prefix+"_id", set->m_id);
+    checkpoint->AddArray(prefix+"_birth_frame", set->m_birthFrame);
+}
+
+//Replaces the set's contents, false if an array is missing or the arrays disagree on count
+bool GetParticleSetChunks(utilityCore::Checkpoint* checkpoint, const std::string& prefix,
+                          ParticleSet* set){
+    ClearParticleSet(set);
+    bool found = checkpoint->GetArray(prefix+"_p", set->m_p) &&
+                 checkpoint->GetArray(prefix+"_u", set->m_u) &&
+                 checkpoint->GetArray(prefix+"_n", set->m_n) &&
+                 checkpoint->GetArray(prefix+"_density", set->m_density) &&
+                 checkpoint->GetArray(prefix+"_mass", set->m_mass) &&
+                 checkpoint->GetArray(prefix+"_type", set->m_type) &&
+                 checkpoint->GetArray(prefix+"_invalid", set->m_invalid) &&
+                 checkpoint->GetArray(prefix+"_id", set->m_id) &&
+                 checkpoint->GetArray(prefix+"_birth_frame", set->m_birthFrame);
+    unsigned int count = set->m_p.size();
+    if(found==false || set->m_u.size()!=count || set->m_n.size()!=count || 
+       set->m_density.size()!=count || set->m_mass.size()!=count || 
+       set->m_type.size()!=count || set->m_invalid.size()!=count || 
+       set->m_id.size()!=count || set->m_birthFrame.size()!=count){
+        ClearParticleSet(set);
+        return false;
+    }
+    return true;
+}
+}
+
+#endif
@@ -0,0 +1,54 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: surfacingsettings.inl
+// Per-scene settings for turning exported liquid particles into a level set and a mesh
+
+#ifndef SURFACINGSETTINGS_INL
+#define SURFACINGSETTINGS_INL
+
+#include "../utilities/utilities.h"
+
+enum surfacingraster {SURFACING_RASTER_TRAILS=0, SURFACING_RASTER_SPHERES=1};
+enum meshformat {MESH_FORMAT_OBJ=0, MESH_FORMAT_PLY=1};
+
+namespace fluidCore {
+//====================================
+// Struct and Function Declarations
+//====================================
+
+//Lengths are in sim grid cells unless noted
+struct SurfacingSettings{
+    float           m_voxelSize;
+    float           m_halfBandWidth; //voxels either side of the surface
+    int             m_raster; //trails smear each particle along its velocity
+    float           m_particleRadius;
+    float           m_minRadius; //voxels, smaller particles are skipped
+    float           m_adaptivity; //0 meshes every voxel, 1 merges flat regions the most
+    int             m_grainSize; //rasterization grain, 0 rasterizes serially
+    int             m_meshFormat;
+};
+
+//Forward declarations for externed inlineable methods
+extern inline SurfacingSettings CreateSurfacingSettings();
+
+//====================================
+// Function Implementations
+//====================================
+
+//Default settings match the original hardcoded surfacing and ascii obj output
+SurfacingSettings CreateSurfacingSettings(){
+    SurfacingSettings s;
+    s.m_voxelSize = 1.0f;
+    s.m_halfBandWidth = 3.0f;
+    s.m_raster = SURFACING_RASTER_TRAILS;
+    s.m_particleRadius = 0.5f;
+    s.m_minRadius = 0.01f;
+    s.m_adaptivity = 0.05f;
+    s.m_grainSize = 1;
+    s.m_meshFormat = MESH_FORMAT_OBJ;
+    return s;
+}
+}
+
+#endif
@@ -0,0 +1,303 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: tilemask.inl
+// Active tile mask that restricts grid passes and the pressure solve to the liquid region
+
+#ifndef TILEMASK_INL
+#define TILEMASK_INL
+
+#include <vector>
+#include <algorithm>
+#include <tbb/tbb.h>
+#include "grid.hpp"
+#include "gridutils.inl"
+#include "../utilities/utilities.h"
+#include "../utilities/numa.hpp"
+
+namespace fluidCore {
+//====================================
+// Struct and Function Declarations
+//====================================
+
+//The cell grid is split into GRID_BRICK_SIZE^3 tiles. A tile is active if it holds a fluid cell
+//or lies within m_band tiles of one. Cells outside active tiles hold no fluid and no face next
+//to fluid, so stencil passes and the solver can skip them entirely. Faces are owned by the tile
+//of the cell on their high side, the last face layer of each axis belongs to the last tiles
+struct TileMask{
+    glm::vec3                   m_dimensions; //in cells
+    int                         m_tiles[3]; //tile count per axis
+    int                         m_band; //dilation in tiles
+    bool                        m_sparse; //when false every tile is always active
+    std::vector<unsigned char>  m_active;
+    std::vector<unsigned char>  m_released; //active on the previous build, inactive now
+    std::vector<unsigned int>   m_activeTiles;
+    std::vector<unsigned int>   m_releasedTiles;
+    //active tiles bucketed by ti+tj+tk, wavefront w is m_wavefrontTiles[m_wavefrontStart[w]]
+    //through m_wavefrontTiles[m_wavefrontStart[w+1]-1]
+    std::vector<unsigned int>   m_wavefrontTiles;
+    std::vector<unsigned int>   m_wavefrontStart;
+};
+
+//Forward declarations for externed inlineable methods
+extern inline TileMask CreateTileMask(const glm::vec3& dimensions, const bool& sparse,
+                                      const int& band);
+extern inline void BuildTileMask(TileMask* mask, Grid<unsigned char>* A);
+extern inline void BuildTileMask(TileMask* mask, const std::vector<unsigned char>& fluidTiles);
+extern inline void GetTileBounds(TileMask* mask, const unsigned int& tile, const int& axis,
+                                 int* lo, int* hi);
+extern inline void GetActiveBounds(TileMask* mask, int* lo, int* hi);
+extern inline void BuildWavefronts(TileMask* mask);
+extern inline void GetNodeTiles(TileMask* mask, const int& node, unsigned int* begin,
+                                unsigned int* end);
+template <typename T> void ClearReleasedTiles(TileMask* mask, Grid<T>* grid, const int& axis);
+template <typename F> void ForEachActiveTile(TileMask* mask, const int& axis, const F& fn);
+template <typename F> double ReduceActiveTiles(TileMask* mask, const bool& deterministic,
+                                               const F& body);
+
+//====================================
+// Function Implementations
+//====================================
+
+TileMask CreateTileMask(const glm::vec3& dimensions, const bool& sparse, const int& band){
+    TileMask mask;
+    mask.m_dimensions = dimensions;
+    for(unsigned int n=0; n<3; n++){
+        mask.m_tiles[n] = ((int)dimensions[n]+GRID_BRICK_MASK)>>GRID_BRICK_SHIFT;
+    }
+    mask.m_band = band;
+    mask.m_sparse = sparse;
+    unsigned int tileCount = mask.m_tiles[0]*mask.m_tiles[1]*mask.m_tiles[2];
+    mask.m_active.assign(tileCount, 0);
+    mask.m_released.assign(tileCount, 0);
+    return mask;
+}
+
+//Rebuilds the active set from cell types and records which tiles dropped out since the last
+//build so callers can reset whatever those tiles still hold
+void BuildTileMask(TileMask* mask, Grid<unsigned char>* A){
+    int tx = mask->m_tiles[0]; int ty = mask->m_tiles[1]; int tz = mask->m_tiles[2];
+    unsigned int tileCount = tx*ty*tz;
+    std::vector<unsigned char> fluid(tileCount, mask->m_sparse ? 0 : 1);
+    if(mask->m_sparse==true){
+        int x = (int)mask->m_dimensions.x; int y = (int)mask->m_dimensions.y;
+        int z = (int)mask->m_dimensions.z;
+        unsigned char* a = A->GetRawData();
+        unsigned int sx = A->GetStrideX(); unsigned int sy = A->GetStrideY();
+        unsigned char* f = &fluid[0];
+        //each task owns one x row of tiles, so flags are written by a single thread
+        tbb::parallel_for(tbb::blocked_range<int>(0,tx),
+            [=](const tbb::blocked_range<int>& r){
+                for(int ti=r.begin(); ti!=r.end(); ++ti){
+                    int iend = glm::min((ti+1)<<GRID_BRICK_SHIFT, x);
+                    for(int i=ti<<GRID_BRICK_SHIFT; i<iend; ++i){
+                        for(int j=0; j<y; ++j){
+                            unsigned int row = i*sx + j*sy;
+                            for(int k=0; k<z; ++k){
+                                if(a[row+k]==FLUID){
+                                    f[(ti*ty + (j>>GRID_BRICK_SHIFT))*tz +
+                                      (k>>GRID_BRICK_SHIFT)] = 1;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        );
+    }
+    BuildTileMask(mask, fluid);
+}
+
+//Same, from flags that are set on tiles holding a fluid cell
+void BuildTileMask(TileMask* mask, const std::vector<unsigned char>& fluidTiles){
+    int tx = mask->m_tiles[0]; int ty = mask->m_tiles[1]; int tz = mask->m_tiles[2];
+    unsigned int tileCount = tx*ty*tz;
+    std::vector<unsigned char> dense;
+    if(mask->m_sparse==false){
+        dense.assign(tileCount, 1);
+    }
+    const std::vector<unsigned char>& fluid = mask->m_sparse ? fluidTiles : dense;
+
+    //dilate by the band and diff against the previous build
+    int band = mask->m_band;
+    std::vector<unsigned char> active(tileCount, 0);
+    mask->m_activeTiles.clear();
+    mask->m_releasedTiles.clear();
+    for(int ti=0; ti<tx; ti++){
+        for(int tj=0; tj<ty; tj++){
+            for(int tk=0; tk<tz; tk++){
+                unsigned int tile = (ti*ty + tj)*tz + tk;
+                bool on = false;
+                for(int i=glm::max(ti-band,0); i<=glm::min(ti+band,tx-1) && !on; i++){
+                    for(int j=glm::max(tj-band,0); j<=glm::min(tj+band,ty-1) && !on; j++){
+                        for(int k=glm::max(tk-band,0); k<=glm::min(tk+band,tz-1) && !on; k++){
+                            on = fluid[(i*ty + j)*tz + k]!=0;
+                        }
+                    }
+                }
+                active[tile] = on;
+                mask->m_released[tile] = mask->m_active[tile] && !on;
+                if(on){
+                    mask->m_activeTiles.push_back(tile);
+                }else if(mask->m_released[tile]){
+                    mask->m_releasedTiles.push_back(tile);
+                }
+            }
+        }
+    }
+    mask->m_active.swap(active);
+    BuildWavefronts(mask);
+}
+
+//Buckets active tiles by diagonal. A tile only borders lower index tiles on the previous
+//diagonal, so sweeps that run in i,j,k order can process a whole diagonal at once
+void BuildWavefronts(TileMask* mask){
+    int ty = mask->m_tiles[1]; int tz = mask->m_tiles[2];
+    unsigned int wavefronts = mask->m_tiles[0] + ty + tz - 2;
+    mask->m_wavefrontStart.assign(wavefronts+1, 0);
+    unsigned int activeCount = mask->m_activeTiles.size();
+    for(unsigned int t=0; t<activeCount; t++){
+        unsigned int tile = mask->m_activeTiles[t];
+        unsigned int w = tile/(ty*tz) + (tile/tz)%ty + tile%tz;
+        mask->m_wavefrontStart[w+1]++;
+    }
+    for(unsigned int w=0; w<wavefronts; w++){
+        mask->m_wavefrontStart[w+1] += mask->m_wavefrontStart[w];
+    }
+    mask->m_wavefrontTiles.resize(activeCount);
+    std::vector<unsigned int> fill(mask->m_wavefrontStart.begin(), 
+                                   mask->m_wavefrontStart.end()-1);
+    for(unsigned int t=0; t<activeCount; t++){
+        unsigned int tile = mask->m_activeTiles[t];
+        unsigned int w = tile/(ty*tz) + (tile/tz)%ty + tile%tz;
+        mask->m_wavefrontTiles[fill[w]++] = tile;
+    }
+}
+
+//Cell or face range [lo,hi) covered by a tile. axis is -1 for cell centered grids or the face
+//axis for face grids
+void GetTileBounds(TileMask* mask, const unsigned int& tile, const int& axis, int* lo, int* hi){
+    int ty = mask->m_tiles[1]; int tz = mask->m_tiles[2];
+    int t[3] = {(int)tile/(ty*tz), ((int)tile/tz)%ty, (int)tile%tz};
+    for(int n=0; n<3; n++){
+        int dim = (int)mask->m_dimensions[n];
+        lo[n] = t[n]<<GRID_BRICK_SHIFT;
+        hi[n] = glm::min((t[n]+1)<<GRID_BRICK_SHIFT, dim);
+        if(n==axis && hi[n]==dim){
+            hi[n]++;
+        }
+    }
+}
+
+//Cell range [lo,hi) enclosing every active tile, empty if nothing is active
+void GetActiveBounds(TileMask* mask, int* lo, int* hi){
+    for(int n=0; n<3; n++){
+        lo[n] = (int)mask->m_dimensions[n];
+        hi[n] = 0;
+    }
+    for(unsigned int t=0; t<mask->m_activeTiles.size(); t++){
+        int tlo[3]; int thi[3];
+        GetTileBounds(mask, mask->m_activeTiles[t], -1, tlo, thi);
+        for(int n=0; n<3; n++){
+            lo[n] = glm::min(lo[n], tlo[n]);
+            hi[n] = glm::max(hi[n], thi[n]);
+        }
+    }
+}
+
+//Zeroes a linear grid inside every tile released by the last build
+template <typename T> void ClearReleasedTiles(TileMask* mask, Grid<T>* grid, const int& axis){
+    T* g = grid->GetRawData();
+    unsigned int sx = grid->GetStrideX(); unsigned int sy = grid->GetStrideY();
+    for(unsigned int t=0; t<mask->m_releasedTiles.size(); t++){
+        int lo[3]; int hi[3];
+        GetTileBounds(mask, mask->m_releasedTiles[t], axis, lo, hi);
+        for(int i=lo[0]; i<hi[0]; i++){
+            for(int j=lo[1]; j<hi[1]; j++){
+                unsigned int row = i*sx + j*sy;
+                for(int k=lo[2]; k<hi[2]; k++){
+                    g[row+k] = T(0);
+                }
+            }
+        }
+    }
+}
+
+//Active tiles [begin, end) in the tile rows node owns. Active tiles are listed in tile order, so
+//each node's share is a contiguous run of the list
+void GetNodeTiles(TileMask* mask, const int& node, unsigned int* begin, unsigned int* end){
+    unsigned int first; unsigned int last;
+    utilityCore::GetNumaTopology()->GetNodeRange(node, mask->m_tiles[0], &first, &last);
+    unsigned int rowTiles = mask->m_tiles[1]*mask->m_tiles[2];
+    std::vector<unsigned int>::iterator tiles = mask->m_activeTiles.begin();
+    *begin = std::lower_bound(tiles, mask->m_activeTiles.end(), first*rowTiles) - tiles;
+    *end = std::lower_bound(tiles, mask->m_activeTiles.end(), last*rowTiles) - tiles;
+}
+
+//Calls fn(lo, hi) for every active tile in parallel, bounds as in GetTileBounds. With NUMA
+//placement every node's arena runs the tiles over its own slab of the grids
+template <typename F> void ForEachActiveTile(TileMask* mask, const int& axis, const F& fn){
+    const unsigned int* tiles = mask->m_activeTiles.data();
+    auto runTiles = [&](const tbb::blocked_range<unsigned int>& r){
+        for(unsigned int t=r.begin(); t!=r.end(); ++t){
+            int lo[3]; int hi[3];
+            GetTileBounds(mask, tiles[t], axis, lo, hi);
+            fn(lo, hi);
+        }
+    };
+    utilityCore::NumaTopology* numa = utilityCore::GetNumaTopology();
+    if(numa->IsEnabled()==false){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,mask->m_activeTiles.size()),
+                          runTiles);
+        return;
+    }
+    numa->ForEachNode([&](const int& node){
+        unsigned int begin; unsigned int end;
+        GetNodeTiles(mask, node, &begin, &end);
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(begin,end), runTiles);
+    });
+}
+
+//Sums body(lo, hi) over all active cell tiles in double precision. In deterministic mode the
+//tile list is always split the same way and partials are joined in a fixed order, so the result
+//is bitwise reproducible regardless of thread count or scheduling. NUMA placement reduces each
+//node's tiles on its own and joins the nodes in order, which is reproducible for a given node
+//count but not bitwise equal to the single arena sum
+template <typename F> double ReduceActiveTiles(TileMask* mask, const bool& deterministic,
+                                               const F& body){
+    const unsigned int* tiles = mask->m_activeTiles.data();
+    auto sumTiles = [&](const tbb::blocked_range<unsigned int>& r, double sum)->double{
+        for(unsigned int t=r.begin(); t!=r.end(); ++t){
+            int lo[3]; int hi[3];
+            GetTileBounds(mask, tiles[t], -1, lo, hi);
+            sum += body(lo, hi);
+        }
+        return sum;
+    };
+    auto reduceTiles = [&](const unsigned int& begin, const unsigned int& end)->double{
+        tbb::blocked_range<unsigned int> range(begin,end,1);
+        if(deterministic==true){
+            return tbb::parallel_deterministic_reduce(range, 0.0, sumTiles, std::plus<double>());
+        }else{
+            return tbb::parallel_reduce(range, 0.0, sumTiles, std::plus<double>());
+        }
+    };
+    utilityCore::NumaTopology* numa = utilityCore::GetNumaTopology();
+    if(numa->IsEnabled()==false){
+        return reduceTiles(0, mask->m_activeTiles.size());
+    }
+    std::vector<double> partials(numa->GetNodeCount(), 0.0);
+    numa->ForEachNode([&](const int& node){
+        unsigned int begin; unsigned int end;
+        GetNodeTiles(mask, node, &begin, &end);
+        partials[node] = reduceTiles(begin, end);
+    });
+    double sum = 0.0;
+    for(unsigned int n=0; n<partials.size(); n++){
+        sum += partials[n];
+    }
+    return sum;
+}
+}
+
+#endif
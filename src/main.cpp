@@ -7,14 +7,31 @@
 #include <iostream>
 #include "grid/particlegrid.hpp"
 #include "sim/flip.hpp"
+#include "sim/wedge.hpp"
 #include "viewer/viewer.hpp"
 #include "scene/sceneloader.hpp"
+#include "utilities/profiler.hpp"
+#include "utilities/memorytracker.hpp"
+#include "utilities/numa.hpp"
 
 using namespace std;
 using namespace glm;
 
-int main(int argc, char** argv){ 
+//Runs the sim without a window, exporting every step, and returns once frames steps are done.
+//A sim resumed from a checkpoint continues from its saved frame
+void RunHeadless(fluidCore::FlipSim* sim, const int& frames, const bool& dumpVDB, 
+                 const bool& dumpOBJ, const bool& dumpPARTIO){
+    if(sim->m_frame==0){
+        sim->Init();
+    }
+    while(sim->m_frame<frames){
+        sim->Step(dumpVDB, dumpOBJ, dumpPARTIO);
+    }
+    sim->GetScene()->FlushExports();
+    cout << "Finished " << frames << " frames." << endl;
+}
 
+int main(int argc, char** argv){ 
     cout << "" << endl;
     cout << "===================================================" << endl;
     cout << "Ariel: FLIP Fluid Simulator" << endl;
@@ -26,6 +43,22 @@ int main(int argc, char** argv){
     bool retina = false;
     bool verbose = false;
     string scenefile = "";
+    string profilefile = "";
+    string tracefile = "";
+    bool headless = false;
+    int frames = -1;
+    bool dumpVDB = false;
+    bool dumpOBJ = false;
+    bool dumpPARTIO = false;
+    bool dumpPLY = false;
+    string checkpointfile = "";
+    int checkpointInterval = 1;
+    bool checkpointCompress = true;
+    string resumefile = "";
+    bool memoryReport = false;
+    string memoryfile = "";
+    bool numa = false;
+    int pointBudget = -1;
 
     for(int i=1; i<argc; i++){
         string header; string data;
@@ -39,6 +72,55 @@ int main(int argc, char** argv){
             cout << "Verbose mode activated..." << endl;
         }else if(strcmp(header.c_str(), "-scene")==0){
             scenefile = data;
+        }else if(strcmp(header.c_str(), "-profile")==0){
+            profilefile = data;
+            cout << "Writing per frame stage timings to " << profilefile << ".csv/.jsonl..." 
+                 << endl;
+        }else if(strcmp(header.c_str(), "-trace")==0){
+            tracefile = data;
+            cout << "Writing trace events to " << tracefile << "..." << endl;
+        }else if(strcmp(header.c_str(), "-memreport")==0){
+            memoryReport = true;
+            memoryfile = data;
+            if(strcmp(memoryfile.c_str(), "")==0){
+                cout << "Reporting per frame memory use..." << endl;
+            }else{
+                cout << "Writing per frame memory use to " << memoryfile << "..." << endl;
+            }
+        }else if(strcmp(header.c_str(), "-numa")==0){
+            numa = true;
+        }else if(strcmp(header.c_str(), "-pointbudget")==0){
+            pointBudget = atoi(data.c_str());
+        }else if(strcmp(header.c_str(), "-headless")==0){
+            headless = true;
+            cout << "Headless mode activated..." << endl;
+        }else if(strcmp(header.c_str(), "-frames")==0){
+            frames = atoi(data.c_str());
+        }else if(strcmp(header.c_str(), "-checkpoint")==0){
+            checkpointfile = data;
+            cout << "Writing checkpoints to " << checkpointfile << "..." << endl;
+        }else if(strcmp(header.c_str(), "-checkpointinterval")==0){
+            checkpointInterval = atoi(data.c_str());
+        }else if(strcmp(header.c_str(), "-checkpointcompress")==0){
+            checkpointCompress = atoi(data.c_str())!=0;
+        }else if(strcmp(header.c_str(), "-resume")==0){
+            resumefile = data;
+        }else if(strcmp(header.c_str(), "-export")==0){
+            vector<string> formats = utilityCore::tokenizeString(data, ",");
+            for(unsigned int j=0; j<formats.size(); j++){
+                if(strcmp(formats[j].c_str(), "vdb")==0){
+                    dumpVDB = true;
+                }else if(strcmp(formats[j].c_str(), "obj")==0){
+                    dumpOBJ = true;
+                }else if(strcmp(formats[j].c_str(), "ply")==0){
+                    dumpOBJ = true;
+                    dumpPLY = true;
+                }else if(strcmp(formats[j].c_str(), "partio")==0){
+                    dumpPARTIO = true;
+                }else{
+                    cout << "Warning: unknown export format " << formats[j] << endl;
+                }
+            }
         }
     }
 
@@ -47,15 +129,93 @@ int main(int argc, char** argv){
         exit(EXIT_FAILURE);
     } 
 
+    if(headless==true && frames<=0){
+        cout << "Error: headless mode needs a frame count! Use -frames=[number]\n" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    //grids first touch their storage on creation, so placement has to be on before the sim
+    //allocates anything
+    if(numa==true){
+        utilityCore::GetNumaTopology()->Enable();
+    }
+
     sceneCore::SceneLoader* sloader = new sceneCore::SceneLoader(scenefile);
+    bool wedge = sloader->GetWedgeVariants().empty()==false;
+    if(wedge==true && headless==false){
+        cout << "Warning: wedge variants only run headless, running the scene as written" 
+             << endl;
+        wedge = false;
+    }
+
+    //the profiler times one sim's frames, concurrent variants would interleave their stages
+    if(wedge==true && (profilefile.empty()==false || tracefile.empty()==false)){
+        cout << "Warning: profiling is off while running wedge variants" << endl;
+    }else{
+        utilityCore::GetProfiler()->Open(profilefile, tracefile);
+    }
+    if(memoryReport==true){
+        utilityCore::GetMemoryTracker()->OpenReport(memoryfile);
+    }
+
+    if(wedge==true){
+        if(strcmp(resumefile.c_str(), "")!=0){
+            cout << "Warning: -resume is ignored while running wedge variants" << endl;
+        }
+        fluidCore::WedgeRunner* runner = new fluidCore::WedgeRunner(sloader, verbose);
+        if(runner->Load()==false){
+            cout << "Error: could not set up the wedge variants\n" << endl;
+            exit(EXIT_FAILURE);
+        }
+        runner->SetCheckpointing(checkpointfile, checkpointInterval, checkpointCompress);
+        if(dumpPLY==true){
+            runner->SetMeshFormat(MESH_FORMAT_PLY);
+        }
+        //reports the meshes and static solid level set every variant shares
+        sloader->GetScene()->UpdateMemoryUsage();
+        runner->Run(frames, dumpVDB, dumpOBJ, dumpPARTIO);
+        delete runner;
+        delete sloader->GetScene();
+        delete sloader;
+        utilityCore::GetProfiler()->Close();
+        utilityCore::GetMemoryTracker()->CloseReport();
+        return 0;
+    }
+
+    //what the sim will need before any of it is allocated
+    size_t estimate[MEMORY_SUBSYSTEM_COUNT];
+    fluidCore::FlipSim::EstimateMemory(sloader->GetDimensions(), sloader->GetDensity(), 
+                                       sloader->GetSimSettings(), estimate);
+    utilityCore::GetMemoryTracker()->ReportEstimate(estimate);
 
     fluidCore::FlipSim* f = new fluidCore::FlipSim(sloader->GetDimensions(), sloader->GetDensity(), 
                                                    sloader->GetStepsize(), sloader->GetScene(), 
-                                                   verbose);
+                                                   sloader->GetSimSettings(), verbose);
+    f->SetCheckpointing(checkpointfile, checkpointInterval, checkpointCompress);
+    if(dumpPLY==true){
+        sloader->GetScene()->SetMeshFormat(MESH_FORMAT_PLY);
+    }
+    if(strcmp(resumefile.c_str(), "")!=0 && f->LoadCheckpoint(resumefile)==false){
+        cout << "Error: could not resume from " << resumefile << "\n" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if(headless==true){
+        RunHeadless(f, frames, dumpVDB, dumpOBJ, dumpPARTIO);
+        delete f;
+        delete sloader;
+        utilityCore::GetProfiler()->Close();
+        utilityCore::GetMemoryTracker()->CloseReport();
+        return 0;
+    }
 
     viewerCore::Viewer* glview = new viewerCore::Viewer();
     glview->Load(f, retina, sloader->m_cameraResolution, sloader->m_cameraRotate, 
                  sloader->m_cameraTranslate, sloader->m_cameraFov, sloader->m_cameraLookat);
+    glview->SetFrameLimit(frames);
+    if(pointBudget>=0){
+        glview->SetPointBudget(pointBudget);
+    }
     glview->Launch();
 
 }
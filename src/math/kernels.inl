@@ -19,6 +19,29 @@ extern inline float Smooth(const float& r2, const float& h);
 extern inline float Sharpen(const float& r2, const float& h);
 extern inline float Sqrlength(const glm::vec3& p0, const glm::vec3& p1);
 
+//Particle to grid transfer kernels. Weight takes the offset from a particle to a sample point in
+//grid cells. NormalRadius and TangentRadius are how many faces past a particle's own cell the
+//kernel reaches along and across a face's normal
+struct SharpenKernel{
+    static const int NormalRadius = 1;
+    static const int TangentRadius = 2;
+    static inline float Weight(const glm::vec3& d);
+};
+
+struct LinearKernel{
+    static const int NormalRadius = 1;
+    static const int TangentRadius = 2;
+    static inline float Weight(const glm::vec3& d);
+};
+
+struct QuadraticKernel{
+    static const int NormalRadius = 2;
+    static const int TangentRadius = 2;
+    static inline float Weight(const glm::vec3& d);
+};
+
+inline float QuadraticBSpline(const float& r);
+
 //====================================
 // Function Implementations
 //====================================
@@ -36,6 +59,30 @@ float Smooth(const float& r2, const float& h) {
 float Sharpen(const float& r2, const float& h) {
     return glm::max(h*h/glm::max(r2,(float)1.0e-5) - 1.0f, 0.0f);
 }
+
+float QuadraticBSpline(const float& r){
+    float a = glm::abs(r);
+    if(a<0.5f){
+        return 0.75f - a*a;
+    }else if(a<1.5f){
+        return 0.5f*(1.5f-a)*(1.5f-a);
+    }
+    return 0.0f;
+}
+
+//same sharpen kernel and radius the gather splat has always used
+float SharpenKernel::Weight(const glm::vec3& d){
+    return Sharpen(d.x*d.x + d.y*d.y + d.z*d.z, 1.4f);
+}
+
+float LinearKernel::Weight(const glm::vec3& d){
+    return glm::max(1.0f-glm::abs(d.x), 0.0f) * glm::max(1.0f-glm::abs(d.y), 0.0f) * 
+           glm::max(1.0f-glm::abs(d.z), 0.0f);
+}
+
+float QuadraticKernel::Weight(const glm::vec3& d){
+    return QuadraticBSpline(d.x) * QuadraticBSpline(d.y) * QuadraticBSpline(d.z);
+}
 }
 
 #endif
@@ -0,0 +1,63 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: random.inl
+// Counter based random numbers that are safe to draw from inside parallel loops
+
+#ifndef RANDOM_INL
+#define RANDOM_INL
+
+#include "../utilities/utilities.h"
+
+//Every stochastic stage draws from its own stream so stages never see correlated numbers
+enum randomstream {RANDOM_STREAM_RESAMPLE=0, RANDOM_STREAM_SEED=1};
+
+namespace mathCore {
+//====================================
+// Struct and Function Declarations
+//====================================
+
+//Forward declarations for externed inlineable methods
+extern inline unsigned int HashRandom(const unsigned int& v);
+extern inline unsigned int HashRandomKeys(const unsigned int& stream, const unsigned int& frame,
+                                          const unsigned int& a, const unsigned int& b);
+extern inline float RandomFloat(const unsigned int& stream, const unsigned int& frame,
+                                const unsigned int& a, const unsigned int& b);
+extern inline glm::vec3 RandomVec3(const unsigned int& stream, const unsigned int& frame,
+                                   const unsigned int& a, const unsigned int& b);
+
+//====================================
+// Function Implementations
+//====================================
+
+//PCG output permutation applied to a single counter value
+unsigned int HashRandom(const unsigned int& v){
+    unsigned int state = v*747796405u + 2891336453u;
+    unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+//Folds all keys into one counter. A value depends only on its keys, never on which thread draws
+//it or in what order, so runs are reproducible for any thread count
+unsigned int HashRandomKeys(const unsigned int& stream, const unsigned int& frame,
+                            const unsigned int& a, const unsigned int& b){
+    return HashRandom(b + HashRandom(a + HashRandom(frame + HashRandom(stream))));
+}
+
+//Uniform in [0,1)
+float RandomFloat(const unsigned int& stream, const unsigned int& frame, const unsigned int& a,
+                  const unsigned int& b){
+    return (HashRandomKeys(stream, frame, a, b) >> 8) * (1.0f/16777216.0f);
+}
+
+//Three independent uniforms in [0,1)
+glm::vec3 RandomVec3(const unsigned int& stream, const unsigned int& frame, const unsigned int& a,
+                     const unsigned int& b){
+    unsigned int key = HashRandomKeys(stream, frame, a, b);
+    return glm::vec3((HashRandom(key) >> 8) * (1.0f/16777216.0f),
+                     (HashRandom(key+1u) >> 8) * (1.0f/16777216.0f),
+                     (HashRandom(key+2u) >> 8) * (1.0f/16777216.0f));
+}
+}
+
+#endif
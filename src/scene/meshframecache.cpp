@@ -0,0 +1,267 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: meshframecache.cpp
+// Implements meshframecache.hpp
+
+#include <algorithm>
+#include "meshframecache.hpp"
+#include "scene.hpp"
+
+namespace sceneCore {
+
+static bool CompareLastUsed(const MeshFrameEntry* a, const MeshFrameEntry* b){
+    return a->m_lastUsed<b->m_lastUsed;
+}
+
+//====================================
+// MeshFrameCache Class
+//====================================
+
+MeshFrameCache::MeshFrameCache(){
+    m_enabled = false;
+    m_useObjCache = false;
+    m_budget = 0;
+    m_prefetchPending = 0;
+    m_prefetchArenaReady = false;
+}
+
+MeshFrameCache::~MeshFrameCache(){
+    WaitForPrefetch();
+}
+
+void MeshFrameCache::Configure(const bool& enabled, const unsigned long long& budget,
+                               const bool& useObjCache){
+    m_enabled = enabled;
+    m_budget = budget;
+    m_useObjCache = useObjCache;
+}
+
+bool MeshFrameCache::IsEnabled(){
+    return m_enabled;
+}
+
+void MeshFrameCache::AddMeshFile(const unsigned int& meshID, const std::string& path){
+    if(meshID>=m_meshEntryIDs.size()){
+        m_meshEntryIDs.resize(meshID+1, -1);
+    }
+    MeshFrameEntry entry;
+    entry.m_meshID = meshID;
+    entry.m_path = path;
+    entry.m_resident = false;
+    entry.m_lastUsed = -1;
+    entry.m_bytes = 0;
+    m_meshEntryIDs[meshID] = m_meshEntries.size();
+    m_meshEntries.push_back(entry);
+}
+
+void MeshFrameCache::AddAnimFrame(const unsigned int& animMeshID, const unsigned int& sequence,
+                                  const unsigned int& mesh0, const unsigned int& mesh1){
+    if(animMeshID>=m_animEntryIDs.size()){
+        m_animEntryIDs.resize(animMeshID+1, -1);
+    }
+    if(sequence>=m_topologies.size()){
+        m_topologies.resize(sequence+1, -1);
+        m_topologyElements.resize(sequence+1, 0);
+    }
+    AnimFrameEntry entry;
+    entry.m_animMeshID = animMeshID;
+    entry.m_sequence = sequence;
+    entry.m_mesh0 = mesh0;
+    entry.m_mesh1 = mesh1;
+    entry.m_built = false;
+    entry.m_sharesTopology = false;
+    entry.m_bytes = 0;
+    m_animEntryIDs[animMeshID] = m_animEntries.size();
+    m_animEntries.push_back(entry);
+}
+
+//The window covers the frame the viewer may still be drawing and the one after the current
+//frame, nothing in it is evicted
+void MeshFrameCache::PrepareFrame(Scene* scene, const int& frame){
+    if(m_enabled==false){
+        return;
+    }
+    WaitForPrefetch();
+    std::vector<unsigned int> meshes;
+    std::vector<unsigned int> animMeshes;
+    for(int f=frame-1; f<=frame+1; f++){
+        CollectFrame(scene, f, meshes, animMeshes);
+    }
+    Load(scene, meshes, animMeshes, frame);
+
+    //evict the least recently needed mesh files outside the window until under budget
+    unsigned long long resident = GetResidentBytes();
+    if(resident>m_budget){
+        std::vector<unsigned char> needed(m_meshEntries.size(), 0);
+        for(unsigned int i=0; i<meshes.size(); i++){
+            if(meshes[i]<m_meshEntryIDs.size() && m_meshEntryIDs[meshes[i]]>=0){
+                needed[m_meshEntryIDs[meshes[i]]] = 1;
+            }
+        }
+        std::vector<MeshFrameEntry*> candidates;
+        for(unsigned int e=0; e<m_meshEntries.size(); e++){
+            if(m_meshEntries[e].m_resident==true && needed[e]==0){
+                candidates.push_back(&m_meshEntries[e]);
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), CompareLastUsed);
+        scene->m_meshFrameLock.lock();
+        for(unsigned int c=0; c<candidates.size() && resident>m_budget; c++){
+            EvictMesh(scene, candidates[c]->m_meshID);
+            resident = GetResidentBytes();
+        }
+        scene->m_meshFrameLock.unlock();
+        if(resident>m_budget){
+            std::cout << "Warning: frame " << frame << " needs " << resident/(1024*1024) 
+                      << " MB of meshes, over the mesh memory budget" << std::endl;
+        }
+    }
+
+    //prefetch the frame after the window
+    std::vector<unsigned int> nextMeshes;
+    std::vector<unsigned int> nextAnimMeshes;
+    CollectFrame(scene, frame+2, nextMeshes, nextAnimMeshes);
+    if(nextMeshes.empty()==true && nextAnimMeshes.empty()==true){
+        return;
+    }
+    if(m_prefetchArenaReady==false){
+        //a single thread keeps loading off the sim's workers
+        m_prefetchArena.initialize(1, 0);
+        m_prefetchArenaReady = true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_prefetchLock);
+        m_prefetchPending++;
+    }
+    int nextFrame = frame+2;
+    m_prefetchArena.enqueue([this, scene, nextMeshes, nextAnimMeshes, nextFrame](){
+        Load(scene, nextMeshes, nextAnimMeshes, nextFrame);
+        std::lock_guard<std::mutex> lock(m_prefetchLock);
+        m_prefetchPending--;
+        if(m_prefetchPending==0){
+            m_prefetchDone.notify_all();
+        }
+    });
+}
+
+void MeshFrameCache::WaitForPrefetch(){
+    std::unique_lock<std::mutex> lock(m_prefetchLock);
+    while(m_prefetchPending>0){
+        m_prefetchDone.wait(lock);
+    }
+}
+
+//Mesh files while resident plus every anim mesh bvh that is still allocated
+unsigned long long MeshFrameCache::GetResidentBytes(){
+    unsigned long long bytes = 0;
+    for(unsigned int e=0; e<m_meshEntries.size(); e++){
+        bytes += m_meshEntries[e].m_resident ? m_meshEntries[e].m_bytes : 0;
+    }
+    for(unsigned int e=0; e<m_animEntries.size(); e++){
+        bytes += m_animEntries[e].m_bytes;
+    }
+    return bytes;
+}
+
+//Mesh file and anim mesh ids every container uses at frame, duplicates included
+void MeshFrameCache::CollectFrame(Scene* scene, const int& frame, 
+                                  std::vector<unsigned int>& meshes,
+                                  std::vector<unsigned int>& animMeshes){
+    for(unsigned int i=0; i<scene->m_meshContainers.size(); i++){
+        geomCore::MeshContainer& m = scene->m_meshContainers[i];
+        if(m.m_numberOfFrames>0){
+            meshes.push_back(m.GetMeshFrame((float)frame)->m_id);
+        }
+    }
+    for(unsigned int i=0; i<scene->m_animmeshContainers.size(); i++){
+        geomCore::AnimatedMeshContainer& m = scene->m_animmeshContainers[i];
+        if(m.m_numberOfFrames==0){
+            continue;
+        }
+        unsigned int animMeshID = m.GetMeshFrame((float)frame)->m_id;
+        animMeshes.push_back(animMeshID);
+        if(animMeshID<m_animEntryIDs.size() && m_animEntryIDs[animMeshID]>=0){
+            AnimFrameEntry& entry = m_animEntries[m_animEntryIDs[animMeshID]];
+            meshes.push_back(entry.m_mesh0);
+            meshes.push_back(entry.m_mesh1);
+        }
+    }
+}
+
+void MeshFrameCache::Load(Scene* scene, const std::vector<unsigned int>& meshes,
+                          const std::vector<unsigned int>& animMeshes, const int& frame){
+    for(unsigned int i=0; i<meshes.size(); i++){
+        if(meshes[i]<m_meshEntryIDs.size() && m_meshEntryIDs[meshes[i]]>=0){
+            LoadMesh(scene, meshes[i], frame);
+        }
+    }
+    for(unsigned int i=0; i<animMeshes.size(); i++){
+        if(animMeshes[i]<m_animEntryIDs.size() && m_animEntryIDs[animMeshes[i]]>=0 &&
+           m_animEntries[m_animEntryIDs[animMeshes[i]]].m_built==false){
+            BuildAnimMesh(scene, animMeshes[i]);
+        }
+    }
+}
+
+void MeshFrameCache::LoadMesh(Scene* scene, const unsigned int& meshID, const int& frame){
+    MeshFrameEntry& entry = m_meshEntries[m_meshEntryIDs[meshID]];
+    entry.m_lastUsed = glm::max(entry.m_lastUsed, frame);
+    if(entry.m_resident==true){
+        return;
+    }
+    spaceCore::Bvh<objCore::Obj>& mesh = scene->m_meshFiles[meshID];
+    mesh.m_basegeom.ClearGeometry();
+    mesh.m_basegeom.ReadObj(entry.m_path, m_useObjCache);
+    mesh.BuildBvh(24);
+    entry.m_bytes = mesh.m_basegeom.GetMemoryUsage() + mesh.GetMemoryUsage(true);
+    entry.m_resident = true;
+}
+
+//Anim frames built on the mesh go with it. The topology frame of a sequence keeps its hierarchy
+//since every other frame of the sequence shares its references
+void MeshFrameCache::EvictMesh(Scene* scene, const unsigned int& meshID){
+    for(unsigned int a=0; a<m_animEntries.size(); a++){
+        AnimFrameEntry& anim = m_animEntries[a];
+        if(anim.m_built==false || (anim.m_mesh0!=meshID && anim.m_mesh1!=meshID)){
+            continue;
+        }
+        if(m_topologies[anim.m_sequence]!=(int)anim.m_animMeshID){
+            scene->m_animMeshes[anim.m_animMeshID].Release(anim.m_sharesTopology==false);
+            anim.m_bytes = 0;
+        }
+        anim.m_built = false;
+    }
+    MeshFrameEntry& entry = m_meshEntries[m_meshEntryIDs[meshID]];
+    spaceCore::Bvh<objCore::Obj>& mesh = scene->m_meshFiles[meshID];
+    mesh.Release(true);
+    mesh.m_basegeom.ClearGeometry();
+    entry.m_resident = false;
+    entry.m_bytes = 0;
+}
+
+//Same rule as loading everything up front: frames refit the sequence topology when their poly
+//count matches it. Frames that don't match get a bvh of their own
+void MeshFrameCache::BuildAnimMesh(Scene* scene, const unsigned int& animMeshID){
+    AnimFrameEntry& entry = m_animEntries[m_animEntryIDs[animMeshID]];
+    spaceCore::Bvh<objCore::InterpolatedObj>& animmesh = scene->m_animMeshes[animMeshID];
+    int& topology = m_topologies[entry.m_sequence];
+    unsigned int elements = animmesh.m_basegeom.GetNumberOfElements();
+    if(topology==(int)animMeshID){
+        animmesh.Refit();
+    }else if(topology>=0 && m_topologyElements[entry.m_sequence]==elements){
+        animmesh.RefitFrom(scene->m_animMeshes[topology]);
+        entry.m_sharesTopology = true;
+    }else{
+        animmesh.BuildBvh(24);
+        entry.m_sharesTopology = false;
+        if(topology<0){
+            topology = animMeshID;
+            m_topologyElements[entry.m_sequence] = elements;
+        }
+    }
+    //shared references are counted with the topology's bvh
+    entry.m_bytes = animmesh.GetMemoryUsage(entry.m_sharesTopology==false);
+    entry.m_built = true;
+}
+}
@@ -0,0 +1,101 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: meshframecache.hpp
+// On demand loading of mesh file frames, so long mesh sequences don't have to stay resident
+
+#ifndef MESHFRAMECACHE_HPP
+#define MESHFRAMECACHE_HPP
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <tbb/tbb.h>
+
+namespace sceneCore {
+
+class Scene;
+
+//====================================
+// Struct Declarations
+//====================================
+
+//One obj backed mesh file. Mesh files that aren't registered with the cache, such as generated
+//meshes, are always resident
+struct MeshFrameEntry {
+    unsigned int                                m_meshID;
+    std::string                                 m_path;
+    bool                                        m_resident;
+    int                                         m_lastUsed; //last frame whose window needed it
+    unsigned long long                          m_bytes; //geometry plus bvh, while resident
+};
+
+//One frame of an animated mesh sequence, interpolating between two mesh files
+struct AnimFrameEntry {
+    unsigned int                                m_animMeshID;
+    unsigned int                                m_sequence;
+    unsigned int                                m_mesh0;
+    unsigned int                                m_mesh1;
+    bool                                        m_built;
+    bool                                        m_sharesTopology; //references belong to topology
+    unsigned long long                          m_bytes; //bvh, kept for a topology after eviction
+};
+
+//====================================
+// Class Declarations
+//====================================
+
+//Keeps the mesh files and animated mesh bvhs needed for a window of frames around the current
+//one resident. The keyframes after the window are loaded on a background arena while the sim
+//steps, and frames outside the window are evicted oldest first once the budget is exceeded.
+//Every frame of a sequence refits the hierarchy of the first frame built for it, which is the
+//one bvh that is never freed
+class MeshFrameCache {
+    public:
+        MeshFrameCache();
+        ~MeshFrameCache();
+
+        void Configure(const bool& enabled, const unsigned long long& budget, 
+                       const bool& useObjCache);
+        bool IsEnabled();
+
+        void AddMeshFile(const unsigned int& meshID, const std::string& path);
+        void AddAnimFrame(const unsigned int& animMeshID, const unsigned int& sequence, 
+                          const unsigned int& mesh0, const unsigned int& mesh1);
+
+        //makes every frame in [frame-1, frame+1] resident and starts prefetching frame+2
+        void PrepareFrame(Scene* scene, const int& frame);
+        void WaitForPrefetch();
+
+        unsigned long long GetResidentBytes();
+
+    private:
+        void CollectFrame(Scene* scene, const int& frame, std::vector<unsigned int>& meshes,
+                          std::vector<unsigned int>& animMeshes);
+        void LoadMesh(Scene* scene, const unsigned int& meshID, const int& frame);
+        void EvictMesh(Scene* scene, const unsigned int& meshID);
+        void BuildAnimMesh(Scene* scene, const unsigned int& animMeshID);
+        void Load(Scene* scene, const std::vector<unsigned int>& meshes, 
+                  const std::vector<unsigned int>& animMeshes, const int& frame);
+
+        bool                                        m_enabled;
+        bool                                        m_useObjCache;
+        unsigned long long                          m_budget; //bytes
+        std::vector<int>                            m_meshEntryIDs; //mesh file to entry, or -1
+        std::vector<MeshFrameEntry>                 m_meshEntries;
+        std::vector<int>                            m_animEntryIDs; //anim mesh to entry, or -1
+        std::vector<AnimFrameEntry>                 m_animEntries;
+        std::vector<int>                            m_topologies; //per sequence, -1 until built
+        std::vector<unsigned int>                   m_topologyElements; //per sequence
+
+        tbb::task_arena                             m_prefetchArena;
+        //prefetches enqueued but not finished, m_prefetchDone fires when it drops to 0
+        int                                         m_prefetchPending;
+        std::mutex                                  m_prefetchLock;
+        std::condition_variable                     m_prefetchDone;
+        bool                                        m_prefetchArenaReady;
+};
+}
+
+#endif
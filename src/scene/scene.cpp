@@ -7,21 +7,84 @@
 #include <openvdb/openvdb.h>
 #include <openvdb/tools/MeshToVolume.h>
 #include <partio/Partio.h>
+#include <set>
 #include "scene.hpp"
+#include "../utilities/profiler.hpp"
+
+//columns of seed samples handled per chunk
+#define SEED_CHUNK_SIZE 64
+//cells per axis of a solid culling block
+#define SOLID_CULL_BLOCK 4
 
 namespace sceneCore{
 
-Scene::Scene(){
+Scene::Scene(): m_meshMemory(MEMORY_MESHES), m_levelSetMemory(MEMORY_LEVELSETS),
+                m_particleMemory(MEMORY_PARTICLES){
     m_solidLevelSet = new fluidCore::LevelSet();
     m_liquidLevelSet = new fluidCore::LevelSet();
     m_permaSolidLevelSet = new fluidCore::LevelSet();
     m_liquidParticleCount = 0;
+    m_permaSolidOffset = -1;
+    m_solidQueryMode = SOLID_QUERY_RAYCAST;
+    m_solidLevelSetFrame = -1;
+    m_solidLevelSetComplete = false;
+    m_solidLevelSetMerged = true;
+    m_permaSolidLevelSetEmpty = true;
+    m_permaSolidLevelSetBuilt = false;
+    m_source = NULL;
+    m_exportsPending = 0;
+    m_exportQueueDepth = 2;
+    m_exportThreads = 2;
+    m_exportArenaReady = false;
+    m_partioChannels = 0;
+    m_surfacingSettings = fluidCore::CreateSurfacingSettings();
+    m_nextLiquidID = 0;
+    m_solidCullBand = 0;
 }
 
 Scene::~Scene(){
+    FlushExports();
+    m_meshFrameCache.WaitForPrefetch();
     delete m_solidLevelSet;
     delete m_liquidLevelSet;
-    delete m_permaSolidLevelSet;
+    if(m_source==NULL){
+        delete m_permaSolidLevelSet;
+    }
+    for(unsigned int i=0; i<m_solidSDFCache.size(); i++){
+        delete m_solidSDFCache[i].m_levelSet;
+    }
+}
+
+//Geoms are handles to containers the loaded scene owns, so copying them shares the meshes
+Scene* Scene::CreateInstance(){
+    if(m_meshFrameCache.IsEnabled()==true){
+        std::cout << "Warning: scenes with lazily loaded meshes can't be instanced" << std::endl;
+        return NULL;
+    }
+    PrepareMeshFrames(0);
+    BuildPermaSolidGeomLevelSet();
+    Scene* instance = new Scene();
+    instance->m_source = this;
+    instance->SetPaths(m_imagePath, m_meshPath, m_vdbPath, m_partioPath);
+    instance->m_externalForces = m_externalForces;
+    instance->m_geoms = m_geoms;
+    instance->m_solids = m_solids;
+    instance->m_liquids = m_liquids;
+    instance->m_liquidStartingVelocities = m_liquidStartingVelocities;
+    instance->m_bakeCache = m_bakeCache;
+    instance->m_solidCullBand = m_solidCullBand;
+    instance->m_solidQueryMode = m_solidQueryMode;
+    instance->m_exportQueueDepth = m_exportQueueDepth;
+    instance->m_exportThreads = m_exportThreads;
+    instance->m_partioChannels = m_partioChannels;
+    instance->m_surfacingSettings = m_surfacingSettings;
+    instance->m_exportTag = m_exportTag;
+    delete instance->m_permaSolidLevelSet;
+    instance->m_permaSolidLevelSet = m_permaSolidLevelSet;
+    instance->m_permaSolidLevelSetEmpty = m_permaSolidLevelSetEmpty;
+    instance->m_permaSolidLevelSetBuilt = true;
+    instance->m_solidLevelSetMerged = false;
+    return instance;
 }
 
 void Scene::SetPaths(const std::string& imagePath, const std::string& meshPath, 
@@ -32,22 +95,157 @@ void Scene::SetPaths(const std::string& imagePath, const std::string& meshPath,
     m_partioPath = partioPath;
 }
 
-void Scene::ExportParticles(std::vector<fluidCore::Particle*> particles, 
+void Scene::SetExportTag(const std::string& tag){
+    m_exportTag = tag;
+}
+
+void Scene::SetMeshFormat(const int& format){
+    m_surfacingSettings.m_meshFormat = format;
+}
+
+//Copies the exportable particles and queues the frame for the export arena, so meshing and disk
+//writes of this frame overlap the next step
+void Scene::ExportParticles(fluidCore::ParticleSet* particles, 
                             const float& maxd, const int& frame, const bool& VDB, const bool& OBJ, 
                             const bool& PARTIO){
-    unsigned int particlesCount = particles.size();
+    ExportParticles(particles, maxd, frame, VDB, OBJ, PARTIO, std::vector<glm::vec3>());
+}
+
+void Scene::ExportParticles(fluidCore::ParticleSet* particles, 
+                            const float& maxd, const int& frame, const bool& VDB, const bool& OBJ, 
+                            const bool& PARTIO, const std::vector<glm::vec3>& fill){
+    unsigned int particlesCount = fluidCore::GetParticleCount(particles);
 
-    std::vector<fluidCore::Particle*> sdfparticles;
-    for(unsigned int i = 0; i<particlesCount; i++){
-        if(particles[i]->m_type==FLUID && !particles[i]->m_invalid){
-            sdfparticles.push_back(particles[i]);
+    //prefix sum filter of the valid liquid particles into a list of their indices
+    m_exportIndices.resize(particlesCount);
+    unsigned int* source = m_exportIndices.data();
+    const int* types = particles->m_type.data();
+    const unsigned char* invalid = particles->m_invalid.data();
+    unsigned int sdfparticlesCount = tbb::parallel_scan(
+        tbb::blocked_range<unsigned int>(0,particlesCount), 0u,
+        [=](const tbb::blocked_range<unsigned int>& r, unsigned int sum, 
+            const bool isFinal)->unsigned int{
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                if(types[i]==FLUID && invalid[i]==0){
+                    if(isFinal==true){
+                        source[sum] = i;
+                    }
+                    sum++;
+                }
+            }
+            return sum;
+        },
+        std::plus<unsigned int>()
+    );
+
+    //only what the writers read is kept, compacted so the snapshot is as small as possible
+    ExportSnapshot* snapshot = new ExportSnapshot();
+    fluidCore::ParticleSet* copy = &snapshot->m_particles;
+    fluidCore::ResizeParticleSet(copy, sdfparticlesCount);
+    snapshot->m_indices.resize(sdfparticlesCount);
+    unsigned int* indices = snapshot->m_indices.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,sdfparticlesCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                unsigned int p = source[i];
+                copy->m_p[i] = particles->m_p[p];
+                copy->m_u[i] = particles->m_u[p];
+                copy->m_density[i] = particles->m_density[p];
+                copy->m_type[i] = FLUID;
+                copy->m_invalid[i] = 0;
+                copy->m_id[i] = particles->m_id[p];
+                copy->m_birthFrame[i] = particles->m_birthFrame[p];
+                indices[i] = i;
+            }
         }
+    );
+    //fill points are only rasterized, so they carry nothing but a position
+    unsigned int fillCount = (VDB || OBJ) ? fill.size() : 0;
+    fluidCore::ResizeParticleSet(&snapshot->m_fill, fillCount);
+    snapshot->m_fillIndices.resize(fillCount);
+    for(unsigned int i=0; i<fillCount; i++){
+        snapshot->m_fill.m_p[i] = fill[i];
+        snapshot->m_fill.m_invalid[i] = 0;
+        snapshot->m_fillIndices[i] = i;
+    }
+    snapshot->m_maxd = maxd;
+    snapshot->m_frame = frame;
+    snapshot->m_VDB = VDB;
+    snapshot->m_OBJ = OBJ;
+    snapshot->m_PARTIO = PARTIO;
+    QueueExport(snapshot);
+}
+
+void Scene::ExportCheckpoint(utilityCore::Checkpoint* checkpoint, const std::string& filename,
+                             const bool& compress){
+    ExportSnapshot* snapshot = new ExportSnapshot();
+    snapshot->m_checkpoint = checkpoint;
+    snapshot->m_checkpointPath = filename;
+    snapshot->m_checkpointCompress = compress;
+    QueueExport(snapshot);
+}
+
+//Hands a snapshot to the export arena, or writes it right away if the queue is disabled
+void Scene::QueueExport(ExportSnapshot* snapshot){
+    if(m_exportQueueDepth<=0){
+        WriteExport(snapshot);
+        delete snapshot;
+        return;
     }
+    if(m_exportArenaReady==false){
+        //no slot is reserved for a master thread, the arena's work only ever comes from enqueue
+        m_exportArena.initialize(glm::max(m_exportThreads, 1), 0);
+        m_exportQueue.set_capacity(m_exportQueueDepth);
+        m_exportArenaReady = true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_exportLock);
+        m_exportsPending++;
+    }
+    m_exportQueue.push(snapshot); //blocks while the queue is full
+    //enqueued rather than spawned, tbb gives enqueued work a worker even on one core
+    m_exportArena.enqueue([this](){
+        ExportSnapshot* next;
+        m_exportQueue.pop(next);
+        WriteExport(next);
+        delete next;
+        std::lock_guard<std::mutex> lock(m_exportLock);
+        m_exportsPending--;
+        if(m_exportsPending==0){
+            m_exportsDone.notify_all();
+        }
+    });
+}
+
+//Blocks until every queued frame has been written
+void Scene::FlushExports(){
+    std::unique_lock<std::mutex> lock(m_exportLock);
+    while(m_exportsPending>0){
+        m_exportsDone.wait(lock);
+    }
+}
+
+void Scene::WriteExport(ExportSnapshot* snapshot){
+    if(snapshot->m_checkpoint!=NULL){
+        if(snapshot->m_checkpoint->Write(snapshot->m_checkpointPath, 
+                                         snapshot->m_checkpointCompress)==true){
+            std::cout << "Wrote checkpoint " << snapshot->m_checkpointPath << std::endl;
+        }
+        delete snapshot->m_checkpoint;
+        snapshot->m_checkpoint = NULL;
+        return;
+    }
+    std::vector<unsigned int>& sdfparticles = snapshot->m_indices;
+    fluidCore::ParticleSet* particles = &snapshot->m_particles;
     int sdfparticlesCount = sdfparticles.size();
-    
-    std::string frameString = utilityCore::padString(4, utilityCore::convertIntToString(frame));
+    float maxd = snapshot->m_maxd;
+    std::string frameString = utilityCore::padString(4, 
+                                  utilityCore::convertIntToString(snapshot->m_frame));
+    if(m_exportTag.empty()==false){
+        frameString = m_exportTag + "." + frameString;
+    }
 
-    if(PARTIO){
+    if(snapshot->m_PARTIO){
         std::string partiofilename = m_partioPath;
         std::vector<std::string> tokens = utilityCore::tokenizeString(partiofilename, ".");
         std::string ext = "." + tokens[tokens.size()-1];
@@ -63,48 +261,98 @@ void Scene::ExportParticles(std::vector<fluidCore::Particle*> particles,
                                                                           Partio::VECTOR, 3);
         Partio::ParticleAttribute velocityAttr = partioData->addAttribute("v", Partio::VECTOR, 3);
         Partio::ParticleAttribute idAttr = partioData->addAttribute("id", Partio::INT, 1);
+        Partio::ParticleAttribute densityAttr;
+        Partio::ParticleAttribute ageAttr;
+        bool writeDensity = (m_partioChannels & PARTIO_CHANNEL_DENSITY)!=0;
+        bool writeAge = (m_partioChannels & PARTIO_CHANNEL_AGE)!=0;
+        if(writeDensity==true){
+            densityAttr = partioData->addAttribute("density", Partio::FLOAT, 1);
+        }
+        if(writeAge==true){
+            ageAttr = partioData->addAttribute("age", Partio::INT, 1);
+        }
 
-        for(unsigned int i = 0; i<sdfparticlesCount; i++){
-            float* pos = partioData->dataWrite<float>(positionAttr, i);
-            pos[0] = sdfparticles[i]->m_p.x * maxd;
-            pos[1] = sdfparticles[i]->m_p.y * maxd;
-            pos[2] = sdfparticles[i]->m_p.z * maxd;
-            float* vel = partioData->dataWrite<float>(velocityAttr, i);
-            vel[0] = sdfparticles[i]->m_u.x;
-            vel[1] = sdfparticles[i]->m_u.y;
-            vel[2] = sdfparticles[i]->m_u.z;
-            int* id = partioData->dataWrite<int>(idAttr, i);
-            id[0] = i;          
+        //Partio::create makes a ParticlesSimple, which keeps each attribute in one contiguous
+        //array, so the first particle's pointer addresses the whole channel and every channel
+        //is filled in a single parallel pass
+        if(sdfparticlesCount>0){
+            float* pos = partioData->dataWrite<float>(positionAttr, 0);
+            float* vel = partioData->dataWrite<float>(velocityAttr, 0);
+            int* id = partioData->dataWrite<int>(idAttr, 0);
+            float* density = writeDensity ? partioData->dataWrite<float>(densityAttr, 0) : NULL;
+            int* age = writeAge ? partioData->dataWrite<int>(ageAttr, 0) : NULL;
+            int frame = snapshot->m_frame;
+            tbb::parallel_for(tbb::blocked_range<unsigned int>(0,sdfparticlesCount),
+                [=](const tbb::blocked_range<unsigned int>& r){
+                    for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                        glm::vec3 p = particles->m_p[i];
+                        glm::vec3 u = particles->m_u[i];
+                        pos[3*i] = p.x * maxd;
+                        pos[3*i+1] = p.y * maxd;
+                        pos[3*i+2] = p.z * maxd;
+                        vel[3*i] = u.x;
+                        vel[3*i+1] = u.y;
+                        vel[3*i+2] = u.z;
+                        id[i] = (int)particles->m_id[i];
+                        if(density!=NULL){
+                            density[i] = particles->m_density[i];
+                        }
+                        if(age!=NULL){
+                            age[i] = frame - particles->m_birthFrame[i];
+                        }
+                    }
+                }
+            );
         }
 
         Partio::write(partiofilename.c_str() ,*partioData);
         partioData->release();
     }
 
-    if(VDB || OBJ){
+    if(snapshot->m_VDB || snapshot->m_OBJ){
         std::string vdbfilename = m_vdbPath;
         utilityCore::replaceString(vdbfilename, ".vdb", "."+frameString+".vdb");
 
         std::string objfilename = m_meshPath;
         utilityCore::replaceString(objfilename, ".obj", "."+frameString+".obj");
 
-        fluidCore::LevelSet* fluidSDF = new fluidCore::LevelSet(sdfparticles, maxd);
+        //fill spheres reach a cell's corners so neighboring fill cells leave no gaps
+        float fillRadius = 0.87f;
+        fluidCore::LevelSet* fluidSDF = new fluidCore::LevelSet(particles, sdfparticles, maxd,
+                                                                m_surfacingSettings, 
+                                                                &snapshot->m_fill,
+                                                                snapshot->m_fillIndices,
+                                                                fillRadius);
 
-        if(VDB){
+        if(snapshot->m_VDB){
             fluidSDF->WriteVDBGridToFile(vdbfilename);
         }
 
-        if(OBJ){
-            fluidSDF->WriteObjToFile(objfilename);
+        if(snapshot->m_OBJ){
+            if(m_surfacingSettings.m_meshFormat==MESH_FORMAT_PLY){
+                std::string plyfilename = m_meshPath;
+                utilityCore::replaceString(plyfilename, ".obj", "."+frameString+".ply");
+                fluidSDF->WritePlyToFile(plyfilename, m_surfacingSettings.m_adaptivity);
+            }else{
+                fluidSDF->WriteObjToFile(objfilename, m_surfacingSettings.m_adaptivity);
+            }
         }
         delete fluidSDF;
     }
 }
 
+void Scene::PrepareMeshFrames(const int& frame){
+    m_meshFrameCache.PrepareFrame(this, frame);
+}
+
 void Scene::AddExternalForce(glm::vec3 force){
     m_externalForces.push_back(force);
 }
 
+void Scene::SetExternalForces(const std::vector<glm::vec3>& forces){
+    m_externalForces = forces;
+}
+
 std::vector<glm::vec3>& Scene::GetExternalForces(){
     return m_externalForces;
 }
@@ -117,132 +365,231 @@ std::vector<geomCore::Geom*>& Scene::GetLiquidGeoms(){
     return m_liquids;
 }
 
-void Scene::BuildPermaSolidGeomLevelSet(){
-    delete m_permaSolidLevelSet;
-    m_permaSolidLevelSet = new fluidCore::LevelSet();
+//Voxelizes a mesh or animated mesh geom at frame, NULL for any other geom type
+fluidCore::LevelSet* Scene::CreateGeomLevelSet(geomCore::Geom* geom, const int& frame, 
+                                               const glm::mat4& transform){
+    GeomType type = geom->m_geom->GetType();
+    if(type==MESH){
+        geomCore::MeshContainer* m = dynamic_cast<geomCore::MeshContainer*>(geom->m_geom);
+        objCore::Obj* o = &m->GetMeshFrame((float)frame)->m_basegeom;
+        return new fluidCore::LevelSet(o, transform);
+    }else if(type==ANIMMESH){
+        geomCore::AnimatedMeshContainer* m = dynamic_cast<geomCore::AnimatedMeshContainer*>
+                                                         (geom->m_geom);
+        objCore::InterpolatedObj* o = &m->GetMeshFrame((float)frame)->m_basegeom;
+        float interpolationWeight = m->GetInterpolationWeight((float)frame);
+        return new fluidCore::LevelSet(o, interpolationWeight, transform);
+    }
+    return NULL;
+}
+
+//Unions a list of level sets, NULL entries are skipped. Takes ownership of every entry and
+//returns an empty level set if there is nothing to merge
+fluidCore::LevelSet* Scene::UnionLevelSets(std::vector<fluidCore::LevelSet*>& levelSets){
+    std::vector<fluidCore::LevelSet*> rest;
+    fluidCore::LevelSet* result = NULL;
+    for(unsigned int i=0; i<levelSets.size(); i++){
+        if(levelSets[i]==NULL){
+            continue;
+        }
+        if(result==NULL){
+            result = levelSets[i];
+        }else{
+            rest.push_back(levelSets[i]);
+        }
+    }
+    if(result==NULL){
+        return new fluidCore::LevelSet();
+    }
+    result->MergeAll(rest);
+    for(unsigned int i=0; i<rest.size(); i++){
+        delete rest[i];
+    }
+    return result;
+}
 
+//Key over every static solid's frame 0 mesh and placement, in solid order. False if a static
+//solid is not a mesh, its seeding can't be keyed then. Those solids never feed the level set
+bool Scene::HashStaticSolids(unsigned long long& key){
+    key = utilityCore::HashValue(0, BAKE_CACHE_VERSION);
+    bool keyed = true;
+    for(unsigned int i=0; i<m_solids.size(); i++){
+        if(m_solids[i]->m_geom->IsDynamic()==true){
+            continue;
+        }
+        if(m_solids[i]->m_geom->GetType()!=MESH){
+            keyed = false;
+            continue;
+        }
+        geomCore::MeshContainer* m = dynamic_cast<geomCore::MeshContainer*>(m_solids[i]->m_geom);
+        key = utilityCore::HashCombine(key, m->GetMeshFrame(0.0f)->m_basegeom.GetContentHash());
+        glm::mat4 transform;
+        glm::mat4 inversetransform;
+        bool placed = m_solids[i]->m_geom->GetTransforms(0, transform, inversetransform);
+        key = utilityCore::HashValue(key, placed);
+        if(placed==true){
+            key = utilityCore::HashValue(key, transform);
+        }
+    }
+    return keyed;
+}
+
+void Scene::BuildPermaSolidGeomLevelSet(){
+    if(m_permaSolidLevelSetBuilt==true){
+        return;
+    }
+    m_permaSolidLevelSetBuilt = true;
+    unsigned long long key = 0;
+    utilityCore::Checkpoint entry;
+    if(m_bakeCache.IsEnabled()==true){
+        HashStaticSolids(key);
+        size_t bytes;
+        if(m_bakeCache.Read("perma_solid_sdf", key, entry)==true &&
+           entry.GetValue("empty", m_permaSolidLevelSetEmpty)==true){
+            const char* grid = entry.GetChunk("vdb_grid", bytes);
+            if(grid!=NULL && m_permaSolidLevelSet->ReadVDBGridFromBuffer(grid, bytes)==true){
+                m_solidLevelSetMerged = false;
+                return;
+            }
+        }
+    }
     unsigned int solidObjectsCount = m_solids.size();
-    bool permaSolidSDFCreated = false;
-    for(unsigned int i=0; i<solidObjectsCount; i++){
-        GeomType type = m_solids[i]->m_geom->GetType();
-        if(type==MESH && m_solids[i]->m_geom->IsDynamic()==false){
-            glm::mat4 transform;
-            glm::mat4 inversetransform; 
-            if(m_solids[i]->m_geom->GetTransforms(0, transform, inversetransform)==true){
-                geomCore::MeshContainer* m = dynamic_cast<geomCore::MeshContainer*>
-                                                             (m_solids[i]->m_geom);
-                objCore::Obj* o = &m->GetMeshFrame(0)->m_basegeom;
-                if(permaSolidSDFCreated==false){
-                    delete m_permaSolidLevelSet;
-                    m_permaSolidLevelSet = new fluidCore::LevelSet(o, transform);
-                    permaSolidSDFCreated = true;
-                }else{
-                    fluidCore::LevelSet* objectSDF = new fluidCore::LevelSet(o, transform);
-                    m_permaSolidLevelSet->Merge(*objectSDF);
-                    delete objectSDF;
+    std::vector<fluidCore::LevelSet*> solidSDFs(solidObjectsCount, NULL);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,solidObjectsCount,1),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                GeomType type = m_solids[i]->m_geom->GetType();
+                if(type==MESH && m_solids[i]->m_geom->IsDynamic()==false){
+                    glm::mat4 transform;
+                    glm::mat4 inversetransform; 
+                    if(m_solids[i]->m_geom->GetTransforms(0, transform, inversetransform)==true){
+                        solidSDFs[i] = CreateGeomLevelSet(m_solids[i], 0, transform);
+                    }
                 }
             }
         }
+    );
+    m_permaSolidLevelSetEmpty = true;
+    for(unsigned int i=0; i<solidObjectsCount; i++){
+        if(solidSDFs[i]!=NULL){
+            m_permaSolidLevelSetEmpty = false;
+        }
+    }
+    delete m_permaSolidLevelSet;
+    m_permaSolidLevelSet = UnionLevelSets(solidSDFs);
+    m_solidLevelSetMerged = false;
+    if(m_bakeCache.IsEnabled()==true){
+        std::vector<char> grid;
+        m_permaSolidLevelSet->WriteVDBGridToBuffer(grid);
+        entry.Clear();
+        entry.AddValue("empty", m_permaSolidLevelSetEmpty);
+        entry.AddArray("vdb_grid", grid);
+        m_bakeCache.Write("perma_solid_sdf", key, entry);
     }
 }
 
+//Only updates the per solid SDF caches. Rigid motion re-places a cached grid, a new mesh frame,
+//keyframe interpolation or scale re-voxelizes it. Stale caches are voxelized concurrently. The
+//union with the static solid level set is deferred to GetSolidLevelSet, point queries take the
+//min over the parts instead
 void Scene::BuildSolidGeomLevelSet(const int& frame){
-    delete m_solidLevelSet;
-    m_solidLevelSet = new fluidCore::LevelSet();
-    //build levelsets for all varying geoms, then merge in cached permanent solid level set
     unsigned int solidObjectsCount = m_solids.size();
-    bool solidSDFCreated = false;
+    m_solidSDFCache.resize(solidObjectsCount);
+    //only mesh solids are rasterized, any other solid type has to stay on ray casting
+    m_solidLevelSetFrame = frame;
+    m_solidLevelSetComplete = true;
+    m_solidLevelSetMerged = false;
     for(unsigned int i=0; i<solidObjectsCount; i++){
-        if(m_solids[i]->m_geom->IsDynamic()==true){     
-            glm::mat4 transform;
-            glm::mat4 inversetransform;
-            if(m_solids[i]->m_geom->GetTransforms((float)frame, transform, inversetransform)==true){
-                GeomType type = m_solids[i]->m_geom->GetType();
-                if(type==MESH){
-                    geomCore::MeshContainer* m = dynamic_cast<geomCore::MeshContainer*>
+        GeomType solidType = m_solids[i]->m_geom->GetType();
+        if(solidType!=MESH && solidType!=ANIMMESH){
+            m_solidLevelSetComplete = false;
+        }
+    }
+    std::vector<unsigned int> stale;
+    std::vector<glm::mat4> placements(solidObjectsCount);
+    for(unsigned int i=0; i<solidObjectsCount; i++){
+        SolidSDFCache& cache = m_solidSDFCache[i];
+        cache.m_active = false;
+        GeomType type = m_solids[i]->m_geom->GetType();
+        if(m_solids[i]->m_geom->IsDynamic()==false || (type!=MESH && type!=ANIMMESH)){
+            continue;
+        }
+        glm::mat4 transform;
+        glm::mat4 inversetransform;
+        if(m_solids[i]->m_geom->GetTransforms((float)frame, transform, inversetransform)==false){
+            continue;
+        }
+        //transforms are translate*rotate*scale, split off the scale
+        glm::vec3 scale(glm::length(glm::vec3(transform[0])), 
+                        glm::length(glm::vec3(transform[1])),
+                        glm::length(glm::vec3(transform[2])));
+        placements[i] = transform * utilityCore::buildScale(1.0f/scale);
+        bool changed = cache.m_levelSet==NULL || 
+                       glm::length(cache.m_scale-scale)>1e-5f*glm::length(scale);
+        if(type==MESH){
+            geomCore::MeshContainer* m = dynamic_cast<geomCore::MeshContainer*>
+                                                     (m_solids[i]->m_geom);
+            spaceCore::Bvh<objCore::Obj>* mesh = m->GetMeshFrame((float)frame);
+            changed = changed || cache.m_mesh!=mesh;
+            cache.m_mesh = mesh;
+            cache.m_animMesh = NULL;
+        }else{
+            geomCore::AnimatedMeshContainer* m = dynamic_cast<geomCore::AnimatedMeshContainer*>
                                                              (m_solids[i]->m_geom);
-                    objCore::Obj* o = &m->GetMeshFrame((float)frame)->m_basegeom;
-                    if(solidSDFCreated==false){
-                        delete m_solidLevelSet;
-                        m_solidLevelSet = new fluidCore::LevelSet(o, transform);
-                        solidSDFCreated = true;
-                    }else{
-                        fluidCore::LevelSet* objectSDF = new fluidCore::LevelSet(o, transform);
-                        m_solidLevelSet->Merge(*objectSDF);
-                        delete objectSDF;
-                    }
-                }else if(type==ANIMMESH){
-                    geomCore::AnimatedMeshContainer* m = dynamic_cast
-                                                         <geomCore::AnimatedMeshContainer*>
-                                                         (m_solids[i]->m_geom);
-                    objCore::InterpolatedObj* o = &m->GetMeshFrame((float)frame)->m_basegeom;
-                    float interpolationWeight = m->GetInterpolationWeight((float)frame);
-                    if(solidSDFCreated==false){
-                        delete m_solidLevelSet;
-                        m_solidLevelSet = new fluidCore::LevelSet(o, interpolationWeight,
-                                                                   transform);
-                        solidSDFCreated = true;
-                    }else{
-                        fluidCore::LevelSet* objectSDF = 
-                                                new fluidCore::LevelSet(o, interpolationWeight,
-                                                                        transform);
-                        m_solidLevelSet->Merge(*objectSDF);
-                        delete objectSDF;
-                    }
+            spaceCore::Bvh<objCore::InterpolatedObj>* animmesh = m->GetMeshFrame((float)frame);
+            float interpolationWeight = m->GetInterpolationWeight((float)frame);
+            changed = changed || cache.m_animMesh!=animmesh || 
+                      cache.m_interpolation!=interpolationWeight;
+            cache.m_mesh = NULL;
+            cache.m_animMesh = animmesh;
+            cache.m_interpolation = interpolationWeight;
+        }
+        if(changed==true){
+            cache.m_scale = scale;
+            stale.push_back(i);
+        }
+        cache.m_active = true;
+    }
+    SolidSDFCache* caches = m_solidSDFCache.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,stale.size(),1),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int s=r.begin(); s!=r.end(); ++s){
+                SolidSDFCache& cache = caches[stale[s]];
+                glm::mat4 local = utilityCore::buildScale(cache.m_scale);
+                delete cache.m_levelSet;
+                if(cache.m_mesh!=NULL){
+                    cache.m_levelSet = new fluidCore::LevelSet(&cache.m_mesh->m_basegeom, local);
+                }else{
+                    cache.m_levelSet = new fluidCore::LevelSet(&cache.m_animMesh->m_basegeom,
+                                                               cache.m_interpolation, local);
                 }
             }
         }
-    }
-    if(solidSDFCreated==false){
-        m_solidLevelSet->Copy(*m_permaSolidLevelSet);
-    }else{
-        m_solidLevelSet->Merge(*m_permaSolidLevelSet);
+    );
+    for(unsigned int i=0; i<solidObjectsCount; i++){
+        if(caches[i].m_active==true){
+            caches[i].m_levelSet->SetPlacement(placements[i]);
+        }
     }
 }
 
 void Scene::BuildLiquidGeomLevelSet(const int& frame){
-    delete m_liquidLevelSet;
-    m_liquidLevelSet = new fluidCore::LevelSet();
-
     unsigned int liquidObjectsCount = m_liquids.size();
-    bool liquidSDFCreated = false;
-    for(unsigned int i=0; i<liquidObjectsCount; i++){
-        glm::mat4 transform;
-        glm::mat4 inversetransform;
-        if(m_liquids[i]->m_geom->GetTransforms((float)frame, transform, inversetransform)==true){
-            GeomType type = m_liquids[i]->m_geom->GetType();
-            if(type==MESH){
-                geomCore::MeshContainer* m = dynamic_cast<geomCore::MeshContainer*>
-                                                         (m_liquids[i]->m_geom);
-                objCore::Obj* o = &m->GetMeshFrame((float)frame)->m_basegeom;
-                if(liquidSDFCreated==false){
-                    delete m_liquidLevelSet;
-                    m_liquidLevelSet = new fluidCore::LevelSet(o, transform);
-                    liquidSDFCreated = true;
-                }else{
-                    fluidCore::LevelSet* objectSDF = new fluidCore::LevelSet(o, transform);
-                    m_liquidLevelSet->Merge(*objectSDF);
-                    delete objectSDF;
-                }
-            }else if(type==ANIMMESH){
-                geomCore::AnimatedMeshContainer* m=dynamic_cast<geomCore::AnimatedMeshContainer*>
-                                                                  (m_liquids[i]->m_geom);
-                objCore::InterpolatedObj* o = &m->GetMeshFrame((float)frame)->m_basegeom;
-                float interpolationWeight = m->GetInterpolationWeight((float)frame);
-                if(liquidSDFCreated==false){
-                    delete m_liquidLevelSet;
-                    m_liquidLevelSet = new fluidCore::LevelSet(o, interpolationWeight,
-                                                               transform);
-                    liquidSDFCreated = true;
-                }else{
-                    fluidCore::LevelSet* objectSDF = new fluidCore::LevelSet(o,interpolationWeight,
-                                                                             transform);
-                    m_liquidLevelSet->Merge(*objectSDF);
-                    delete objectSDF;
+    std::vector<fluidCore::LevelSet*> liquidSDFs(liquidObjectsCount, NULL);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,liquidObjectsCount,1),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                glm::mat4 transform;
+                glm::mat4 inversetransform;
+                if(m_liquids[i]->m_geom->GetTransforms((float)frame, transform, 
+                                                       inversetransform)==true){
+                    liquidSDFs[i] = CreateGeomLevelSet(m_liquids[i], frame, transform);
                 }
             }
         }
-    }
+    );
+    delete m_liquidLevelSet;
+    m_liquidLevelSet = UnionLevelSets(liquidSDFs);
 }
 
 void Scene::BuildLevelSets(const int& frame){
@@ -250,113 +597,461 @@ void Scene::BuildLevelSets(const int& frame){
     BuildSolidGeomLevelSet(frame);
 }
 
+//The perma solid particles are only emitted on frame 0, so a restart needs them from the file.
+//Dynamic solids are re-emitted every frame and level sets are rebuilt from the geometry
+void Scene::AddCheckpointChunks(utilityCore::Checkpoint* checkpoint){
+    checkpoint->AddValue("scene_liquid_count", m_liquidParticleCount);
+    checkpoint->AddValue("scene_perma_solid_offset", m_permaSolidOffset);
+    checkpoint->AddValue("scene_next_liquid_id", m_nextLiquidID);
+    fluidCore::AddParticleSetChunks(checkpoint, "scene_perma_solids", &m_permaSolidParticles);
+}
+
+bool Scene::GetCheckpointChunks(utilityCore::Checkpoint* checkpoint){
+    return checkpoint->GetValue("scene_liquid_count", m_liquidParticleCount) &&
+           checkpoint->GetValue("scene_perma_solid_offset", m_permaSolidOffset) &&
+           checkpoint->GetValue("scene_next_liquid_id", m_nextLiquidID) &&
+           fluidCore::GetParticleSetChunks(checkpoint, "scene_perma_solids", 
+                                           &m_permaSolidParticles);
+}
+
 unsigned int Scene::GetLiquidParticleCount(){
     return m_liquidParticleCount;
 }
 
-void Scene::GenerateParticles(std::vector<fluidCore::Particle*>& particles,
-                              const glm::vec3& dimensions, const float& density, 
-                              fluidCore::ParticleGrid* pgrid, const int& frame){
+void Scene::RebandLiquidParticles(fluidCore::ParticleSet* particles, 
+                                  const std::vector<unsigned int>& kept,
+                                  const std::vector<glm::vec3>& seeds,
+                                  const std::vector<glm::vec3>& seedVelocities, 
+                                  const int& frame){
+    m_particleLock.lock();
 
-    float maxdimension = glm::max(glm::max(dimensions.x, dimensions.y), dimensions.z);
+    //staged in the emission set, which is empty between GenerateParticles calls
+    unsigned int total = fluidCore::GetParticleCount(particles);
+    fluidCore::ResizeParticleSet(&m_liquidParticles, kept.size());
+    fluidCore::CopyParticleSubset(&m_liquidParticles, 0, particles, kept);
+    EmitParticles(&m_liquidParticles, seeds, glm::vec3(0.0f), FLUID, 1.0f, frame);
+    std::copy(seedVelocities.begin(), seedVelocities.end(), 
+              m_liquidParticles.m_u.begin()+kept.size());
+    unsigned int liquidCount = fluidCore::GetParticleCount(&m_liquidParticles);
 
-    float thickness = 1.0f/maxdimension;
-    float w = density*thickness;
+    m_rebandSolids.resize(total-m_liquidParticleCount);
+    for(unsigned int i=0; i<m_rebandSolids.size(); i++){
+        m_rebandSolids[i] = m_liquidParticleCount+i;
+    }
+    fluidCore::ResizeParticleSet(&m_liquidParticles, liquidCount+m_rebandSolids.size());
+    fluidCore::CopyParticleSubset(&m_liquidParticles, liquidCount, particles, m_rebandSolids);
+    fluidCore::ResizeParticleSet(particles, fluidCore::GetParticleCount(&m_liquidParticles));
+    fluidCore::CopyParticles(particles, 0, &m_liquidParticles);
+    if(m_permaSolidOffset>=0){
+        m_permaSolidOffset = liquidCount;
+    }
+    m_liquidParticleCount = liquidCount;
+    fluidCore::ClearParticleSet(&m_liquidParticles);
 
-    //store list of pointers to particles we need to delete for later deletion in the locked block
-    std::vector<fluidCore::Particle*> particlesToDelete;
-    particlesToDelete.reserve(m_solidParticles.size());
-    particlesToDelete.insert(particlesToDelete.end(), m_solidParticles.begin(), 
-                             m_solidParticles.end());
+    m_particleLock.unlock();
+}
+
+//Anim frames that refit a topology share its references, so those are counted once
+void Scene::UpdateMemoryUsage(){
+    std::set<fluidCore::LevelSet*> levelSets;
+    levelSets.insert(m_solidLevelSet);
+    //a shared static solid level set is reported by the scene that owns it
+    if(m_source==NULL){
+        levelSets.insert(m_permaSolidLevelSet);
+    }
+    levelSets.insert(m_liquidLevelSet);
+    for(unsigned int i=0; i<m_solidSDFCache.size(); i++){
+        levelSets.insert(m_solidSDFCache[i].m_levelSet);
+    }
+    size_t levelSetBytes = 0;
+    for(std::set<fluidCore::LevelSet*>::iterator it=levelSets.begin(); it!=levelSets.end();
+        ++it){
+        if(*it!=NULL){
+            levelSetBytes += (*it)->GetMemoryUsage();
+        }
+    }
+    m_levelSetMemory.Update(levelSetBytes);
+
+    unsigned long long meshBytes = 0;
+    for(unsigned int i=0; i<m_meshFiles.size(); i++){
+        meshBytes += m_meshFiles[i].m_basegeom.GetMemoryUsage() +
+                     m_meshFiles[i].GetMemoryUsage(true);
+    }
+    std::set<unsigned int*> references;
+    for(unsigned int i=0; i<m_animMeshes.size(); i++){
+        bool shared = references.insert(m_animMeshes[i].m_referenceIndices).second==false;
+        meshBytes += m_animMeshes[i].GetMemoryUsage(shared==false);
+    }
+    m_meshMemory.Update((size_t)meshBytes);
 
-    tbb::concurrent_vector<fluidCore::Particle*>().swap(m_solidParticles);
+    m_particleMemory.Update(fluidCore::GetParticleSetBytes(&m_liquidParticles) +
+                            fluidCore::GetParticleSetBytes(&m_permaSolidParticles) +
+                            fluidCore::GetParticleSetBytes(&m_solidParticles) +
+                            m_seedPositions.capacity()*sizeof(glm::vec3));
+}
+
+void Scene::GenerateParticles(fluidCore::ParticleSet* particles,
+                              const glm::vec3& dimensions, const float& density, 
+                              fluidCore::ParticleGrid* pgrid, const int& frame){
+    //dynamic solid particles are regenerated every frame. Staging sets and the position buffer
+    //keep their capacity, so steady state emission allocates nothing
+    fluidCore::ClearParticleSet(&m_solidParticles);
+    std::vector<glm::vec3>& positions = m_seedPositions;
     
-    //place fluid particles
-    //for each fluid geom in the frame, loop through voxels in the geom's AABB to place particles
+    //place fluid particles, samples inside a solid are dropped
     unsigned int liquidCount = m_liquids.size();
     for(unsigned int l=0; l<liquidCount; ++l){
-
-        spaceCore::Aabb liquidaabb = m_liquids[l]->m_geom->GetAabb(frame);   
-        glm::vec3 liquidvelocity = m_liquidStartingVelocities[l]; 
-
         if(m_liquids[l]->m_geom->IsInFrame(frame)){
-            //clip AABB to sim boundaries, account for density
-            glm::vec3 lmin = glm::floor(liquidaabb.m_min);
-            glm::vec3 lmax = glm::ceil(liquidaabb.m_max);
-            lmin = glm::max(lmin, glm::vec3(0.0f))/density;             
-            lmax = glm::min(lmax, dimensions+glm::vec3(1.0f))/density;
-            //place particles in AABB
-            tbb::parallel_for(tbb::blocked_range<unsigned int>(lmin.x,lmax.x),
-                [=](const tbb::blocked_range<unsigned int>& r){
-                    for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                        for(unsigned int j = lmin.y; j<lmax.y; ++j){
-                            for(unsigned int k = lmin.z; k<lmax.z; ++k){
-                                float x = (i*w)+(w/2.0f);
-                                float y = (j*w)+(w/2.0f);
-                                float z = (k*w)+(w/2.0f);
-                                AddLiquidParticle(glm::vec3(x,y,z), liquidvelocity, 
-                                                  3.0f/maxdimension, maxdimension, 
-                                                  frame, m_liquids[l]->m_id);
-                            }
-                        }
-                    }
-                }
-            );
+            positions.clear();
+            SeedGeom(m_liquids[l], frame, dimensions, density, true, positions);
+            EmitParticles(&m_liquidParticles, positions, m_liquidStartingVelocities[l], FLUID, 
+                          1.0f, frame);
         }   
     }
+    //static solids are only seeded at frame 0, from the bake cache when it has them
+    unsigned long long permaKey = 0;
+    bool bakePermaSolids = frame==0 && m_bakeCache.IsEnabled()==true && 
+                           HashStaticSolids(permaKey)==true;
+    bool bakedPermaSolids = false;
+    utilityCore::Checkpoint entry;
+    if(bakePermaSolids==true){
+        permaKey = utilityCore::HashValue(permaKey, dimensions);
+        permaKey = utilityCore::HashValue(permaKey, density);
+        bakedPermaSolids = m_bakeCache.Read("perma_solids", permaKey, entry)==true &&
+                           fluidCore::GetParticleSetChunks(&entry, "perma_solids", 
+                                                           &m_permaSolidParticles)==true;
+    }
     unsigned int solidCount = m_solids.size();
     for(unsigned int l=0; l<solidCount; ++l){
-        spaceCore::Aabb solidaabb = m_solids[l]->m_geom->GetAabb(frame);        
-        if((frame==0 && m_solids[l]->m_geom->IsDynamic()==false) || 
-           (m_solids[l]->m_geom->IsDynamic()==true && m_solids[l]->m_geom->IsInFrame(frame))){
-            //clip AABB to sim boundaries, account for density
-            glm::vec3 lmin = glm::floor(solidaabb.m_min);
-            glm::vec3 lmax = glm::ceil(solidaabb.m_max);
-            lmin = glm::max(lmin, glm::vec3(0.0f))/density;             
-            lmax = glm::min(lmax, dimensions+glm::vec3(1.0f))/density;
-            //place particles in AABB
-            tbb::parallel_for(tbb::blocked_range<unsigned int>(lmin.x,lmax.x),
-                [=](const tbb::blocked_range<unsigned int>& r){
-                    for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                        for(unsigned int j = lmin.y; j<lmax.y; ++j){
-                            for(unsigned int k = lmin.z; k<lmax.z; ++k){
-                                float x = (i*w)+(w/2.0f);
-                                float y = (j*w)+(w/2.0f);
-                                float z = (k*w)+(w/2.0f);
-                                AddSolidParticle(glm::vec3(x,y,z), 3.0f/maxdimension, 
-                                                 maxdimension, frame, m_solids[l]->m_id);
+        bool dynamic = m_solids[l]->m_geom->IsDynamic();
+        bool seedStatic = frame==0 && dynamic==false && bakedPermaSolids==false;
+        if(seedStatic==true || (dynamic==true && m_solids[l]->m_geom->IsInFrame(frame))){
+            positions.clear();
+            SeedGeom(m_solids[l], frame, dimensions, density, false, positions);
+            EmitParticles(dynamic ? &m_solidParticles : &m_permaSolidParticles, positions, 
+                          glm::vec3(0.0f), SOLID, 10.0f, frame);
+        }   
+    }
+    if(bakePermaSolids==true && bakedPermaSolids==false){
+        entry.Clear();
+        fluidCore::AddParticleSetChunks(&entry, "perma_solids", &m_permaSolidParticles);
+        m_bakeCache.Write("perma_solids", permaKey, entry);
+    }
+
+    m_particleLock.lock();
+
+    //the set is laid out as [liquids | perma solids | dynamic solids]. Liquids already in the
+    //set keep their indices and new liquids go after them. The perma solid block is only
+    //rewritten when new liquids push it back, the dynamic solid tail is overwritten in place
+    unsigned int oldLiquidCount = m_liquidParticleCount;
+    unsigned int newLiquidCount = fluidCore::GetParticleCount(&m_liquidParticles);
+    unsigned int permaSolidCount = fluidCore::GetParticleCount(&m_permaSolidParticles);
+    unsigned int dynamicSolidCount = fluidCore::GetParticleCount(&m_solidParticles);
+    unsigned int liquidEnd = oldLiquidCount+newLiquidCount;
+    if(m_solidCullBand>0){
+        BuildSolidCullMask(particles, oldLiquidCount, dimensions);
+        CullSolidParticles(&m_permaSolidParticles, dimensions, m_keptPermaSolids);
+        CullSolidParticles(&m_solidParticles, dimensions, m_keptSolids);
+        permaSolidCount = m_keptPermaSolids.size();
+        dynamicSolidCount = m_keptSolids.size();
+    }
+    fluidCore::ResizeParticleSet(particles, liquidEnd+permaSolidCount+dynamicSolidCount);
+    fluidCore::CopyParticles(particles, oldLiquidCount, &m_liquidParticles);
+    if(m_solidCullBand>0){
+        //the kept perma solids change as the liquid moves, so their block is always rewritten
+        fluidCore::CopyParticleSubset(particles, liquidEnd, &m_permaSolidParticles, 
+                                      m_keptPermaSolids);
+        fluidCore::CopyParticleSubset(particles, liquidEnd+permaSolidCount, &m_solidParticles,
+                                      m_keptSolids);
+        m_permaSolidOffset = -1;
+    }else{
+        if(m_permaSolidOffset!=(int)liquidEnd){
+            fluidCore::CopyParticles(particles, liquidEnd, &m_permaSolidParticles);
+            m_permaSolidOffset = liquidEnd;
+        }
+        fluidCore::CopyParticles(particles, liquidEnd+permaSolidCount, &m_solidParticles);
+    }
+    m_liquidParticleCount = liquidEnd;
+    fluidCore::ClearParticleSet(&m_liquidParticles);
+
+    //std::cout << "Solid+Fluid particles: " << GetParticleCount(particles) << std::endl;
+
+    m_particleLock.unlock();
+}
+
+//Flags the culling blocks holding a liquid particle, either one already in particles or one
+//emitted this frame, then dilates the flags by the band
+void Scene::BuildSolidCullMask(fluidCore::ParticleSet* particles, const unsigned int& liquidCount,
+                               const glm::vec3& dimensions){
+    //positions reach dimensions, one cell past the last, along each axis
+    int* blocks = m_solidCullBlocks;
+    for(unsigned int n=0; n<3; n++){
+        blocks[n] = (int)dimensions[n]/SOLID_CULL_BLOCK + 1;
+    }
+    int bx = blocks[0]; int by = blocks[1]; int bz = blocks[2];
+    unsigned int blockCount = bx*by*bz;
+    tbb::atomic<unsigned char>* liquid = new tbb::atomic<unsigned char>[blockCount];
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,blockCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                liquid[b] = 0;
+            }
+        }
+    );
+    float maxd = glm::max(glm::max(dimensions.x, dimensions.y), dimensions.z);
+    auto flagLiquid = [=](const glm::vec3* positions, const unsigned int& count){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,count),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                    glm::ivec3 b = glm::clamp(glm::ivec3(positions[p]*maxd)/SOLID_CULL_BLOCK,
+                                              glm::ivec3(0), glm::ivec3(bx-1, by-1, bz-1));
+                    unsigned int block = (b.x*by + b.y)*bz + b.z;
+                    if(liquid[block]==0){
+                        liquid[block] = 1;
+                    }
+                }
+            }
+        );
+    };
+    if(liquidCount>0){
+        flagLiquid(particles->m_p.data(), liquidCount);
+    }
+    if(m_liquidParticles.m_p.empty()==false){
+        flagLiquid(m_liquidParticles.m_p.data(), fluidCore::GetParticleCount(&m_liquidParticles));
+    }
+
+    int band = (m_solidCullBand+SOLID_CULL_BLOCK-1)/SOLID_CULL_BLOCK;
+    m_solidCullMask.resize(blockCount);
+    unsigned char* mask = m_solidCullMask.data();
+    tbb::parallel_for(tbb::blocked_range<int>(0,bx),
+        [=](const tbb::blocked_range<int>& r){
+            for(int bi=r.begin(); bi!=r.end(); ++bi){
+                for(int bj=0; bj<by; bj++){
+                    for(int bk=0; bk<bz; bk++){
+                        bool on = false;
+                        for(int i=glm::max(bi-band,0); i<=glm::min(bi+band,bx-1) && !on; i++){
+                            for(int j=glm::max(bj-band,0); j<=glm::min(bj+band,by-1) && !on; 
+                                j++){
+                                for(int k=glm::max(bk-band,0); k<=glm::min(bk+band,bz-1) && !on;
+                                    k++){
+                                    on = liquid[(i*by + j)*bz + k]!=0;
+                                }
                             }
                         }
+                        mask[(bi*by + bj)*bz + bk] = on;
                     }
                 }
-            );
-        }   
+            }
+        }
+    );
+    delete [] liquid;
+}
+
+//Indices of the particles of set inside a flagged culling block, in index order
+void Scene::CullSolidParticles(fluidCore::ParticleSet* set, const glm::vec3& dimensions,
+                               std::vector<unsigned int>& kept){
+    unsigned int count = fluidCore::GetParticleCount(set);
+    kept.resize(count);
+    if(count==0){
+        return;
     }
+    float maxd = glm::max(glm::max(dimensions.x, dimensions.y), dimensions.z);
+    int bx = m_solidCullBlocks[0]; int by = m_solidCullBlocks[1]; int bz = m_solidCullBlocks[2];
+    const unsigned char* mask = m_solidCullMask.data();
+    const glm::vec3* positions = set->m_p.data();
+    unsigned int* target = kept.data();
+    unsigned int keptCount = tbb::parallel_scan(tbb::blocked_range<unsigned int>(0,count), 0u,
+        [=](const tbb::blocked_range<unsigned int>& r, unsigned int sum, 
+            const bool isFinal)->unsigned int{
+            for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                glm::ivec3 b = glm::clamp(glm::ivec3(positions[p]*maxd)/SOLID_CULL_BLOCK,
+                                          glm::ivec3(0), glm::ivec3(bx-1, by-1, bz-1));
+                if(mask[(b.x*by + b.y)*bz + b.z]!=0){
+                    if(isFinal==true){
+                        target[sum] = p;
+                    }
+                    sum++;
+                }
+            }
+            return sum;
+        },
+        std::plus<unsigned int>()
+    );
+    kept.resize(keptCount);
+}
 
-    m_particleLock.lock();
-   
-    //delete old particles 
-    unsigned int delParticleCount = particlesToDelete.size();
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,delParticleCount),
+//Appends positions to set as particles of one type, all fields are filled in parallel. Liquid
+//particles get consecutive ids, solids are re-emitted too often for ids to mean anything
+void Scene::EmitParticles(fluidCore::ParticleSet* set, const std::vector<glm::vec3>& positions,
+                          const glm::vec3& velocity, const int& type, const float& mass,
+                          const int& frame){
+    unsigned int offset = fluidCore::GetParticleCount(set);
+    unsigned int count = positions.size();
+    fluidCore::ResizeParticleSet(set, offset+count);
+    if(count==0){
+        return;
+    }
+    const glm::vec3* source = positions.data();
+    glm::vec3* p = &set->m_p[offset];
+    glm::vec3* u = &set->m_u[offset];
+    glm::vec3* n = &set->m_n[offset];
+    float* d = &set->m_density[offset];
+    float* m = &set->m_mass[offset];
+    int* t = &set->m_type[offset];
+    unsigned char* invalid = &set->m_invalid[offset];
+    unsigned int* id = &set->m_id[offset];
+    int* birthFrame = &set->m_birthFrame[offset];
+    unsigned int firstID = 0;
+    if(type==FLUID){
+        firstID = m_nextLiquidID;
+        m_nextLiquidID += count;
+    }
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,count),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                delete particlesToDelete[i];
+                p[i] = source[i];
+                u[i] = velocity;
+                n[i] = glm::vec3(0.0f);
+                d[i] = 10.0f;
+                m[i] = mass;
+                t[i] = type;
+                invalid[i] = 0;
+                id[i] = type==FLUID ? firstID+i : 0;
+                birthFrame[i] = frame;
             }
         }
     );
+}
 
-    //add new particles to main particles list
-    std::vector<fluidCore::Particle*>().swap(particles);
-    particles.reserve(m_liquidParticles.size()+m_permaSolidParticles.size()+
-                      m_solidParticles.size()); 
-    particles.insert(particles.end(), m_liquidParticles.begin(), m_liquidParticles.end()); 
-    particles.insert(particles.end(), m_permaSolidParticles.begin(), m_permaSolidParticles.end());
-    particles.insert(particles.end(), m_solidParticles.begin(), m_solidParticles.end());
-    m_liquidParticleCount = m_liquidParticles.size();
+//Appends the sample positions inside geom to positions, in sim space. Each column of samples in
+//the geom's clipped AABB is parity tested with a single ray from below the geom, so a sample is
+//inside if an odd number of crossings lie at or above it, same as a ray cast from the sample.
+//Columns are split into fixed chunks that collect positions locally, then a prefix sum over the
+//chunk counts places every chunk in the output block. With excludeSolids, samples inside a solid
+//are dropped, using the solid level set when it can answer for this frame
+void Scene::SeedGeom(geomCore::Geom* geom, const int& frame, const glm::vec3& dimensions,
+                     const float& density, const bool& excludeSolids,
+                     std::vector<glm::vec3>& positions){
+    float maxdimension = glm::max(glm::max(dimensions.x, dimensions.y), dimensions.z);
+    float w = density/maxdimension;
+    //clip AABB to sim boundaries, account for density
+    spaceCore::Aabb aabb = geom->m_geom->GetAabb(frame);
+    glm::vec3 lmin = glm::max(glm::floor(aabb.m_min), glm::vec3(0.0f))/density;
+    glm::vec3 lmax = glm::min(glm::ceil(aabb.m_max), dimensions+glm::vec3(1.0f))/density;
+    if(lmax.x<=lmin.x || lmax.y<=lmin.y || lmax.z<=lmin.z){
+        return;
+    }
+    int i0 = (int)lmin.x; int j0 = (int)lmin.y; int k0 = (int)lmin.z;
+    int ni = (int)glm::ceil(lmax.x)-i0;
+    int nj = (int)glm::ceil(lmax.y)-j0;
+    int nk = (int)glm::ceil(lmax.z)-k0;
 
-    //std::cout << "Solid+Fluid particles: " << particles.size() << std::endl;
+    //solids whose AABB can overlap the geom's columns, only needed without a solid level set
+    bool useSolidLevelSet = excludeSolids==true && UseSolidLevelSet((float)frame);
+    std::vector<geomCore::Geom*> solids;
+    std::vector<spaceCore::Aabb> solidAabbs;
+    if(excludeSolids==true && useSolidLevelSet==false){
+        for(unsigned int s=0; s<m_solids.size(); s++){
+            spaceCore::Aabb solidaabb = m_solids[s]->m_geom->GetAabb(frame);
+            if(solidaabb.m_max.x>=aabb.m_min.x && solidaabb.m_min.x<=aabb.m_max.x &&
+               solidaabb.m_max.y>=aabb.m_min.y && solidaabb.m_min.y<=aabb.m_max.y){
+                solids.push_back(m_solids[s]);
+                solidAabbs.push_back(solidaabb);
+            }
+        }
+    }
 
-    m_particleLock.unlock();
+    unsigned int columnCount = ni*nj;
+    unsigned int chunkCount = (columnCount+SEED_CHUNK_SIZE-1)/SEED_CHUNK_SIZE;
+    std::vector< std::vector<glm::vec3> > chunks(chunkCount);
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,chunkCount,1),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            std::vector<float> crossings;
+            std::vector< std::vector<float> > solidCrossings(solids.size());
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                std::vector<glm::vec3>& chunk = chunks[c];
+                unsigned int columnEnd = glm::min((c+1)*SEED_CHUNK_SIZE, columnCount);
+                for(unsigned int column=c*SEED_CHUNK_SIZE; column<columnEnd; column++){
+                    float x = ((i0+column/nj)*w)+(w/2.0f);
+                    float y = ((j0+column%nj)*w)+(w/2.0f);
+                    glm::vec2 worldColumn(x*maxdimension, y*maxdimension);
+                    FindColumnCrossings(geom, worldColumn, aabb.m_min.z, frame, crossings);
+                    if(crossings.empty()==true){
+                        continue;
+                    }
+                    for(unsigned int s=0; s<solids.size(); s++){
+                        solidCrossings[s].clear();
+                        if(worldColumn.x>=solidAabbs[s].m_min.x && 
+                           worldColumn.x<=solidAabbs[s].m_max.x &&
+                           worldColumn.y>=solidAabbs[s].m_min.y && 
+                           worldColumn.y<=solidAabbs[s].m_max.y){
+                            FindColumnCrossings(solids[s], worldColumn, solidAabbs[s].m_min.z, 
+                                                frame, solidCrossings[s]);
+                        }
+                    }
+                    for(int k=k0; k<k0+nk; k++){
+                        float z = (k*w)+(w/2.0f);
+                        float worldZ = z*maxdimension;
+                        unsigned int above = crossings.end()-std::lower_bound(crossings.begin(),
+                                                                              crossings.end(),
+                                                                              worldZ);
+                        if(above%2==0){
+                            continue;
+                        }
+                        bool inSolid = false;
+                        if(useSolidLevelSet==true){
+                            int solidID;
+                            glm::vec3 worldpos(worldColumn.x, worldColumn.y, worldZ);
+                            inSolid = SampleSolidLevelSets(worldpos, solidID)<0.0f;
+                        }
+                        for(unsigned int s=0; s<solids.size() && inSolid==false; s++){
+                            std::vector<float>& sc = solidCrossings[s];
+                            above = sc.end()-std::lower_bound(sc.begin(), sc.end(), worldZ);
+                            inSolid = above%2==1;
+                        }
+                        if(inSolid==false){
+                            chunk.push_back(glm::vec3(x,y,z));
+                        }
+                    }
+                }
+            }
+        }
+    );
+
+    std::vector<unsigned int> offsets(chunkCount+1);
+    offsets[0] = positions.size();
+    for(unsigned int c=0; c<chunkCount; c++){
+        offsets[c+1] = offsets[c]+chunks[c].size();
+    }
+    positions.resize(offsets[chunkCount]);
+    glm::vec3* out = positions.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,chunkCount),
+        [&](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                std::copy(chunks[c].begin(), chunks[c].end(), out+offsets[c]);
+            }
+        }
+    );
+}
+
+//Sorted world space z of every surface crossing along a +z ray through column, started below
+//zmin so no crossing above it is missed
+void Scene::FindColumnCrossings(geomCore::Geom* geom, const glm::vec2& column, 
+                                const float& zmin, const float& frame, 
+                                std::vector<float>& crossings){
+    rayCore::Ray r;
+    r.m_origin = glm::vec3(column.x, column.y, zmin-1.0f);
+    r.m_frame = frame;
+    r.m_direction = glm::vec3(0,0,1);
+    spaceCore::HitListTraverseAccumulator traverser;
+    geom->Intersect(r, traverser);
+    utilityCore::GetProfiler()->AddCount(PROFILE_RAYS_CAST, 1);
+    unsigned int crossingCount = traverser.m_points.size();
+    crossings.resize(crossingCount);
+    for(unsigned int i=0; i<crossingCount; i++){
+        crossings[i] = traverser.m_points[i].z;
+    }
+    std::sort(crossings.begin(), crossings.end());
 }
 
 bool Scene::CheckPointInsideGeomByID(const glm::vec3& p, const float& frame, 
@@ -369,6 +1064,7 @@ bool Scene::CheckPointInsideGeomByID(const glm::vec3& p, const float& frame,
         unsigned int hits = 0;
         spaceCore::HitCountTraverseAccumulator traverser(p);
         m_geoms[geomID].Intersect(r, traverser);
+        utilityCore::GetProfiler()->AddCount(PROFILE_RAYS_CAST, 1);
         bool hit = false;
         if(traverser.m_intersection.m_hit==true){
             if((traverser.m_numberOfHits)%2==1){
@@ -379,8 +1075,70 @@ bool Scene::CheckPointInsideGeomByID(const glm::vec3& p, const float& frame,
     return false;
 }
 
+//The solid level set is only trusted for the frame it was built for and only if every solid went
+//into it. Level sets built from meshes carry the inside sign across their whole interior
+bool Scene::UseSolidLevelSet(const float& frame){
+    return m_solidQueryMode==SOLID_QUERY_SDF && m_solidLevelSetComplete==true && 
+           m_solidLevelSetFrame==(int)frame && m_solids.size()>0;
+}
+
+bool Scene::GetSolidDistance(const glm::vec3& p, const float& frame, float& distance){
+    if(UseSolidLevelSet(frame)==false){
+        return false;
+    }
+    int solidID;
+    distance = SampleSolidLevelSets(p, solidID);
+    return true;
+}
+
+//Min over the static solid level set and every cached solid SDF placed this frame. solidGeomID
+//is the cached solid that gave the min, -1 if it came from the static solids
+float Scene::SampleSolidLevelSets(const glm::vec3& p, int& solidGeomID){
+    float distance = REALLY_BIG_NUMBER;
+    solidGeomID = -1;
+    if(m_permaSolidLevelSetEmpty==false){
+        distance = m_permaSolidLevelSet->GetInterpolatedCell(p);
+    }
+    unsigned int solidObjectsCount = m_solidSDFCache.size();
+    for(unsigned int i=0; i<solidObjectsCount; i++){
+        if(m_solidSDFCache[i].m_active==true){
+            float d = m_solidSDFCache[i].m_levelSet->GetInterpolatedCell(p);
+            if(d<distance){
+                distance = d;
+                solidGeomID = i;
+            }
+        }
+    }
+    return distance;
+}
+
+//Interpolated distances can be off by up to about a voxel, callers pad distance tests by this
+float Scene::GetSolidDistanceTolerance(){
+    float voxelSize = 0.0f;
+    if(m_permaSolidLevelSetEmpty==false){
+        voxelSize = m_permaSolidLevelSet->GetVoxelSize();
+    }
+    for(unsigned int i=0; i<m_solidSDFCache.size(); i++){
+        if(m_solidSDFCache[i].m_active==true){
+            voxelSize = glm::max(voxelSize, m_solidSDFCache[i].m_levelSet->GetVoxelSize());
+        }
+    }
+    return 2.0f*voxelSize;
+}
+
+//In SDF query mode solidGeomID is only set for dynamic solids, static solids share one level set
 bool Scene::CheckPointInsideSolidGeom(const glm::vec3& p, const float& frame, 
                                       unsigned int& solidGeomID){
+    if(UseSolidLevelSet(frame)==true){
+        int solidID;
+        if(SampleSolidLevelSets(p, solidID)<0.0f){
+            if(solidID>=0){
+                solidGeomID = solidID;
+            }
+            return true;
+        }
+        return false;
+    }
     rayCore::Ray r;
     r.m_origin = p;
     r.m_frame = frame;
@@ -390,6 +1148,7 @@ bool Scene::CheckPointInsideSolidGeom(const glm::vec3& p, const float& frame,
         unsigned int hits = 0;
         spaceCore::HitCountTraverseAccumulator traverser(p);
         m_solids[i]->Intersect(r, traverser);
+        utilityCore::GetProfiler()->AddCount(PROFILE_RAYS_CAST, 1);
         bool hit = false;
         if(traverser.m_intersection.m_hit==true){
             if((traverser.m_numberOfHits)%2==1){
@@ -411,6 +1170,7 @@ bool Scene::CheckPointInsideLiquidGeom(const glm::vec3& p, const float& frame,
     for(unsigned int i=0; i<liquidGeomCount; i++){
         spaceCore::HitCountTraverseAccumulator traverser(p);
         m_liquids[i]->Intersect(r, traverser);
+        utilityCore::GetProfiler()->AddCount(PROFILE_RAYS_CAST, 1);
         bool hit = false;
         if(traverser.m_intersection.m_hit==true){
             if((traverser.m_numberOfHits)%2==1){
@@ -428,55 +1188,33 @@ rayCore::Intersection Scene::IntersectSolidGeoms(const rayCore::Ray& r){
     for(unsigned int i=0; i<solidGeomCount; i++){
         spaceCore::TraverseAccumulator traverser;
         m_solids[i]->Intersect(r, traverser);
+        utilityCore::GetProfiler()->AddCount(PROFILE_RAYS_CAST, 1);
         bestHit = bestHit.CompareClosestAgainst(traverser.m_intersection, r.m_origin);
     }
     return bestHit;
 }
 
-void Scene::AddLiquidParticle(const glm::vec3& pos, const glm::vec3& vel, const float& thickness, 
-                              const float& scale, const int& frame, 
-                              const unsigned int& liquidGeomID){
-    glm::vec3 worldpos = pos*scale;
-    if(CheckPointInsideGeomByID(worldpos, frame, liquidGeomID)==true){
-        //if particles are in a solid, don't generate them
-        unsigned int solidGeomID;
-        if(CheckPointInsideSolidGeom(worldpos, frame, solidGeomID)==false){
-            fluidCore::Particle* p = new fluidCore::Particle;
-            p->m_p = pos;
-            p->m_u = vel;
-            p->m_n = glm::vec3(0.0f);
-            p->m_density = 10.0f;
-            p->m_type = FLUID;
-            p->m_mass = 1.0f;
-            p->m_invalid = false;
-            m_liquidParticles.push_back(p);
-        }
-    }
-}
-
-void Scene::AddSolidParticle(const glm::vec3& pos, const float& thickness, const float& scale, 
-                             const int& frame, const unsigned int& solidGeomID){
-    glm::vec3 worldpos = pos*scale;
-    if(CheckPointInsideGeomByID(worldpos, frame, solidGeomID)==true){
-        fluidCore::Particle* p = new fluidCore::Particle;
-        p->m_p = pos;
-        p->m_u = glm::vec3(0.0f);
-        p->m_n = glm::vec3(0.0f);
-        p->m_density = 10.0f;
-        p->m_type = SOLID;
-        p->m_mass = 10.0f;
-        p->m_invalid = false;
-        if(frame==0 && m_geoms[solidGeomID].m_geom->IsDynamic()==false){
-            m_permaSolidParticles.push_back(p);
-        }else if(m_geoms[solidGeomID].m_geom->IsDynamic()==true){
-            m_solidParticles.push_back(p);
-        }else{
-            delete p;
+//Builds the union of the static and cached solid level sets on first use after a rebuild
+fluidCore::LevelSet* Scene::GetSolidLevelSet(){
+    if(m_solidLevelSetMerged==false){
+        delete m_solidLevelSet;
+        m_solidLevelSet = new fluidCore::LevelSet();
+        std::vector<fluidCore::LevelSet*> parts;
+        if(m_permaSolidLevelSetEmpty==false){
+            parts.push_back(m_permaSolidLevelSet);
+        }
+        for(unsigned int i=0; i<m_solidSDFCache.size(); i++){
+            if(m_solidSDFCache[i].m_active==true){
+                parts.push_back(m_solidSDFCache[i].m_levelSet);
+            }
         }
+        if(parts.empty()==false){
+            m_solidLevelSet->Copy(*parts[0]);
+            parts.erase(parts.begin());
+            m_solidLevelSet->MergeAll(parts);
+        }
+        m_solidLevelSetMerged = true;
     }
-}
-
-fluidCore::LevelSet* Scene::GetSolidLevelSet(){
     return m_solidLevelSet; 
 }
 
@@ -8,47 +8,142 @@
 #define SCENE_HPP
 
 #include <vector>
+#include <mutex>
+#include <condition_variable>
 #include <tbb/tbb.h>
-#include <tbb/concurrent_vector.h>
 #include "../utilities/utilities.h"
 #include "../grid/macgrid.inl"
 #include "../geom/mesh.hpp"
 #include "../grid/particlegrid.hpp"
 #include "../grid/levelset.hpp"
 #include "../spatial/bvh.hpp"
+#include "../utilities/checkpoint.hpp"
+#include "../utilities/memorytracker.hpp"
+#include "../utilities/bakecache.hpp"
+#include "meshframecache.hpp"
+
+//SOLID_QUERY_RAYCAST counts ray hits against every solid BVH, SOLID_QUERY_SDF answers inside and
+//distance queries from the solid level set when it covers every solid for the queried frame
+enum solidquerytype {SOLID_QUERY_RAYCAST=0, SOLID_QUERY_SDF=1};
+//optional Partio channels written next to position, v and id
+enum partiochannel {PARTIO_CHANNEL_DENSITY=1, PARTIO_CHANNEL_AGE=2};
 
 namespace sceneCore {
+//====================================
+// Struct Declarations
+//====================================
+
+//SDF of one dynamic solid, voxelized in the solid's local frame with only its scale applied so
+//rigid motion only moves the grid. The source mesh frame, keyframe interpolation and scale are
+//what the grid was voxelized from, a change in any of them forces a re-voxelize
+struct SolidSDFCache {
+    fluidCore::LevelSet*                        m_levelSet;
+    spaceCore::Bvh<objCore::Obj>*               m_mesh;
+    spaceCore::Bvh<objCore::InterpolatedObj>*   m_animMesh;
+    float                                       m_interpolation;
+    glm::vec3                                   m_scale;
+    bool                                        m_active; //placed for the current frame
+
+    SolidSDFCache(){
+        m_levelSet = NULL;
+        m_mesh = NULL;
+        m_animMesh = NULL;
+        m_interpolation = 0.0f;
+        m_scale = glm::vec3(0.0f);
+        m_active = false;
+    }
+};
+
+//Exportable liquid particles of one frame, copied out of the sim so the sim can keep stepping
+//while the frame is meshed and written. A snapshot carrying a checkpoint only writes that
+struct ExportSnapshot {
+    fluidCore::ParticleSet                      m_particles;
+    std::vector<unsigned int>                   m_indices;
+    //cell centers of liquid held on the sim grid, only surfaced
+    fluidCore::ParticleSet                      m_fill;
+    std::vector<unsigned int>                   m_fillIndices;
+    float                                       m_maxd;
+    int                                         m_frame;
+    bool                                        m_VDB;
+    bool                                        m_OBJ;
+    bool                                        m_PARTIO;
+    utilityCore::Checkpoint*                    m_checkpoint; //owned by the snapshot
+    std::string                                 m_checkpointPath;
+    bool                                        m_checkpointCompress;
+
+    ExportSnapshot(){
+        m_maxd = 0.0f;
+        m_frame = 0;
+        m_VDB = false;
+        m_OBJ = false;
+        m_PARTIO = false;
+        m_checkpoint = NULL;
+        m_checkpointCompress = false;
+    }
+};
+
 //====================================
 // Class Declarations
 //====================================
 
 class Scene {
     friend class SceneLoader;
+    friend class MeshFrameCache;
     public:
         Scene();
         ~Scene();
 
-        void GenerateParticles(std::vector<fluidCore::Particle*>& particles, 
+        //A new scene for one more sim of the same setup, as in a wedge. Instances share this
+        //scene's geoms, meshes, bvhs and static solid level set, which are read only once
+        //loaded, and own their emission, dynamic solid level sets and export queue. This scene
+        //must outlive its instances and isn't stepped itself. NULL when meshes are loaded
+        //lazily, since their frames are swapped in and out per frame
+        Scene* CreateInstance();
+
+        void GenerateParticles(fluidCore::ParticleSet* particles, 
                                const glm::vec3& dimensions, const float& density, 
                                fluidCore::ParticleGrid* pgrid, const int& frame);
 
         void AddExternalForce(glm::vec3 force);
+        void SetExternalForces(const std::vector<glm::vec3>& forces);
         std::vector<glm::vec3>& GetExternalForces();
 
         fluidCore::LevelSet* GetSolidLevelSet();
         fluidCore::LevelSet* GetLiquidLevelSet();
 
+        //loads the mesh frames used around frame when meshes are loaded lazily
+        void PrepareMeshFrames(const int& frame);
+
         void BuildLevelSets(const int& frame);
         void BuildLiquidGeomLevelSet(const int& frame);
         void BuildSolidGeomLevelSet(const int& frame);
+        //static solids never change, so only the first call builds anything
         void BuildPermaSolidGeomLevelSet();
 
         void SetPaths(const std::string& imagePath, const std::string& meshPath, 
                       const std::string& vdbPath, const std::string& partioPath);
+        //export names get tag before the frame number, so instances can share output paths
+        void SetExportTag(const std::string& tag);
+        //overrides the scene's mesh_format, the rest of its surfacing settings are kept
+        void SetMeshFormat(const int& format);
 
-        void ExportParticles(std::vector<fluidCore::Particle*> particles, 
+        void ExportParticles(fluidCore::ParticleSet* particles, 
                              const float& maxd, const int& frame, const bool& VDB, 
                              const bool& OBJ, const bool& PARTIO);
+        //fill holds cell centers of liquid the sim keeps on its grid, they are surfaced along
+        //with the particles but not written as particles
+        void ExportParticles(fluidCore::ParticleSet* particles, 
+                             const float& maxd, const int& frame, const bool& VDB, 
+                             const bool& OBJ, const bool& PARTIO, 
+                             const std::vector<glm::vec3>& fill);
+        void FlushExports();
+        //takes ownership of checkpoint and writes it to filename through the export queue
+        void ExportCheckpoint(utilityCore::Checkpoint* checkpoint, const std::string& filename,
+                              const bool& compress);
+
+        //emission state that has to survive a checkpoint restart
+        void AddCheckpointChunks(utilityCore::Checkpoint* checkpoint);
+        bool GetCheckpointChunks(utilityCore::Checkpoint* checkpoint);
 
         std::vector<geomCore::Geom*>& GetSolidGeoms();
         std::vector<geomCore::Geom*>& GetLiquidGeoms();
@@ -60,8 +155,21 @@ class Scene {
                                         unsigned int& liquidGeomID);
         bool CheckPointInsideGeomByID(const glm::vec3& p, const float& frame, 
                                       const unsigned int& geomID);
+        //signed distance from p to the nearest solid, false if no usable solid SDF this frame
+        bool GetSolidDistance(const glm::vec3& p, const float& frame, float& distance);
+        float GetSolidDistanceTolerance();
 
         unsigned int GetLiquidParticleCount();
+        //For narrow band FLIP. Replaces the liquid block of particles with the liquids listed in
+        //kept, in order, followed by new liquid particles at seeds with seedVelocities. The
+        //solid blocks move along behind the liquids
+        void RebandLiquidParticles(fluidCore::ParticleSet* particles, 
+                                   const std::vector<unsigned int>& kept,
+                                   const std::vector<glm::vec3>& seeds,
+                                   const std::vector<glm::vec3>& seedVelocities, 
+                                   const int& frame);
+        //reports the meshes, level sets and staging particles the scene holds right now
+        void UpdateMemoryUsage();
 
         std::string                                                 m_imagePath;
         std::string                                                 m_meshPath;
@@ -69,16 +177,35 @@ class Scene {
         std::string                                                 m_partioPath;
 
         tbb::mutex                                                  m_particleLock;
+        //held while lazily loaded mesh frames are evicted
+        tbb::mutex                                                  m_meshFrameLock;
 
     private:
-        void AddLiquidParticle(const glm::vec3& pos, const glm::vec3& vel, const float& thickness, 
-                               const float& scale, const int& frame, 
-                               const unsigned int& liquidGeomID);
-        void AddSolidParticle(const glm::vec3& pos, const float& thickness, const float& scale, 
-                              const int& frame, const unsigned int& solidGeomID);
+        void SeedGeom(geomCore::Geom* geom, const int& frame, const glm::vec3& dimensions,
+                      const float& density, const bool& excludeSolids,
+                      std::vector<glm::vec3>& positions);
+        void FindColumnCrossings(geomCore::Geom* geom, const glm::vec2& column, 
+                                 const float& zmin, const float& frame, 
+                                 std::vector<float>& crossings);
+        void EmitParticles(fluidCore::ParticleSet* set, const std::vector<glm::vec3>& positions,
+                           const glm::vec3& velocity, const int& type, const float& mass,
+                           const int& frame);
+        void BuildSolidCullMask(fluidCore::ParticleSet* particles, 
+                                const unsigned int& liquidCount, const glm::vec3& dimensions);
+        void CullSolidParticles(fluidCore::ParticleSet* set, const glm::vec3& dimensions,
+                                std::vector<unsigned int>& kept);
+        bool UseSolidLevelSet(const float& frame);
+        float SampleSolidLevelSets(const glm::vec3& p, int& solidGeomID);
+        fluidCore::LevelSet* CreateGeomLevelSet(geomCore::Geom* geom, const int& frame, 
+                                                const glm::mat4& transform);
+        fluidCore::LevelSet* UnionLevelSets(std::vector<fluidCore::LevelSet*>& levelSets);
+        bool HashStaticSolids(unsigned long long& key);
+        void QueueExport(ExportSnapshot* snapshot);
+        void WriteExport(ExportSnapshot* snapshot);
 
         fluidCore::LevelSet*                                        m_solidLevelSet;
         fluidCore::LevelSet*                                        m_permaSolidLevelSet;
+        std::vector<SolidSDFCache>                                  m_solidSDFCache; //per solid
         fluidCore::LevelSet*                                        m_liquidLevelSet;
         std::vector<glm::vec3>                                      m_externalForces;
 
@@ -91,13 +218,67 @@ class Scene {
         std::vector<geomCore::Geom*>                                m_solids;
         std::vector<geomCore::Geom*>                                m_liquids;  
         std::vector<glm::vec3>                                      m_liquidStartingVelocities;
+        MeshFrameCache                                              m_meshFrameCache;
+        //static mesh bvhs, the perma solid level set and the frame 0 perma solid particles are
+        //baked here when the scene sets a bake_cache directory
+        utilityCore::BakeCache                                      m_bakeCache;
+
+        //liquid particles emitted during the current GenerateParticles call. Once they are added
+        //to the sim's ParticleSet the set owns them
+        fluidCore::ParticleSet                                      m_liquidParticles;
+        fluidCore::ParticleSet                                      m_permaSolidParticles;
+        fluidCore::ParticleSet                                      m_solidParticles;
+        std::vector<glm::vec3>                                      m_seedPositions;
+        //solid particles further than m_solidCullBand cells from every liquid particle are
+        //left out of the sim's set, 0 keeps them all. The mask flags SOLID_CULL_BLOCK^3 cell
+        //blocks within the band and is rebuilt every frame as the liquid moves, so the band has
+        //to cover how far liquid travels in a frame plus the velocity extrapolation layers
+        int                                                         m_solidCullBand;
+        int                                                         m_solidCullBlocks[3];
+        std::vector<unsigned char>                                  m_solidCullMask;
+        std::vector<unsigned int>                                   m_keptPermaSolids;
+        std::vector<unsigned int>                                   m_keptSolids;
+        //solid tail indices moved by RebandLiquidParticles
+        std::vector<unsigned int>                                   m_rebandSolids;
+        //id handed to the next emitted liquid particle
+        unsigned int                                                m_nextLiquidID;
 
-        tbb::concurrent_vector<fluidCore::Particle*>                m_liquidParticles;
-        tbb::concurrent_vector<fluidCore::Particle*>                m_permaSolidParticles;
-        tbb::concurrent_vector<fluidCore::Particle*>                m_solidParticles;
+        utilityCore::MemoryRecord                                   m_meshMemory;
+        utilityCore::MemoryRecord                                   m_levelSetMemory;
+        utilityCore::MemoryRecord                                   m_particleMemory;
+
+        //frames waiting to export are capped at m_exportQueueDepth, ExportParticles blocks
+        //until there is room. A depth of 0 exports synchronously
+        tbb::task_arena                                             m_exportArena;
+        tbb::concurrent_bounded_queue<ExportSnapshot*>              m_exportQueue;
+        //frames handed off but not yet written, m_exportsDone fires when it drops to 0
+        int                                                         m_exportsPending;
+        std::mutex                                                  m_exportLock;
+        std::condition_variable                                     m_exportsDone;
+        int                                                         m_exportQueueDepth;
+        int                                                         m_exportThreads;
+        bool                                                        m_exportArenaReady;
+        //source indices of the particles picked by the last ExportParticles call
+        std::vector<unsigned int>                                   m_exportIndices;
+        int                                                         m_partioChannels;
+        //read by every export worker, only set while loading
+        fluidCore::SurfacingSettings                                m_surfacingSettings;
+        std::string                                                 m_exportTag;
+        //where the perma solid block currently starts in the sim's set, -1 before it is placed
+        int                                                         m_permaSolidOffset;
     
         unsigned int                                                m_liquidParticleCount;
 
+        int                                                         m_solidQueryMode;
+        int                                                         m_solidLevelSetFrame;
+        bool                                                        m_solidLevelSetComplete;
+        bool                                                        m_solidLevelSetMerged;
+        bool                                                        m_permaSolidLevelSetEmpty;
+        bool                                                        m_permaSolidLevelSetBuilt;
+        //scene this one is an instance of, the owner of everything they share. NULL for a
+        //loaded scene
+        Scene*                                                      m_source;
+
 };
 }
 
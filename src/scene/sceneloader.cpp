@@ -16,6 +16,10 @@ SceneLoader::SceneLoader(const std::string& filename){
     m_cameraLookat = 0.0f;
     m_cameraResolution = glm::vec2(1024);
     m_cameraFov = glm::vec2(45.0f);
+    m_simSettings = fluidCore::CreateSimSettings();
+    m_meshCache = false;
+    m_lazyMeshes = false;
+    m_meshMemoryBudget = 4096;
 
     //grab relative path
     std::vector<std::string> pathTokens = utilityCore::tokenizeString(filename, "/");
@@ -122,6 +126,13 @@ SceneLoader::SceneLoader(const std::string& filename){
                 LoadSim(root["sim"][j]);
             }
         }   
+        if(root.isMember("wedge")){
+            std::cout << "Loading wedge..." << std::endl;
+            unsigned int variantCount = root["wedge"].size();
+            for(unsigned int j=0; j<variantCount; j++){
+                LoadWedgeVariant(root["wedge"][j]);
+            }
+        }
     }
 
     m_s->SetPaths(m_imagePath, m_meshPath, m_vdbPath, m_partioPath);
@@ -150,6 +161,24 @@ float SceneLoader::GetStepsize(){
     return m_stepsize;
 }
 
+fluidCore::SimSettings SceneLoader::GetSimSettings(){
+    return m_simSettings;
+}
+
+std::vector<WedgeVariant>& SceneLoader::GetWedgeVariants(){
+    return m_wedgeVariants;
+}
+
+//Geometry is placed in cell units through its transforms, scaling translation and scale about
+//the origin scales every mesh, emitter and collider with the grid
+void SceneLoader::ScaleResolution(const float& factor){
+    m_dimensions = glm::max(glm::floor(m_dimensions*factor+0.5f), glm::vec3(1.0f));
+    for(unsigned int t=0; t<m_s->m_geomTransforms.size(); t++){
+        m_s->m_geomTransforms[t].m_translation *= factor;
+        m_s->m_geomTransforms[t].m_scale *= factor;
+    }
+}
+
 void SceneLoader::LoadSim(const Json::Value& jsonsim){
     std::string id = jsonsim["geom"].asString();
     unsigned int geomID = m_linkNames["geom_"+id];
@@ -271,6 +300,9 @@ void SceneLoader::LoadAnimMeshSequences(const Json::Value& jsonanimmesh){
             unsigned int frameCount = jsonanimmesh["frames"].size();
             m_animMeshSequences[nodeNumber].reserve(frameCount);
             std::cout << "Creating animmesh with " << frameCount << " frames" << std::endl;
+            //frames share topology, so only the first frame pays for a full build and the rest
+            //refit its hierarchy
+            int topologyID = -1;
             for(unsigned int i=0; i<frameCount-1; i++){
                 //grab current and next frame IDs to pass to an InterpolatedObj
                 std::string thisframelink = jsonanimmesh["frames"][i].asString();
@@ -282,7 +314,12 @@ void SceneLoader::LoadAnimMeshSequences(const Json::Value& jsonanimmesh){
                 objCore::InterpolatedObj interpObj(&m_s->m_meshFiles[thisframeID].m_basegeom,
                                                    &m_s->m_meshFiles[nextframeID].m_basegeom);
                 m_s->m_animMeshes[animMeshNodeNumber] = interpObj;
-                m_s->m_animMeshes[animMeshNodeNumber].BuildBvh(24);
+                if(m_lazyMeshes==true){
+                    m_s->m_meshFrameCache.AddAnimFrame(animMeshNodeNumber, nodeNumber, 
+                                                       thisframeID, nextframeID);
+                }else{
+                    BuildAnimMeshBvh(animMeshNodeNumber, topologyID);
+                }
                 m_s->m_animMeshes[animMeshNodeNumber].m_id = animMeshNodeNumber;
                 m_animMeshSequences[nodeNumber].push_back(&m_s->m_animMeshes[animMeshNodeNumber]);
             }
@@ -294,7 +331,12 @@ void SceneLoader::LoadAnimMeshSequences(const Json::Value& jsonanimmesh){
             objCore::InterpolatedObj interpObj(&m_s->m_meshFiles[thisframeID].m_basegeom,
                                                &m_s->m_meshFiles[thisframeID].m_basegeom);
             m_s->m_animMeshes[animMeshNodeNumber] = interpObj;
-            m_s->m_animMeshes[animMeshNodeNumber].BuildBvh(24);
+            if(m_lazyMeshes==true){
+                m_s->m_meshFrameCache.AddAnimFrame(animMeshNodeNumber, nodeNumber, thisframeID,
+                                                   thisframeID);
+            }else{
+                BuildAnimMeshBvh(animMeshNodeNumber, topologyID);
+            }
             m_s->m_animMeshes[animMeshNodeNumber].m_id = animMeshNodeNumber;
             m_animMeshSequences[nodeNumber].push_back(&m_s->m_animMeshes[animMeshNodeNumber]);
             m_linkNames["animmesh_"+id] = nodeNumber;
@@ -302,6 +344,41 @@ void SceneLoader::LoadAnimMeshSequences(const Json::Value& jsonanimmesh){
     }
 }
 
+//Reuses a hierarchy baked by an earlier run over the same mesh, otherwise builds and bakes it
+void SceneLoader::BuildMeshBvh(const unsigned int& meshID){
+    spaceCore::Bvh<objCore::Obj>& bvh = m_s->m_meshFiles[meshID];
+    unsigned int maxDepth = 24;
+    if(m_s->m_bakeCache.IsEnabled()==false){
+        bvh.BuildBvh(maxDepth);
+        return;
+    }
+    unsigned long long key = utilityCore::HashValue(bvh.m_basegeom.GetContentHash(), maxDepth);
+    key = utilityCore::HashValue(key, BAKE_CACHE_VERSION);
+    utilityCore::Checkpoint entry;
+    if(m_s->m_bakeCache.Read("bvh", key, entry)==true && bvh.GetCacheChunks(&entry)==true){
+        return;
+    }
+    bvh.BuildBvh(maxDepth);
+    entry.Clear();
+    bvh.AddCacheChunks(&entry);
+    m_s->m_bakeCache.Write("bvh", key, entry);
+}
+
+//Refits the bvh of topologyID when its mesh has the same poly count, otherwise builds a new one
+//and makes it the topology for the following frames
+void SceneLoader::BuildAnimMeshBvh(const unsigned int& animMeshID, int& topologyID){
+    spaceCore::Bvh<objCore::InterpolatedObj>& animmesh = m_s->m_animMeshes[animMeshID];
+    if(topologyID>=0){
+        spaceCore::Bvh<objCore::InterpolatedObj>& topology = m_s->m_animMeshes[topologyID];
+        if(topology.m_basegeom.GetNumberOfElements()==animmesh.m_basegeom.GetNumberOfElements()){
+            animmesh.RefitFrom(topology);
+            return;
+        }
+    }
+    animmesh.BuildBvh(24);
+    topologyID = animMeshID;
+}
+
 void SceneLoader::LoadGeomTransforms(const Json::Value& jsontransforms){
     if(jsontransforms.isMember("id")==false){
         std::cout << "Warning: Couldn't load transform node, missing ID. Skipping...\n" 
@@ -360,7 +437,13 @@ void SceneLoader::LoadMeshFiles(const Json::Value& jsonmeshfile){
             //meshfile can either point to obj file or request a mesh generator
             if(jsonmeshfile.isMember("file")==true){    
                 std::string filename = jsonmeshfile["file"].asString();
-                m_s->m_meshFiles[nodeNumber].m_basegeom.ReadObj(m_relativePath+filename);
+                if(m_lazyMeshes==true){
+                    //read and built by the scene's mesh frame cache when a frame needs it
+                    m_s->m_meshFrameCache.AddMeshFile(nodeNumber, m_relativePath+filename);
+                }else{
+                    m_s->m_meshFiles[nodeNumber].m_basegeom.ReadObj(m_relativePath+filename, 
+                                                                      m_meshCache);
+                }
             }else if(jsonmeshfile.isMember("mesh_gen")==true){
                 std::string gentype = jsonmeshfile["mesh_gen"].asString();
                 if(strcmp(gentype.c_str(), "box")==0){
@@ -389,7 +472,9 @@ void SceneLoader::LoadMeshFiles(const Json::Value& jsonmeshfile){
                                             center, radius);
                 }
             }
-            m_s->m_meshFiles[nodeNumber].BuildBvh(24);
+            if(m_lazyMeshes==false || jsonmeshfile.isMember("file")==false){
+                BuildMeshBvh(nodeNumber);
+            }
             m_linkNames["meshfile_"+id] = nodeNumber;
             m_s->m_meshFiles[nodeNumber].m_basegeom.m_id = nodeNumber;
             m_s->m_meshFiles[nodeNumber].m_id = nodeNumber;
@@ -408,6 +493,40 @@ void SceneLoader::LoadGlobalForces(const Json::Value& jsonforces){
     }
 }
 
+//Variants start from the loaded settings and global forces, so they only list what they change
+void SceneLoader::LoadWedgeVariant(const Json::Value& jsonvariant){
+    WedgeVariant variant;
+    variant.m_name = "wedge"+utilityCore::convertIntToString(m_wedgeVariants.size());
+    variant.m_threads = 0;
+    variant.m_density = m_density;
+    variant.m_simSettings = m_simSettings;
+    variant.m_externalForces = m_s->GetExternalForces();
+    if(jsonvariant.isMember("name")){
+        variant.m_name = jsonvariant["name"].asString();
+    }
+    if(jsonvariant.isMember("threads")){
+        variant.m_threads = glm::max(jsonvariant["threads"].asInt(), 0);
+    }
+    if(jsonvariant.isMember("density")){
+        variant.m_density = jsonvariant["density"].asFloat();
+    }
+    if(jsonvariant.isMember("pic_flip_ratio")){
+        variant.m_simSettings.m_picFlipRatio = jsonvariant["pic_flip_ratio"].asFloat();
+    }
+    if(jsonvariant.isMember("globalforces")){
+        const Json::Value& jsonforces = jsonvariant["globalforces"];
+        variant.m_externalForces.clear();
+        for(unsigned int i=0; i<jsonforces.size(); i++){
+            glm::vec3 force;
+            force[0] = jsonforces[i]["x"].asFloat();
+            force[1] = jsonforces[i]["y"].asFloat();
+            force[2] = jsonforces[i]["z"].asFloat();
+            variant.m_externalForces.push_back(force);
+        }
+    }
+    m_wedgeVariants.push_back(variant);
+}
+
 void SceneLoader::LoadSettings(const Json::Value& jsonsettings){
     m_density = .5f;
     m_dimensions = glm::vec3(32);
@@ -415,6 +534,7 @@ void SceneLoader::LoadSettings(const Json::Value& jsonsettings){
     m_meshPath = m_relativePath;
     m_vdbPath = m_relativePath;
     m_stepsize = 0.005f;
+    m_simSettings = fluidCore::CreateSimSettings();
 
     if(jsonsettings.isMember("density")){
         m_density = jsonsettings["density"].asFloat();
@@ -440,6 +560,223 @@ void SceneLoader::LoadSettings(const Json::Value& jsonsettings){
     if(jsonsettings.isMember("partio_output")){
         m_partioPath = jsonsettings["partio_output"].asString();
     }
+    if(jsonsettings.isMember("pic_flip_ratio")){
+        m_simSettings.m_picFlipRatio = jsonsettings["pic_flip_ratio"].asFloat();
+    }
+    if(jsonsettings.isMember("preconditioner")){
+        std::string preconditioner = jsonsettings["preconditioner"].asString();
+        if(std::strcmp(preconditioner.c_str(), "multigrid")==0){
+            m_simSettings.m_preconditioner = PRECONDITIONER_MULTIGRID;
+        }else if(std::strcmp(preconditioner.c_str(), "mic")==0){
+            m_simSettings.m_preconditioner = PRECONDITIONER_MIC;
+        }else{
+            std::cout << "Warning: unknown preconditioner " << preconditioner 
+                      << ", using mic" << std::endl;
+        }
+    }
+    if(jsonsettings.isMember("deterministic")){
+        m_simSettings.m_deterministic = jsonsettings["deterministic"].asBool();
+    }
+    if(jsonsettings.isMember("reorder_particles")){
+        m_simSettings.m_reorderParticles = jsonsettings["reorder_particles"].asBool();
+    }
+    if(jsonsettings.isMember("reorder_curve")){
+        std::string curve = jsonsettings["reorder_curve"].asString();
+        if(std::strcmp(curve.c_str(), "morton")==0){
+            m_simSettings.m_reorderCurve = REORDER_CURVE_MORTON;
+        }else if(std::strcmp(curve.c_str(), "linear")==0){
+            m_simSettings.m_reorderCurve = REORDER_CURVE_LINEAR;
+        }else{
+            std::cout << "Warning: unknown reorder curve " << curve 
+                      << ", using linear" << std::endl;
+        }
+    }
+    if(jsonsettings.isMember("reorder_interval")){
+        m_simSettings.m_reorderInterval = glm::max(jsonsettings["reorder_interval"].asInt(), 0);
+    }
+    if(jsonsettings.isMember("sparse_domain")){
+        m_simSettings.m_sparseDomain = jsonsettings["sparse_domain"].asBool();
+    }
+    if(jsonsettings.isMember("extrapolation_layers")){
+        m_simSettings.m_extrapolationLayers = jsonsettings["extrapolation_layers"].asInt();
+    }
+    if(jsonsettings.isMember("warm_start")){
+        m_simSettings.m_warmStart = jsonsettings["warm_start"].asBool();
+    }
+    if(jsonsettings.isMember("pcg_tolerance")){
+        m_simSettings.m_pcgTolerance = jsonsettings["pcg_tolerance"].asFloat();
+    }
+    if(jsonsettings.isMember("pcg_max_iterations")){
+        m_simSettings.m_pcgMaxIterations = jsonsettings["pcg_max_iterations"].asInt();
+    }
+    if(jsonsettings.isMember("solver_device")){
+        std::string device = jsonsettings["solver_device"].asString();
+        if(std::strcmp(device.c_str(), "cuda")==0){
+#if defined(ARIEL_USE_CUDA)
+            m_simSettings.m_solverDevice = SOLVER_DEVICE_CUDA;
+#else
+            std::cout << "Warning: Ariel was built without CUDA, using the cpu solver"
+                      << std::endl;
+#endif
+        }else if(std::strcmp(device.c_str(), "cpu")==0){
+            m_simSettings.m_solverDevice = SOLVER_DEVICE_CPU;
+        }else{
+            std::cout << "Warning: unknown solver device " << device 
+                      << ", using cpu" << std::endl;
+        }
+    }
+    if(jsonsettings.isMember("neighbor_lists")){
+        m_simSettings.m_neighborLists = jsonsettings["neighbor_lists"].asBool();
+    }
+    if(jsonsettings.isMember("compact_storage")){
+        m_simSettings.m_compactStorage = jsonsettings["compact_storage"].asBool();
+    }
+    if(jsonsettings.isMember("narrow_band")){
+        m_simSettings.m_narrowBand = glm::max(jsonsettings["narrow_band"].asInt(), 0);
+    }
+    if(jsonsettings.isMember("adaptive_substeps")){
+        m_simSettings.m_adaptiveSubsteps = jsonsettings["adaptive_substeps"].asBool();
+    }
+    if(jsonsettings.isMember("cfl")){
+        m_simSettings.m_cflNumber = jsonsettings["cfl"].asFloat();
+    }
+    if(jsonsettings.isMember("min_substep")){
+        m_simSettings.m_minSubstep = jsonsettings["min_substep"].asFloat();
+    }
+    if(jsonsettings.isMember("max_substep")){
+        m_simSettings.m_maxSubstep = jsonsettings["max_substep"].asFloat();
+    }
+    if(m_simSettings.m_adaptiveSubsteps==true && (m_simSettings.m_cflNumber<=0.0f || 
+       m_simSettings.m_minSubstep<=0.0f || 
+       m_simSettings.m_maxSubstep<m_simSettings.m_minSubstep)){
+        std::cout << "Warning: substeps need a positive cfl and 0 < min_substep <= max_substep,"
+                  << " using one substep per frame" << std::endl;
+        m_simSettings.m_adaptiveSubsteps = false;
+    }
+    if(jsonsettings.isMember("export_queue_depth")){
+        m_s->m_exportQueueDepth = jsonsettings["export_queue_depth"].asInt();
+    }
+    if(jsonsettings.isMember("export_threads")){
+        m_s->m_exportThreads = jsonsettings["export_threads"].asInt();
+    }
+    if(jsonsettings.isMember("partio_channels")){
+        const Json::Value& channels = jsonsettings["partio_channels"];
+        m_s->m_partioChannels = 0;
+        for(unsigned int c=0; c<channels.size(); c++){
+            std::string channel = channels[c].asString();
+            if(std::strcmp(channel.c_str(), "density")==0){
+                m_s->m_partioChannels |= PARTIO_CHANNEL_DENSITY;
+            }else if(std::strcmp(channel.c_str(), "age")==0){
+                m_s->m_partioChannels |= PARTIO_CHANNEL_AGE;
+            }else{
+                std::cout << "Warning: unknown partio channel " << channel << std::endl;
+            }
+        }
+    }
+    if(jsonsettings.isMember("solid_cull_band")){
+        m_s->m_solidCullBand = glm::max(jsonsettings["solid_cull_band"].asInt(), 0);
+    }
+    if(jsonsettings.isMember("surfacing")){
+        const Json::Value& surfacing = jsonsettings["surfacing"];
+        fluidCore::SurfacingSettings& settings = m_s->m_surfacingSettings;
+        if(surfacing.isMember("voxel_size")){
+            settings.m_voxelSize = surfacing["voxel_size"].asFloat();
+        }
+        if(surfacing.isMember("half_band")){
+            settings.m_halfBandWidth = surfacing["half_band"].asFloat();
+        }
+        if(surfacing.isMember("raster")){
+            std::string raster = surfacing["raster"].asString();
+            if(std::strcmp(raster.c_str(), "trails")==0){
+                settings.m_raster = SURFACING_RASTER_TRAILS;
+            }else if(std::strcmp(raster.c_str(), "spheres")==0){
+                settings.m_raster = SURFACING_RASTER_SPHERES;
+            }else{
+                std::cout << "Warning: unknown surfacing raster " << raster 
+                          << ", using trails" << std::endl;
+            }
+        }
+        if(surfacing.isMember("particle_radius")){
+            settings.m_particleRadius = surfacing["particle_radius"].asFloat();
+        }
+        if(surfacing.isMember("min_radius")){
+            settings.m_minRadius = surfacing["min_radius"].asFloat();
+        }
+        if(surfacing.isMember("adaptivity")){
+            settings.m_adaptivity = glm::clamp(surfacing["adaptivity"].asFloat(), 0.0f, 1.0f);
+        }
+        if(surfacing.isMember("grain_size")){
+            settings.m_grainSize = glm::max(surfacing["grain_size"].asInt(), 0);
+        }
+        if(surfacing.isMember("mesh_format")){
+            std::string format = surfacing["mesh_format"].asString();
+            if(std::strcmp(format.c_str(), "obj")==0){
+                settings.m_meshFormat = MESH_FORMAT_OBJ;
+            }else if(std::strcmp(format.c_str(), "ply")==0){
+                settings.m_meshFormat = MESH_FORMAT_PLY;
+            }else{
+                std::cout << "Warning: unknown mesh format " << format 
+                          << ", using obj" << std::endl;
+            }
+        }
+        if(settings.m_voxelSize<=0.0f || settings.m_halfBandWidth<=0.0f || 
+           settings.m_particleRadius<=0.0f){
+            std::cout << "Warning: surfacing needs a positive voxel_size, half_band and"
+                      << " particle_radius, using the defaults" << std::endl;
+            fluidCore::SurfacingSettings defaults = fluidCore::CreateSurfacingSettings();
+            settings.m_voxelSize = defaults.m_voxelSize;
+            settings.m_halfBandWidth = defaults.m_halfBandWidth;
+            settings.m_particleRadius = defaults.m_particleRadius;
+        }
+    }
+    if(jsonsettings.isMember("mesh_cache")){
+        m_meshCache = jsonsettings["mesh_cache"].asBool();
+    }
+    if(jsonsettings.isMember("bake_cache")){
+        m_s->m_bakeCache.SetDirectory(jsonsettings["bake_cache"].asString());
+    }
+    if(jsonsettings.isMember("lazy_meshes")){
+        m_lazyMeshes = jsonsettings["lazy_meshes"].asBool();
+    }
+    if(jsonsettings.isMember("mesh_memory_budget")){
+        m_meshMemoryBudget = glm::max(jsonsettings["mesh_memory_budget"].asInt(), 0);
+    }
+    if(jsonsettings.isMember("solid_query")){
+        std::string query = jsonsettings["solid_query"].asString();
+        if(std::strcmp(query.c_str(), "sdf")==0){
+            m_s->m_solidQueryMode = SOLID_QUERY_SDF;
+        }else if(std::strcmp(query.c_str(), "raycast")==0){
+            m_s->m_solidQueryMode = SOLID_QUERY_RAYCAST;
+        }else{
+            std::cout << "Warning: unknown solid query mode " << query << ", using raycast" 
+                      << std::endl;
+        }
+    }
+    if(jsonsettings.isMember("p2g")){
+        std::string p2g = jsonsettings["p2g"].asString();
+        if(std::strcmp(p2g.c_str(), "scatter")==0){
+            m_simSettings.m_p2gMode = P2G_SCATTER;
+        }else if(std::strcmp(p2g.c_str(), "gather")==0){
+            m_simSettings.m_p2gMode = P2G_GATHER;
+        }else{
+            std::cout << "Warning: unknown p2g mode " << p2g << ", using gather" << std::endl;
+        }
+    }
+    if(jsonsettings.isMember("p2g_kernel")){
+        std::string kernel = jsonsettings["p2g_kernel"].asString();
+        if(std::strcmp(kernel.c_str(), "sharpen")==0){
+            m_simSettings.m_p2gKernel = P2G_KERNEL_SHARPEN;
+        }else if(std::strcmp(kernel.c_str(), "linear")==0){
+            m_simSettings.m_p2gKernel = P2G_KERNEL_LINEAR;
+        }else if(std::strcmp(kernel.c_str(), "quadratic")==0){
+            m_simSettings.m_p2gKernel = P2G_KERNEL_QUADRATIC;
+        }else{
+            std::cout << "Warning: unknown p2g kernel " << kernel << ", using sharpen" 
+                      << std::endl;
+        }
+    }
+    unsigned long long budget = (unsigned long long)m_meshMemoryBudget*1024*1024;
+    m_s->m_meshFrameCache.Configure(m_lazyMeshes, budget, m_meshCache);
 }
 
 void SceneLoader::LoadCamera(const Json::Value& jsoncamera){
@@ -11,8 +11,22 @@
 #include "../utilities/utilities.h"
 #include "../geom/geomlist.hpp"
 #include "scene.hpp"
+#include "../sim/simsettings.inl"
 
 namespace sceneCore {
+//====================================
+// Struct Declarations
+//====================================
+
+//One sim of an in-process wedge and what it overrides of the scene's settings
+struct WedgeVariant {
+    std::string                                 m_name; //tags the variant's export names
+    int                                         m_threads; //arena quota, 0 for an even share
+    float                                       m_density;
+    fluidCore::SimSettings                      m_simSettings;
+    std::vector<glm::vec3>                      m_externalForces;
+};
+
 //====================================
 // Class Declarations
 //====================================
@@ -26,6 +40,12 @@ class SceneLoader {
         float GetDensity();
         glm::vec3 GetDimensions();
         float GetStepsize();
+        fluidCore::SimSettings GetSimSettings();
+        //the scene's "wedge" entries, empty without one
+        std::vector<WedgeVariant>& GetWedgeVariants();
+        //Multiplies the grid resolution and every geom transform by factor, so the scene keeps
+        //its layout at factor times the cells along each axis
+        void ScaleResolution(const float& factor);
 
         glm::vec3       m_cameraRotate;
         glm::vec3       m_cameraTranslate;
@@ -41,19 +61,27 @@ class SceneLoader {
         void LoadGeomTransforms(const Json::Value& jsontransforms);
         void LoadMeshFiles(const Json::Value& jsonmeshfiles);
         void LoadAnimMeshSequences(const Json::Value& jsonanimmesh);
+        void BuildAnimMeshBvh(const unsigned int& animMeshID, int& topologyID);
+        void BuildMeshBvh(const unsigned int& meshID);
         void LoadGeom(const Json::Value& jsongeom);
         void LoadSim(const Json::Value& jsonsim);
+        void LoadWedgeVariant(const Json::Value& jsonvariant);
 
         Scene*                                  m_s;
         glm::vec3                               m_dimensions;
         float                                   m_density;
         float                                   m_stepsize;
+        fluidCore::SimSettings                  m_simSettings;
+        bool                                    m_meshCache; //read and write .objcache sidecars
+        bool                                    m_lazyMeshes; //load obj frames on demand
+        int                                     m_meshMemoryBudget; //MB of lazily loaded meshes
         std::string                             m_relativePath;
         std::string                             m_imagePath;
         std::string                             m_meshPath;
         std::string                             m_vdbPath;
         std::string                             m_partioPath;
         std::vector<glm::vec3>                  m_externalForces;
+        std::vector<WedgeVariant>               m_wedgeVariants;
         
         std::map<std::string, unsigned int>                         m_linkNames;
         std::vector< std::vector< 
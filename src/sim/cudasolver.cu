@@ -0,0 +1,702 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: cudasolver.cu
+// Implements cudasolver.hpp
+
+#include <iostream>
+#include <cmath>
+#include <cuda_runtime.h>
+#include "cudasolver.hpp"
+
+//cells per tile side, matches GRID_BRICK_SIZE in grid.hpp
+#define CUDA_TILE_SHIFT 3
+#define CUDA_TILE_SIZE 8
+//local diagonals in a tile, i+j+k runs from 0 to 3*(CUDA_TILE_SIZE-1)
+#define CUDA_TILE_DIAGONALS 22
+
+//threads per block, one per cell of a tile. The reductions assume a power of two
+#define CUDA_SOLVER_BLOCK_SIZE 512
+//threads per block in the sweeps, one per column of a tile
+#define CUDA_SWEEP_BLOCK_SIZE 64
+
+namespace fluidCore {
+
+//these match geomtype in macgrid.inl, which isn't included here to keep the grid headers away
+//from nvcc
+#define CUDA_AIR 0
+#define CUDA_FLUID 1
+#define CUDA_SOLID 2
+
+static bool CheckCuda(const cudaError_t& error, const char* what){
+    if(error!=cudaSuccess){
+        std::cout << "Warning: CUDA " << what << " failed: " << cudaGetErrorString(error)
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//====================================
+// Device Helpers
+//====================================
+
+__device__ bool OutOfBounds(const CudaGridShape& s, const int& i, const int& j, const int& k){
+    return i<0 || i>s.m_x-1 || j<0 || j>s.m_y-1 || k<0 || k>s.m_z-1;
+}
+
+__device__ unsigned int Index(const CudaGridShape& s, const int& i, const int& j, const int& k){
+    return i*s.m_strideX + j*s.m_strideY + k;
+}
+
+//Lowest cell of the block's tile in tiles
+__device__ void GetTileOrigin(const CudaGridShape& s, const unsigned int* tiles, int& i, int& j,
+                              int& k){
+    unsigned int tile = tiles[blockIdx.x];
+    i = (tile/(s.m_tiles[1]*s.m_tiles[2]))<<CUDA_TILE_SHIFT;
+    j = ((tile/s.m_tiles[2])%s.m_tiles[1])<<CUDA_TILE_SHIFT;
+    k = (tile%s.m_tiles[2])<<CUDA_TILE_SHIFT;
+}
+
+//The thread's cell in the block's tile, false past the grid edge in partial edge tiles
+__device__ bool GetTileCell(const CudaGridShape& s, const unsigned int* tiles, int& i, int& j,
+                            int& k, unsigned int& c){
+    GetTileOrigin(s,tiles,i,j,k);
+    i += threadIdx.x>>(2*CUDA_TILE_SHIFT);
+    j += (threadIdx.x>>CUDA_TILE_SHIFT)&(CUDA_TILE_SIZE-1);
+    k += threadIdx.x&(CUDA_TILE_SIZE-1);
+    c = Index(s,i,j,k);
+    return i<s.m_x && j<s.m_y && k<s.m_z;
+}
+
+//Same as ARef in solver.inl
+__device__ float ARef(const unsigned char* A, const CudaGridShape& s, int i, int j, int k, int qi,
+                      int qj, int qk){
+    if(OutOfBounds(s,i,j,k) || A[Index(s,i,j,k)]!=CUDA_FLUID){
+        return 0.0f;
+    }
+    if(OutOfBounds(s,qi,qj,qk) || A[Index(s,qi,qj,qk)]!=CUDA_FLUID){
+        return 0.0f;
+    }
+    return -1.0f;
+}
+
+//Same as PRef in solver.inl, including its test of the value against FLUID
+__device__ float PRef(const float* p, const CudaGridShape& s, int i, int j, int k){
+    if(OutOfBounds(s,i,j,k) || p[Index(s,i,j,k)]!=(float)CUDA_FLUID){
+        return 0.0f;
+    }
+    return p[Index(s,i,j,k)];
+}
+
+//Same as ADiag in solver.inl
+__device__ float ADiag(const unsigned char* A, const float* L, const CudaGridShape& s, int i, int j,
+                       int k, int subcell){
+    float diag = 6.0f;
+    unsigned int c = Index(s,i,j,k);
+    if(A[c]!=CUDA_FLUID){
+        return diag;
+    }
+    int q[][3] = { {i-1,j,k}, {i+1,j,k}, {i,j-1,k}, {i,j+1,k}, {i,j,k-1}, {i,j,k+1} };
+    for(int m=0; m<6; m++){
+        int qi = q[m][0]; int qj = q[m][1]; int qk = q[m][2];
+        if(OutOfBounds(s,qi,qj,qk) || A[Index(s,qi,qj,qk)]==CUDA_SOLID){
+            diag -= 1.0f;
+        }else if(A[Index(s,qi,qj,qk)]==CUDA_AIR && subcell){
+            diag -= L[Index(s,qi,qj,qk)]/fminf(1.0e-6f,L[c]);
+        }
+    }
+    return diag;
+}
+
+//Same as XRef in solver.inl
+__device__ float XRef(const unsigned char* A, const float* L, const float* X,
+                      const CudaGridShape& s, int fi, int fj, int fk, int pi, int pj, int pk,
+                      int subcell){
+    int i = min(max(0,pi),s.m_x-1);
+    int j = min(max(0,pj),s.m_y-1);
+    int k = min(max(0,pk),s.m_z-1);
+    unsigned int c = Index(s,i,j,k);
+    unsigned int f = Index(s,fi,fj,fk);
+    if(A[c]==CUDA_FLUID){
+        return X[c];
+    }else if(A[c]==CUDA_SOLID){
+        return X[f];
+    }
+    if(subcell){
+        return L[c]/fminf(1.0e-6f,L[f])*X[f];
+    }
+    return 0.0f;
+}
+
+//Sums value over the block into partials[blockIdx.x] with a fixed order tree
+__device__ void BlockSum(double value, double* partials){
+    __shared__ double sums[CUDA_SOLVER_BLOCK_SIZE];
+    sums[threadIdx.x] = value;
+    __syncthreads();
+    for(unsigned int stride=blockDim.x/2; stride>0; stride>>=1){
+        if(threadIdx.x<stride){
+            sums[threadIdx.x] += sums[threadIdx.x+stride];
+        }
+        __syncthreads();
+    }
+    if(threadIdx.x==0){
+        partials[blockIdx.x] = sums[0];
+    }
+}
+
+//====================================
+// Kernels
+//====================================
+
+__global__ void SumPartialsKernel(const double* partials, unsigned int count, double* result){
+    double sum = 0.0;
+    for(unsigned int b=threadIdx.x; b<count; b+=blockDim.x){
+        sum += partials[b];
+    }
+    BlockSum(sum, result);
+}
+
+//zeroes pressure the warm start can't keep
+__global__ void PrepareKernel(const unsigned char* A, float* P, CudaGridShape s,
+                              const unsigned int* tiles, bool warmStart){
+    int i; int j; int k; unsigned int c;
+    if(GetTileCell(s,tiles,i,j,k,c)==false){
+        return;
+    }
+    if(warmStart==false || A[c]!=CUDA_FLUID){
+        P[c] = 0.0f;
+    }
+}
+
+// target = AX, partials gets the blocks' target . X when it isn't NULL
+__global__ void ComputeAxKernel(const unsigned char* A, const float* L, const float* X,
+                                float* target, CudaGridShape s, const unsigned int* tiles,
+                                int subcell, float h, double* partials){
+    int i; int j; int k; unsigned int c;
+    double sum = 0.0;
+    if(GetTileCell(s,tiles,i,j,k,c)==true){
+        if(A[c]==CUDA_FLUID){
+            float result = (6.0f*X[c]
+                            -XRef(A,L,X,s,i,j,k,i+1,j,k,subcell)
+                            -XRef(A,L,X,s,i,j,k,i-1,j,k,subcell)
+                            -XRef(A,L,X,s,i,j,k,i,j+1,k,subcell)
+                            -XRef(A,L,X,s,i,j,k,i,j-1,k,subcell)
+                            -XRef(A,L,X,s,i,j,k,i,j,k+1,subcell)
+                            -XRef(A,L,X,s,i,j,k,i,j,k-1,subcell)
+                            )/h;
+            target[c] = result;
+            sum = result * X[c];
+        }else{
+            target[c] = 0.0f;
+        }
+    }
+    if(partials!=NULL){
+        BlockSum(sum, partials);
+    }
+}
+
+// target = X + alpha*Y
+__global__ void OpKernel(const unsigned char* A, const float* X, const float* Y, float* target,
+                         float alpha, CudaGridShape s, const unsigned int* tiles){
+    int i; int j; int k; unsigned int c;
+    if(GetTileCell(s,tiles,i,j,k,c)==false){
+        return;
+    }
+    target[c] = (A[c]==CUDA_FLUID) ? X[c]+alpha*Y[c] : 0.0f;
+}
+
+// X . Y over fluid cells, or the fluid cell count when X is NULL
+__global__ void ProductKernel(const unsigned char* A, const float* X, const float* Y,
+                              CudaGridShape s, const unsigned int* tiles, double* partials){
+    int i; int j; int k; unsigned int c;
+    double sum = 0.0;
+    if(GetTileCell(s,tiles,i,j,k,c)==true){
+        if(A[c]==CUDA_FLUID){
+            sum = (X!=NULL) ? (double)(X[c] * Y[c]) : 1.0;
+        }
+    }
+    BlockSum(sum, partials);
+}
+
+// X = X + alpha*S and R = R - alpha*Z, partials gets the blocks' R . R
+__global__ void UpdateKernel(const unsigned char* A, float* X, float* R, const float* S,
+                             const float* Z, float alpha, CudaGridShape s,
+                             const unsigned int* tiles, double* partials){
+    int i; int j; int k; unsigned int c;
+    double sum = 0.0;
+    if(GetTileCell(s,tiles,i,j,k,c)==true){
+        if(A[c]==CUDA_FLUID){
+            X[c] = X[c] + alpha*S[c];
+            R[c] = R[c] - alpha*Z[c];
+            sum = R[c] * R[c];
+        }else{
+            X[c] = 0.0f;
+            R[c] = 0.0f;
+        }
+    }
+    BlockSum(sum, partials);
+}
+
+//Packed tiles hold CUDA_SOLVER_BLOCK_SIZE cells each, in the order GetTileCell hands them to
+//threads. Slots past the grid edge in partial edge tiles are never read
+template <typename T> __global__ void ScatterTilesKernel(const T* packed, T* grid,
+                                                         CudaGridShape s,
+                                                         const unsigned int* tiles){
+    int i; int j; int k; unsigned int c;
+    if(GetTileCell(s,tiles,i,j,k,c)==true){
+        grid[c] = packed[blockIdx.x*CUDA_SOLVER_BLOCK_SIZE+threadIdx.x];
+    }
+}
+
+template <typename T> __global__ void GatherTilesKernel(const T* grid, T* packed, CudaGridShape s,
+                                                        const unsigned int* tiles){
+    int i; int j; int k; unsigned int c;
+    if(GetTileCell(s,tiles,i,j,k,c)==true){
+        packed[blockIdx.x*CUDA_SOLVER_BLOCK_SIZE+threadIdx.x] = grid[c];
+    }
+}
+
+//zeroes the resident pressure in tiles that dropped out, as ClearReleasedTiles does on the host
+__global__ void ClearTilesKernel(float* P, CudaGridShape s, const unsigned int* tiles){
+    int i; int j; int k; unsigned int c;
+    if(GetTileCell(s,tiles,i,j,k,c)==true){
+        P[c] = 0.0f;
+    }
+}
+
+//The preconditioner build and both triangular solves only read neighbors one step back (or
+//forward) along each axis. Those neighbors lie in the same tile on the previous local diagonal
+//or in a tile on the previous tile wavefront, see BuildWavefronts in tilemask.inl. One launch
+//per wavefront runs a block per tile, and each block walks its tile's local diagonals with a
+//barrier in between, which gives the same result as the serial sweep. Threads cover the tile's
+//x*y columns and pick the column's cell on the diagonal, if it has one
+__device__ bool GetSweepCell(const CudaGridShape& s, const unsigned int* tiles,
+                             const int& diagonal, int& i, int& j, int& k){
+    GetTileOrigin(s,tiles,i,j,k);
+    int ti = threadIdx.x>>CUDA_TILE_SHIFT;
+    int tj = threadIdx.x&(CUDA_TILE_SIZE-1);
+    int tk = diagonal-ti-tj;
+    i += ti;
+    j += tj;
+    k += tk;
+    return tk>=0 && tk<CUDA_TILE_SIZE && i<s.m_x && j<s.m_y && k<s.m_z;
+}
+
+__device__ void BuildPreconditionerCell(const unsigned char* A, const float* L, float* pc,
+                                        const CudaGridShape& s, int subcell, int i, int j, int k){
+    if(A[Index(s,i,j,k)]!=CUDA_FLUID){
+        return;
+    }
+    float a = 0.25f;
+    float left = ARef(A,s,i-1,j,k,i,j,k) * PRef(pc,s,i-1,j,k);
+    float bottom = ARef(A,s,i,j-1,k,i,j,k) * PRef(pc,s,i,j-1,k);
+    float back = ARef(A,s,i,j,k-1,i,j,k) * PRef(pc,s,i,j,k-1);
+    float diag = ADiag(A,L,s,i,j,k,subcell);
+    float e = diag - (left*left) - (bottom*bottom) - (back*back);
+    if(diag>0){
+        if(e < a*diag){
+            e = diag;
+        }
+        pc[Index(s,i,j,k)] = 1.0f/sqrtf(e);
+    }
+}
+
+// LQ = R
+__device__ void ForwardSolveCell(const unsigned char* A, const float* P, const float* R, float* Q,
+                                 const CudaGridShape& s, int i, int j, int k){
+    if(A[Index(s,i,j,k)]!=CUDA_FLUID){
+        return;
+    }
+    float left = ARef(A,s,i-1,j,k,i,j,k) * PRef(P,s,i-1,j,k) * PRef(Q,s,i-1,j,k);
+    float bottom = ARef(A,s,i,j-1,k,i,j,k) * PRef(P,s,i,j-1,k) * PRef(Q,s,i,j-1,k);
+    float back = ARef(A,s,i,j,k-1,i,j,k) * PRef(P,s,i,j,k-1) * PRef(Q,s,i,j,k-1);
+    unsigned int c = Index(s,i,j,k);
+    float t = R[c] - left - bottom - back;
+    Q[c] = t * P[c];
+}
+
+// L^T Z = Q
+__device__ void BackwardSolveCell(const unsigned char* A, const float* P, const float* Q,
+                                  float* Z, const CudaGridShape& s, int i, int j, int k){
+    if(A[Index(s,i,j,k)]!=CUDA_FLUID){
+        return;
+    }
+    float right = ARef(A,s,i,j,k,i+1,j,k) * PRef(P,s,i,j,k) * PRef(Z,s,i+1,j,k);
+    float top = ARef(A,s,i,j,k,i,j+1,k) * PRef(P,s,i,j,k) * PRef(Z,s,i,j+1,k);
+    float front = ARef(A,s,i,j,k,i,j,k+1) * PRef(P,s,i,j,k) * PRef(Z,s,i,j,k+1);
+    unsigned int c = Index(s,i,j,k);
+    float t = Q[c] - right - top - front;
+    Z[c] = t * P[c];
+}
+
+__global__ void BuildPreconditionerKernel(const unsigned char* A, const float* L, float* pc,
+                                          CudaGridShape s, const unsigned int* tiles,
+                                          int subcell){
+    for(int d=0; d<CUDA_TILE_DIAGONALS; d++){
+        int i; int j; int k;
+        if(GetSweepCell(s,tiles,d,i,j,k)==true){
+            BuildPreconditionerCell(A,L,pc,s,subcell,i,j,k);
+        }
+        __syncthreads();
+    }
+}
+
+__global__ void ForwardSolveKernel(const unsigned char* A, const float* P, const float* R, float* Q,
+                                   CudaGridShape s, const unsigned int* tiles){
+    for(int d=0; d<CUDA_TILE_DIAGONALS; d++){
+        int i; int j; int k;
+        if(GetSweepCell(s,tiles,d,i,j,k)==true){
+            ForwardSolveCell(A,P,R,Q,s,i,j,k);
+        }
+        __syncthreads();
+    }
+}
+
+__global__ void BackwardSolveKernel(const unsigned char* A, const float* P, const float* Q,
+                                    float* Z, CudaGridShape s, const unsigned int* tiles){
+    for(int d=CUDA_TILE_DIAGONALS-1; d>=0; d--){
+        int i; int j; int k;
+        if(GetSweepCell(s,tiles,d,i,j,k)==true){
+            BackwardSolveCell(A,P,Q,Z,s,i,j,k);
+        }
+        __syncthreads();
+    }
+}
+
+//====================================
+// Host Helpers
+//====================================
+
+//Calls fn(cell, slot) for every grid cell of the listed tiles, slot indexes the packed tiles
+template <typename F> static void ForEachTileCell(const CudaGridShape& s,
+                                                  const unsigned int* tiles,
+                                                  const unsigned int& count, const F& fn){
+    for(unsigned int t=0; t<count; t++){
+        unsigned int tile = tiles[t];
+        int lo[3] = { (int)(tile/(s.m_tiles[1]*s.m_tiles[2]))<<CUDA_TILE_SHIFT,
+                      (int)((tile/s.m_tiles[2])%s.m_tiles[1])<<CUDA_TILE_SHIFT,
+                      (int)(tile%s.m_tiles[2])<<CUDA_TILE_SHIFT };
+        int hi[3] = { min(lo[0]+CUDA_TILE_SIZE, s.m_x), min(lo[1]+CUDA_TILE_SIZE, s.m_y),
+                      min(lo[2]+CUDA_TILE_SIZE, s.m_z) };
+        for(int i=lo[0]; i<hi[0]; i++){
+            for(int j=lo[1]; j<hi[1]; j++){
+                unsigned int row = i*s.m_strideX + j*s.m_strideY;
+                unsigned int slot = t*CUDA_SOLVER_BLOCK_SIZE + 
+                                    ((i-lo[0])<<(2*CUDA_TILE_SHIFT)) + 
+                                    ((j-lo[1])<<CUDA_TILE_SHIFT);
+                for(int k=lo[2]; k<hi[2]; k++){
+                    fn(row+k, slot+(k-lo[2]));
+                }
+            }
+        }
+    }
+}
+
+//====================================
+// CudaSolver Class
+//====================================
+
+CudaSolver::CudaSolver(){
+    m_shape.m_x = 0; m_shape.m_y = 0; m_shape.m_z = 0;
+    m_shape.m_strideX = 0; m_shape.m_strideY = 0; m_shape.m_cells = 0;
+    m_tileCount = 0;
+    m_pressureResident = false;
+    m_activeTiles = NULL;
+    m_wavefrontTiles = NULL;
+    m_releasedTiles = NULL;
+    m_hostStage = NULL;
+    m_deviceStage = NULL;
+    m_A = NULL;
+    m_L = NULL;
+    m_D = NULL;
+    m_P = NULL;
+    m_PC = NULL;
+    m_R = NULL;
+    m_Z = NULL;
+    m_S = NULL;
+    m_Q = NULL;
+    m_partials = NULL;
+    m_result = NULL;
+}
+
+CudaSolver::~CudaSolver(){
+    Release();
+}
+
+bool CudaSolver::IsAvailable(){
+    int count = 0;
+    return cudaGetDeviceCount(&count)==cudaSuccess && count>0;
+}
+
+void CudaSolver::Release(){
+    cudaFree(m_A);
+    cudaFree(m_L);
+    cudaFree(m_D);
+    cudaFree(m_P);
+    cudaFree(m_PC);
+    cudaFree(m_R);
+    cudaFree(m_Z);
+    cudaFree(m_S);
+    cudaFree(m_Q);
+    cudaFree(m_partials);
+    cudaFree(m_result);
+    cudaFree(m_activeTiles);
+    cudaFree(m_wavefrontTiles);
+    cudaFree(m_releasedTiles);
+    cudaFree(m_deviceStage);
+    cudaFreeHost(m_hostStage);
+    m_A = NULL;
+    m_L = NULL;
+    m_D = NULL;
+    m_P = NULL;
+    m_PC = NULL;
+    m_R = NULL;
+    m_Z = NULL;
+    m_S = NULL;
+    m_Q = NULL;
+    m_partials = NULL;
+    m_result = NULL;
+    m_activeTiles = NULL;
+    m_wavefrontTiles = NULL;
+    m_releasedTiles = NULL;
+    m_deviceStage = NULL;
+    m_hostStage = NULL;
+    m_pressureResident = false;
+    m_shape.m_cells = 0;
+}
+
+//Everything is sized for the whole grid up front, so nothing is reallocated as the active set
+//grows and shrinks
+bool CudaSolver::Allocate(const CudaGridShape& shape){
+    if(m_A!=NULL && shape.m_x==m_shape.m_x && shape.m_y==m_shape.m_y &&
+       shape.m_z==m_shape.m_z && shape.m_strideX==m_shape.m_strideX &&
+       shape.m_strideY==m_shape.m_strideY && shape.m_cells==m_shape.m_cells){
+        return true;
+    }
+    Release();
+    m_shape = shape;
+    size_t floatBytes = (size_t)shape.m_cells*sizeof(float);
+    size_t tiles = (size_t)shape.m_tiles[0]*shape.m_tiles[1]*shape.m_tiles[2];
+    size_t stageBytes = tiles*CUDA_SOLVER_BLOCK_SIZE*sizeof(float);
+    bool ok = CheckCuda(cudaMalloc((void**)&m_A, (size_t)shape.m_cells*sizeof(unsigned char)),
+                        "malloc");
+    float** grids[] = { &m_L, &m_D, &m_P, &m_PC, &m_R, &m_Z, &m_S, &m_Q };
+    for(unsigned int g=0; g<sizeof(grids)/sizeof(grids[0]) && ok; g++){
+        ok = CheckCuda(cudaMalloc((void**)grids[g], floatBytes), "malloc");
+    }
+    unsigned int** lists[] = { &m_activeTiles, &m_wavefrontTiles, &m_releasedTiles };
+    for(unsigned int l=0; l<sizeof(lists)/sizeof(lists[0]) && ok; l++){
+        ok = CheckCuda(cudaMalloc((void**)lists[l], tiles*sizeof(unsigned int)), "malloc");
+    }
+    ok = ok && CheckCuda(cudaMalloc((void**)&m_partials, tiles*sizeof(double)), "malloc");
+    ok = ok && CheckCuda(cudaMalloc((void**)&m_result, sizeof(double)), "malloc");
+    ok = ok && CheckCuda(cudaMalloc((void**)&m_deviceStage, stageBytes), "malloc");
+    ok = ok && CheckCuda(cudaMallocHost((void**)&m_hostStage, stageBytes), "pinned malloc");
+    //cells outside the active tiles start out as the host's cleared grids do
+    ok = ok && CheckCuda(cudaMemset(m_A, 0, (size_t)shape.m_cells*sizeof(unsigned char)),
+                         "memset");
+    ok = ok && CheckCuda(cudaMemset(m_L, 0, floatBytes), "memset");
+    ok = ok && CheckCuda(cudaMemset(m_D, 0, floatBytes), "memset");
+    ok = ok && CheckCuda(cudaMemset(m_P, 0, floatBytes), "memset");
+    if(ok==false){
+        Release();
+    }
+    return ok;
+}
+
+//Also zeroes the resident pressure in the tiles the host just released
+bool CudaSolver::UploadTileLists(const CudaTileList& tiles){
+    m_tileCount = tiles.m_activeCount;
+    m_wavefrontStart.assign(tiles.m_wavefrontStart, 
+                            tiles.m_wavefrontStart+tiles.m_wavefronts+1);
+    size_t tileBytes = (size_t)m_tileCount*sizeof(unsigned int);
+    bool ok = CheckCuda(cudaMemcpy(m_activeTiles, tiles.m_activeTiles, tileBytes,
+                                   cudaMemcpyHostToDevice), "upload");
+    ok = ok && CheckCuda(cudaMemcpy(m_wavefrontTiles, tiles.m_wavefrontTiles, tileBytes,
+                                    cudaMemcpyHostToDevice), "upload");
+    if(ok==true && m_pressureResident==true && tiles.m_releasedCount>0){
+        ok = CheckCuda(cudaMemcpy(m_releasedTiles, tiles.m_releasedTiles,
+                                  (size_t)tiles.m_releasedCount*sizeof(unsigned int),
+                                  cudaMemcpyHostToDevice), "upload");
+        ClearTilesKernel<<<tiles.m_releasedCount, CUDA_SOLVER_BLOCK_SIZE>>>(m_P, m_shape,
+                                                                            m_releasedTiles);
+    }
+    return ok;
+}
+
+//Both stage buffers are reused by every transfer. cudaMemcpy from pinned memory returns once the
+//copy is done and runs after earlier kernels in the stream, so no transfer can overtake another
+template <typename T> bool CudaSolver::UploadTiles(const CudaTileList& tiles, const T* grid,
+                                                   T* target){
+    T* stage = (T*)m_hostStage;
+    ForEachTileCell(m_shape, tiles.m_activeTiles, m_tileCount,
+        [=](const unsigned int& cell, const unsigned int& slot){
+            stage[slot] = grid[cell];
+        }
+    );
+    size_t bytes = (size_t)m_tileCount*CUDA_SOLVER_BLOCK_SIZE*sizeof(T);
+    if(CheckCuda(cudaMemcpy(m_deviceStage, stage, bytes, cudaMemcpyHostToDevice), 
+                 "upload")==false){
+        return false;
+    }
+    ScatterTilesKernel<T><<<m_tileCount, CUDA_SOLVER_BLOCK_SIZE>>>((const T*)m_deviceStage,
+                                                                   target, m_shape,
+                                                                   m_activeTiles);
+    return true;
+}
+
+template <typename T> bool CudaSolver::DownloadTiles(const CudaTileList& tiles, const T* source,
+                                                     T* grid){
+    GatherTilesKernel<T><<<m_tileCount, CUDA_SOLVER_BLOCK_SIZE>>>(source, (T*)m_deviceStage,
+                                                                  m_shape, m_activeTiles);
+    T* stage = (T*)m_hostStage;
+    size_t bytes = (size_t)m_tileCount*CUDA_SOLVER_BLOCK_SIZE*sizeof(T);
+    if(CheckCuda(cudaMemcpy(stage, m_deviceStage, bytes, cudaMemcpyDeviceToHost), 
+                 "download")==false){
+        return false;
+    }
+    ForEachTileCell(m_shape, tiles.m_activeTiles, m_tileCount,
+        [=](const unsigned int& cell, const unsigned int& slot){
+            grid[cell] = stage[slot];
+        }
+    );
+    return true;
+}
+
+bool CudaSolver::Reduce(const unsigned int& blocks, double& result){
+    SumPartialsKernel<<<1, CUDA_SOLVER_BLOCK_SIZE>>>(m_partials, blocks, m_result);
+    return CheckCuda(cudaMemcpy(&result, m_result, sizeof(double), cudaMemcpyDeviceToHost),
+                     "reduction");
+}
+
+// z = f(r). Q is zeroed once per solve and the sweeps only write fluid cells, which the forward
+//sweep always writes before it reads them, so Q needs no clearing between applications
+bool CudaSolver::ApplyPreconditioner(){
+    unsigned int wavefronts = m_wavefrontStart.size()-1;
+    for(unsigned int w=0; w<wavefronts; w++){
+        unsigned int count = m_wavefrontStart[w+1]-m_wavefrontStart[w];
+        if(count>0){
+            ForwardSolveKernel<<<count, CUDA_SWEEP_BLOCK_SIZE>>>(m_A, m_PC, m_R, m_Q, m_shape,
+                                             m_wavefrontTiles+m_wavefrontStart[w]);
+        }
+    }
+    for(unsigned int w=wavefronts; w>0; w--){
+        unsigned int count = m_wavefrontStart[w]-m_wavefrontStart[w-1];
+        if(count>0){
+            BackwardSolveKernel<<<count, CUDA_SWEEP_BLOCK_SIZE>>>(m_A, m_PC, m_Q, m_Z, m_shape,
+                                              m_wavefrontTiles+m_wavefrontStart[w-1]);
+        }
+    }
+    return CheckCuda(cudaGetLastError(), "preconditioner");
+}
+
+bool CudaSolver::Solve(const unsigned char* A, const float* L, const float* D, float* P,
+                       const CudaGridShape& shape, const CudaTileList& tiles, const int& subcell,
+                       const SimSettings& settings, int& iterations, float& residual,
+                       float& divergence){
+    iterations = 0;
+    residual = 0.0f;
+    divergence = 0.0f;
+    if(Allocate(shape)==false || UploadTileLists(tiles)==false){
+        return false;
+    }
+    //no active tiles means no fluid cells, so there is nothing to solve
+    if(m_tileCount==0){
+        return true;
+    }
+    bool ok = UploadTiles(tiles, A, m_A);
+    ok = ok && UploadTiles(tiles, L, m_L);
+    ok = ok && UploadTiles(tiles, D, m_D);
+    if(m_pressureResident==false){
+        ok = ok && UploadTiles(tiles, (const float*)P, m_P);
+        m_pressureResident = ok;
+    }
+    //device side clears, the scratch grids never cross over
+    size_t floatBytes = (size_t)shape.m_cells*sizeof(float);
+    ok = ok && CheckCuda(cudaMemset(m_PC, 0, floatBytes), "memset");
+    ok = ok && CheckCuda(cudaMemset(m_R, 0, floatBytes), "memset");
+    ok = ok && CheckCuda(cudaMemset(m_Z, 0, floatBytes), "memset");
+    ok = ok && CheckCuda(cudaMemset(m_Q, 0, floatBytes), "memset");
+    if(ok==false){
+        return false;
+    }
+    unsigned int blocks = m_tileCount;
+    unsigned int threads = CUDA_SOLVER_BLOCK_SIZE;
+    const unsigned int* active = m_activeTiles;
+    float n = (float)max(max(shape.m_x,shape.m_y),shape.m_z);
+    float h = 1.0f/(n*n);
+
+    //build preconditioner
+    for(unsigned int w=0; w+1<m_wavefrontStart.size(); w++){
+        unsigned int count = m_wavefrontStart[w+1]-m_wavefrontStart[w];
+        if(count>0){
+            BuildPreconditionerKernel<<<count, CUDA_SWEEP_BLOCK_SIZE>>>(m_A, m_L, m_PC, m_shape,
+                                                   m_wavefrontTiles+m_wavefrontStart[w], subcell);
+        }
+    }
+
+    PrepareKernel<<<blocks, threads>>>(m_A, m_P, m_shape, active, settings.m_warmStart);
+    ComputeAxKernel<<<blocks, threads>>>(m_A, m_L, m_P, m_Z, m_shape, active, subcell, h, NULL);
+    OpKernel<<<blocks, threads>>>(m_A, m_D, m_Z, m_R, -1.0f, m_shape, active); // r = b-Ax
+    double result;
+    ProductKernel<<<blocks, threads>>>(m_A, m_R, m_R, m_shape, active, m_partials);
+    ok = Reduce(blocks, result);                                          // error0 = r.r
+    float error0 = (float)result;
+    ok = ok && ApplyPreconditioner();
+    ok = ok && CheckCuda(cudaMemcpy(m_S, m_Z, floatBytes, cudaMemcpyDeviceToDevice), "copy");
+    ProductKernel<<<blocks, threads>>>(m_A, NULL, NULL, m_shape, active, m_partials);
+    ok = ok && Reduce(blocks, result);
+    float fluidCells = (float)result;
+    ProductKernel<<<blocks, threads>>>(m_A, m_D, m_D, m_shape, active, m_partials);
+    ok = ok && Reduce(blocks, result);                                    // b.b
+    divergence = (float)result;
+    ProductKernel<<<blocks, threads>>>(m_A, m_Z, m_R, m_shape, active, m_partials);
+    ok = ok && Reduce(blocks, result);                                    // a = z.r
+    float a = (float)result;
+    if(ok==false){
+        return false;
+    }
+
+    float tolerance = settings.m_pcgTolerance;
+    float eps = fmaxf(tolerance*tolerance*divergence, 1.0e-2f*fluidCells);
+    residual = error0;
+    int maxIterations = min(settings.m_pcgMaxIterations, shape.m_x*shape.m_y*shape.m_z);
+    for(int k=0; k<maxIterations && error0>eps && ok; k++){
+        // z = applyA(s), alpha = a/(z . s)
+        ComputeAxKernel<<<blocks, threads>>>(m_A, m_L, m_S, m_Z, m_shape, active, subcell, h,
+                                             m_partials);
+        ok = Reduce(blocks, result);
+        float alpha = a/(float)result;
+        // x = x + alpha*s, r = r - alpha*z, error1 = product(r,r)
+        UpdateKernel<<<blocks, threads>>>(m_A, m_P, m_R, m_S, m_Z, alpha, m_shape, active,
+                                          m_partials);
+        ok = ok && Reduce(blocks, result);
+        float error1 = (float)result;
+        error0 = fmaxf(error0, error1);
+        iterations = k+1;
+        residual = error1;
+        float rate = 1.0f - fmaxf(0.0f,fminf(1.0f,(error1-eps)/(error0-eps)));
+        std::cout << "PCG Iteration " << k+1 << ": " << 100.0f*pow(rate,6) << "% solved"
+                  << std::endl;
+        if(error1<=eps){
+            break;
+        }
+        if(k+1==maxIterations){
+            std::cout << "Warning: PCG hit the iteration cap of " << maxIterations
+                      << " with residual " << error1 << std::endl;
+            break;
+        }
+        // z = f(r)
+        ok = ok && ApplyPreconditioner();
+        ProductKernel<<<blocks, threads>>>(m_A, m_Z, m_R, m_shape, active, m_partials);
+        ok = ok && Reduce(blocks, result);                                // a2 = z.r
+        float a2 = (float)result;
+        float beta = a2/a;
+        OpKernel<<<blocks, threads>>>(m_A, m_Z, m_S, m_S, beta, m_shape, active); // s = z + beta*s
+        a = a2;
+    }
+    ok = ok && DownloadTiles(tiles, (const float*)m_P, P);
+    return ok;
+}
+}
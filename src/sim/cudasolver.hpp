@@ -0,0 +1,101 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: cudasolver.hpp
+// MIC(0) PCG pressure solve on a CUDA device, only built with ARIEL_USE_CUDA
+
+#ifndef CUDASOLVER_HPP
+#define CUDASOLVER_HPP
+
+#include <vector>
+#include "simsettings.inl"
+
+namespace fluidCore {
+//====================================
+// Struct and Class Declarations
+//====================================
+
+//Shape of a linear solver grid, all cell centered solver grids share one
+struct CudaGridShape{
+    int             m_x;
+    int             m_y;
+    int             m_z;
+    unsigned int    m_strideX;
+    unsigned int    m_strideY;
+    unsigned int    m_cells; //stored cells, at least m_x*m_y*m_z
+    int             m_tiles[3]; //tile count per axis, as in TileMask
+};
+
+//Active tiles of a TileMask, see tilemask.inl
+struct CudaTileList{
+    const unsigned int* m_activeTiles;
+    unsigned int        m_activeCount;
+    const unsigned int* m_wavefrontTiles; //the same tiles bucketed by wavefront
+    const unsigned int* m_wavefrontStart; //m_wavefronts+1 entries
+    unsigned int        m_wavefronts;
+    const unsigned int* m_releasedTiles; //active on the previous build, inactive now
+    unsigned int        m_releasedCount;
+};
+
+//Runs the same PCG iteration as SolveConjugateGradient in solver.inl with every solver vector
+//kept on the device. Device buffers live as long as the solver and are only reallocated when
+//the grid shape changes. Only the active tiles move between host and device, packed through
+//pinned staging: per solve their cell types, liquid level set and divergence go up and their
+//pressure comes back. The pressure itself stays resident, so warm starts read the device copy.
+//Kernels only cover the active tiles, one block per tile, and the sweeps run one launch per
+//tile wavefront. Reductions sum one partial per tile in tile order, so results are reproducible
+//run to run whatever m_deterministic says
+class CudaSolver{
+    public:
+        CudaSolver();
+        ~CudaSolver();
+
+        //true if a CUDA device is present
+        static bool IsAvailable();
+
+        //D must already be negated, as Solve in solver.inl does before its solve. P is only
+        //read on the first solve, after that the device pressure is kept between solves and
+        //the active tiles of P are written back when a solve succeeds. Anything else that
+        //changes P on the host needs a new solver. Returns false on any CUDA error
+        bool Solve(const unsigned char* A, const float* L, const float* D, float* P,
+                   const CudaGridShape& shape, const CudaTileList& tiles, const int& subcell,
+                   const SimSettings& settings, int& iterations, float& residual,
+                   float& divergence);
+
+    private:
+        bool Allocate(const CudaGridShape& shape);
+        bool UploadTileLists(const CudaTileList& tiles);
+        //move the active tiles of a grid between the host grid and a device grid
+        template <typename T> bool UploadTiles(const CudaTileList& tiles, const T* grid,
+                                               T* target);
+        template <typename T> bool DownloadTiles(const CudaTileList& tiles, const T* source,
+                                                 T* grid);
+        void Release();
+        //sums the per block partials of the last reduction kernel
+        bool Reduce(const unsigned int& blocks, double& result);
+        bool ApplyPreconditioner();
+
+        CudaGridShape   m_shape;
+        unsigned int    m_tileCount; //active tiles, also blocks in a launch over them
+        bool            m_pressureResident; //false until the first solve uploads P
+        std::vector<unsigned int> m_wavefrontStart;
+        unsigned int*   m_activeTiles; //tile lists hold up to every tile of the grid
+        unsigned int*   m_wavefrontTiles;
+        unsigned int*   m_releasedTiles;
+        char*           m_hostStage; //pinned, one float per cell of every tile
+        char*           m_deviceStage;
+        unsigned char*  m_A;
+        float*          m_L;
+        float*          m_D;
+        float*          m_P;
+        float*          m_PC; //MIC(0) preconditioner
+        float*          m_R;
+        float*          m_Z;
+        float*          m_S;
+        float*          m_Q; //triangular solve scratch
+        double*         m_partials;
+        double*         m_result;
+};
+}
+
+#endif
@@ -4,43 +4,96 @@
 // File: flip.cpp
 // Implements the FLIP sim
 
+#include <algorithm>
 #include "flip.hpp"
 #include "../math/kernels.inl"
 #include "particlegridoperations.inl"
 #include "particleresampler.inl"
+#include "narrowband.inl"
 #include "solver.inl"
+#include "../utilities/profiler.hpp"
 
 namespace fluidCore{
 
+//checkpoint chunk names of the float grids saved by SaveCheckpoint, in the order it saves them
+static const char* g_checkpointGridNames[7] = {"grid_u_x", "grid_u_y", "grid_u_z", "grid_P",
+                                               "grid_previous_u_x", "grid_previous_u_y",
+                                               "grid_previous_u_z"};
+
 FlipSim::FlipSim(const glm::vec3& maxres, const float& density, const float& stepsize, 
-                 sceneCore::Scene* s, const bool& verbose){
+                 sceneCore::Scene* s, const bool& verbose):
+    FlipSim(maxres, density, stepsize, s, CreateSimSettings(), verbose){
+}
+
+FlipSim::FlipSim(const glm::vec3& maxres, const float& density, const float& stepsize, 
+                 sceneCore::Scene* s, const SimSettings& settings, const bool& verbose):
+    m_particleMemory(MEMORY_PARTICLES), m_particleGridMemory(MEMORY_PARTICLE_GRID),
+    m_scratchMemory(MEMORY_GRIDS){
     m_dimensions = maxres;  
     m_pgrid = new ParticleGrid(maxres);
     m_mgrid = CreateMacgrid(maxres);
-    m_mgrid_previous = CreateMacgrid(maxres);
+    m_mgrid_previous = CreateVelocityHistory(maxres, settings.m_compactStorage);
+    //one tile of band covers the extrapolation ring and the widest transfer kernel
+    m_tiles = CreateTileMask(maxres, settings.m_sparseDomain, 1);
+    m_bandSDF = NULL;
+    if(settings.m_narrowBand>0){
+        m_bandSDF = new Grid<float>(maxres, settings.m_narrowBand+2.5f);
+    }
     m_max_density = 0.0f;
     m_density = density;
     m_scene = s;
+    m_settings = settings;
     m_frame = 0;
     m_stepsize = stepsize;
+    m_substep = stepsize;
+    m_maxVelocity = 0.0f;
+    m_reorderPending = false;
     m_subcell = 1;
-    m_picflipratio = .95f;
+    m_picflipratio = settings.m_picFlipRatio;
     m_densitythreshold = 0.04f;
     m_verbose = verbose;
+    //lists reach one cell, as far as the grid gather is guaranteed to, and the widest kernel
+    //that reads them is the wall push's
+    float maxd = glm::max(glm::max(maxres.x, maxres.z), maxres.y);
+    m_neighborSkin = (1.0f-1.5f*density)/maxd;
+    if(m_settings.m_neighborLists==true && m_neighborSkin<=0.0f){
+        std::cout << "Warning: neighbor lists need a density below 2/3, gathering from the grid"
+                  << std::endl;
+        m_settings.m_neighborLists = false;
+    }
+    m_checkpointInterval = 0;
+    m_checkpointCompress = true;
+#if defined(ARIEL_USE_CUDA)
+    m_cudaSolver = NULL;
+#endif
 }
 
 FlipSim::~FlipSim(){
     delete m_pgrid;
-    unsigned int particlecount = m_particles.size();
-    for(unsigned int i=0; i<particlecount; i++){
-        delete m_particles[i];
-    }
-    m_particles.clear();
+    ClearParticleSet(&m_particles);
     ClearMacgrid(m_mgrid);
+    ClearVelocityHistory(m_mgrid_previous);
+    delete m_bandSDF;
+#if defined(ARIEL_USE_CUDA)
+    delete m_cudaSolver;
+#endif
 }
 
 void FlipSim::Init(){
+    m_scene->PrepareMeshFrames(0);
     m_scene->BuildPermaSolidGeomLevelSet();
+    ComputeMaxDensity();
+
+    //Generate particles and sort
+    m_scene->GenerateParticles(&m_particles, m_dimensions, m_density, m_pgrid, 0);
+    m_pgrid->Sort(&m_particles);
+    m_pgrid->MarkCellTypes(&m_particles, m_mgrid.m_A, m_mgrid.m_L, m_density);
+    if(m_bandSDF!=NULL){
+        BuildBandSDF(m_mgrid.m_A, m_bandSDF, m_settings.m_narrowBand+2);
+    }
+}
+
+void FlipSim::ComputeMaxDensity(){
     //We need to figure out maximum particle pressure, 
     //so we generate a bunch of temporary particles
     //inside of a known area, sort them back onto the underlying grid, and calculate the density
@@ -50,40 +103,154 @@ void FlipSim::Init(){
     for(unsigned int i = 0; i < 10; i++){               //FOR_EACH_CELL
         for(unsigned int j = 0; j < 10; j++){ 
             for(unsigned int k = 0; k < 10; k++){ 
-                Particle* p = new Particle;
-                p->m_p = (glm::vec3(i,j,k) + glm::vec3(0.5f))*h;
-                p->m_type = FLUID;
-                p->m_mass = 1.0f;
-                m_particles.push_back(p);
+                Particle p;
+                p.m_p = (glm::vec3(i,j,k) + glm::vec3(0.5f))*h;
+                p.m_u = glm::vec3(0.0f);
+                p.m_n = glm::vec3(0.0f);
+                p.m_density = 0.0f;
+                p.m_type = FLUID;
+                p.m_mass = 1.0f;
+                p.m_invalid = false;
+                p.m_id = 0;
+                p.m_birthFrame = 0;
+                AppendParticle(&m_particles, p);
             }
         }
     }
-    m_pgrid->Sort(m_particles);
+    m_pgrid->Sort(&m_particles);
     m_max_density = 1.0f;
     ComputeDensity(); 
     m_max_density = 0.0f;
     //sum densities across particles
-    for(unsigned int n=0; n<m_particles.size(); n++) {
-        Particle *p = m_particles[n];
-        m_max_density = glm::max(m_max_density,p->m_density);
-        delete p;
+    unsigned int tempcount = GetParticleCount(&m_particles);
+    for(unsigned int n=0; n<tempcount; n++) {
+        m_max_density = glm::max(m_max_density,m_particles.m_density[n]);
     }
-    m_particles.clear();
+    ClearParticleSet(&m_particles);
+}
 
-    //Generate particles and sort
-    m_scene->GenerateParticles(m_particles, m_dimensions, m_density, m_pgrid, 0);
-    m_pgrid->Sort(m_particles);
-    m_pgrid->MarkCellTypes(m_particles, m_mgrid.m_A, m_density);
+void FlipSim::SetCheckpointing(const std::string& path, const int& interval, 
+                               const bool& compress){
+    m_checkpointPath = path;
+    m_checkpointInterval = interval;
+    m_checkpointCompress = compress;
+}
+
+//Copies everything a later step reads from the previous one. Scratch grids, the extrapolation
+//state and the particle grid are rebuilt every step and are not saved. The copy is made here,
+//compression and the disk write happen on the scene's export arena
+void FlipSim::SaveCheckpoint(const std::string& filename, const bool& compress){
+    utilityCore::Checkpoint* checkpoint = new utilityCore::Checkpoint();
+    checkpoint->AddValue("sim_frame", m_frame);
+    checkpoint->AddValue("sim_dimensions", m_dimensions);
+    checkpoint->AddValue("sim_max_velocity", m_maxVelocity);
+    AddParticleSetChunks(checkpoint, "particles", &m_particles);
+    Grid<float>* floatGrids[4] = {m_mgrid.m_u_x, m_mgrid.m_u_y, m_mgrid.m_u_z, m_mgrid.m_P};
+    for(unsigned int g=0; g<4; g++){
+        checkpoint->AddChunk(g_checkpointGridNames[g], floatGrids[g]->GetRawData(), 
+                             floatGrids[g]->GetNumberOfCells()*sizeof(float));
+    }
+    for(int n=0; n<3; n++){
+        AddVelocityHistoryChunk(checkpoint, g_checkpointGridNames[4+n], m_mgrid_previous, n);
+    }
+    checkpoint->AddChunk("grid_A", m_mgrid.m_A->GetRawData(),
+                         m_mgrid.m_A->GetNumberOfCells()*sizeof(unsigned char));
+    checkpoint->AddArray("tiles_active", m_tiles.m_active);
+    if(m_bandSDF!=NULL){
+        checkpoint->AddChunk("grid_band_sdf", m_bandSDF->GetRawData(),
+                             m_bandSDF->GetNumberOfCells()*sizeof(float));
+    }
+    m_scene->AddCheckpointChunks(checkpoint);
+    m_scene->ExportCheckpoint(checkpoint, filename, compress);
+}
+
+bool FlipSim::LoadCheckpoint(const std::string& filename){
+    utilityCore::Checkpoint checkpoint;
+    if(checkpoint.Read(filename)==false){
+        return false;
+    }
+    int frame;
+    glm::vec3 dimensions;
+    if(checkpoint.GetValue("sim_frame", frame)==false ||
+       checkpoint.GetValue("sim_dimensions", dimensions)==false){
+        std::cout << "Warning: " << filename << " holds no sim state" << std::endl;
+        return false;
+    }
+    if(dimensions!=m_dimensions){
+        std::cout << "Warning: " << filename << " was saved at a resolution of " 
+                  << dimensions.x << "x" << dimensions.y << "x" << dimensions.z 
+                  << ", the scene resolution is " << m_dimensions.x << "x" << m_dimensions.y 
+                  << "x" << m_dimensions.z << std::endl;
+        return false;
+    }
+
+    //the scene side of Init, then the sim state on top of it
+    m_scene->PrepareMeshFrames(frame);
+    m_scene->BuildPermaSolidGeomLevelSet();
+    ComputeMaxDensity();
+    Grid<float>* floatGrids[4] = {m_mgrid.m_u_x, m_mgrid.m_u_y, m_mgrid.m_u_z, m_mgrid.m_P};
+    bool found = GetParticleSetChunks(&checkpoint, "particles", &m_particles);
+    for(unsigned int g=0; g<4 && found; g++){
+        found = checkpoint.GetArray(g_checkpointGridNames[g], floatGrids[g]->GetRawData(),
+                                    floatGrids[g]->GetNumberOfCells());
+    }
+    for(int n=0; n<3 && found; n++){
+        found = GetVelocityHistoryChunk(&checkpoint, g_checkpointGridNames[4+n], 
+                                        m_mgrid_previous, n);
+    }
+    //cell types were saved as ints before they were stored as bytes
+    unsigned char* cellTypes = m_mgrid.m_A->GetRawData();
+    unsigned int cells = m_mgrid.m_A->GetNumberOfCells();
+    if(found==true && checkpoint.GetArray("grid_A", cellTypes, cells)==false){
+        std::vector<int> wideCellTypes;
+        found = checkpoint.GetArray("grid_A", wideCellTypes) && wideCellTypes.size()==cells;
+        for(unsigned int c=0; c<wideCellTypes.size() && found==true; c++){
+            cellTypes[c] = (unsigned char)wideCellTypes[c];
+        }
+    }
+    std::vector<unsigned char> active;
+    found = found && checkpoint.GetArray("tiles_active", active) && 
+            active.size()==m_tiles.m_active.size();
+    found = found && m_scene->GetCheckpointChunks(&checkpoint);
+    if(found==false){
+        std::cout << "Warning: " << filename << " is missing sim state" << std::endl;
+        return false;
+    }
+    m_tiles.m_active.swap(active);
+    m_pgrid->InvalidateCellTypes();
+#if defined(ARIEL_USE_CUDA)
+    //the cuda solver keeps its own pressure, which no longer matches
+    delete m_cudaSolver;
+    m_cudaSolver = NULL;
+#endif
+    //checkpoints saved with every particle have no band, it is rebuilt from the cell types
+    if(m_bandSDF!=NULL && checkpoint.GetArray("grid_band_sdf", m_bandSDF->GetRawData(),
+                                              m_bandSDF->GetNumberOfCells())==false){
+        BuildBandSDF(m_mgrid.m_A, m_bandSDF, m_settings.m_narrowBand+2);
+    }
+    m_frame = frame;
+    m_neighbors.Invalidate();
+    //older checkpoints have no substep state, their first frame starts at the longest substep
+    float maxVelocity = 0.0f;
+    checkpoint.GetValue("sim_max_velocity", maxVelocity);
+    m_maxVelocity = maxVelocity;
+    m_pgrid->Sort(&m_particles);
+    std::cout << "Resumed from checkpoint " << filename << " at frame " << m_frame << std::endl;
+    return true;
 }
 
 void FlipSim::StoreTempParticleVelocities(){
-    unsigned int particlecount = m_particles.size();
+    unsigned int particlecount = GetParticleCount(&m_particles);
+    glm::vec3* pos = m_particles.m_p.data();
+    glm::vec3* vel = m_particles.m_u.data();
+    glm::vec3* pt = GetParticleScratch(&m_particles, m_particles.m_pt);
+    glm::vec3* ut = GetParticleScratch(&m_particles, m_particles.m_ut);
 
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int p=r.begin(); p!=r.end(); ++p){ 
-                m_particles[p]->m_pt = m_particles[p]->m_p;
-                m_particles[p]->m_ut = m_particles[p]->m_u;
+                pt[p] = pos[p];
+                ut[p] = vel[p];
             }
         }
     );
@@ -92,44 +259,296 @@ void FlipSim::StoreTempParticleVelocities(){
 void FlipSim::Step(bool saveVDB, bool saveOBJ, bool savePARTIO){
     m_frame++;  
     std::cout << "Simulating Step: " << m_frame << "..." << std::endl;
+    utilityCore::Profiler* profiler = utilityCore::GetProfiler();
+    profiler->BeginFrame(m_frame);
     
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
 
-    m_scene->GenerateParticles(m_particles, m_dimensions, m_density, m_pgrid, m_frame);
-    m_scene->BuildSolidGeomLevelSet(m_frame);
-
-    AdjustParticlesStuckInSolids();
-
-    StoreTempParticleVelocities();
-    m_pgrid->Sort(m_particles);
-    ComputeDensity();
-    ApplyExternalForces(); 
-    SplatParticlesToMACGrid(m_pgrid, m_particles, &m_mgrid);
-    m_pgrid->MarkCellTypes(m_particles, m_mgrid.m_A, m_density);
-    StorePreviousGrid();
-    EnforceBoundaryVelocity(&m_mgrid);
-    Project();
-    EnforceBoundaryVelocity(&m_mgrid);
-    ExtrapolateVelocity();
-    SubtractPreviousGrid();
-    SolvePicFlip();
-    AdvectParticles();
-    
-    CheckParticleSolidConstraints();
-    StoreTempParticleVelocities();
-    float h = m_density/maxd;
-    ResampleParticles(m_pgrid, m_particles, m_scene, m_frame, m_stepsize, h, m_dimensions);
+    {
+        utilityCore::ProfileScope scope("PrepareMeshFrames");
+        m_scene->PrepareMeshFrames(m_frame);
+    }
+    //solids first so emission can answer inside queries from this frame's solid level set
+    {
+        utilityCore::ProfileScope scope("BuildSolidGeomLevelSet");
+        m_scene->BuildSolidGeomLevelSet(m_frame);
+    }
+    {
+        utilityCore::ProfileScope scope("GenerateParticles");
+        m_scene->GenerateParticles(&m_particles, m_dimensions, m_density, m_pgrid, m_frame);
+    }
+    {
+        utilityCore::ProfileScope scope("AdjustParticlesStuckInSolids");
+        AdjustParticlesStuckInSolids();
+    }
 
-    CheckParticleSolidConstraints();
+    m_reorderPending = m_settings.m_reorderInterval>0 && 
+                       m_frame%m_settings.m_reorderInterval==0;
+
+    //substeps run until they land exactly on the frame boundary
+    float remaining = m_stepsize;
+    unsigned int substeps = 0;
+    do{
+        float dt = ComputeSubstep(remaining);
+        Substep(dt);
+        remaining -= dt;
+        substeps++;
+    }while(remaining>0.0f);
+    if(m_verbose==true && m_settings.m_adaptiveSubsteps==true){
+        std::cout << "Ran " << substeps << " substeps, max velocity " << m_maxVelocity 
+                  << std::endl;
+    }
+
+    if(m_bandSDF!=NULL){
+        utilityCore::ProfileScope scope("RebandParticles");
+        RebandParticles();
+    }
 
     if(saveVDB || saveOBJ || savePARTIO){
-        m_scene->ExportParticles(m_particles, maxd, m_frame, saveVDB, saveOBJ, savePARTIO);
+        utilityCore::ProfileScope scope("ExportParticles");
+        m_scene->ExportParticles(&m_particles, maxd, m_frame, saveVDB, saveOBJ, savePARTIO,
+                                 m_bandFill);
+    }
+    if(m_checkpointInterval>0 && m_checkpointPath.empty()==false && 
+       m_frame%m_checkpointInterval==0){
+        utilityCore::ProfileScope scope("SaveCheckpoint");
+        std::string frameString = utilityCore::padString(4, 
+                                      utilityCore::convertIntToString(m_frame));
+        std::string filename = m_checkpointPath;
+        size_t extension = filename.find_last_of('.');
+        size_t directory = filename.find_last_of("/\\");
+        if(extension==std::string::npos || 
+           (directory!=std::string::npos && extension<directory)){
+            filename += "."+frameString;
+        }else{
+            filename.insert(extension, "."+frameString);
+        }
+        SaveCheckpoint(filename, m_checkpointCompress);
+    }
+
+    if(profiler->IsEnabled()==true){
+        profiler->SetCounter("particles", GetParticleCount(&m_particles));
+        profiler->SetCounter("liquid_particles", m_scene->GetLiquidParticleCount());
+        profiler->SetCounter("fluid_cells", CountFluidCells());
+        profiler->SetCounter("active_tiles", m_tiles.m_activeTiles.size());
+        profiler->SetCounter("substeps", substeps);
+        profiler->SetCounter("memory_macgrid_mb", GetMacgridBytes(m_mgrid)/1048576.0);
+        profiler->SetCounter("memory_previous_macgrid_mb", 
+                             GetVelocityHistoryBytes(m_mgrid_previous)/1048576.0);
+    }
+    UpdateMemoryUsage();
+    profiler->EndFrame();
+    utilityCore::GetMemoryTracker()->EndFrame(m_frame);
+}
+
+//Containers only grow between frames, so what they hold at the end of one is its high-water mark
+void FlipSim::UpdateMemoryUsage(){
+    m_particleMemory.Update(GetParticleSetBytes(&m_particles));
+    m_particleGridMemory.Update(m_pgrid->GetMemoryUsage() + m_neighbors.GetMemoryUsage());
+    size_t scratch = m_extrapolationFront.capacity()*sizeof(unsigned int) + 
+                     m_extrapolationValues.capacity()*sizeof(float);
+    for(unsigned int n=0; n<3; n++){
+        scratch += m_extrapolationDepth[n].capacity()*sizeof(int);
+    }
+    for(tbb::enumerable_thread_specific<std::vector<unsigned int> >::iterator it=
+        m_extrapolationLocal.begin(); it!=m_extrapolationLocal.end(); ++it){
+        scratch += it->capacity()*sizeof(unsigned int);
     }
+    m_scratchMemory.Update(scratch);
+    m_scene->UpdateMemoryUsage();
+}
+
+//One pass of the FLIP update over dt seconds of the current frame. Solids and emission stay at
+//the frame's state, so every substep of a frame sees the same scene.
+//Stages run as a graph of their data dependencies. After the density pass, the velocity branch
+//pushes external forces and transfers the particles to the faces while the cell branch marks
+//cell types and the level set and rebuilds the tile mask. Neither branch writes anything the
+//other reads, so overlapping them doesn't change the result. Everything from the projection on
+//depends on both and runs in order. In narrow band FLIP both branches read the band distance
+//advected by the last substep, which is only rebuilt once they are done
+void FlipSim::Substep(const float& dt){
+    m_substep = dt;
+    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
+    float h = m_density/maxd;
+
+    typedef tbb::flow::continue_node<tbb::flow::continue_msg> StageNode;
+    typedef tbb::flow::continue_msg StageMessage;
+    tbb::flow::graph graph;
+    StageNode sort(graph, [this](const StageMessage&){
+        StoreTempParticleVelocities();
+        utilityCore::ProfileScope scope("Sort");
+        m_pgrid->Sort(&m_particles);
+        if(m_settings.m_reorderParticles==true && 
+           (m_settings.m_reorderInterval<=0 || m_reorderPending==true)){
+            //keep liquid particles that share a cell next to each other in memory
+            m_pgrid->ReorderParticles(&m_particles, 0, m_scene->GetLiquidParticleCount(),
+                                      m_settings.m_reorderCurve);
+            m_reorderPending = false;
+        }
+    });
+    StageNode density(graph, [this](const StageMessage&){
+        utilityCore::ProfileScope scope("ComputeDensity");
+        ComputeDensity();
+    });
+    //the two branches overlap, so they record their stages on lanes of their own
+    StageNode velocities(graph, [this](const StageMessage&){
+        ApplyExternalForces(); 
+        Grid<float>* interior[3] = {NULL, NULL, NULL};
+        if(m_bandSDF!=NULL){
+            utilityCore::ProfileScope scope("AdvectInteriorVelocity", 0);
+            AdvectInteriorVelocity(interior);
+        }
+        {
+            utilityCore::ProfileScope scope("TransferParticlesToMACGrid", 0);
+            TransferParticlesToMACGrid(m_pgrid, &m_particles, &m_mgrid, m_settings, 
+                                       &m_floatPool);
+        }
+        if(m_bandSDF!=NULL){
+            StoreInteriorFaces(m_pgrid, m_bandSDF, &m_mgrid, m_settings.m_narrowBand, interior);
+            for(int n=0; n<3; n++){
+                m_floatPool.Release(interior[n]);
+            }
+        }
+    });
+    StageNode cells(graph, [this](const StageMessage&){
+        utilityCore::ProfileScope scope("MarkCellTypes", 1);
+        m_pgrid->MarkCellTypes(&m_particles, m_mgrid.m_A, m_mgrid.m_L, m_density);
+        if(m_bandSDF!=NULL){
+            //interior cells hold no particles, so they don't show up in the particle grid's
+            //tiles and A is scanned for fluid instead
+            MarkInteriorCells(m_bandSDF, m_mgrid.m_A, m_mgrid.m_L, m_settings.m_narrowBand);
+            m_pgrid->InvalidateCellTypes();
+            BuildTileMask(&m_tiles, m_mgrid.m_A);
+        }else{
+            BuildTileMask(&m_tiles, m_pgrid->GetFluidTiles());
+        }
+        //pressure and the previous velocity are only updated inside active tiles, so reset
+        //both in tiles that just dropped out
+        ClearReleasedTiles(&m_tiles, m_mgrid.m_P, -1);
+        if(m_mgrid_previous.m_compact==true){
+            ClearReleasedTiles(&m_tiles, m_mgrid_previous.m_h_x, 0);
+            ClearReleasedTiles(&m_tiles, m_mgrid_previous.m_h_y, 1);
+            ClearReleasedTiles(&m_tiles, m_mgrid_previous.m_h_z, 2);
+        }else{
+            ClearReleasedTiles(&m_tiles, m_mgrid_previous.m_u_x, 0);
+            ClearReleasedTiles(&m_tiles, m_mgrid_previous.m_u_y, 1);
+            ClearReleasedTiles(&m_tiles, m_mgrid_previous.m_u_z, 2);
+        }
+    });
+    StageNode project(graph, [this](const StageMessage&){
+        if(m_bandSDF!=NULL){
+            utilityCore::ProfileScope scope("BuildBandSDF");
+            BuildBandSDF(m_mgrid.m_A, m_bandSDF, m_settings.m_narrowBand+2);
+        }
+        StorePreviousGrid();
+        EnforceBoundaryVelocity(&m_mgrid);
+        {
+            utilityCore::ProfileScope scope("Project");
+            Project();
+        }
+        EnforceBoundaryVelocity(&m_mgrid);
+    });
+    StageNode extrapolate(graph, [this](const StageMessage&){
+        utilityCore::ProfileScope scope("ExtrapolateVelocity");
+        ExtrapolateVelocity();
+    });
+    StageNode advect(graph, [this](const StageMessage&){
+        {
+            utilityCore::ProfileScope scope("AdvectParticles");
+            AdvectParticles();
+        }
+        {
+            utilityCore::ProfileScope scope("CheckParticleSolidConstraints");
+            CheckParticleSolidConstraints();
+        }
+        if(m_bandSDF!=NULL){
+            utilityCore::ProfileScope scope("AdvectBandSDF");
+            AdvectBandSDF(m_bandSDF, &m_mgrid, m_substep, &m_floatPool);
+        }
+        StoreTempParticleVelocities();
+    });
+    StageNode resample(graph, [this, h](const StageMessage&){
+        {
+            utilityCore::ProfileScope scope("ResampleParticles");
+            NeighborList* neighbors = NULL;
+            if(m_settings.m_neighborLists==true){
+                RefreshNeighbors();
+                neighbors = &m_neighbors;
+            }
+            ResampleParticles(m_pgrid, neighbors, &m_particles, m_scene, m_frame, m_substep, h, 
+                              m_dimensions);
+        }
+        {
+            utilityCore::ProfileScope scope("CheckParticleSolidConstraints");
+            CheckParticleSolidConstraints();
+        }
+    });
+
+    tbb::flow::make_edge(sort, density);
+    tbb::flow::make_edge(density, velocities);
+    tbb::flow::make_edge(density, cells);
+    tbb::flow::make_edge(velocities, project);
+    tbb::flow::make_edge(cells, project);
+    tbb::flow::make_edge(project, extrapolate);
+    tbb::flow::make_edge(extrapolate, advect);
+    tbb::flow::make_edge(advect, resample);
+    sort.try_put(StageMessage());
+    graph.wait_for_all();
+}
+
+//The CFL limit, with the speed gravity can add over the substep folded in, clamped to the
+//substep bounds. A substep that would leave less than itself before the frame boundary is split
+//in half with the remainder so the frame doesn't end on a sliver
+float FlipSim::ComputeSubstep(const float& remaining){
+    if(m_settings.m_adaptiveSubsteps==false){
+        return remaining;
+    }
+    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
+    float h = 1.0f/maxd;
+    std::vector<glm::vec3> externalForces = m_scene->GetExternalForces();
+    glm::vec3 force(0.0f);
+    for(unsigned int j=0; j<externalForces.size(); j++){
+        force += externalForces[j];
+    }
+    float speed = m_maxVelocity + glm::sqrt(h*glm::length(force));
+    float dt = m_settings.m_maxSubstep;
+    if(speed>0.0f){
+        dt = glm::min(dt, m_settings.m_cflNumber*h/speed);
+    }
+    dt = glm::max(dt, m_settings.m_minSubstep);
+    if(dt>=remaining){
+        return remaining;
+    }else if(2.0f*dt>remaining){
+        return 0.5f*remaining;
+    }
+    return dt;
+}
+
+//Cell types as of the last MarkCellTypes. Fluid cells always sit inside active tiles
+unsigned int FlipSim::CountFluidCells(){
+    unsigned char* a = m_mgrid.m_A->GetRawData();
+    unsigned int sx = m_mgrid.m_A->GetStrideX(); unsigned int sy = m_mgrid.m_A->GetStrideY();
+    double count = ReduceActiveTiles(&m_tiles, true, [=](const int* lo, const int* hi)->double{
+        unsigned int tileCount = 0;
+        for(int i=lo[0]; i<hi[0]; ++i){
+            for(int j=lo[1]; j<hi[1]; ++j){
+                unsigned int row = i*sx + j*sy;
+                for(unsigned int k=row+lo[2]; k<row+hi[2]; ++k){
+                    tileCount += a[k]==FLUID;
+                }
+            }
+        }
+        return (double)tileCount;
+    });
+    return (unsigned int)count;
 }
 
 void FlipSim::AdjustParticlesStuckInSolids(){
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
-    unsigned int particleCount = m_particles.size();
+    unsigned int particleCount = m_scene->GetLiquidParticleCount();
+    glm::vec3* pos = m_particles.m_p.data();
+    glm::vec3* vel = m_particles.m_u.data();
+    glm::vec3* pt = GetParticleScratch(&m_particles, m_particles.m_pt);
     //pushi_back to vectors doesn't play nice with lambdas for some reason, so we have to
     //do something a little bit convoluted here...
     bool* particleInSolidChecks = new bool[particleCount];
@@ -137,44 +556,40 @@ void FlipSim::AdjustParticlesStuckInSolids(){
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int p=r.begin(); p!=r.end(); ++p){ 
                 particleInSolidChecks[p] = false;
-                if(m_particles[p]->m_type==FLUID){
-                                    m_particles[p]->m_temp = false;
-                    m_particles[p]->m_temp2 = false;
-                    glm::vec3 point = m_particles[p]->m_p * maxd;
-                    unsigned int id;
-                    if(m_scene->CheckPointInsideSolidGeom(point, m_frame, id)==true){
-                        particleInSolidChecks[p] = true;
-                    }
+                glm::vec3 point = pos[p] * maxd;
+                unsigned int id;
+                if(m_scene->CheckPointInsideSolidGeom(point, m_frame, id)==true){
+                    particleInSolidChecks[p] = true;
                 }
             }
         }
     );
-    //build vector of particles we need to adjust
-    std::vector<Particle*> stuckParticles;
+    //build list of particles we need to adjust
+    std::vector<unsigned int> stuckParticles;
     stuckParticles.reserve(particleCount);  
     for(unsigned int p=0; p<particleCount; p++){
         if(particleInSolidChecks[p]==true){
-            stuckParticles.push_back(m_particles[p]);
-            m_particles[p]->m_pt = m_particles[p]->m_p;
+            stuckParticles.push_back(p);
+            pt[p] = pos[p];
         }
     }
-    delete particleInSolidChecks;
+    delete [] particleInSolidChecks;
     //figure out direction to nearest surface from levelset, then raycast for a precise result
-    m_scene->GetSolidLevelSet()->ProjectPointsToSurface(stuckParticles, maxd);
+    m_scene->GetSolidLevelSet()->ProjectPointsToSurface(&m_particles, stuckParticles, maxd);
     unsigned int stuckCount = stuckParticles.size();
-    for(unsigned int p=0; p<stuckCount; p++){
+    for(unsigned int s=0; s<stuckCount; s++){
+        unsigned int p = stuckParticles[s];
         rayCore::Ray r;
-        r.m_origin = stuckParticles[p]->m_pt * maxd;
+        r.m_origin = pt[p] * maxd;
         r.m_frame = m_frame;
-        r.m_direction = glm::normalize(stuckParticles[p]->m_p - 
-                                       stuckParticles[p]->m_pt);
-        float d = glm::length(stuckParticles[p]->m_p - stuckParticles[p]->m_pt);
+        r.m_direction = glm::normalize(pos[p] - pt[p]);
+        float d = glm::length(pos[p] - pt[p]);
         float raynulltest = glm::length(r.m_direction);
         if(raynulltest==raynulltest){
             rayCore::Intersection hit = m_scene->IntersectSolidGeoms(r);
             float nearestDistance = glm::length(r.m_origin - hit.m_point);
-            stuckParticles[p]->m_p = (r.m_origin + r.m_direction * 1.05f * nearestDistance)/maxd;
-            stuckParticles[p]->m_u = glm::normalize(r.m_direction) * d;
+            pos[p] = (r.m_origin + r.m_direction * 1.05f * nearestDistance)/maxd;
+            vel[p] = glm::normalize(r.m_direction) * d;
         }
     }
     stuckParticles.clear();
@@ -182,43 +597,52 @@ void FlipSim::AdjustParticlesStuckInSolids(){
 
 void FlipSim::CheckParticleSolidConstraints(){
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
-    unsigned int particlecount = m_particles.size();   
+    unsigned int particlecount = m_scene->GetLiquidParticleCount();
+    glm::vec3* pos = m_particles.m_p.data();
+    glm::vec3* vel = m_particles.m_u.data();
+    glm::vec3* pt = GetParticleScratch(&m_particles, m_particles.m_pt);
+    glm::vec3* ut = GetParticleScratch(&m_particles, m_particles.m_ut);
     // for(unsigned int p=0; p<particlecount; p++){ 
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int p=r.begin(); p!=r.end(); ++p){ 
-                if(m_particles[p]->m_type==FLUID){
-                    rayCore::Ray r;
-                    r.m_origin = m_particles[p]->m_pt * maxd;
-                    r.m_frame = m_frame;
-                    r.m_direction = glm::normalize(m_particles[p]->m_p - 
-                                                   m_particles[p]->m_pt);
-                    float d = glm::length(m_particles[p]->m_p - m_particles[p]->m_pt);
-                    float raynulltest = glm::length(r.m_direction);
-
-                    if(raynulltest==raynulltest){
-                        rayCore::Intersection hit = m_scene->IntersectSolidGeoms(r);
-                        float u_dir = glm::length(m_particles[p]->m_ut);
-                        if(hit.m_hit==true){
-                            float solidDistance = glm::length(r.m_origin - 
-                                                              hit.m_point);
-                            float velocityDistance = glm::length(m_particles[p]->m_p - 
-                                                                 m_particles[p]->m_pt) * maxd;
-                            if(solidDistance<velocityDistance){
-                                m_particles[p]->m_p = (r.m_origin + 
-                                                       r.m_direction * .90f * solidDistance)/maxd;
-                                m_particles[p]->m_u = 2.0f*glm::dot(r.m_direction, hit.m_normal)*
-                                                      hit.m_normal-glm::normalize(r.m_direction);
-                                m_particles[p]->m_u = glm::normalize(m_particles[p]->m_u) * u_dir;
-                            }
-                        }    
-                        r.m_origin = m_particles[p]->m_p * maxd;
-                        unsigned int id;
-                        if(m_scene->CheckPointInsideSolidGeom(r.m_origin, m_frame, id)==true){
-                            m_particles[p]->m_u = -glm::normalize(r.m_direction) * u_dir;
-                            m_particles[p]->m_p = m_particles[p]->m_pt + 
-                                                  m_particles[p]->m_u * m_stepsize;
+                rayCore::Ray r;
+                r.m_origin = pt[p] * maxd;
+                r.m_frame = m_frame;
+                r.m_direction = glm::normalize(pos[p] - pt[p]);
+                float d = glm::length(pos[p] - pt[p]);
+                float raynulltest = glm::length(r.m_direction);
+
+                if(raynulltest==raynulltest){
+                    float u_dir = glm::length(ut[p]);
+                    //a particle that starts further from every solid than it moved can't
+                    //have crossed one, so only cast for particles near solids
+                    float startDistance;
+                    bool nearSolid = true;
+                    if(m_scene->GetSolidDistance(r.m_origin, m_frame, startDistance)==true){
+                        nearSolid = startDistance <= d*maxd + 
+                                                     m_scene->GetSolidDistanceTolerance();
+                    }
+                    rayCore::Intersection hit;
+                    if(nearSolid==true){
+                        hit = m_scene->IntersectSolidGeoms(r);
+                    }
+                    if(hit.m_hit==true){
+                        float solidDistance = glm::length(r.m_origin - 
+                                                          hit.m_point);
+                        float velocityDistance = glm::length(pos[p] - pt[p]) * maxd;
+                        if(solidDistance<velocityDistance){
+                            pos[p] = (r.m_origin + r.m_direction * .90f * solidDistance)/maxd;
+                            vel[p] = 2.0f*glm::dot(r.m_direction, hit.m_normal)*
+                                     hit.m_normal-glm::normalize(r.m_direction);
+                            vel[p] = glm::normalize(vel[p]) * u_dir;
                         }
+                    }    
+                    r.m_origin = pos[p] * maxd;
+                    unsigned int id;
+                    if(m_scene->CheckPointInsideSolidGeom(r.m_origin, m_frame, id)==true){
+                        vel[p] = -glm::normalize(r.m_direction) * u_dir;
+                        pos[p] = pt[p] + vel[p] * m_substep;
                     }
                 }
             }
@@ -226,187 +650,274 @@ void FlipSim::CheckParticleSolidConstraints(){
     );
 }
 
+//Fused grid to particle pass: each particle samples the new and previous grid velocity with one
+//stencil, blends PIC and FLIP, and fluid particles are then moved with a midpoint RK2 step
 void FlipSim::AdvectParticles(){
     unsigned int x = (unsigned int)m_dimensions.x; unsigned int y = (unsigned int)m_dimensions.y; 
     unsigned int z = (unsigned int)m_dimensions.z;
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
-    unsigned int particleCount = m_particles.size();
+    //solids never move within a frame, so only the liquids at the front of the set are advected
+    unsigned int particleCount = m_scene->GetLiquidParticleCount();
+    glm::vec3* pos = m_particles.m_p.data();
+    glm::vec3* vel = m_particles.m_u.data();
+    glm::vec3* normal = m_particles.m_n.data();
+    int* type = m_particles.m_type.data();
 
-    //update positions
+    //the previous grid is only kept inside active tiles, elsewhere the FLIP delta is zero
+    TileMask* tiles = &m_tiles;
+    int ty = m_tiles.m_tiles[1]; int tz = m_tiles.m_tiles[2];
+    const unsigned char* active = m_tiles.m_active.data();
+    float ratio = m_picflipratio;
+    float dt = m_substep;
+    //squared speeds of the fastest liquid particle and grid sample, folded in while the
+    //velocities are in registers
+    tbb::enumerable_thread_specific<float> maxSpeeds(0.0f);
+    tbb::enumerable_thread_specific<float>* speeds = &maxSpeeds;
+
+    //update velocities and positions. Midpoints are gathered per chunk so the second RK2 sample
+    //goes through the batched interpolation
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
         [=](const tbb::blocked_range<unsigned int>& r){
+            const unsigned int chunk = 16*INTERPOLATE_BATCH_WIDTH;
+            glm::vec3 midpoints[chunk];
+            unsigned int movers[chunk];
+            unsigned int moverCount = 0;
+            float maxSpeed = 0.0f;
             for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                if(m_particles[i]->m_type == FLUID){
-                    glm::vec3 velocity = InterpolateVelocity(m_particles[i]->m_p, &m_mgrid);
-                    m_particles[i]->m_p += m_stepsize*velocity;
-                    //m_particles[i]->m_u = velocity;
+                glm::vec3 u; glm::vec3 uprevious;
+                InterpolateVelocityPair(pos[i], &m_mgrid, &m_mgrid_previous, u, uprevious);
+                glm::vec3 delta = u - uprevious;
+                if(tiles->m_sparse==true){
+                    unsigned int ci = glm::min(x-1.0f,pos[i].x*maxd);
+                    unsigned int cj = glm::min(y-1.0f,pos[i].y*maxd);
+                    unsigned int ck = glm::min(z-1.0f,pos[i].z*maxd);
+                    unsigned int tile = ((ci>>GRID_BRICK_SHIFT)*ty + (cj>>GRID_BRICK_SHIFT))*tz +
+                                        (ck>>GRID_BRICK_SHIFT);
+                    if(active[tile]==0){
+                        delta = glm::vec3(0.0f);
+                    }
+                }
+                //PIC takes the grid velocity, FLIP adds the grid's change to the particle's own
+                vel[i] = (1.0f-ratio)*u + ratio*(vel[i] + delta);
+                maxSpeed = glm::max(maxSpeed, glm::max(glm::dot(u,u), glm::dot(vel[i],vel[i])));
+                midpoints[moverCount] = pos[i] + 0.5f*dt*u;
+                movers[moverCount++] = i;
+                if(moverCount==chunk || (i+1==r.end() && moverCount>0)){
+                    glm::vec3 velocity[chunk];
+                    InterpolateVelocityBatch(midpoints, moverCount, &m_mgrid, velocity);
+                    for(unsigned int m=0; m<moverCount; m++){
+                        pos[movers[m]] += dt*velocity[m];
+                    }
+                    moverCount = 0;
                 }
             }
+            float& localSpeed = speeds->local();
+            localSpeed = glm::max(localSpeed, maxSpeed);
         }
     );
-    m_pgrid->Sort(m_particles); //sort
+    float maxSpeed = 0.0f;
+    for(tbb::enumerable_thread_specific<float>::iterator it=maxSpeeds.begin(); 
+        it!=maxSpeeds.end(); ++it){
+        maxSpeed = glm::max(maxSpeed, *it);
+    }
+    m_maxVelocity = glm::sqrt(maxSpeed);
+    NeighborList* neighbors = NULL;
+    if(m_settings.m_neighborLists==true){
+        RefreshNeighbors();
+        neighbors = &m_neighbors;
+    }else{
+        m_pgrid->Sort(&m_particles); //sort
+    }
 
-    //apply constraints for outer walls of sim
+    //apply constraints for outer walls of sim. Clamping only moves a particle towards the box
+    //its list was built in, so the lists stay valid
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int p0=r.begin(); p0!=r.end(); ++p0){  
                 float r = 1.0f/maxd;
-                if( m_particles[p0]->m_type == FLUID ) {
-                    m_particles[p0]->m_p = glm::max(glm::vec3(r),glm::min(glm::vec3(1.0f-r),
-                                                m_particles[p0]->m_p));
-                }
+                pos[p0] = glm::max(glm::vec3(r),glm::min(glm::vec3(1.0f-r), pos[p0]));
 
-                Particle* p = m_particles[p0];
-                if(p->m_type == FLUID){
-                    unsigned int i = glm::min(x-1.0f,p->m_p.x*maxd);
-                    unsigned int j = glm::min(y-1.0f,p->m_p.y*maxd);
-                    unsigned int k = glm::min(z-1.0f,p->m_p.z*maxd);            
-                    std::vector<Particle*> neighbors = m_pgrid->GetCellNeighbors(glm::vec3(i,j,k), 
-                                                                                 glm::vec3(1));
-                    for(int p1=0; p1<neighbors.size(); p1++){
-                        Particle* np = neighbors[p1];
-                        float re = 1.5f*m_density/maxd;
-                        if(np->m_type == SOLID){
-                            float dist = glm::length(p->m_p-np->m_p); //check this later
-                            if(dist<re){
-                                glm::vec3 normal = np->m_n;
-                                if(glm::length(normal)<0.0000001f && dist){
-                                    normal = glm::normalize(p->m_p - np->m_p);
-                                }
-                                p->m_p += (re-dist)*normal;
-                                p->m_u -= glm::dot(p->m_u, normal) * normal;
+                unsigned int i = glm::min(x-1.0f,pos[p0].x*maxd);
+                unsigned int j = glm::min(y-1.0f,pos[p0].y*maxd);
+                unsigned int k = glm::min(z-1.0f,pos[p0].z*maxd);            
+                float re = 1.5f*m_density/maxd;
+                auto push = [&](const unsigned int& np){
+                    if(type[np] == SOLID){
+                        float dist = glm::length(pos[p0]-pos[np]); //check this later
+                        if(dist<re){
+                            glm::vec3 n = normal[np];
+                            if(glm::length(n)<0.0000001f && dist){
+                                n = glm::normalize(pos[p0] - pos[np]);
                             }
+                            pos[p0] += (re-dist)*n;
+                            vel[p0] -= glm::dot(vel[p0], n) * n;
                         }
                     }
+                };
+                if(neighbors!=NULL){
+                    neighbors->ForEachNeighbor(p0, push);
+                }else{
+                    m_pgrid->ForEachCellNeighbor(glm::vec3(i,j,k), glm::vec3(1), push);
                 }
             }
         }
     );
 }
 
-void FlipSim::SolvePicFlip(){
-    int particleCount = m_particles.size();
-
-    //store copy of current velocities for later
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                m_particles[i]->m_t = m_particles[i]->m_u;
-            }
-        }
-    );
-
-    SplatMACGridToParticles(m_particles, &m_mgrid_previous);
-
-    //set FLIP velocity
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                m_particles[i]->m_t = m_particles[i]->m_u + m_particles[i]->m_t;
-            }
-        }
-    );
-
-    //set PIC velocity
-    SplatMACGridToParticles(m_particles, &m_mgrid);
-
-    //combine PIC and FLIP
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                m_particles[i]->m_u = (1.0f-m_picflipratio)*m_particles[i]->m_u + 
-                                      m_picflipratio*m_particles[i]->m_t;
-            }
-        }
-    );
+//Interior faces of narrow band FLIP, advected from the last substep's grid into scratch grids
+//from the pool that StoreInteriorFaces copies back after the transfer
+void FlipSim::AdvectInteriorVelocity(Grid<float>** interior){
+    Grid<float>* faces[3] = {m_mgrid.m_u_x, m_mgrid.m_u_y, m_mgrid.m_u_z};
+    for(int n=0; n<3; n++){
+        interior[n] = m_floatPool.AcquireUninitialized(faces[n]->GetDimensions(), 0.0f);
+    }
+    std::vector<glm::vec3> externalForces = m_scene->GetExternalForces();
+    glm::vec3 dv(0.0f);
+    for(unsigned int j=0; j<externalForces.size(); j++){
+        dv += externalForces[j]*m_substep;
+    }
+    AdvectInteriorFaces(m_pgrid, m_bandSDF, &m_mgrid, m_settings.m_narrowBand, m_substep, dv,
+                        interior);
 }
 
-void FlipSim::StorePreviousGrid(){
-    unsigned int x = (unsigned int)m_dimensions.x; unsigned int y = (unsigned int)m_dimensions.y; 
-    unsigned int z = (unsigned int)m_dimensions.z;
-    //for every x face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        m_mgrid_previous.m_u_x->SetCell(i,j,k,m_mgrid.m_u_x->GetCell(i,j,k));
-                    }
-                }
-            }
-        }
-    );
-    //for every y face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y+1; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        m_mgrid_previous.m_u_y->SetCell(i,j,k,m_mgrid.m_u_y->GetCell(i,j,k));
+//Keeps the liquid particles a shell of m_settings.m_narrowBand cells under the surface. Liquids
+//in cells deeper than the band are culled, and band cells below the surface layer that have no
+//particles left are seeded on the emission lattice with the grid velocity. The surface layer is
+//never seeded, a cell emptied there is liquid that moved away. The culled cells' centers go to
+//m_bandFill so the exported surface isn't hollow
+void FlipSim::RebandParticles(){
+    int x = (int)m_dimensions.x; int y = (int)m_dimensions.y; int z = (int)m_dimensions.z;
+    float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
+    float depth = -(float)m_settings.m_narrowBand;
+    float density = m_density;
+    const float* d = m_bandSDF->GetRawData();
+    const unsigned char* a = m_mgrid.m_A->GetRawData();
+    unsigned int sx = m_bandSDF->GetStrideX(); unsigned int sy = m_bandSDF->GetStrideY();
+    m_pgrid->Sort(&m_particles);
+
+    //prefix sum filter of the liquid particles still inside the band
+    unsigned int liquidCount = m_scene->GetLiquidParticleCount();
+    m_bandKept.resize(liquidCount);
+    unsigned int* kept = m_bandKept.data();
+    const glm::vec3* pos = m_particles.m_p.data();
+    unsigned int keptCount = tbb::parallel_scan(
+        tbb::blocked_range<unsigned int>(0,liquidCount), 0u,
+        [=](const tbb::blocked_range<unsigned int>& r, unsigned int sum, 
+            const bool isFinal)->unsigned int{
+            for(unsigned int p=r.begin(); p!=r.end(); ++p){
+                int i = (int)glm::max(0.0f, glm::min(x-1.0f, maxd*pos[p].x));
+                int j = (int)glm::max(0.0f, glm::min(y-1.0f, maxd*pos[p].y));
+                int k = (int)glm::max(0.0f, glm::min(z-1.0f, maxd*pos[p].z));
+                if(d[i*sx + j*sy + k]>=depth){
+                    if(isFinal==true){
+                        kept[sum] = p;
                     }
+                    sum++;
                 }
             }
-        }
+            return sum;
+        },
+        std::plus<unsigned int>()
     );
-    //for every z face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        m_mgrid_previous.m_u_z->SetCell(i,j,k,m_mgrid.m_u_z->GetCell(i,j,k));
+    m_bandKept.resize(keptCount);
+
+    //per slab so seeds and fill come out in cell order
+    std::vector<std::vector<glm::vec3> > slabSeeds(x);
+    std::vector<std::vector<glm::vec3> > slabFill(x);
+    ParticleGrid* pgrid = m_pgrid;
+    tbb::parallel_for(tbb::blocked_range<int>(0,x),
+        [&](const tbb::blocked_range<int>& r){
+            for(int i=r.begin(); i!=r.end(); ++i){
+                for(int j=0; j<y; ++j){
+                    for(int k=0; k<z; ++k){
+                        unsigned int c = i*sx + j*sy + k;
+                        if(a[c]==SOLID){
+                            continue;
+                        }
+                        if(d[c]<depth){
+                            slabFill[i].push_back(glm::vec3(i+0.5f, j+0.5f, k+0.5f)/maxd);
+                        }else if(d[c]<-1.0f && 
+                                 pgrid->GetCellCount(pgrid->GetCellIndex(i,j,k))==0){
+                            //emission lattice points that fall inside the cell
+                            int lo[3] = {i, j, k};
+                            int first[3]; int last[3];
+                            for(int n=0; n<3; n++){
+                                first[n] = (int)glm::ceil(lo[n]/density-0.5f);
+                                last[n] = (int)glm::ceil((lo[n]+1)/density-0.5f);
+                            }
+                            for(int li=first[0]; li<last[0]; li++){
+                                for(int lj=first[1]; lj<last[1]; lj++){
+                                    for(int lk=first[2]; lk<last[2]; lk++){
+                                        glm::vec3 p = (glm::vec3(li,lj,lk)+0.5f)*density;
+                                        slabSeeds[i].push_back(p/maxd);
+                                    }
+                                }
+                            }
+                        }
                     }
                 }
             }
         }
     );
+    m_bandSeeds.clear();
+    m_bandFill.clear();
+    for(int i=0; i<x; i++){
+        m_bandSeeds.insert(m_bandSeeds.end(), slabSeeds[i].begin(), slabSeeds[i].end());
+        m_bandFill.insert(m_bandFill.end(), slabFill[i].begin(), slabFill[i].end());
+    }
+    m_bandSeedVelocities.resize(m_bandSeeds.size());
+    for(unsigned int s=0; s<m_bandSeeds.size(); s++){
+        m_bandSeedVelocities[s] = InterpolateVelocity(m_bandSeeds[s], &m_mgrid);
+    }
+
+    m_scene->RebandLiquidParticles(&m_particles, m_bandKept, m_bandSeeds, m_bandSeedVelocities,
+                                   m_frame);
+    m_neighbors.Invalidate();
+    if(m_verbose==true){
+        std::cout << "Narrow band kept " << keptCount << " of " << liquidCount 
+                  << " liquid particles, seeded " << m_bandSeeds.size() << std::endl;
+    }
 }
 
-void FlipSim::SubtractPreviousGrid(){
-    unsigned int x = (unsigned int)m_dimensions.x; unsigned int y = (unsigned int)m_dimensions.y; 
-    unsigned int z = (unsigned int)m_dimensions.z;
-    //for every x face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        float subx = m_mgrid.m_u_x->GetCell(i,j,k) - 
-                                     m_mgrid_previous.m_u_x->GetCell(i,j,k);
-                        m_mgrid_previous.m_u_x->SetCell(i,j,k,subx);
-                    }
-                }
-            }
-        }
-    );
-    //for every y face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y+1; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        float suby = m_mgrid.m_u_y->GetCell(i,j,k) - 
-                                     m_mgrid_previous.m_u_y->GetCell(i,j,k);
-                        m_mgrid_previous.m_u_y->SetCell(i,j,k,suby);
+//Re-sorts and rebuilds the lists once any particle has moved further than half the skin
+void FlipSim::RefreshNeighbors(){
+    if(m_neighbors.IsValid(&m_particles)==false){
+        float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
+        m_pgrid->Sort(&m_particles);
+        m_neighbors.Build(m_pgrid, &m_particles, maxd, 1.0f/maxd, m_neighborSkin);
+    }
+}
+
+//Keeps a copy of the pre-projection velocity for the FLIP delta. The history shares the
+//macgrid's face dimensions and layout, so faces can be walked as flat rows. Only active tiles
+//are touched. Compact histories narrow each row to fp16 as it is copied
+void FlipSim::StorePreviousGrid(){
+    Grid<float>* current[3] = {m_mgrid.m_u_x, m_mgrid.m_u_y, m_mgrid.m_u_z};
+    Grid<float>* previous[3] = {m_mgrid_previous.m_u_x, m_mgrid_previous.m_u_y, 
+                                m_mgrid_previous.m_u_z};
+    Grid<unsigned short>* compact[3] = {m_mgrid_previous.m_h_x, m_mgrid_previous.m_h_y, 
+                                        m_mgrid_previous.m_h_z};
+    bool narrow = m_mgrid_previous.m_compact;
+    for(int n=0; n<3; n++){
+        float* u = current[n]->GetRawData();
+        float* uprev = narrow ? NULL : previous[n]->GetRawData();
+        unsigned short* hprev = narrow ? compact[n]->GetRawData() : NULL;
+        unsigned int sx = current[n]->GetStrideX(); unsigned int sy = current[n]->GetStrideY();
+        ForEachActiveTile(&m_tiles, n, [=](const int* lo, const int* hi){
+            for(int i=lo[0]; i<hi[0]; ++i){
+                for(int j=lo[1]; j<hi[1]; ++j){
+                    unsigned int row = i*sx + j*sy;
+                    if(narrow==true){
+                        FloatsToHalves(u+row+lo[2], hprev+row+lo[2], hi[2]-lo[2]);
+                        continue;
                     }
-                }
-            }
-        }
-    );
-    //for every z face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        float subz = m_mgrid.m_u_z->GetCell(i,j,k) - 
-                                     m_mgrid_previous.m_u_z->GetCell(i,j,k);
-                        m_mgrid_previous.m_u_z->SetCell(i,j,k,subz);
+                    for(unsigned int k=row+lo[2]; k<row+hi[2]; ++k){
+                        uprev[k] = u[k];
                     }
                 }
             }
-        }
-    );
+        });
+    }
 }
 
 void FlipSim::Project(){
@@ -417,29 +928,35 @@ void FlipSim::Project(){
     float h = 1.0f/maxd; //cell width
 
     //compute divergence per cell
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(unsigned int j = 0; j < y; ++j){
-                    for(unsigned int k = 0; k < z; ++k){
-                        float divergence = (m_mgrid.m_u_x->GetCell(i+1, j, k) - 
-                                            m_mgrid.m_u_x->GetCell(i, j, k) + 
-                                            m_mgrid.m_u_y->GetCell(i, j+1, k) - 
-                                            m_mgrid.m_u_y->GetCell(i, j, k) +
-                                            m_mgrid.m_u_z->GetCell(i, j, k+1) - 
-                                            m_mgrid.m_u_z->GetCell(i, j, k)
-                                            ) / h;
-                        m_mgrid.m_D->SetCell(i,j,k,divergence);
-                    }
+    float* ux = m_mgrid.m_u_x->GetRawData();
+    float* uy = m_mgrid.m_u_y->GetRawData();
+    float* uz = m_mgrid.m_u_z->GetRawData();
+    float* d = m_mgrid.m_D->GetRawData();
+    unsigned int uxsx = m_mgrid.m_u_x->GetStrideX(); unsigned int uxsy = m_mgrid.m_u_x->GetStrideY();
+    unsigned int uysx = m_mgrid.m_u_y->GetStrideX(); unsigned int uysy = m_mgrid.m_u_y->GetStrideY();
+    unsigned int uzsx = m_mgrid.m_u_z->GetStrideX(); unsigned int uzsy = m_mgrid.m_u_z->GetStrideY();
+    unsigned int dsx = m_mgrid.m_D->GetStrideX(); unsigned int dsy = m_mgrid.m_D->GetStrideY();
+    //only fluid cells are read by the solver, so divergence is skipped outside active tiles
+    ForEachActiveTile(&m_tiles, -1, [=](const int* lo, const int* hi){
+        for(int i=lo[0]; i<hi[0]; ++i){
+            for(int j=lo[1]; j<hi[1]; ++j){
+                //unit stride rows along k
+                const float* uxrow = &ux[i*uxsx + j*uxsy];
+                const float* uyrow = &uy[i*uysx + j*uysy];
+                const float* uzrow = &uz[i*uzsx + j*uzsy];
+                float* drow = &d[i*dsx + j*dsy];
+                for(int k=lo[2]; k<hi[2]; ++k){
+                    drow[k] = (uxrow[k+uxsx] - uxrow[k] + uyrow[k+uysy] - uyrow[k] + 
+                               uzrow[k+1] - uzrow[k]) / h;
                 }
             }
         }
-    );
+    });
 
-    //compute internal level set for liquid surface
-    m_pgrid->BuildSDF(m_mgrid, m_density);
-    
-    Solve(m_mgrid, m_subcell, m_verbose);
+    //the internal level set for the liquid surface was written by MarkCellTypes
+    if(SolveOnDevice()==false){
+        Solve(m_mgrid, m_subcell, &m_tiles, m_settings, &m_floatPool, &m_cellPool, m_verbose);
+    }
 
     if(m_verbose){
         std::cout << " " << std::endl;//TODO: no more stupid formatting hacks like this to std::out
@@ -449,246 +966,280 @@ void FlipSim::Project(){
     SubtractPressureGradient();
 }
 
-void FlipSim::ExtrapolateVelocity(){
-    unsigned int x = (unsigned int)m_dimensions.x; unsigned int y = (unsigned int)m_dimensions.y; 
-    unsigned int z = (unsigned int)m_dimensions.z;
+//Runs the pressure solve on the GPU if the scene asked for it. Returns false when the CPU solver
+//should run instead, and falls back to the CPU for the rest of the sim after any CUDA failure
+bool FlipSim::SolveOnDevice(){
+#if defined(ARIEL_USE_CUDA)
+    if(m_settings.m_solverDevice!=SOLVER_DEVICE_CUDA){
+        return false;
+    }
+    if(m_settings.m_preconditioner!=PRECONDITIONER_MIC || CudaSolver::IsAvailable()==false){
+        std::cout << "Warning: the cuda solver needs a CUDA device and the mic preconditioner, "
+                  << "using the cpu solver" << std::endl;
+        m_settings.m_solverDevice = SOLVER_DEVICE_CPU;
+        return false;
+    }
+    if(m_cudaSolver==NULL){
+        m_cudaSolver = new CudaSolver();
+    }
+    CudaGridShape shape;
+    shape.m_x = (int)m_dimensions.x; shape.m_y = (int)m_dimensions.y; 
+    shape.m_z = (int)m_dimensions.z;
+    shape.m_strideX = m_mgrid.m_A->GetStrideX();
+    shape.m_strideY = m_mgrid.m_A->GetStrideY();
+    shape.m_cells = m_mgrid.m_A->GetNumberOfCells();
+    for(int n=0; n<3; n++){
+        shape.m_tiles[n] = m_tiles.m_tiles[n];
+    }
+    CudaTileList tiles;
+    tiles.m_activeTiles = m_tiles.m_activeTiles.data();
+    tiles.m_activeCount = m_tiles.m_activeTiles.size();
+    tiles.m_wavefrontTiles = m_tiles.m_wavefrontTiles.data();
+    tiles.m_wavefrontStart = m_tiles.m_wavefrontStart.data();
+    tiles.m_wavefronts = m_tiles.m_wavefrontStart.size()-1;
+    tiles.m_releasedTiles = m_tiles.m_releasedTiles.data();
+    tiles.m_releasedCount = m_tiles.m_releasedTiles.size();
 
-    Grid<int>** mark = new Grid<int>*[3];
-    Grid<int>** wallmark = new Grid<int>*[3];
-    for(unsigned int i=0; i<3; i++){
-        mark[i] = new Grid<int>(m_dimensions, 0);
-        wallmark[i] = new Grid<int>(m_dimensions, 0);
+    //same sign convention as Solve
+    FlipGrid(m_mgrid.m_D, m_mgrid.m_dimensions);
+    int iterations; float residual; float divergence;
+    if(m_cudaSolver->Solve(m_mgrid.m_A->GetRawData(), m_mgrid.m_L->GetRawData(), 
+                           m_mgrid.m_D->GetRawData(), m_mgrid.m_P->GetRawData(), shape, 
+                           tiles, m_subcell, m_settings, iterations, residual, divergence)==false){
+        std::cout << "Warning: cuda pressure solve failed, using the cpu solver" << std::endl;
+        //undo the flip, Solve does its own
+        FlipGrid(m_mgrid.m_D, m_mgrid.m_dimensions);
+        m_settings.m_solverDevice = SOLVER_DEVICE_CPU;
+        delete m_cudaSolver;
+        m_cudaSolver = NULL;
+        return false;
     }
+    utilityCore::GetProfiler()->SetCounter("pcg_iterations", iterations);
+    utilityCore::GetProfiler()->SetCounter("pcg_residual", residual);
+    utilityCore::GetProfiler()->SetCounter("pcg_relative_residual", 
+                                           divergence>0.0f ? sqrt(residual/divergence) : 0.0f);
+    return true;
+#else
+    return false;
+#endif
+}
 
-    //initalize temp grids with values
-    //for every x face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        mark[0]->SetCell(i,j,k, (i>0 && m_mgrid.m_A->GetCell(i-1,j,k)==FLUID) || 
-                                                (i<x && m_mgrid.m_A->GetCell(i,j,k)==FLUID));
-                        wallmark[0]->SetCell(i,j,k,(i<=0 || m_mgrid.m_A->GetCell(i-1,j,k)==SOLID) && 
-                                                   (i>=x || m_mgrid.m_A->GetCell(i,j,k)==SOLID));
+//Flat indices of the in-bounds neighbors of face f within its own face grid, returns how many
+inline unsigned int GetFaceNeighbors(const unsigned int& f, const unsigned int& sx,
+                                     const unsigned int& sy, const int* bounds, 
+                                     unsigned int* neighbors){
+    int i = f/sx; int j = (f-i*sx)/sy; int k = f-i*sx-j*sy;
+    unsigned int count = 0;
+    if(i>0){ neighbors[count++] = f-sx; }
+    if(i<bounds[0]-1){ neighbors[count++] = f+sx; }
+    if(j>0){ neighbors[count++] = f-sy; }
+    if(j<bounds[1]-1){ neighbors[count++] = f+sy; }
+    if(k>0){ neighbors[count++] = f-1; }
+    if(k<bounds[2]-1){ neighbors[count++] = f+1; }
+    return count;
+}
+
+//Extrapolates face velocities outward from faces that touch fluid, one layer of faces per pass
+//for m_extrapolationLayers passes. Each pass only visits the current front, so the work follows
+//the liquid surface instead of the box. The layer count is capped below the tile band, so the
+//front never reaches faces outside the active tiles whose scratch state is stale
+void FlipSim::ExtrapolateVelocity(){
+    int dims[3] = {(int)m_dimensions.x, (int)m_dimensions.y, (int)m_dimensions.z};
+    int layers = glm::clamp(m_settings.m_extrapolationLayers, 1, GRID_BRICK_SIZE-2);
+    unsigned char* a = m_mgrid.m_A->GetRawData();
+    unsigned int asx = m_mgrid.m_A->GetStrideX(); unsigned int asy = m_mgrid.m_A->GetStrideY();
+
+    Grid<float>* faces[3] = {m_mgrid.m_u_x, m_mgrid.m_u_y, m_mgrid.m_u_z};
+    for(int n=0; n<3; ++n){
+        float* u = faces[n]->GetRawData();
+        unsigned int sx = faces[n]->GetStrideX(); unsigned int sy = faces[n]->GetStrideY();
+        int bounds[3] = {dims[0]+(n==0), dims[1]+(n==1), dims[2]+(n==2)};
+        std::vector<int>& depthArray = m_extrapolationDepth[n];
+        if(depthArray.size()!=faces[n]->GetNumberOfCells()){
+            depthArray.assign(faces[n]->GetNumberOfCells(), EXTRAPOLATION_UNKNOWN);
+        }
+        int* depth = depthArray.data();
+
+        //faces with fluid on either side are known
+        ForEachActiveTile(&m_tiles, n, [=](const int* lo, const int* hi){
+            for(int i=lo[0]; i<hi[0]; ++i){
+                for(int j=lo[1]; j<hi[1]; ++j){
+                    for(int k=lo[2]; k<hi[2]; ++k){
+                        int c[3] = {i,j,k};
+                        bool fluid = c[n]<dims[n] && a[c[0]*asx + c[1]*asy + c[2]]==FLUID;
+                        c[n]--;
+                        fluid = fluid || (c[n]>=0 && a[c[0]*asx + c[1]*asy + c[2]]==FLUID);
+                        depth[i*sx + j*sy + k] = fluid ? 0 : EXTRAPOLATION_UNKNOWN;
                     }
                 }
             }
-        }
-    );
-    //for every y face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(unsigned int j = 0; j < y+1; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        mark[1]->SetCell(i,j,k, (j>0 && m_mgrid.m_A->GetCell(i,j-1,k)==FLUID) || 
-                                                (j<y && m_mgrid.m_A->GetCell(i,j,k)==FLUID));
-                        wallmark[1]->SetCell(i,j,k,(j<=0 || m_mgrid.m_A->GetCell(i,j-1,k)==SOLID) && 
-                                                   (j>=y || m_mgrid.m_A->GetCell(i,j,k)==SOLID));
+        });
+        //tiles that just dropped out may still hold known faces from an earlier step
+        for(unsigned int t=0; t<m_tiles.m_releasedTiles.size(); t++){
+            int lo[3]; int hi[3];
+            GetTileBounds(&m_tiles, m_tiles.m_releasedTiles[t], n, lo, hi);
+            for(int i=lo[0]; i<hi[0]; ++i){
+                for(int j=lo[1]; j<hi[1]; ++j){
+                    for(int k=lo[2]; k<hi[2]; ++k){
+                        depth[i*sx + j*sy + k] = EXTRAPOLATION_UNKNOWN;
                     }
                 }
             }
         }
-    );
-    //for every z face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){     
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        mark[2]->SetCell(i,j,k, (k>0 && m_mgrid.m_A->GetCell(i,j,k-1)==FLUID) || 
-                                                (k<z && m_mgrid.m_A->GetCell(i,j,k)==FLUID));
-                        wallmark[2]->SetCell(i,j,k,(k<=0 || m_mgrid.m_A->GetCell(i,j,k-1)==SOLID) && 
-                                                   (k>=z || m_mgrid.m_A->GetCell(i,j,k)==SOLID));
+        //the first front is every unknown face next to a known one
+        ForEachActiveTile(&m_tiles, n, [&](const int* lo, const int* hi){
+            std::vector<unsigned int>& local = m_extrapolationLocal.local();
+            for(int i=lo[0]; i<hi[0]; ++i){
+                for(int j=lo[1]; j<hi[1]; ++j){
+                    for(int k=lo[2]; k<hi[2]; ++k){
+                        unsigned int f = i*sx + j*sy + k;
+                        if(depth[f]!=EXTRAPOLATION_UNKNOWN){
+                            continue;
+                        }
+                        unsigned int q[6];
+                        unsigned int qcount = GetFaceNeighbors(f, sx, sy, bounds, q);
+                        for(unsigned int qk=0; qk<qcount; ++qk){
+                            if(depth[q[qk]]==0){
+                                local.push_back(f);
+                                break;
+                            }
+                        }
                     }
                 }
             }
-        }
-    );
+        });
+        GatherExtrapolationFront();
 
-    //extrapolate
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y+1; ++j){ 
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        for(unsigned int n=0; n<3; ++n){
-                            if(n!=0 && i>x-1){ continue; };
-                            if(n!=1 && j>y-1){ continue; };
-                            if(n!=2 && k>z-1){ continue; };
-                            if(!mark[n]->GetCell(i,j,k) && wallmark[n]->GetCell(i,j,k)){
-                                unsigned int wsum = 0;
-                                float sum = 0.0f;
-                                glm::vec3 q[6] = { glm::vec3(i-1,j,k), glm::vec3(i+1,j,k), 
-                                                   glm::vec3(i,j-1,k), glm::vec3(i,j+1,k), 
-                                                   glm::vec3(i,j,k-1), glm::vec3(i,j,k+1) };
-                                for(unsigned int qk=0; qk<6; ++qk){
-                                    if(q[qk][0]>=0 && q[qk][0]<x+(n==0) && q[qk][1]>=0 && 
-                                       q[qk][1]<y+(n==1) && q[qk][2]>=0 && q[qk][2]<z+(n==2) ) {
-                                        if(mark[n]->GetCell(q[qk][0],q[qk][1],q[qk][2])){
-                                            wsum ++;
-                                            if(n==0){
-                                                sum += m_mgrid.m_u_x->GetCell(q[qk][0],q[qk][1],
-                                                                          q[qk][2]);
-                                            }else if(n==1){
-                                                sum += m_mgrid.m_u_y->GetCell(q[qk][0],q[qk][1],
-                                                                          q[qk][2]);
-                                            }else if(n==2){
-                                                sum += m_mgrid.m_u_z->GetCell(q[qk][0],q[qk][1],
-                                                                          q[qk][2]);
-                                            }
-                                        }
-                                    }
-                                }
-                                if(wsum){
-                                    if(n==0){
-                                        m_mgrid.m_u_x->SetCell(i,j,k,sum/wsum);
-                                    }else if(n==1){
-                                        m_mgrid.m_u_y->SetCell(i,j,k,sum/wsum);
-                                    }else if(n==2){
-                                        m_mgrid.m_u_z->SetCell(i,j,k,sum/wsum);
-                                    }
-                                }
+        for(int layer=1; layer<=layers && m_extrapolationFront.empty()==false; layer++){
+            unsigned int frontCount = m_extrapolationFront.size();
+            m_extrapolationValues.resize(frontCount);
+            const unsigned int* front = m_extrapolationFront.data();
+            float* values = m_extrapolationValues.data();
+            //average the faces finished by earlier layers. Values are staged so every face in
+            //the layer reads the same inputs regardless of scheduling
+            tbb::parallel_for(tbb::blocked_range<unsigned int>(0,frontCount),
+                [=](const tbb::blocked_range<unsigned int>& r){
+                    for(unsigned int t=r.begin(); t!=r.end(); ++t){
+                        unsigned int q[6];
+                        unsigned int qcount = GetFaceNeighbors(front[t], sx, sy, bounds, q);
+                        unsigned int wsum = 0;
+                        float sum = 0.0f;
+                        for(unsigned int qk=0; qk<qcount; ++qk){
+                            if(depth[q[qk]]<layer){
+                                wsum++;
+                                sum += u[q[qk]];
                             }
                         }
+                        values[t] = wsum ? sum/wsum : u[front[t]];
+                    }
+                }
+            );
+            tbb::parallel_for(tbb::blocked_range<unsigned int>(0,frontCount),
+                [=](const tbb::blocked_range<unsigned int>& r){
+                    for(unsigned int t=r.begin(); t!=r.end(); ++t){
+                        u[front[t]] = values[t];
+                        depth[front[t]] = layer;
                     }
                 }
+            );
+            if(layer==layers){
+                break;
             }
+            //the next front is every still unknown neighbor of this one
+            tbb::parallel_for(tbb::blocked_range<unsigned int>(0,frontCount),
+                [&](const tbb::blocked_range<unsigned int>& r){
+                    std::vector<unsigned int>& local = m_extrapolationLocal.local();
+                    for(unsigned int t=r.begin(); t!=r.end(); ++t){
+                        unsigned int q[6];
+                        unsigned int qcount = GetFaceNeighbors(front[t], sx, sy, bounds, q);
+                        for(unsigned int qk=0; qk<qcount; ++qk){
+                            if(depth[q[qk]]==EXTRAPOLATION_UNKNOWN){
+                                local.push_back(q[qk]);
+                            }
+                        }
+                    }
+                }
+            );
+            GatherExtrapolationFront();
         }
-    );
-    for(unsigned int i=0; i<3; i++){
-        delete mark[i];
-        delete wallmark[i];
     }
-    delete mark;
-    delete wallmark;
+}
+
+//Moves the per thread front candidates into m_extrapolationFront, sorted and without repeats.
+//Thread local vectors keep their capacity for the next gather
+void FlipSim::GatherExtrapolationFront(){
+    m_extrapolationFront.clear();
+    for(tbb::enumerable_thread_specific<std::vector<unsigned int> >::iterator 
+        it=m_extrapolationLocal.begin(); it!=m_extrapolationLocal.end(); ++it){
+        m_extrapolationFront.insert(m_extrapolationFront.end(), it->begin(), it->end());
+        it->clear();
+    }
+    tbb::parallel_sort(m_extrapolationFront.begin(), m_extrapolationFront.end());
+    m_extrapolationFront.erase(std::unique(m_extrapolationFront.begin(), 
+                                           m_extrapolationFront.end()), 
+                               m_extrapolationFront.end());
 }
 
 void FlipSim::SubtractPressureGradient(){
-    unsigned int x = (unsigned int)m_dimensions.x; unsigned int y = (unsigned int)m_dimensions.y; 
-    unsigned int z = (unsigned int)m_dimensions.z;
+    if(m_subcell){
+        SubtractPressureGradient<true>();
+    }else{
+        SubtractPressureGradient<false>();
+    }
+}
+
+//Faces on the domain walls have no back cell and are left alone, every other face of an active
+//tile takes the branch free row kernel
+template <bool Subcell> void FlipSim::SubtractPressureGradient(){
+    int x = (int)m_dimensions.x; int y = (int)m_dimensions.y; int z = (int)m_dimensions.z;
 
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
     float h = 1.0f/maxd; //cell width
 
-    //for every x face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        if(i>0 && i<x){
-                            float pf = m_mgrid.m_P->GetCell(i,j,k);
-                            float pb = m_mgrid.m_P->GetCell(i-1,j,k);
-                            if(m_subcell && m_mgrid.m_L->GetCell(i,j,k) * 
-                               m_mgrid.m_L->GetCell(i-1,j,k) < 0.0f){
-                                if(m_mgrid.m_L->GetCell(i,j,k)<0.0f){
-                                    pf = m_mgrid.m_P->GetCell(i,j,k);
-                                }else{
-                                    pf = m_mgrid.m_L->GetCell(i,j,k)/
-                                         glm::min(1.0e-3f,m_mgrid.m_L->GetCell(i-1,j,k))*
-                                                  m_mgrid.m_P->GetCell(i-1,j,k);
-                                }
-                                if(m_mgrid.m_L->GetCell(i-1,j,k)<0.0f){
-                                    pb = m_mgrid.m_P->GetCell(i-1,j,k);
-                                }else{
-                                    pb = m_mgrid.m_L->GetCell(i-1,j,k)/
-                                         glm::min(1.0e-6f,m_mgrid.m_L->GetCell(i,j,k))*
-                                                  m_mgrid.m_P->GetCell(i,j,k);
-                                }               
-                            }
-                            float xval = m_mgrid.m_u_x->GetCell(i,j,k);
-                            xval -= (pf-pb)/h;
-                            m_mgrid.m_u_x->SetCell(i,j,k,xval);
-                        }
-                    }
-                }
-            } 
-        }
-    );
-    //for every y face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y+1; ++j){
-                    for(unsigned int k = 0; k < z; ++k){
-                        if(j>0 && j<y){
-                            float pf = m_mgrid.m_P->GetCell(i,j,k);
-                            float pb = m_mgrid.m_P->GetCell(i,j-1,k);   
-                            if(m_subcell && m_mgrid.m_L->GetCell(i,j,k) * 
-                               m_mgrid.m_L->GetCell(i,j-1,k) < 0.0f){
-                                if(m_mgrid.m_L->GetCell(i,j,k)<0.0f){
-                                    pf = m_mgrid.m_P->GetCell(i,j,k);
-                                }else{
-                                    pf = m_mgrid.m_L->GetCell(i,j,k)/
-                                         glm::min(1.0e-3f,m_mgrid.m_L->GetCell(i,j-1,k))*
-                                                  m_mgrid.m_P->GetCell(i,j-1,k);
-                                }
-                                if(m_mgrid.m_L->GetCell(i,j-1,k)<0.0f){
-                                    pb = m_mgrid.m_P->GetCell(i,j-1,k);
-                                }else{
-                                    pb = m_mgrid.m_L->GetCell(i,j-1,k)/
-                                         glm::min(1.0e-6f,m_mgrid.m_L->GetCell(i,j,k))*
-                                                  m_mgrid.m_P->GetCell(i,j,k);
-                                }   
-                            }
-                            float yval = m_mgrid.m_u_y->GetCell(i,j,k);
-                            yval -= (pf-pb)/h;
-                            m_mgrid.m_u_y->SetCell(i,j,k,yval);
-                        }       
-                    } 
-                }
+    const float* p = m_mgrid.m_P->GetRawData();
+    const float* l = m_mgrid.m_L->GetRawData();
+    unsigned int sx = m_mgrid.m_P->GetStrideX(); unsigned int sy = m_mgrid.m_P->GetStrideY();
+    Grid<float>* faces[3] = {m_mgrid.m_u_x, m_mgrid.m_u_y, m_mgrid.m_u_z};
+    unsigned int offsets[3] = {sx, sy, 1};
+    int limits[3] = {x, y, z};
+    for(int axis=0; axis<3; axis++){
+        float* u = faces[axis]->GetRawData();
+        unsigned int fsx = faces[axis]->GetStrideX(); unsigned int fsy = faces[axis]->GetStrideY();
+        unsigned int offset = offsets[axis];
+        int limit = limits[axis];
+        ForEachActiveTile(&m_tiles, axis, [=](const int* lo, const int* hi){
+            int begin[3] = {lo[0], lo[1], lo[2]}; int end[3] = {hi[0], hi[1], hi[2]};
+            begin[axis] = glm::max(begin[axis], 1);
+            end[axis] = glm::min(end[axis], limit);
+            if(begin[2]>=end[2]){
+                return;
             }
-        }
-    );
-    //for every z face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        if(k>0 && k<z){
-                            float pf = m_mgrid.m_P->GetCell(i,j,k);
-                            float pb = m_mgrid.m_P->GetCell(i,j,k-1);
-                            if(m_subcell && m_mgrid.m_L->GetCell(i,j,k) * 
-                               m_mgrid.m_L->GetCell(i,j,k-1) < 0.0f){
-                                if(m_mgrid.m_L->GetCell(i,j,k)<0.0f){
-                                    pf = m_mgrid.m_P->GetCell(i,j,k);
-                                }else{
-                                    pf = m_mgrid.m_L->GetCell(i,j,k)/
-                                         glm::min(1.0e-3f,m_mgrid.m_L->GetCell(i,j,k-1))*
-                                                  m_mgrid.m_P->GetCell(i,j,k-1);
-                                }
-                                if(m_mgrid.m_L->GetCell(i,j,k-1)<0.0f){
-                                    pb = m_mgrid.m_P->GetCell(i,j,k-1);
-                                }else{
-                                    pb = m_mgrid.m_L->GetCell(i,j,k-1)/
-                                         glm::min(1.0e-6f,m_mgrid.m_L->GetCell(i,j,k))*
-                                                  m_mgrid.m_P->GetCell(i,j,k);
-                                }   
-                            }
-                            float zval = m_mgrid.m_u_z->GetCell(i,j,k);
-                            zval -= (pf-pb)/h;
-                            m_mgrid.m_u_z->SetCell(i,j,k,zval);
-                        }       
-                    } 
+            for(int i=begin[0]; i<end[0]; ++i){
+                for(int j=begin[1]; j<end[1]; ++j){
+                    SubtractPressureGradientRow<Subcell>(p, l, u, i*sx + j*sy + begin[2],
+                                                         i*fsx + j*fsy + begin[2],
+                                                         end[2]-begin[2], offset, h);
                 }
             }
-        }
-    );
+        });
+    }
 }
 
 void FlipSim::ApplyExternalForces(){
     std::vector<glm::vec3> externalForces = m_scene->GetExternalForces();
     unsigned int numberOfExternalForces = externalForces.size();
-    unsigned int particlecount = m_particles.size();
+    //solid velocities are never read, so only the liquids at the front of the set are pushed
+    unsigned int particlecount = m_scene->GetLiquidParticleCount();
+    glm::vec3* vel = m_particles.m_u.data();
+    //forces are constant across particles, so sum them once
+    glm::vec3 dv(0.0f);
+    for(unsigned int j=0; j<numberOfExternalForces; j++){
+        dv += externalForces[j]*m_substep;
+    }
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j=0; j<numberOfExternalForces; j++){
-                    m_particles[i]->m_u += externalForces[j]*m_stepsize;
-                }
+                vel[i] += dv;
             }
         }
     );
@@ -698,34 +1249,60 @@ void FlipSim::ComputeDensity(){
 
     float maxd = glm::max(glm::max(m_dimensions.x, m_dimensions.z), m_dimensions.y);
 
-    unsigned int particlecount = m_particles.size();
+    unsigned int particlecount = GetParticleCount(&m_particles);
+    glm::vec3* pos = m_particles.m_p.data();
+    float* density = m_particles.m_density.data();
+    float* mass = m_particles.m_mass.data();
+    int* type = m_particles.m_type.data();
+    if(m_settings.m_neighborLists==true){
+        //the density kernel reaches past the lists, so it sums over the full gather the lists
+        //are built from. Sums run in the same order as below
+        float h = 4.0f*m_density/maxd;
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    density[i] = 0.0f;
+                }
+            }
+        );
+        m_neighbors.Build(m_pgrid, &m_particles, maxd, 1.0f/maxd, m_neighborSkin, 
+                          [=](const unsigned int& i, const unsigned int& n){
+            density[i] = density[i] + mass[n]*mathCore::Smooth(mathCore::Sqrlength(pos[n], 
+                                                                                  pos[i]), h);
+        });
+        float maxDensity = m_max_density;
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    density[i] = type[i]==SOLID ? 1.0f : density[i]/maxDensity;
+                }
+            }
+        );
+        return;
+    }
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particlecount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
                 //Find neighbours
-                if(m_particles[i]->m_type==SOLID){
-                    m_particles[i]->m_density = 1.0f;
+                if(type[i]==SOLID){
+                    density[i] = 1.0f;
                 }else{
-                    glm::vec3 position = m_particles[i]->m_p;
+                    glm::vec3 position = pos[i];
 
                     position.x = (int)glm::max(0.0f,glm::min((int)maxd-1.0f,(int)maxd*position.x));
                     position.y = (int)glm::max(0.0f,glm::min((int)maxd-1.0f,(int)maxd*position.y));
                     position.z = (int)glm::max(0.0f,glm::min((int)maxd-1.0f,(int)maxd*position.z));
-                    std::vector<Particle *> neighbors;
-                    neighbors = m_pgrid->GetCellNeighbors(position, glm::vec3(1));
                     float weightsum = 0.0f;
-                    unsigned int neighborscount = neighbors.size();
-                    for(unsigned int m=0; m<neighborscount; m++){
-                        // if(neighbors[m]->m_type!=SOLID){
-                            float sqd = mathCore::Sqrlength(neighbors[m]->m_p, 
-                                                            m_particles[i]->m_p);
+                    m_pgrid->ForEachCellNeighbor(position, glm::vec3(1), 
+                                                 [&](const unsigned int& n){
+                        // if(type[n]!=SOLID){
+                            float sqd = mathCore::Sqrlength(pos[n], pos[i]);
                             //TODO: figure out a better density smooth approx than density/maxd
-                            float weight = neighbors[m]->m_mass * 
-                                           mathCore::Smooth(sqd, 4.0f*m_density/maxd);
+                            float weight = mass[n] * mathCore::Smooth(sqd, 4.0f*m_density/maxd);
                             weightsum = weightsum + weight;
                         // }
-                    }
-                    m_particles[i]->m_density = weightsum/m_max_density;
+                    });
+                    density[i] = weightsum/m_max_density;
                 }
             }
         }
@@ -740,7 +1317,7 @@ bool FlipSim::IsCellFluid(const int& x, const int& y, const int& z){
     }
 }
 
-std::vector<Particle*>* FlipSim::GetParticles(){
+ParticleSet* FlipSim::GetParticles(){
     return &m_particles;
 }
 
@@ -752,15 +1329,51 @@ sceneCore::Scene* FlipSim::GetScene(){
     return m_scene; 
 }
 
-FlipTask::FlipTask(FlipSim* sim, bool dumpVDB, bool dumpOBJ, bool dumpPARTIO){
-    m_sim = sim;
-    m_dumpPARTIO = dumpPARTIO;
-    m_dumpOBJ = dumpOBJ;
-    m_dumpVDB = dumpVDB;
+//Grids are allocated one cell wider than their dimensions on every axis
+static size_t EstimateGridCells(const glm::vec3& dimensions){
+    return (size_t)(dimensions.x+1)*(size_t)(dimensions.y+1)*(size_t)(dimensions.z+1);
 }
 
-tbb::task* FlipTask::execute(){
-    m_sim->Step(m_dumpVDB, m_dumpOBJ, m_dumpPARTIO);
-    return NULL;
+void FlipSim::EstimateMemory(const glm::vec3& dimensions, const float& density,
+                             const SimSettings& settings, size_t* bytes){
+    for(unsigned int s=0; s<MEMORY_SUBSYSTEM_COUNT; s++){
+        bytes[s] = 0;
+    }
+    glm::vec3 x(1,0,0); glm::vec3 y(0,1,0); glm::vec3 z(0,0,1);
+    size_t cells = EstimateGridCells(dimensions);
+    size_t faces = EstimateGridCells(dimensions+x) + EstimateGridCells(dimensions+y) + 
+                   EstimateGridCells(dimensions+z);
+    //the macgrid: faces, D, P and L as floats, A as bytes and N as shorts. The velocity history
+    //only holds faces, as halves in compact storage
+    size_t macgrid = (faces+3*cells)*sizeof(float) + cells*sizeof(unsigned char) + 
+                     cells*sizeof(unsigned short);
+    size_t history = faces*(settings.m_compactStorage ? sizeof(unsigned short) : sizeof(float));
+    //the solver's R, Z, Q and MIC preconditioner, or R, Z, Q and four floats and a cell type
+    //byte per cell summed over the coarse multigrid levels
+    size_t solver = 4*cells*sizeof(float);
+    if(settings.m_preconditioner==PRECONDITIONER_MULTIGRID){
+        solver = 3*cells*sizeof(float) + (4*cells*sizeof(float) + cells)/7;
+    }
+    size_t transfer = settings.m_p2gMode==P2G_SCATTER ? faces*sizeof(float) : 0;
+    //one int of extrapolation depth per face
+    bytes[MEMORY_GRIDS] = macgrid + history + std::max(solver, transfer) + faces*sizeof(int);
+    if(settings.m_narrowBand>0){
+        //the band distance, its scratch comes from the pool the solver's does
+        bytes[MEMORY_GRIDS] += cells*sizeof(float);
+    }
+
+    //every array of a ParticleSet, scratch included
+    size_t particleBytes = 7*sizeof(glm::vec3) + 3*sizeof(float) + sizeof(unsigned char) + 
+                           2*sizeof(int);
+    size_t particles = (size_t)(cells/(density*density*density));
+    bytes[MEMORY_PARTICLES] = particles*particleBytes;
+    //bin index and sorted order per particle, a count and an offset per cell
+    size_t particleGrid = particles*2*sizeof(unsigned int) + cells*2*sizeof(unsigned int);
+    if(settings.m_neighborLists==true){
+        //an offset per particle and every particle within the one cell radius
+        size_t neighbors = (size_t)(4.19f/(density*density*density));
+        particleGrid += particles*(neighbors+1)*sizeof(unsigned int);
+    }
+    bytes[MEMORY_PARTICLE_GRID] = particleGrid;
 }
 }
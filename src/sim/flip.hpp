@@ -8,9 +8,24 @@
 #define FLIP_HPP
 
 #include <tbb/tbb.h>
+#include <tbb/flow_graph.h>
 #include "../grid/macgrid.inl"
 #include "../grid/particlegrid.hpp"
+#include "../grid/neighborlist.hpp"
+#include "../grid/tilemask.inl"
+#include "../grid/gridpool.hpp"
 #include "../scene/scene.hpp"
+#include "simsettings.inl"
+#if defined(ARIEL_USE_CUDA)
+#include "cudasolver.hpp"
+#endif
+
+//extrapolation depth of a face no layer has reached yet
+#define EXTRAPOLATION_UNKNOWN 0x7fffffff
+
+namespace benchCore {
+class KernelBench;
+}
 
 namespace fluidCore {
 //====================================
@@ -18,40 +33,95 @@ namespace fluidCore {
 //====================================
 
 class FlipSim{
+    //ariel_bench drives single stages of a step
+    friend class benchCore::KernelBench;
     public:
         FlipSim(const glm::vec3& maxres, const float& density, const float& stepsize, 
                 sceneCore::Scene* scene, const bool& verbose);
+        FlipSim(const glm::vec3& maxres, const float& density, const float& stepsize, 
+                sceneCore::Scene* scene, const SimSettings& settings, const bool& verbose);
         ~FlipSim();
 
         void Init();
+        //Advances one frame of m_stepsize seconds. Emission runs at the start of the frame and
+        //export at the end, with one or more substeps in between
         void Step(bool saveVDB, bool saveOBJ, bool savePARTIO);
 
-        std::vector<Particle*>* GetParticles();
+        //Restores a saved step in place of Init. The scene, step size and sim settings are the
+        //current ones, so a checkpoint can be branched with different settings as long as the
+        //grid resolution matches
+        bool LoadCheckpoint(const std::string& filename);
+        void SaveCheckpoint(const std::string& filename, const bool& compress);
+        //every interval frames Step saves a checkpoint named after path with the frame number
+        //inserted before the extension
+        void SetCheckpointing(const std::string& path, const int& interval, const bool& compress);
+
+        ParticleSet* GetParticles();
         glm::vec3 GetDimensions();
         sceneCore::Scene* GetScene();
 
+        //Upper bound on what a sim of these dimensions holds, the liquid filling the whole box.
+        //bytes takes one entry per memorysubsystem, the scene's meshes and level sets and the
+        //viewer are left at 0
+        static void EstimateMemory(const glm::vec3& dimensions, const float& density,
+                                   const SimSettings& settings, size_t* bytes);
+
         int                                     m_frame;
 
     private:
+        void ComputeMaxDensity();
+        void Substep(const float& dt);
+        float ComputeSubstep(const float& remaining);
         void StoreTempParticleVelocities();
         void CheckParticleSolidConstraints();
         void AdjustParticlesStuckInSolids();
         void ComputeDensity();
         void ApplyExternalForces();
-        void SubtractPreviousGrid();
         void StorePreviousGrid();
         void SubtractPressureGradient();
+        template <bool Subcell> void SubtractPressureGradient();
         void ExtrapolateVelocity();
+        void GatherExtrapolationFront();
         void Project();
-        void SolvePicFlip();
+        bool SolveOnDevice();
         void AdvectParticles();
+        void AdvectInteriorVelocity(Grid<float>** interior);
+        void RebandParticles();
+        void RefreshNeighbors();
+        void UpdateMemoryUsage();
         bool IsCellFluid(const int& x, const int& y, const int& z);
+        unsigned int CountFluidCells();
 
         glm::vec3                               m_dimensions;
-        std::vector<Particle*>                  m_particles;
+        ParticleSet                             m_particles;
         MacGrid                                 m_mgrid;
-        MacGrid                                 m_mgrid_previous;
+        VelocityHistory                         m_mgrid_previous;
         ParticleGrid*                           m_pgrid;
+        //built with the density pass after the substep's sort, while m_settings.m_neighborLists
+        //is set. Whenever it is rebuilt m_pgrid has just been sorted
+        NeighborList                            m_neighbors;
+        float                                   m_neighborSkin;
+        TileMask                                m_tiles;
+        //scratch grids for the solver and transfers, reused between iterations and steps
+        GridPool<float>                         m_floatPool;
+        GridPool<unsigned char>                 m_cellPool;
+
+        //extrapolation scratch, kept between steps so nothing is allocated per step. Depth is
+        //the layer a face was filled on, 0 for faces next to fluid
+        std::vector<int>                        m_extrapolationDepth[3];
+        std::vector<unsigned int>               m_extrapolationFront;
+        std::vector<float>                      m_extrapolationValues;
+        tbb::enumerable_thread_specific<std::vector<unsigned int> >   m_extrapolationLocal;
+
+        //narrow band FLIP only, NULL otherwise. Layered distance in cells to the liquid surface,
+        //rebuilt from the cell types every substep and advected with the grid, so the interior
+        //the particles were culled from moves with the liquid around it
+        Grid<float>*                            m_bandSDF;
+        //reband scratch, kept between frames. Fill holds the culled cells' centers for export
+        std::vector<unsigned int>               m_bandKept;
+        std::vector<glm::vec3>                  m_bandSeeds;
+        std::vector<glm::vec3>                  m_bandSeedVelocities;
+        std::vector<glm::vec3>                  m_bandFill;
 
         int                                     m_subcell;
         float                                   m_density;
@@ -60,21 +130,28 @@ class FlipSim{
         float                                   m_picflipratio;
 
         sceneCore::Scene*                       m_scene;
+        SimSettings                             m_settings;
+#if defined(ARIEL_USE_CUDA)
+        CudaSolver*                             m_cudaSolver; //created on first device solve
+#endif
 
         bool                                    m_verbose;
-        float                                   m_stepsize;
-};
+        float                                   m_stepsize; //frame length
+        float                                   m_substep; //length of the running substep
+        //fastest liquid particle or sampled grid velocity of the last advection, sets the
+        //length of the next substep
+        float                                   m_maxVelocity;
+        //set on frames that reorder particles when m_reorderInterval is above 0, cleared by
+        //the first substep's sort
+        bool                                    m_reorderPending;
 
-class FlipTask: public tbb::task {
-    public:
-        FlipTask(FlipSim* sim, bool dumpVDB, bool dumpOBJ, bool dumpPARTIO);
+        std::string                             m_checkpointPath;
+        int                                     m_checkpointInterval;
+        bool                                    m_checkpointCompress;
 
-        tbb::task* execute();
-    private:
-        FlipSim*                                m_sim;
-        bool                                    m_dumpPARTIO;
-        bool                                    m_dumpOBJ;
-        bool                                    m_dumpVDB;
+        utilityCore::MemoryRecord               m_particleMemory;
+        utilityCore::MemoryRecord               m_particleGridMemory; //bins and neighbor lists
+        utilityCore::MemoryRecord               m_scratchMemory; //extrapolation scratch
 };
 }
 
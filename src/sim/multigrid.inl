@@ -0,0 +1,335 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: multigrid.inl
+// Geometric multigrid V-cycle used as a preconditioner for the PCG pressure solve (MGPCG)
+
+#ifndef MULTIGRID_INL
+#define MULTIGRID_INL
+
+#include <tbb/tbb.h>
+#include <vector>
+#include "../grid/macgrid.inl"
+#include "../grid/gridpool.hpp"
+#include "../utilities/utilities.h"
+
+namespace fluidCore {
+//====================================
+// Struct and Function Declarations
+//====================================
+
+//One level of the multigrid hierarchy. Level 0 borrows the macgrid's cell types, coarser levels
+//own theirs
+struct MultigridLevel{
+    glm::vec3               m_dimensions;
+    Grid<unsigned char>*    m_A; //cell type
+    Grid<float>*            m_diag; //diagonal of the level's operator
+    Grid<float>*            m_x; //solution
+    Grid<float>*            m_b; //right hand side
+    Grid<float>*            m_r; //residual
+};
+
+//Forward declarations for externed inlineable methods
+extern inline std::vector<MultigridLevel> BuildMultigrid(MacGrid& mgrid, const int& subcell,
+                                                         GridPool<float>* floatPool,
+                                                         GridPool<unsigned char>* cellPool);
+extern inline void DeleteMultigrid(std::vector<MultigridLevel>& levels, 
+                                   GridPool<float>* floatPool, GridPool<unsigned char>* cellPool);
+extern inline void ApplyMultigridPreconditioner(std::vector<MultigridLevel>& levels,
+                                                Grid<float>* Z, Grid<float>* R);
+inline void MultigridResidual(MultigridLevel& level);
+inline void MultigridSmooth(MultigridLevel& level, const unsigned int& iterations);
+inline void MultigridRestrict(MultigridLevel& fine, MultigridLevel& coarse);
+inline void MultigridProlongate(MultigridLevel& coarse, MultigridLevel& fine);
+inline void MultigridVCycle(std::vector<MultigridLevel>& levels, const unsigned int& l);
+
+//====================================
+// Function Implementations
+//====================================
+
+//Builds the level hierarchy from the current cell classification. The finest operator matches
+//ComputeAx exactly, including ghost fluid air terms, coarser levels are rediscretized. Level
+//grids come from the pools and go back to them in DeleteMultigrid
+std::vector<MultigridLevel> BuildMultigrid(MacGrid& mgrid, const int& subcell,
+                                           GridPool<float>* floatPool,
+                                           GridPool<unsigned char>* cellPool){
+    std::vector<MultigridLevel> levels;
+
+    MultigridLevel finest;
+    finest.m_dimensions = mgrid.m_dimensions;
+    finest.m_A = mgrid.m_A;
+    levels.push_back(finest);
+
+    //coarsen until the grid gets too small to be worth another level
+    glm::vec3 dimensions = mgrid.m_dimensions;
+    while(glm::min(glm::min(dimensions.x, dimensions.y), dimensions.z)>4.0f && levels.size()<8){
+        MultigridLevel& fine = levels.back();
+        int fx = (int)fine.m_dimensions.x; int fy = (int)fine.m_dimensions.y;
+        int fz = (int)fine.m_dimensions.z;
+        dimensions = glm::ceil(dimensions/2.0f);
+        MultigridLevel coarse;
+        coarse.m_dimensions = dimensions;
+        coarse.m_A = cellPool->Acquire(dimensions, AIR);
+        int cx = (int)dimensions.x; int cy = (int)dimensions.y; int cz = (int)dimensions.z;
+        Grid<unsigned char>* fineA = fine.m_A;
+        Grid<unsigned char>* coarseA = coarse.m_A;
+        //a coarse cell is air if any child is air, otherwise fluid if any child is fluid
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cx),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    for(unsigned int j=0; j<cy; ++j){
+                        for(unsigned int k=0; k<cz; ++k){
+                            bool hasAir = false;
+                            bool hasFluid = false;
+                            for(unsigned int c=0; c<8; c++){
+                                int ci = 2*i+(c&1); int cj = 2*j+((c>>1)&1);
+                                int ck = 2*k+((c>>2)&1);
+                                if(ci<fx && cj<fy && ck<fz){
+                                    int type = fineA->GetCell(ci,cj,ck);
+                                    hasAir = hasAir || type==AIR;
+                                    hasFluid = hasFluid || type==FLUID;
+                                }
+                            }
+                            if(hasAir==true){
+                                coarseA->SetCell(i,j,k,AIR);
+                            }else if(hasFluid==true){
+                                coarseA->SetCell(i,j,k,FLUID);
+                            }else{
+                                coarseA->SetCell(i,j,k,SOLID);
+                            }
+                        }
+                    }
+                }
+            }
+        );
+        levels.push_back(coarse);
+    }
+
+    //allocate work grids and fill in operator diagonals
+    unsigned int levelCount = levels.size();
+    for(unsigned int l=0; l<levelCount; l++){
+        MultigridLevel& level = levels[l];
+        level.m_diag = floatPool->Acquire(level.m_dimensions, 0.0f);
+        level.m_x = floatPool->Acquire(level.m_dimensions, 0.0f);
+        level.m_b = floatPool->Acquire(level.m_dimensions, 0.0f);
+        level.m_r = floatPool->Acquire(level.m_dimensions, 0.0f);
+        int x = (int)level.m_dimensions.x; int y = (int)level.m_dimensions.y;
+        int z = (int)level.m_dimensions.z;
+        Grid<unsigned char>* A = level.m_A;
+        Grid<float>* diag = level.m_diag;
+        Grid<float>* L = mgrid.m_L;
+        bool ghostFluid = (l==0 && subcell);
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    for(unsigned int j=0; j<y; ++j){
+                        for(unsigned int k=0; k<z; ++k){
+                            if(A->GetCell(i,j,k)!=FLUID){
+                                continue;
+                            }
+                            float d = 6.0f;
+                            int ci = i; int cj = j; int ck = k;
+                            int q[][3] = { {ci-1,cj,ck}, {ci+1,cj,ck}, {ci,cj-1,ck},
+                                           {ci,cj+1,ck}, {ci,cj,ck-1}, {ci,cj,ck+1} };
+                            for(unsigned int m=0; m<6; m++){
+                                int qi = q[m][0]; int qj = q[m][1]; int qk = q[m][2];
+                                if(qi<0 || qi>x-1 || qj<0 || qj>y-1 || qk<0 || qk>z-1 ||
+                                   A->GetCell(qi,qj,qk)==SOLID){
+                                    d -= 1.0f;
+                                }else if(ghostFluid==true && A->GetCell(qi,qj,qk)==AIR){
+                                    d -= L->GetCell(qi,qj,qk)/
+                                         glm::min(1.0e-6f,L->GetCell(i,j,k));
+                                }
+                            }
+                            diag->SetCell(i,j,k,d);
+                        }
+                    }
+                }
+            }
+        );
+    }
+    return levels;
+}
+
+void DeleteMultigrid(std::vector<MultigridLevel>& levels, GridPool<float>* floatPool, 
+                     GridPool<unsigned char>* cellPool){
+    unsigned int levelCount = levels.size();
+    for(unsigned int l=0; l<levelCount; l++){
+        if(l>0){
+            cellPool->Release(levels[l].m_A);
+        }
+        floatPool->Release(levels[l].m_diag);
+        floatPool->Release(levels[l].m_x);
+        floatPool->Release(levels[l].m_b);
+        floatPool->Release(levels[l].m_r);
+    }
+    levels.clear();
+}
+
+//r = b - Ax for the level's operator
+void MultigridResidual(MultigridLevel& level){
+    int x = (int)level.m_dimensions.x; int y = (int)level.m_dimensions.y;
+    int z = (int)level.m_dimensions.z;
+    Grid<unsigned char>* A = level.m_A;
+    Grid<float>* diag = level.m_diag;
+    Grid<float>* X = level.m_x;
+    Grid<float>* B = level.m_b;
+    Grid<float>* R = level.m_r;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                for(unsigned int j=0; j<y; ++j){
+                    for(unsigned int k=0; k<z; ++k){
+                        if(A->GetCell(i,j,k)!=FLUID){
+                            R->SetCell(i,j,k,0.0f);
+                            continue;
+                        }
+                        float ax = diag->GetCell(i,j,k)*X->GetCell(i,j,k);
+                        int ci = i; int cj = j; int ck = k;
+                        int q[][3] = { {ci-1,cj,ck}, {ci+1,cj,ck}, {ci,cj-1,ck},
+                                       {ci,cj+1,ck}, {ci,cj,ck-1}, {ci,cj,ck+1} };
+                        for(unsigned int m=0; m<6; m++){
+                            int qi = q[m][0]; int qj = q[m][1]; int qk = q[m][2];
+                            if(qi>=0 && qi<x && qj>=0 && qj<y && qk>=0 && qk<z &&
+                               A->GetCell(qi,qj,qk)==FLUID){
+                                ax -= X->GetCell(qi,qj,qk);
+                            }
+                        }
+                        R->SetCell(i,j,k,B->GetCell(i,j,k)-ax);
+                    }
+                }
+            }
+        }
+    );
+}
+
+//Weighted Jacobi. Jacobi keeps the V-cycle symmetric, which PCG needs from its preconditioner
+void MultigridSmooth(MultigridLevel& level, const unsigned int& iterations){
+    int x = (int)level.m_dimensions.x; int y = (int)level.m_dimensions.y;
+    int z = (int)level.m_dimensions.z;
+    float omega = 2.0f/3.0f;
+    for(unsigned int n=0; n<iterations; n++){
+        MultigridResidual(level);
+        Grid<unsigned char>* A = level.m_A;
+        Grid<float>* diag = level.m_diag;
+        Grid<float>* X = level.m_x;
+        Grid<float>* R = level.m_r;
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    for(unsigned int j=0; j<y; ++j){
+                        for(unsigned int k=0; k<z; ++k){
+                            float d = diag->GetCell(i,j,k);
+                            if(A->GetCell(i,j,k)==FLUID && d>0.0f){
+                                X->SetCell(i,j,k,X->GetCell(i,j,k)+omega*R->GetCell(i,j,k)/d);
+                            }
+                        }
+                    }
+                }
+            }
+        );
+    }
+}
+
+//Coarse rhs from the fine residual. Doubling the cell width scales the unscaled stencil by 4,
+//so the coarse rhs is 4 times the average of the children
+void MultigridRestrict(MultigridLevel& fine, MultigridLevel& coarse){
+    int fx = (int)fine.m_dimensions.x; int fy = (int)fine.m_dimensions.y;
+    int fz = (int)fine.m_dimensions.z;
+    int cx = (int)coarse.m_dimensions.x; int cy = (int)coarse.m_dimensions.y;
+    int cz = (int)coarse.m_dimensions.z;
+    Grid<float>* fineR = fine.m_r;
+    Grid<unsigned char>* coarseA = coarse.m_A;
+    Grid<float>* coarseB = coarse.m_b;
+    Grid<float>* coarseX = coarse.m_x;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,cx),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                for(unsigned int j=0; j<cy; ++j){
+                    for(unsigned int k=0; k<cz; ++k){
+                        float sum = 0.0f;
+                        if(coarseA->GetCell(i,j,k)==FLUID){
+                            for(unsigned int c=0; c<8; c++){
+                                int ci = 2*i+(c&1); int cj = 2*j+((c>>1)&1);
+                                int ck = 2*k+((c>>2)&1);
+                                if(ci<fx && cj<fy && ck<fz){
+                                    sum += fineR->GetCell(ci,cj,ck);
+                                }
+                            }
+                        }
+                        coarseB->SetCell(i,j,k,0.5f*sum);
+                        coarseX->SetCell(i,j,k,0.0f);
+                    }
+                }
+            }
+        }
+    );
+}
+
+//Piecewise constant prolongation of the coarse correction
+void MultigridProlongate(MultigridLevel& coarse, MultigridLevel& fine){
+    int fx = (int)fine.m_dimensions.x; int fy = (int)fine.m_dimensions.y;
+    int fz = (int)fine.m_dimensions.z;
+    Grid<float>* coarseX = coarse.m_x;
+    Grid<unsigned char>* fineA = fine.m_A;
+    Grid<float>* fineX = fine.m_x;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,fx),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                for(unsigned int j=0; j<fy; ++j){
+                    for(unsigned int k=0; k<fz; ++k){
+                        if(fineA->GetCell(i,j,k)==FLUID){
+                            float correction = coarseX->GetCell(i/2,j/2,k/2);
+                            fineX->SetCell(i,j,k,fineX->GetCell(i,j,k)+correction);
+                        }
+                    }
+                }
+            }
+        }
+    );
+}
+
+void MultigridVCycle(std::vector<MultigridLevel>& levels, const unsigned int& l){
+    if(l==levels.size()-1){
+        MultigridSmooth(levels[l], 30);
+        return;
+    }
+    MultigridSmooth(levels[l], 2);
+    MultigridResidual(levels[l]);
+    MultigridRestrict(levels[l], levels[l+1]);
+    MultigridVCycle(levels, l+1);
+    MultigridProlongate(levels[l+1], levels[l]);
+    MultigridSmooth(levels[l], 2);
+}
+
+//z = M^-1 r with one V-cycle starting from zero
+void ApplyMultigridPreconditioner(std::vector<MultigridLevel>& levels, Grid<float>* Z,
+                                  Grid<float>* R){
+    MultigridLevel& finest = levels[0];
+    int x = (int)finest.m_dimensions.x; int y = (int)finest.m_dimensions.y;
+    int z = (int)finest.m_dimensions.z;
+    Grid<unsigned char>* A = finest.m_A;
+    Grid<float>* B = finest.m_b;
+    Grid<float>* X = finest.m_x;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                for(unsigned int j=0; j<y; ++j){
+                    for(unsigned int k=0; k<z; ++k){
+                        if(A->GetCell(i,j,k)==FLUID){
+                            B->SetCell(i,j,k,R->GetCell(i,j,k));
+                        }else{
+                            B->SetCell(i,j,k,0.0f);
+                        }
+                        X->SetCell(i,j,k,0.0f);
+                    }
+                }
+            }
+        }
+    );
+    MultigridVCycle(levels, 0);
+    Z->Copy(X);
+}
+}
+
+#endif
@@ -0,0 +1,235 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: narrowband.inl
+// Breakout file for narrow band FLIP, where only liquid near the surface is carried by particles
+
+#ifndef NARROWBAND_INL
+#define NARROWBAND_INL
+
+#include <tbb/tbb.h>
+#include "../grid/macgrid.inl"
+#include "../grid/particlegrid.hpp"
+#include "../grid/gridpool.hpp"
+#include "../utilities/utilities.h"
+#include "particlegridoperations.inl"
+
+namespace fluidCore {
+//====================================
+// Struct and Function Declarations
+//====================================
+
+//Forward declarations for externed inlineable methods
+extern inline void BuildBandSDF(Grid<unsigned char>* A, Grid<float>* sdf, const int& layers);
+extern inline void AdvectBandSDF(Grid<float>* sdf, MacGrid* mgrid, const float& dt,
+                                 GridPool<float>* pool);
+extern inline void MarkInteriorCells(Grid<float>* sdf, Grid<unsigned char>* A, Grid<float>* L,
+                                     const int& band);
+extern inline void AdvectInteriorFaces(ParticleGrid* pgrid, Grid<float>* sdf, MacGrid* mgrid,
+                                       const int& band, const float& dt, const glm::vec3& dv,
+                                       Grid<float>** interior);
+extern inline void StoreInteriorFaces(ParticleGrid* pgrid, Grid<float>* sdf, MacGrid* mgrid,
+                                      const int& band, Grid<float>** interior);
+template <typename F> void ForEachInteriorFace(ParticleGrid* pgrid, Grid<float>* sdf,
+                                               const int& band, const int& axis, const F& fn);
+
+//====================================
+// Function Implementations
+//====================================
+
+//Layered distance in cells from the cell centers to the liquid surface, negative in fluid cells.
+//Fluid cells next to air are -0.5 and air cells next to fluid 0.5, every further layer of
+//6-neighbors is one cell more, and cells past the last layer are clamped to layers+0.5. Solid
+//cells stay outside and never start a layer, so liquid along a wall counts as interior
+void BuildBandSDF(Grid<unsigned char>* A, Grid<float>* sdf, const int& layers){
+    int x = (int)sdf->GetDimensions().x; int y = (int)sdf->GetDimensions().y;
+    int z = (int)sdf->GetDimensions().z;
+    const unsigned char* a = A->GetRawData();
+    float* d = sdf->GetRawData();
+    unsigned int sx = sdf->GetStrideX(); unsigned int sy = sdf->GetStrideY();
+    float far = layers+0.5f;
+
+    tbb::parallel_for(tbb::blocked_range<int>(0,x),
+        [=](const tbb::blocked_range<int>& r){
+            for(int i=r.begin(); i!=r.end(); ++i){
+                for(int j=0; j<y; ++j){
+                    for(int k=0; k<z; ++k){
+                        unsigned int c = i*sx + j*sy + k;
+                        d[c] = a[c]==FLUID ? -far : far;
+                    }
+                }
+            }
+        }
+    );
+
+    //a pass only assigns cells that are still unassigned and only reads the previous layer's
+    //exact value, so the passes can update in place
+    for(int layer=1; layer<=layers; layer++){
+        float previous = layer-1.5f;
+        float current = layer-0.5f;
+        tbb::parallel_for(tbb::blocked_range<int>(0,x),
+            [=](const tbb::blocked_range<int>& r){
+                for(int i=r.begin(); i!=r.end(); ++i){
+                    for(int j=0; j<y; ++j){
+                        for(int k=0; k<z; ++k){
+                            unsigned int c = i*sx + j*sy + k;
+                            if(a[c]==SOLID || glm::abs(d[c])!=far){
+                                continue;
+                            }
+                            bool fluid = a[c]==FLUID;
+                            unsigned int neighbors[6];
+                            unsigned int count = 0;
+                            if(i>0){ neighbors[count++] = c-sx; }
+                            if(i<x-1){ neighbors[count++] = c+sx; }
+                            if(j>0){ neighbors[count++] = c-sy; }
+                            if(j<y-1){ neighbors[count++] = c+sy; }
+                            if(k>0){ neighbors[count++] = c-1; }
+                            if(k<z-1){ neighbors[count++] = c+1; }
+                            bool reached = false;
+                            for(unsigned int n=0; n<count && reached==false; n++){
+                                unsigned int b = neighbors[n];
+                                if(layer==1){
+                                    reached = a[b]!=SOLID && (a[b]==FLUID)!=fluid;
+                                }else{
+                                    reached = d[b]==(fluid ? -previous : previous);
+                                }
+                            }
+                            if(reached==true){
+                                d[c] = fluid ? -current : current;
+                            }
+                        }
+                    }
+                }
+            }
+        );
+    }
+}
+
+//Semi-Lagrangian step of the band distance through the grid velocity, so the interior moves with
+//the liquid between rebuilds
+void AdvectBandSDF(Grid<float>* sdf, MacGrid* mgrid, const float& dt, GridPool<float>* pool){
+    glm::vec3 dimensions = sdf->GetDimensions();
+    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
+    float maxd = glm::max(glm::max(x,y),z);
+    Grid<float>* advected = pool->AcquireUninitialized(dimensions, sdf->GetBackground());
+    float* target = advected->GetRawData();
+    unsigned int sx = sdf->GetStrideX(); unsigned int sy = sdf->GetStrideY();
+
+    tbb::parallel_for(tbb::blocked_range<int>(0,x),
+        [=](const tbb::blocked_range<int>& r){
+            for(int i=r.begin(); i!=r.end(); ++i){
+                for(int j=0; j<y; ++j){
+                    for(int k=0; k<z; ++k){
+                        glm::vec3 p = glm::vec3(i+0.5f, j+0.5f, k+0.5f)/maxd;
+                        glm::vec3 back = (p - dt*InterpolateVelocity(p, mgrid))*maxd;
+                        target[i*sx + j*sy + k] = Interpolate(sdf, back-glm::vec3(0.5f),
+                                                              dimensions);
+                    }
+                }
+            }
+        }
+    );
+    sdf->Copy(advected);
+    pool->Release(advected);
+}
+
+//Interior cells hold no particles, so MarkCellTypes leaves them as air. Non solid cells deeper
+//than the band are made fluid again, well inside the liquid level set
+void MarkInteriorCells(Grid<float>* sdf, Grid<unsigned char>* A, Grid<float>* L,
+                       const int& band){
+    int x = (int)sdf->GetDimensions().x; int y = (int)sdf->GetDimensions().y;
+    int z = (int)sdf->GetDimensions().z;
+    const float* d = sdf->GetRawData();
+    unsigned char* a = A->GetRawData();
+    float* l = L->GetRawData();
+    unsigned int sx = sdf->GetStrideX(); unsigned int sy = sdf->GetStrideY();
+    float depth = -(float)band;
+
+    tbb::parallel_for(tbb::blocked_range<int>(0,x),
+        [=](const tbb::blocked_range<int>& r){
+            for(int i=r.begin(); i!=r.end(); ++i){
+                for(int j=0; j<y; ++j){
+                    for(int k=0; k<z; ++k){
+                        unsigned int c = i*sx + j*sy + k;
+                        if(d[c]<depth && a[c]!=SOLID){
+                            a[c] = FLUID;
+                            l[c] = glm::min(l[c], -1.0f);
+                        }
+                    }
+                }
+            }
+        }
+    );
+}
+
+//fn(i, j, k) for every face of axis whose two cells are both deeper than the band and hold no
+//particles. Domain wall faces are never interior
+template <typename F> void ForEachInteriorFace(ParticleGrid* pgrid, Grid<float>* sdf,
+                                               const int& band, const int& axis, const F& fn){
+    int x = (int)sdf->GetDimensions().x; int y = (int)sdf->GetDimensions().y;
+    int z = (int)sdf->GetDimensions().z;
+    const float* d = sdf->GetRawData();
+    unsigned int sx = sdf->GetStrideX(); unsigned int sy = sdf->GetStrideY();
+    unsigned int offsets[3] = {sx, sy, 1};
+    unsigned int offset = offsets[axis];
+    float depth = -(float)band;
+    int lower[3] = {axis==0 ? 1 : 0, axis==1 ? 1 : 0, axis==2 ? 1 : 0};
+
+    tbb::parallel_for(tbb::blocked_range<int>(lower[0],x),
+        [&](const tbb::blocked_range<int>& r){
+            for(int i=r.begin(); i!=r.end(); ++i){
+                for(int j=lower[1]; j<y; ++j){
+                    for(int k=lower[2]; k<z; ++k){
+                        unsigned int c = i*sx + j*sy + k;
+                        if(d[c]>=depth || d[c-offset]>=depth){
+                            continue;
+                        }
+                        int b[3] = {i-lower[0], j-lower[1], k-lower[2]};
+                        if(pgrid->GetCellCount(pgrid->GetCellIndex(i,j,k))==0 &&
+                           pgrid->GetCellCount(pgrid->GetCellIndex(b[0],b[1],b[2]))==0){
+                            fn(i, j, k);
+                        }
+                    }
+                }
+            }
+        }
+    );
+}
+
+//The particle transfer can't reach interior faces, so they carry their own velocity: a semi-
+//Lagrangian step of the last substep's grid velocity plus the external forces' dv. Written to the
+//three interior face grids before the transfer overwrites the macgrid
+void AdvectInteriorFaces(ParticleGrid* pgrid, Grid<float>* sdf, MacGrid* mgrid,
+                         const int& band, const float& dt, const glm::vec3& dv,
+                         Grid<float>** interior){
+    glm::vec3 dimensions = mgrid->m_dimensions;
+    float maxd = glm::max(glm::max(dimensions.x, dimensions.y), dimensions.z);
+    for(int axis=0; axis<3; axis++){
+        Grid<float>* faces = interior[axis];
+        glm::vec3 center(0.5f);
+        center[axis] = 0.0f;
+        ForEachInteriorFace(pgrid, sdf, band, axis, [=](const int& i, const int& j,
+                                                        const int& k){
+            glm::vec3 p = (glm::vec3(i,j,k)+center)/maxd;
+            glm::vec3 back = p - dt*InterpolateVelocity(p, mgrid);
+            faces->SetCell(i, j, k, InterpolateVelocity(back, mgrid)[axis] + dv[axis]);
+        });
+    }
+}
+
+//Copies the interior faces from AdvectInteriorFaces over the transferred velocity
+void StoreInteriorFaces(ParticleGrid* pgrid, Grid<float>* sdf, MacGrid* mgrid,
+                        const int& band, Grid<float>** interior){
+    Grid<float>* faces[3] = {mgrid->m_u_x, mgrid->m_u_y, mgrid->m_u_z};
+    for(int axis=0; axis<3; axis++){
+        Grid<float>* source = interior[axis];
+        Grid<float>* target = faces[axis];
+        ForEachInteriorFace(pgrid, sdf, band, axis, [=](const int& i, const int& j,
+                                                        const int& k){
+            target->SetCell(i, j, k, source->GetCell(i, j, k));
+        });
+    }
+}
+}
+
+#endif
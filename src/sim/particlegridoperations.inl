@@ -8,11 +8,27 @@
 #define PARTICLEGRIDOPERATIONS_INL
 
 #include <tbb/tbb.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 #include "../grid/macgrid.inl"
 #include "../grid/particlegrid.hpp"
 #include "../grid/levelset.hpp"
 #include "../utilities/utilities.h"
 #include "../grid/gridutils.inl"
+#include "../grid/gridpool.hpp"
+#include "../math/kernels.inl"
+#include "simsettings.inl"
+
+//Particles per block for batched velocity interpolation, picked at compile time from the widest
+//gather the target supports. SSE2 has no gather, so that build uses the scalar block loop
+#if defined(__AVX512F__)
+#define INTERPOLATE_BATCH_WIDTH 16
+#elif defined(__AVX2__)
+#define INTERPOLATE_BATCH_WIDTH 8
+#else
+#define INTERPOLATE_BATCH_WIDTH 4
+#endif
 
 namespace fluidCore {
 //====================================
@@ -20,87 +36,88 @@ namespace fluidCore {
 //====================================
 
 //Forward declarations for externed inlineable methods
-extern inline void SplatParticlesToMACGrid(ParticleGrid* sgrid, 
-                                           std::vector<Particle*>& particles,
-                                           MacGrid* mgrid);
-extern inline void SplatMACGridToParticles(std::vector<Particle*>& particles, 
+extern inline void SplatParticlesToMACGrid(ParticleGrid* sgrid, ParticleSet* particles,
                                            MacGrid* mgrid);
+extern inline void SplatMACGridToParticles(ParticleSet* particles, MacGrid* mgrid);
+extern inline void TransferParticlesToMACGrid(ParticleGrid* sgrid, ParticleSet* particles,
+                                              MacGrid* mgrid, const SimSettings& settings,
+                                              GridPool<float>* pool);
+template <typename K> void ScatterParticlesToMACGrid(ParticleGrid* sgrid, 
+                                                     ParticleSet* particles, MacGrid* mgrid,
+                                                     GridPool<float>* pool);
+template <typename K> inline void ScatterToFaces(float* u, float* w, Grid<float>* faces, 
+                                                 const int& axis, const glm::vec3& pos, 
+                                                 const int* cell, const int* faceCount,
+                                                 const float& mass, const float& velocity);
 extern inline void EnforceBoundaryVelocity(MacGrid* mgrid);
 extern inline glm::vec3 InterpolateVelocity(glm::vec3 p, MacGrid* mgrid);
-inline float CheckWall(Grid<int>* A, const int& x, const int& y, const int& z);
+extern inline void InterpolateVelocityPair(glm::vec3 p, MacGrid* mgrid, 
+                                           VelocityHistory* previous, glm::vec3& u, 
+                                           glm::vec3& uprevious);
 inline float Interpolate(Grid<float>* q, glm::vec3 p, glm::vec3 n);
+inline float LoadFace(const float& value);
+inline float LoadFace(const unsigned short& value);
+template <typename T> inline void InterpolatePair(Grid<float>* q, Grid<T>* qprevious, 
+                                                  glm::vec3 p, glm::vec3 n, float& value, 
+                                                  float& previousValue);
+extern inline void InterpolateVelocityBatch(const glm::vec3* p, const unsigned int& count,
+                                            MacGrid* mgrid, glm::vec3* u);
+inline void InterpolateFaceBlock(Grid<float>* q, const float* gx, const float* gy, 
+                                 const float* gz, const glm::vec3& n, float* out);
     
 //====================================
 // Function Implementations
 //====================================
 
-float CheckWall(Grid<int>* A, const int& x, const int& y, const int& z){
-    if(A->GetCell(x,y,z)==SOLID){ //inside wall
-        return 1.0f;
-    }else{
-        return -1.0f;
-    }
-}
-
+//Zeroes faces on the domain walls and faces between a solid and a non solid cell. Wall faces are
+//the shell of each face grid, interior faces compare their two cells by linear offset
 void EnforceBoundaryVelocity(MacGrid* mgrid){
     unsigned int x = (unsigned int)mgrid->m_dimensions.x;
     unsigned int y = (unsigned int)mgrid->m_dimensions.y;
     unsigned int z = (unsigned int)mgrid->m_dimensions.z;
+    const unsigned char* a = mgrid->m_A->GetRawData();
+    unsigned int sx = mgrid->m_A->GetStrideX(); unsigned int sy = mgrid->m_A->GetStrideY();
+    Grid<float>* faces[3] = {mgrid->m_u_x, mgrid->m_u_y, mgrid->m_u_z};
+    unsigned int offsets[3] = {sx, sy, 1};
+    unsigned int limits[3] = {x, y, z};
 
-    //for every x face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x+1),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        if(i==0 || i==x){
-                            mgrid->m_u_x->SetCell(i,j,k, 0.0f);
-                        }
-                        if( i<x && i>0 && CheckWall(mgrid->m_A, i, j, k)*
-                            CheckWall(mgrid->m_A, i-1, j, k) < 0 ) {
-                            mgrid->m_u_x->SetCell(i,j,k, 0.0f);
+    for(int axis=0; axis<3; axis++){
+        float* u = faces[axis]->GetRawData();
+        unsigned int fsx = faces[axis]->GetStrideX(); unsigned int fsy = faces[axis]->GetStrideY();
+        unsigned int offset = offsets[axis];
+        unsigned int limit = limits[axis];
+        //faces along x and y have one more row in their own axis, z faces one more per row
+        unsigned int rowsX = axis==0 ? x+1 : x;
+        unsigned int rowsY = axis==1 ? y+1 : y;
+        unsigned int rowLength = axis==2 ? z+1 : z;
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,rowsX),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
+                    for(unsigned int j=0; j<rowsY; ++j){ 
+                        float* row = u + i*fsx + j*fsy;
+                        unsigned int wall = axis==0 ? i : j;
+                        if(axis<2 && (wall==0 || wall==limit)){
+                            std::fill(row, row+rowLength, 0.0f);
+                            continue;
                         }
-                    }
-                }
-            } 
-        }
-    );
-    //for every y face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y+1; ++j){ 
-                    for(unsigned int k = 0; k < z; ++k){
-                        if(j==0 || j==y){
-                            mgrid->m_u_y->SetCell(i,j,k, 0.0f);
-                        }
-                        if( j<y && j>0 && CheckWall(mgrid->m_A, i, j, k)*
-                                          CheckWall(mgrid->m_A, i, j-1, k) < 0 ) {
-                            mgrid->m_u_y->SetCell(i,j,k, 0.0f);
-                        }
-                    }
-                }
-            } 
-        }
-    );
-    //for every z face
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                for(unsigned int j = 0; j < y; ++j){ 
-                    for(unsigned int k = 0; k < z+1; ++k){
-                        if(k==0 || k==z){
-                            mgrid->m_u_z->SetCell(i,j,k, 0.0f);
+                        const unsigned char* cells = a + i*sx + j*sy;
+                        const unsigned char* backCells = cells - offset;
+                        unsigned int k0 = 0; unsigned int k1 = z;
+                        if(axis==2){
+                            row[0] = 0.0f;
+                            row[z] = 0.0f;
+                            k0 = 1;
                         }
-                        if( k<z && k>0 && CheckWall(mgrid->m_A, i, j, k)*
-                                          CheckWall(mgrid->m_A, i, j, k-1) < 0 ) {
-                            mgrid->m_u_z->SetCell(i,j,k, 0.0f);
+                        for(unsigned int k=k0; k<k1; ++k){
+                            bool solid = cells[k]==SOLID;
+                            bool backSolid = backCells[k]==SOLID;
+                            row[k] = solid!=backSolid ? 0.0f : row[k];
                         }
                     }
-                }
-            } 
-        }
-    );
+                } 
+            }
+        );
+    }
 }
 
 float Interpolate(Grid<float>* q, glm::vec3 p, glm::vec3 n){
@@ -132,19 +149,210 @@ glm::vec3 InterpolateVelocity(glm::vec3 p, MacGrid* mgrid){
     return u;
 }
 
-void SplatMACGridToParticles(std::vector<Particle*>& particles, MacGrid* mgrid){
-    unsigned int particleCount = particles.size();
+//Widens a stored face value, unsigned short faces are fp16 from a compact VelocityHistory
+float LoadFace(const float& value){
+    return value;
+}
+
+float LoadFace(const unsigned short& value){
+    return HalfToFloat(value);
+}
+
+//Same trilinear stencil as Interpolate, with the weights computed once and applied to two grids
+//that share a layout
+template <typename T> void InterpolatePair(Grid<float>* q, Grid<T>* qprevious, glm::vec3 p, 
+                                           glm::vec3 n, float& value, float& previousValue){
+    float x = glm::max(0.0f,glm::min(n.x,p.x));
+    float y = glm::max(0.0f,glm::min(n.y,p.y));
+    float z = glm::max(0.0f,glm::min(n.z,p.z));
+    int i = glm::min(x,n.x-2);
+    int j = glm::min(y,n.y-2);
+    int k = glm::min(z,n.z-2);
+    float w[8] = {(i+1-x)*(j+1-y)*(k+1-z), (x-i)*(j+1-y)*(k+1-z), 
+                  (i+1-x)*(y-j)*(k+1-z), (x-i)*(y-j)*(k+1-z),
+                  (i+1-x)*(j+1-y)*(z-k), (x-i)*(j+1-y)*(z-k), 
+                  (i+1-x)*(y-j)*(z-k), (x-i)*(y-j)*(z-k)};
+    float* a = q->GetRawData();
+    T* b = qprevious->GetRawData();
+    unsigned int sx = q->GetStrideX(); unsigned int sy = q->GetStrideY();
+    unsigned int base = i*sx + j*sy + k;
+    unsigned int offsets[8] = {0, sx, sy, sx+sy, 1, sx+1, sy+1, sx+sy+1};
+    value = 0.0f;
+    previousValue = 0.0f;
+    for(unsigned int c=0; c<8; c++){
+        value += w[c]*a[base+offsets[c]];
+        previousValue += w[c]*LoadFace(b[base+offsets[c]]);
+    }
+}
+
+//Samples the current and previous velocity at p in one pass over the stencil
+void InterpolateVelocityPair(glm::vec3 p, MacGrid* mgrid, VelocityHistory* previous, 
+                             glm::vec3& u, glm::vec3& uprevious){
+    int x = (int)mgrid->m_dimensions.x; int y = (int)mgrid->m_dimensions.y; 
+    int z = (int)mgrid->m_dimensions.z;
+    float maxd = glm::max(glm::max(x,y),z);
+    x = maxd; y = maxd; z = maxd;
+    if(previous->m_compact==true){
+        InterpolatePair(mgrid->m_u_x, previous->m_h_x, glm::vec3(x*p.x, y*p.y-0.5f, z*p.z-0.5f),
+                        glm::vec3(x+1, y, z), u.x, uprevious.x);
+        InterpolatePair(mgrid->m_u_y, previous->m_h_y, glm::vec3(x*p.x-0.5f, y*p.y, z*p.z-0.5f),
+                        glm::vec3(x, y+1, z), u.y, uprevious.y);
+        InterpolatePair(mgrid->m_u_z, previous->m_h_z, glm::vec3(x*p.x-0.5f, y*p.y-0.5f, z*p.z),
+                        glm::vec3(x, y, z+1), u.z, uprevious.z);
+        return;
+    }
+    InterpolatePair(mgrid->m_u_x, previous->m_u_x, glm::vec3(x*p.x, y*p.y-0.5f, z*p.z-0.5f), 
+                    glm::vec3(x+1, y, z), u.x, uprevious.x);
+    InterpolatePair(mgrid->m_u_y, previous->m_u_y, glm::vec3(x*p.x-0.5f, y*p.y, z*p.z-0.5f), 
+                    glm::vec3(x, y+1, z), u.y, uprevious.y);
+    InterpolatePair(mgrid->m_u_z, previous->m_u_z, glm::vec3(x*p.x-0.5f, y*p.y-0.5f, z*p.z), 
+                    glm::vec3(x, y, z+1), u.z, uprevious.z);
+}
+
+//Interpolates one face grid at INTERPOLATE_BATCH_WIDTH points given in face grid coordinates.
+//Matches Interpolate lane for lane, including the clamping at the grid edges
+void InterpolateFaceBlock(Grid<float>* q, const float* gx, const float* gy, const float* gz,
+                          const glm::vec3& n, float* out){
+    const float* data = q->GetRawData();
+    int sx = q->GetStrideX(); int sy = q->GetStrideY();
+#if defined(__AVX512F__)
+    __m512 zero = _mm512_setzero_ps();
+    __m512 x = _mm512_max_ps(zero, _mm512_min_ps(_mm512_set1_ps(n.x), _mm512_loadu_ps(gx)));
+    __m512 y = _mm512_max_ps(zero, _mm512_min_ps(_mm512_set1_ps(n.y), _mm512_loadu_ps(gy)));
+    __m512 z = _mm512_max_ps(zero, _mm512_min_ps(_mm512_set1_ps(n.z), _mm512_loadu_ps(gz)));
+    __m512i i = _mm512_cvttps_epi32(_mm512_min_ps(x, _mm512_set1_ps(n.x-2)));
+    __m512i j = _mm512_cvttps_epi32(_mm512_min_ps(y, _mm512_set1_ps(n.y-2)));
+    __m512i k = _mm512_cvttps_epi32(_mm512_min_ps(z, _mm512_set1_ps(n.z-2)));
+    __m512 fx = _mm512_sub_ps(x, _mm512_cvtepi32_ps(i));
+    __m512 fy = _mm512_sub_ps(y, _mm512_cvtepi32_ps(j));
+    __m512 fz = _mm512_sub_ps(z, _mm512_cvtepi32_ps(k));
+    __m512i base = _mm512_add_epi32(_mm512_add_epi32(
+                       _mm512_mullo_epi32(i, _mm512_set1_epi32(sx)),
+                       _mm512_mullo_epi32(j, _mm512_set1_epi32(sy))), k);
+    __m512i ox = _mm512_set1_epi32(sx); __m512i oy = _mm512_set1_epi32(sy);
+    __m512i one = _mm512_set1_epi32(1);
+    __m512i b01 = _mm512_add_epi32(base, oy);
+    __m512 c000 = _mm512_i32gather_ps(base, data, 4);
+    __m512 c100 = _mm512_i32gather_ps(_mm512_add_epi32(base, ox), data, 4);
+    __m512 c010 = _mm512_i32gather_ps(b01, data, 4);
+    __m512 c110 = _mm512_i32gather_ps(_mm512_add_epi32(b01, ox), data, 4);
+    __m512i b1 = _mm512_add_epi32(base, one);
+    __m512i b11 = _mm512_add_epi32(b01, one);
+    __m512 c001 = _mm512_i32gather_ps(b1, data, 4);
+    __m512 c101 = _mm512_i32gather_ps(_mm512_add_epi32(b1, ox), data, 4);
+    __m512 c011 = _mm512_i32gather_ps(b11, data, 4);
+    __m512 c111 = _mm512_i32gather_ps(_mm512_add_epi32(b11, ox), data, 4);
+    //lerp along x, then y, then z
+    __m512 c00 = _mm512_fmadd_ps(fx, _mm512_sub_ps(c100, c000), c000);
+    __m512 c10 = _mm512_fmadd_ps(fx, _mm512_sub_ps(c110, c010), c010);
+    __m512 c01 = _mm512_fmadd_ps(fx, _mm512_sub_ps(c101, c001), c001);
+    __m512 c11 = _mm512_fmadd_ps(fx, _mm512_sub_ps(c111, c011), c011);
+    __m512 c0 = _mm512_fmadd_ps(fy, _mm512_sub_ps(c10, c00), c00);
+    __m512 c1 = _mm512_fmadd_ps(fy, _mm512_sub_ps(c11, c01), c01);
+    _mm512_storeu_ps(out, _mm512_fmadd_ps(fz, _mm512_sub_ps(c1, c0), c0));
+#elif defined(__AVX2__)
+    __m256 zero = _mm256_setzero_ps();
+    __m256 x = _mm256_max_ps(zero, _mm256_min_ps(_mm256_set1_ps(n.x), _mm256_loadu_ps(gx)));
+    __m256 y = _mm256_max_ps(zero, _mm256_min_ps(_mm256_set1_ps(n.y), _mm256_loadu_ps(gy)));
+    __m256 z = _mm256_max_ps(zero, _mm256_min_ps(_mm256_set1_ps(n.z), _mm256_loadu_ps(gz)));
+    __m256i i = _mm256_cvttps_epi32(_mm256_min_ps(x, _mm256_set1_ps(n.x-2)));
+    __m256i j = _mm256_cvttps_epi32(_mm256_min_ps(y, _mm256_set1_ps(n.y-2)));
+    __m256i k = _mm256_cvttps_epi32(_mm256_min_ps(z, _mm256_set1_ps(n.z-2)));
+    __m256 fx = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i));
+    __m256 fy = _mm256_sub_ps(y, _mm256_cvtepi32_ps(j));
+    __m256 fz = _mm256_sub_ps(z, _mm256_cvtepi32_ps(k));
+    __m256i base = _mm256_add_epi32(_mm256_add_epi32(
+                       _mm256_mullo_epi32(i, _mm256_set1_epi32(sx)),
+                       _mm256_mullo_epi32(j, _mm256_set1_epi32(sy))), k);
+    __m256i ox = _mm256_set1_epi32(sx); __m256i oy = _mm256_set1_epi32(sy);
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i b01 = _mm256_add_epi32(base, oy);
+    __m256 c000 = _mm256_i32gather_ps(data, base, 4);
+    __m256 c100 = _mm256_i32gather_ps(data, _mm256_add_epi32(base, ox), 4);
+    __m256 c010 = _mm256_i32gather_ps(data, b01, 4);
+    __m256 c110 = _mm256_i32gather_ps(data, _mm256_add_epi32(b01, ox), 4);
+    __m256i b1 = _mm256_add_epi32(base, one);
+    __m256i b11 = _mm256_add_epi32(b01, one);
+    __m256 c001 = _mm256_i32gather_ps(data, b1, 4);
+    __m256 c101 = _mm256_i32gather_ps(data, _mm256_add_epi32(b1, ox), 4);
+    __m256 c011 = _mm256_i32gather_ps(data, b11, 4);
+    __m256 c111 = _mm256_i32gather_ps(data, _mm256_add_epi32(b11, ox), 4);
+    //lerp along x, then y, then z
+    __m256 c00 = _mm256_add_ps(c000, _mm256_mul_ps(fx, _mm256_sub_ps(c100, c000)));
+    __m256 c10 = _mm256_add_ps(c010, _mm256_mul_ps(fx, _mm256_sub_ps(c110, c010)));
+    __m256 c01 = _mm256_add_ps(c001, _mm256_mul_ps(fx, _mm256_sub_ps(c101, c001)));
+    __m256 c11 = _mm256_add_ps(c011, _mm256_mul_ps(fx, _mm256_sub_ps(c111, c011)));
+    __m256 c0 = _mm256_add_ps(c00, _mm256_mul_ps(fy, _mm256_sub_ps(c10, c00)));
+    __m256 c1 = _mm256_add_ps(c01, _mm256_mul_ps(fy, _mm256_sub_ps(c11, c01)));
+    _mm256_storeu_ps(out, _mm256_add_ps(c0, _mm256_mul_ps(fz, _mm256_sub_ps(c1, c0))));
+#else
+    for(unsigned int l=0; l<INTERPOLATE_BATCH_WIDTH; l++){
+        float x = glm::max(0.0f,glm::min(n.x,gx[l]));
+        float y = glm::max(0.0f,glm::min(n.y,gy[l]));
+        float z = glm::max(0.0f,glm::min(n.z,gz[l]));
+        int i = glm::min(x,n.x-2);
+        int j = glm::min(y,n.y-2);
+        int k = glm::min(z,n.z-2);
+        float fx = x-i; float fy = y-j; float fz = z-k;
+        const float* c = data + i*sx + j*sy + k;
+        float c00 = c[0] + fx*(c[sx]-c[0]);
+        float c10 = c[sy] + fx*(c[sx+sy]-c[sy]);
+        float c01 = c[1] + fx*(c[sx+1]-c[1]);
+        float c11 = c[sy+1] + fx*(c[sx+sy+1]-c[sy+1]);
+        float c0 = c00 + fy*(c10-c00);
+        float c1 = c01 + fy*(c11-c01);
+        out[l] = c0 + fz*(c1-c0);
+    }
+#endif
+}
+
+//Batched InterpolateVelocity. Positions are split into SoA blocks once, each face grid's half
+//cell offsets are applied per block, and the partial last block is padded with its first point
+void InterpolateVelocityBatch(const glm::vec3* p, const unsigned int& count, MacGrid* mgrid,
+                              glm::vec3* u){
+    int x = (int)mgrid->m_dimensions.x; int y = (int)mgrid->m_dimensions.y; 
+    int z = (int)mgrid->m_dimensions.z;
+    float maxd = glm::max(glm::max(x,y),z);
+    Grid<float>* faces[3] = {mgrid->m_u_x, mgrid->m_u_y, mgrid->m_u_z};
+    for(unsigned int b=0; b<count; b+=INTERPOLATE_BATCH_WIDTH){
+        unsigned int width = glm::min((unsigned int)INTERPOLATE_BATCH_WIDTH, count-b);
+        float px[INTERPOLATE_BATCH_WIDTH]; float py[INTERPOLATE_BATCH_WIDTH]; 
+        float pz[INTERPOLATE_BATCH_WIDTH];
+        for(unsigned int l=0; l<INTERPOLATE_BATCH_WIDTH; l++){
+            glm::vec3 q = p[b + (l<width ? l : 0)]*maxd;
+            px[l] = q.x; py[l] = q.y; pz[l] = q.z;
+        }
+        float g[3][INTERPOLATE_BATCH_WIDTH];
+        float result[INTERPOLATE_BATCH_WIDTH];
+        for(int axis=0; axis<3; axis++){
+            //faces along axis sit on integer coordinates on that axis and half cells elsewhere
+            for(unsigned int l=0; l<INTERPOLATE_BATCH_WIDTH; l++){
+                g[0][l] = axis==0 ? px[l] : px[l]-0.5f;
+                g[1][l] = axis==1 ? py[l] : py[l]-0.5f;
+                g[2][l] = axis==2 ? pz[l] : pz[l]-0.5f;
+            }
+            glm::vec3 n(maxd);
+            n[axis] += 1.0f;
+            InterpolateFaceBlock(faces[axis], g[0], g[1], g[2], n, result);
+            for(unsigned int l=0; l<width; l++){
+                u[b+l][axis] = result[l];
+            }
+        }
+    }
+}
+
+void SplatMACGridToParticles(ParticleSet* particles, MacGrid* mgrid){
+    unsigned int particleCount = GetParticleCount(particles);
+    const glm::vec3* pos = particles->m_p.data();
+    glm::vec3* vel = particles->m_u.data();
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
         [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
-                particles[i]->m_u = InterpolateVelocity(particles[i]->m_p, mgrid);
-            }
+            InterpolateVelocityBatch(pos+r.begin(), r.end()-r.begin(), mgrid, vel+r.begin());
         }
     );
 }
 
-void SplatParticlesToMACGrid(ParticleGrid* sgrid, std::vector<Particle*>& particles, 
-                             MacGrid* mgrid){
+void SplatParticlesToMACGrid(ParticleGrid* sgrid, ParticleSet* particles, MacGrid* mgrid){
     
     float RE = 1.4f; //sharpen kernel weight
 
@@ -157,90 +365,83 @@ void SplatParticlesToMACGrid(ParticleGrid* sgrid, std::vector<Particle*>& partic
             for(unsigned int i=r.begin(); i!=r.end(); ++i){ 
                 for(unsigned int j = 0; j < y+1; ++j){
                     for(unsigned int k = 0; k < z+1; ++k){
-                        std::vector<Particle*> neighbors;
                         //Splat X direction
                         if(j<y && k<z){
                             glm::vec3 px = glm::vec3(i, j+0.5f, k+0.5f);
                             float sumw = 0.0f;
                             float sumx = 0.0f;
-                            neighbors = sgrid->GetWallNeighbors(glm::vec3(i,j,k), 
-                                                                glm::vec3(1,2,2));
-                            for(unsigned int n=0; n<neighbors.size(); n++){
-                                Particle* p = neighbors[n];
-                                if(p->m_type == FLUID){
+                            sgrid->ForEachWallNeighbor(glm::vec3(i,j,k), glm::vec3(1,2,2), 
+                                                       [&](const unsigned int& p){
+                                if(particles->m_type[p] == FLUID){
+                                    glm::vec3 ppos = particles->m_p[p];
                                     glm::vec3 pos;
-                                    pos.x = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.x));
-                                    pos.y = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.y));
-                                    pos.z = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.z));
-                                    float w = p->m_mass * mathCore::Sharpen(
+                                    pos.x = glm::max(0.0f,glm::min(maxd,maxd*ppos.x));
+                                    pos.y = glm::max(0.0f,glm::min(maxd,maxd*ppos.y));
+                                    pos.z = glm::max(0.0f,glm::min(maxd,maxd*ppos.z));
+                                    float w = particles->m_mass[p] * mathCore::Sharpen(
                                                         mathCore::Sqrlength(pos,px),RE);
-                                    sumx += w*p->m_u.x;
+                                    sumx += w*particles->m_u[p].x;
                                     sumw += w;
                                 }
-                            }
+                            });
                             float uxsum = 0.0f;
                             if(sumw>0){ 
                                 uxsum = sumx/sumw;
                             }
                             mgrid->m_u_x->SetCell(i,j,k,uxsum);
                         }
-                        neighbors.clear();
 
                         //Splat Y direction
                         if(i<x && k<z){
                             glm::vec3 py = glm::vec3(i+0.5f, j, k+0.5f);
                             float sumw = 0.0f;
                             float sumy = 0.0f;
-                            neighbors = sgrid->GetWallNeighbors(glm::vec3(i,j,k), 
-                                                                glm::vec3(2,1,2));
-                            for(unsigned int n=0; n<neighbors.size(); n++){
-                                Particle* p = neighbors[n];
-                                if(p->m_type == FLUID){
+                            sgrid->ForEachWallNeighbor(glm::vec3(i,j,k), glm::vec3(2,1,2), 
+                                                       [&](const unsigned int& p){
+                                if(particles->m_type[p] == FLUID){
+                                    glm::vec3 ppos = particles->m_p[p];
                                     glm::vec3 pos;
-                                    pos.x = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.x));
-                                    pos.y = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.y));
-                                    pos.z = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.z));
-                                    float w = p->m_mass * mathCore::Sharpen(
+                                    pos.x = glm::max(0.0f,glm::min(maxd,maxd*ppos.x));
+                                    pos.y = glm::max(0.0f,glm::min(maxd,maxd*ppos.y));
+                                    pos.z = glm::max(0.0f,glm::min(maxd,maxd*ppos.z));
+                                    float w = particles->m_mass[p] * mathCore::Sharpen(
                                                         mathCore::Sqrlength(pos,py),RE);
-                                    sumy += w*p->m_u.y;
+                                    sumy += w*particles->m_u[p].y;
                                     sumw += w;
                                 }
-                            }
+                            });
                             float uysum = 0.0f;
                             if(sumw>0){
                                 uysum = sumy/sumw;
                             }
                             mgrid->m_u_y->SetCell(i,j,k,uysum);
                         }
-                        neighbors.clear();
 
                         //Splat Z direction
                         if(i<x && j<y){
                             glm::vec3 pz = glm::vec3(i+0.5f, j+0.5f, k);
                             float sumw = 0.0f;
                             float sumz = 0.0f;
-                            neighbors = sgrid->GetWallNeighbors(glm::vec3(i,j,k), 
-                                                                glm::vec3(2,2,1));
-                            for(unsigned int n=0; n<neighbors.size(); n++){
-                                Particle* p = neighbors[n];
-                                if(p->m_type == FLUID){
+                            sgrid->ForEachWallNeighbor(glm::vec3(i,j,k), glm::vec3(2,2,1), 
+                                                       [&](const unsigned int& p){
+                                if(particles->m_type[p] == FLUID){
+                                    glm::vec3 ppos = particles->m_p[p];
                                     glm::vec3 pos;
-                                    pos.x = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.x));
-                                    pos.y = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.y));
-                                    pos.z = glm::max(0.0f,glm::min(maxd,maxd*p->m_p.z));
-                                    float w = p->m_mass * mathCore::Sharpen(
+                                    pos.x = glm::max(0.0f,glm::min(maxd,maxd*ppos.x));
+                                    pos.y = glm::max(0.0f,glm::min(maxd,maxd*ppos.y));
+                                    pos.z = glm::max(0.0f,glm::min(maxd,maxd*ppos.z));
+                                    float w = particles->m_mass[p] * mathCore::Sharpen(
                                                         mathCore::Sqrlength(pos,pz),RE);
-                                    sumz += w*p->m_u.z;
+                                    sumz += w*particles->m_u[p].z;
                                     sumw += w;
                                 }
-                            }
+                            });
                             float uzsum = 0.0f;
                             if(sumw>0){
                                 uzsum = sumz/sumw;
                             }
                             mgrid->m_u_z->SetCell(i,j,k,uzsum);
                         }
-                        neighbors.clear();
                     }
                 }
             }
@@ -248,6 +449,130 @@ void SplatParticlesToMACGrid(ParticleGrid* sgrid, std::vector<Particle*>& partic
     );
 }
 
+//Picks the particle to grid transfer for the current settings. Gather is the original per face
+//splat and always uses the sharpen kernel
+void TransferParticlesToMACGrid(ParticleGrid* sgrid, ParticleSet* particles, MacGrid* mgrid, 
+                                const SimSettings& settings, GridPool<float>* pool){
+    if(settings.m_p2gMode==P2G_SCATTER){
+        if(settings.m_p2gKernel==P2G_KERNEL_LINEAR){
+            ScatterParticlesToMACGrid<mathCore::LinearKernel>(sgrid, particles, mgrid, pool);
+        }else if(settings.m_p2gKernel==P2G_KERNEL_QUADRATIC){
+            ScatterParticlesToMACGrid<mathCore::QuadraticKernel>(sgrid, particles, mgrid, pool);
+        }else{
+            ScatterParticlesToMACGrid<mathCore::SharpenKernel>(sgrid, particles, mgrid, pool);
+        }
+    }else{
+        SplatParticlesToMACGrid(sgrid, particles, mgrid);
+    }
+}
+
+//Adds one particle's weight and momentum to every face of one axis that the kernel reaches.
+//Face n sits at its index offset by half a cell along every axis but its own
+template <typename K> void ScatterToFaces(float* u, float* w, Grid<float>* faces, 
+                                          const int& axis, const glm::vec3& pos, 
+                                          const int* cell, const int* faceCount, 
+                                          const float& mass, const float& velocity){
+    int lo[3]; int hi[3];
+    for(int d=0; d<3; d++){
+        int radius = (d==axis) ? K::NormalRadius : K::TangentRadius;
+        lo[d] = glm::max(cell[d]-radius+1, 0);
+        hi[d] = glm::min(cell[d]+radius, faceCount[d]-1);
+    }
+    glm::vec3 offset(0.5f);
+    offset[axis] = 0.0f;
+    for(int i=lo[0]; i<=hi[0]; i++){
+        for(int j=lo[1]; j<=hi[1]; j++){
+            for(int k=lo[2]; k<=hi[2]; k++){
+                float weight = mass * K::Weight(pos - (glm::vec3(i,j,k)+offset));
+                if(weight>0.0f){
+                    unsigned int index = faces->GetIndex(i,j,k);
+                    w[index] += weight;
+                    u[index] += weight*velocity;
+                }
+            }
+        }
+    }
+}
+
+//Particle centric splat: each liquid particle is visited once and scattered into the faces its
+//kernel reaches, then face sums are normalized. Particles are grouped into x slabs of cells from
+//the sorted particle grid. A particle writes at most two faces past its slab on either side, so
+//with 4 cell wide slabs all even slabs can run at once, then all odd slabs, without two threads
+//touching the same face
+template <typename K> void ScatterParticlesToMACGrid(ParticleGrid* sgrid, ParticleSet* particles,
+                                                     MacGrid* mgrid, GridPool<float>* pool){
+    int x = (int)mgrid->m_dimensions.x; int y = (int)mgrid->m_dimensions.y; 
+    int z = (int)mgrid->m_dimensions.z;
+    float maxd = glm::max(glm::max(x,y),z);
+    const int slabWidth = 4;
+
+    //face velocity grids accumulate momentum, matching grids accumulate weight
+    Grid<float>* faces[3] = {mgrid->m_u_x, mgrid->m_u_y, mgrid->m_u_z};
+    Grid<float>* weights[3];
+    float* u[3]; float* w[3];
+    for(unsigned int n=0; n<3; n++){
+        faces[n]->Clear();
+        weights[n] = pool->Acquire(faces[n]->GetDimensions(), 0.0f);
+        u[n] = faces[n]->GetRawData();
+        w[n] = weights[n]->GetRawData();
+    }
+
+    const unsigned int* indices = sgrid->GetSortedIndices();
+    unsigned int slabCount = (x+slabWidth-1)/slabWidth;
+    for(unsigned int color=0; color<2; color++){
+        unsigned int colorCount = (slabCount+1-color)/2;
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,colorCount),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int c=r.begin(); c!=r.end(); ++c){
+                    int slab = 2*c+color;
+                    unsigned int begin = sgrid->GetCellStart(sgrid->GetCellIndex(slab*slabWidth,
+                                                                                 0, 0));
+                    unsigned int end = sgrid->GetCellStart(sgrid->GetCellIndex(
+                                                glm::min((slab+1)*slabWidth, x), 0, 0));
+                    for(unsigned int a=begin; a<end; a++){
+                        unsigned int p = indices[a];
+                        if(particles->m_type[p] != FLUID){
+                            continue;
+                        }
+                        //same clamped position as the gather splat and same cell as the sort
+                        glm::vec3 ppos = particles->m_p[p];
+                        glm::vec3 pos = glm::max(glm::vec3(0.0f), glm::min(glm::vec3(maxd), 
+                                                                          maxd*ppos));
+                        int cell[3];
+                        cell[0] = (int)glm::max(0.0f, glm::min(x-1.0f, int(maxd)*ppos.x));
+                        cell[1] = (int)glm::max(0.0f, glm::min(y-1.0f, int(maxd)*ppos.y));
+                        cell[2] = (int)glm::max(0.0f, glm::min(z-1.0f, int(maxd)*ppos.z));
+                        float mass = particles->m_mass[p];
+                        glm::vec3 vel = particles->m_u[p];
+                        int xFaces[3] = {x+1, y, z};
+                        int yFaces[3] = {x, y+1, z};
+                        int zFaces[3] = {x, y, z+1};
+                        ScatterToFaces<K>(u[0], w[0], faces[0], 0, pos, cell, xFaces, mass, 
+                                          vel.x);
+                        ScatterToFaces<K>(u[1], w[1], faces[1], 1, pos, cell, yFaces, mass, 
+                                          vel.y);
+                        ScatterToFaces<K>(u[2], w[2], faces[2], 2, pos, cell, zFaces, mass, 
+                                          vel.z);
+                    }
+                }
+            }
+        );
+    }
+
+    //normalize, faces nothing reached end up zero like in the gather splat
+    for(unsigned int n=0; n<3; n++){
+        float* un = u[n];
+        float* wn = w[n];
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,faces[n]->GetNumberOfCells()),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                    un[i] = (wn[i]>0.0f) ? un[i]/wn[i] : 0.0f;
+                }
+            }
+        );
+        pool->Release(weights[n]);
+    }
+}
 }
 
 #endif
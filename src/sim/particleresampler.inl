@@ -10,9 +10,11 @@
 #include <tbb/tbb.h>,
 #include "../grid/macgrid.inl"
 #include "../grid/particlegrid.hpp"
+#include "../grid/neighborlist.hpp"
 #include "../grid/levelset.hpp"
 #include "../utilities/utilities.h"
 #include "../grid/gridutils.inl"
+#include "../math/random.inl"
 
 namespace fluidCore {
 //====================================
@@ -20,96 +22,103 @@ namespace fluidCore {
 //====================================
 
 //Forward declarations for externed inlineable methods
-extern inline void ResampleParticles(ParticleGrid* pgrid, 
-                                     std::vector<Particle*>& particles, 
-                                     sceneCore::Scene* scene, const float& frame, const float& dt,
-                                     const float& re, const glm::vec3& dimensions);
-inline glm::vec3 Resample(ParticleGrid* pgrid, const glm::vec3& p, const glm::vec3& u, float re, 
-                          const glm::vec3& dimensions);
+extern inline void ResampleParticles(ParticleGrid* pgrid, NeighborList* neighbors, 
+                                     ParticleSet* particles, sceneCore::Scene* scene, 
+                                     const float& frame, const float& dt, const float& re, 
+                                     const glm::vec3& dimensions);
+inline glm::vec3 Resample(ParticleGrid* pgrid, NeighborList* neighbors, ParticleSet* particles,
+                          const unsigned int& n, const glm::vec3& p, const glm::vec3& u, 
+                          float re, const glm::vec3& dimensions);
 
 
 //====================================
 // Function Implementations
 //====================================
 
-void ResampleParticles(ParticleGrid* pgrid, std::vector<Particle*>& particles,
+//With neighbors the lists must be valid for the current positions and the springs read them in
+//place of the grid. The grid is then not re-sorted
+void ResampleParticles(ParticleGrid* pgrid, NeighborList* neighbors, ParticleSet* particles, 
                        sceneCore::Scene* scene, const float& frame, const float& dt, 
                        const float& re, const glm::vec3& dimensions){
     int nx = (int)dimensions.x; int ny = (int)dimensions.y; int nz = (int)dimensions.z;
     float maxd = glm::max(glm::max(nx, ny), nz);
-    pgrid->Sort(particles);
+    if(neighbors==NULL){
+        pgrid->Sort(particles);
+    }
 
     float springforce = 50.0f;
 
+    unsigned int particleCount = GetParticleCount(particles);
+    glm::vec3* t = GetParticleScratch(particles, particles->m_t);
+    glm::vec3* t2 = GetParticleScratch(particles, particles->m_t2);
+
     //use springs to temporarily displace particles
-    unsigned int particleCount = particles.size();
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int n0=r.begin(); n0!=r.end(); ++n0){  
-                if(particles[n0]->m_type==FLUID){
-                    Particle* p = particles[n0];
+                if(particles->m_type[n0]==FLUID){
+                    glm::vec3 p = particles->m_p[n0];
                     glm::vec3 spring(0.0f, 0.0f, 0.0f);
-                    float x = glm::max(0.0f,glm::min((float)maxd,maxd*p->m_p.x));
-                    float y = glm::max(0.0f,glm::min((float)maxd,maxd*p->m_p.y));
-                    float z = glm::max(0.0f,glm::min((float)maxd,maxd*p->m_p.z));
-                    std::vector<Particle*> neighbors = pgrid->GetCellNeighbors(glm::vec3(x,y,z),
-                                                                               glm::vec3(1));
-                    unsigned int neighborsCount = neighbors.size();
-                    for(unsigned int n1=0; n1<neighborsCount; ++n1){
-                        Particle* np = neighbors[n1];
-                        if(p!=np){
-                            float dist = glm::length(p->m_p-np->m_p);
-                            float w = springforce * np->m_mass * mathCore::Smooth(dist*dist,re);
+                    float x = glm::max(0.0f,glm::min((float)maxd,maxd*p.x));
+                    float y = glm::max(0.0f,glm::min((float)maxd,maxd*p.y));
+                    float z = glm::max(0.0f,glm::min((float)maxd,maxd*p.z));
+                    auto addSpring = [&](const unsigned int& np){
+                        if(n0!=np){
+                            glm::vec3 npp = particles->m_p[np];
+                            float dist = glm::length(p-npp);
+                            float w = springforce * particles->m_mass[np] * 
+                                      mathCore::Smooth(dist*dist,re);
                             if(dist > 0.1f*re){
-                                spring.x += w * (p->m_p.x-np->m_p.x) / dist * re;
-                                spring.y += w * (p->m_p.y-np->m_p.y) / dist * re;
-                                spring.z += w * (p->m_p.z-np->m_p.z) / dist * re;
+                                spring.x += w * (p.x-npp.x) / dist * re;
+                                spring.y += w * (p.y-npp.y) / dist * re;
+                                spring.z += w * (p.z-npp.z) / dist * re;
                             }else{
-                                if(np->m_type == FLUID){
-                                    spring.x += 0.01f*re/dt*(rand()%101)/100.0f;
-                                    spring.y += 0.01f*re/dt*(rand()%101)/100.0f;
-                                    spring.z += 0.01f*re/dt*(rand()%101)/100.0f;
+                                if(particles->m_type[np] == FLUID){
+                                    //keyed by the particle pair so the jitter is reproducible
+                                    glm::vec3 jitter = mathCore::RandomVec3(
+                                                            RANDOM_STREAM_RESAMPLE, 
+                                                            (unsigned int)frame, n0, np);
+                                    spring += 0.01f*re/dt*jitter;
                                 }else{
-                                    spring.x += 0.05f*re/dt*np->m_n.x;
-                                    spring.y += 0.05f*re/dt*np->m_n.y;
-                                    spring.z += 0.05f*re/dt*np->m_n.z;
+                                    spring.x += 0.05f*re/dt*particles->m_n[np].x;
+                                    spring.y += 0.05f*re/dt*particles->m_n[np].y;
+                                    spring.z += 0.05f*re/dt*particles->m_n[np].z;
                                 }
                             }
                         }
+                    };
+                    if(neighbors!=NULL){
+                        neighbors->ForEachNeighbor(n0, addSpring);
+                    }else{
+                        pgrid->ForEachCellNeighbor(glm::vec3(x,y,z), glm::vec3(1), addSpring);
                     }
-                    p->m_t.x = p->m_p.x + dt*spring.x;
-                    p->m_t.y = p->m_p.y + dt*spring.y;
-                    p->m_t.z = p->m_p.z + dt*spring.z;
+                    t[n0].x = p.x + dt*spring.x;
+                    t[n0].y = p.y + dt*spring.y;
+                    t[n0].z = p.z + dt*spring.z;
                 }
             }
         }
     );
 
-    particleCount = particles.size();
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int n=r.begin(); n!=r.end(); ++n){ 
-                if(particles[n]->m_type == FLUID){
-                    Particle* p = particles[n];
-                    p->m_t2.x = p->m_u.x;
-                    p->m_t2.y = p->m_u.y;
-                    p->m_t2.z = p->m_u.z;
-                    p->m_t2 = Resample(pgrid, p->m_t, p->m_t2, re, dimensions);
+                if(particles->m_type[n] == FLUID){
+                    t2[n] = Resample(pgrid, neighbors, particles, n, t[n], particles->m_u[n], re, 
+                                     dimensions);
                 }
             }
         }
     );
 
-    particleCount = particles.size();
     tbb::parallel_for(tbb::blocked_range<unsigned int>(0,particleCount),
         [=](const tbb::blocked_range<unsigned int>& r){
             for(unsigned int n=r.begin(); n!=r.end(); ++n){ 
-                if(particles[n]->m_type == FLUID){
-                    Particle *p = particles[n];
+                if(particles->m_type[n] == FLUID){
                     unsigned int solidGeomID = 0;
-                    if(scene->CheckPointInsideSolidGeom(p->m_t*maxd, frame, solidGeomID)==false){
-                        p->m_p = p->m_t;
-                        p->m_u = p->m_t2;
+                    if(scene->CheckPointInsideSolidGeom(t[n]*maxd, frame, solidGeomID)==false){
+                        particles->m_p[n] = t[n];
+                        particles->m_u[n] = t2[n];
                     }
                 }
             }
@@ -117,7 +126,9 @@ void ResampleParticles(ParticleGrid* pgrid, std::vector<Particle*>& particles,
     );
 }
 
-glm::vec3 Resample(ParticleGrid* pgrid, const glm::vec3& p, const glm::vec3& u, float re, 
+//Particle n's list is used while it still covers the spring displaced point p
+glm::vec3 Resample(ParticleGrid* pgrid, NeighborList* neighbors, ParticleSet* particles, 
+                   const unsigned int& n, const glm::vec3& p, const glm::vec3& u, float re, 
                    const glm::vec3& dimensions){
     int nx = (int)dimensions.x; int ny = (int)dimensions.y; int nz = (int)dimensions.z;
     float maxd = glm::max(glm::max(nx, ny), nz);
@@ -128,16 +139,18 @@ glm::vec3 Resample(ParticleGrid* pgrid, const glm::vec3& p, const glm::vec3& u,
     float x = glm::max(0.0f,glm::min((float)maxd-1,maxd*p.x));
     float y = glm::max(0.0f,glm::min((float)maxd-1,maxd*p.y));
     float z = glm::max(0.0f,glm::min((float)maxd-1,maxd*p.z));
-    std::vector<Particle*> neighbors = pgrid->GetCellNeighbors(glm::vec3(x,y,z),glm::vec3(1));
-
-    for(int n=0; n<neighbors.size(); n++){
-        Particle *np = neighbors[n];
-        if(np->m_type == FLUID){
-            float dist2 = mathCore::Sqrlength(p,np->m_p);
-            float w = np->m_mass * mathCore::Sharpen(dist2,re);
-            ru += w * np->m_u;
+    auto gather = [&](const unsigned int& np){
+        if(particles->m_type[np] == FLUID){
+            float dist2 = mathCore::Sqrlength(p,particles->m_p[np]);
+            float w = particles->m_mass[np] * mathCore::Sharpen(dist2,re);
+            ru += w * particles->m_u[np];
             wsum += w;
         }
+    };
+    if(neighbors!=NULL && neighbors->Covers(n, p, re)==true){
+        neighbors->ForEachNeighbor(n, gather);
+    }else{
+        pgrid->ForEachCellNeighbor(glm::vec3(x,y,z), glm::vec3(1), gather);
     }
     if(wsum){
         ru /= wsum;
@@ -0,0 +1,84 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: simsettings.inl
+// Per-scene simulation settings that are loaded from the scene file and handed to the sim
+
+#ifndef SIMSETTINGS_INL
+#define SIMSETTINGS_INL
+
+#include "../utilities/utilities.h"
+
+enum preconditionertype {PRECONDITIONER_MIC=0, PRECONDITIONER_MULTIGRID=1};
+enum p2gmode {P2G_GATHER=0, P2G_SCATTER=1};
+enum p2gkernel {P2G_KERNEL_SHARPEN=0, P2G_KERNEL_LINEAR=1, P2G_KERNEL_QUADRATIC=2};
+enum solverdevice {SOLVER_DEVICE_CPU=0, SOLVER_DEVICE_CUDA=1};
+
+namespace fluidCore {
+//====================================
+// Struct and Function Declarations
+//====================================
+
+struct SimSettings{
+    float           m_picFlipRatio; //share of the particle velocity updated by the FLIP delta
+    int             m_preconditioner;
+    bool            m_deterministic; //bitwise reproducible solver reductions
+    bool            m_reorderParticles; //keep liquid particles in cell order in memory
+    int             m_reorderCurve; //REORDER_CURVE_LINEAR or REORDER_CURVE_MORTON
+    int             m_reorderInterval; //frames between reorders, 0 reorders every substep
+    int             m_p2gMode;
+    int             m_p2gKernel; //only used by the scatter transfer
+    bool            m_sparseDomain; //restrict grid passes and the solver to active tiles
+    int             m_extrapolationLayers; //face layers velocity is extended past the fluid
+    bool            m_warmStart; //start the pressure solve from the previous step's pressure
+    float           m_pcgTolerance; //residual norm relative to the divergence norm
+    int             m_pcgMaxIterations;
+    int             m_solverDevice; //cuda needs an ARIEL_USE_CUDA build and the mic preconditioner
+    bool            m_adaptiveSubsteps; //split each frame into CFL limited substeps
+    float           m_cflNumber; //cells the fastest particle may cross in one substep
+    float           m_minSubstep; //substep bounds in seconds, the last one of a frame may be
+    float           m_maxSubstep; //shorter to land on the frame boundary
+    bool            m_neighborLists; //reuse per particle neighbor lists across a substep's passes
+    bool            m_compactStorage; //keep the FLIP delta's previous velocities as fp16
+    int             m_narrowBand; //cells of liquid kept as particles below the surface, 0 keeps all
+};
+
+//Forward declarations for externed inlineable methods
+extern inline SimSettings CreateSimSettings();
+
+//====================================
+// Function Implementations
+//====================================
+
+//Default settings match the sim's original hardcoded behavior, except for the pressure solve.
+//It warm starts and stops at a residual of 1e-3 of the divergence or 1e-2 per fluid cell, capped
+//at 500 iterations, where the original solve started cold and ran until the residual fell below
+//1e-2 per cell of the whole box or it had taken x*y*z iterations
+SimSettings CreateSimSettings(){
+    SimSettings s;
+    s.m_picFlipRatio = 0.95f;
+    s.m_preconditioner = PRECONDITIONER_MIC;
+    s.m_deterministic = false;
+    s.m_reorderParticles = false;
+    s.m_reorderCurve = 0;
+    s.m_reorderInterval = 0;
+    s.m_p2gMode = P2G_GATHER;
+    s.m_p2gKernel = P2G_KERNEL_SHARPEN;
+    s.m_sparseDomain = false;
+    s.m_extrapolationLayers = 2;
+    s.m_warmStart = true;
+    s.m_pcgTolerance = 1.0e-3f;
+    s.m_pcgMaxIterations = 500;
+    s.m_solverDevice = SOLVER_DEVICE_CPU;
+    s.m_adaptiveSubsteps = false;
+    s.m_cflNumber = 1.0f;
+    s.m_minSubstep = 1.0e-4f;
+    s.m_maxSubstep = 1.0f;
+    s.m_neighborLists = false;
+    s.m_compactStorage = false;
+    s.m_narrowBand = 0;
+    return s;
+}
+}
+
+#endif
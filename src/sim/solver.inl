@@ -12,7 +12,24 @@
 #include "../grid/particlegrid.hpp"
 #include "../grid/levelset.hpp"
 #include "../utilities/utilities.h"
+#include "../utilities/profiler.hpp"
 #include "../grid/gridutils.inl"
+#include "../grid/tilemask.inl"
+#include "../grid/gridpool.hpp"
+#include "multigrid.inl"
+#include "simsettings.inl"
+
+//Layout of the packed neighbor types in MacGrid::m_N. Each neighbor's geomtype takes
+//NEIGHBOR_TYPE_BITS, in the order -x, +x, -y, +y, -z, +z, and the cell's own type sits above them
+#define NEIGHBOR_TYPE_BITS 2
+#define NEIGHBOR_TYPE_MASK 3
+#define NEIGHBOR_LEFT 0
+#define NEIGHBOR_RIGHT 1
+#define NEIGHBOR_BOTTOM 2
+#define NEIGHBOR_TOP 3
+#define NEIGHBOR_BACK 4
+#define NEIGHBOR_FRONT 5
+#define NEIGHBOR_SELF 6
 
 namespace fluidCore {
 //====================================
@@ -20,19 +37,69 @@ namespace fluidCore {
 //====================================
 
 //Forward declarations for externed inlineable methods
-extern inline void Solve(MacGrid& mgrid, const int& subcell, const bool& verbose);
-inline void BuildPreconditioner(Grid<float>* pc, MacGrid& mgrid, int subcell);
-inline void SolveConjugateGradient(MacGrid& mgrid, Grid<float>* pc, int subcell, 
-                                   const bool& verbose);
-inline void ComputeAx(Grid<int>* A, Grid<float>* L, Grid<float>* X, Grid<float>* target, 
-                      glm::vec3 dimensions, int subcell);
-inline float XRef(Grid<int>* A, Grid<float>* L, Grid<float>* X, glm::vec3 f, glm::vec3 p, 
-                  glm::vec3 dimensions, int subcell);
-inline void Op(Grid<int>* A, Grid<float>* X, Grid<float>* Y, Grid<float>* target, float alpha, 
-               glm::vec3 dimensions);
-inline float Product(Grid<int>* A, Grid<float>* X, Grid<float>* Y, glm::vec3 dimensions);
+extern inline void Solve(MacGrid& mgrid, const int& subcell, TileMask* tiles,
+                         const SimSettings& settings, GridPool<float>* floatPool,
+                         GridPool<unsigned char>* cellPool, const bool& verbose);
+inline void FlipGrid(Grid<float>* grid, glm::vec3 dimensions);
+inline float ARef(Grid<unsigned char>* A, int i, int j, int k, int qi, int qj, int qk,
+                  glm::vec3 dimensions);
+inline float PRef(Grid<float>* p, int i, int j, int k, glm::vec3 dimensions);
+inline float ADiag(Grid<unsigned char>* A, Grid<float>* L, int i, int j, int k,
+                   glm::vec3 dimensions, int subcell);
+inline void BuildPreconditioner(Grid<float>* pc, MacGrid& mgrid, int subcell, TileMask* tiles);
+inline void SolveConjugateGradient(MacGrid& mgrid, Grid<float>* pc,
+                                   std::vector<MultigridLevel>* multigrid, int subcell,
+                                   TileMask* tiles, const SimSettings& settings,
+                                   GridPool<float>* pool, const bool& verbose);
+inline void ComputeAx(Grid<unsigned char>* A, Grid<unsigned short>* N, Grid<float>* L,
+                      Grid<float>* X, Grid<float>* target, glm::vec3 dimensions, int subcell,
+                      TileMask* tiles);
+inline float ComputeAxProduct(Grid<unsigned char>* A, Grid<unsigned short>* N, Grid<float>* L,
+                              Grid<float>* X, Grid<float>* target, glm::vec3 dimensions,
+                              int subcell, TileMask* tiles, const bool& deterministic);
+inline double ComputeAxTile(Grid<unsigned char>* A, Grid<unsigned short>* N, Grid<float>* L,
+                            Grid<float>* X, Grid<float>* target, glm::vec3 dimensions,
+                            int subcell, const int* lo, const int* hi);
+inline float XRef(Grid<unsigned char>* A, Grid<float>* L, Grid<float>* X, glm::vec3 f,
+                  glm::vec3 p, glm::vec3 dimensions, int subcell);
+inline void Op(Grid<unsigned char>* A, Grid<float>* X, Grid<float>* Y, Grid<float>* target,
+               float alpha, TileMask* tiles);
+inline float Product(Grid<unsigned char>* A, Grid<float>* X, Grid<float>* Y, TileMask* tiles,
+                     const bool& deterministic);
+inline float UpdateSolutionAndResidual(Grid<unsigned char>* A, Grid<float>* X, Grid<float>* R,
+                                       Grid<float>* S, Grid<float>* Z, float alpha,
+                                       TileMask* tiles, const bool& deterministic);
 inline void ApplyPreconditioner(Grid<float>* Z, Grid<float>* R, Grid<float>* P, Grid<float>* L, 
-                                Grid<int>* A, glm::vec3 dimensions);
+                                Grid<unsigned char>* A, Grid<unsigned short>* N,
+                                glm::vec3 dimensions, TileMask* tiles, GridPool<float>* pool);
+inline void BuildNeighborTypes(MacGrid& mgrid, TileMask* tiles);
+inline int GetNeighborType(const unsigned short& types, const int& neighbor);
+inline float ARefInterior(const unsigned short& types, const int& neighbor);
+inline float PRefInterior(const float* p, const unsigned int& n);
+template <bool Subcell> inline float ADiagInterior(const unsigned short& types, const float* l, 
+                                                   const unsigned int& c, const unsigned int& sx,
+                                                   const unsigned int& sy);
+template <bool Subcell> inline float XRefInterior(const unsigned short& types,
+                                                  const int& neighbor, const float* l,
+                                                  const float* x, const unsigned int& c,
+                                                  const unsigned int& n);
+template <bool Subcell> inline void BuildPreconditionerTile(Grid<float>* pc, MacGrid& mgrid,
+                                                            const int* lo, const int* hi);
+template <bool Subcell> inline double ComputeAxTileStencil(Grid<unsigned char>* A,
+                                                           Grid<unsigned short>* N,
+                                                           Grid<float>* L, Grid<float>* X,
+                                                           Grid<float>* target,
+                                                           glm::vec3 dimensions, const int* lo,
+                                                           const int* hi);
+inline bool GetInteriorRow(const int& i, const int& j, const int* lo, const int* hi, 
+                           const int& x, const int& y, const int& z, int& k0, int& k1);
+template <bool Subcell> inline void SubtractPressureGradientRow(const float* p, const float* l,
+                                                                float* u, 
+                                                                const unsigned int& c,
+                                                                const unsigned int& f,
+                                                                const unsigned int& count,
+                                                                const unsigned int& offset,
+                                                                const float& h);
 
 //====================================
 // Function Implementations
@@ -56,7 +123,8 @@ void FlipGrid(Grid<float>* grid, glm::vec3 dimensions){
 }
 
 //Helper for preconditioner builder
-float ARef(Grid<int>* A, int i, int j, int k, int qi, int qj, int qk, glm::vec3 dimensions){
+float ARef(Grid<unsigned char>* A, int i, int j, int k, int qi, int qj, int qk,
+           glm::vec3 dimensions){
     int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
     if( i<0 || i>x-1 || j<0 || j>y-1 || k<0 || k>z-1 || A->GetCell(i,j,k)!=FLUID ){ //if not liquid
         return 0.0;
@@ -78,7 +146,8 @@ float PRef(Grid<float>* p, int i, int j, int k, glm::vec3 dimensions){
 }
 
 //Helper for preconditioner builder
-float ADiag(Grid<int>* A, Grid<float>* L, int i, int j, int k, glm::vec3 dimensions, int subcell){
+float ADiag(Grid<unsigned char>* A, Grid<float>* L, int i, int j, int k, glm::vec3 dimensions,
+            int subcell){
     int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
     float diag = 6.0;
     if( A->GetCell(i,j,k) != FLUID ){
@@ -100,42 +169,171 @@ float ADiag(Grid<int>* A, Grid<float>* L, int i, int j, int k, glm::vec3 dimensi
     return diag;
 }
 
-//Does what it says
-void BuildPreconditioner(Grid<float>* pc, MacGrid& mgrid, int subcell){
+//Interior stencils. A cell whose six neighbors all lie inside the grid needs no bounds checks,
+//so the helpers below index raw data by linear offset and pick between cases with selects. Cell
+//types come from the packed neighbor types in m_N, one load per cell in place of seven scattered
+//ones. Only the one cell shell on the domain boundary goes through the checked helpers above,
+//and both give the same result. Subcell is a template parameter so the interior loops carry no
+//flag
+
+//Packs the type of every cell of the active tiles and of its six neighbors into m_N. Neighbors
+//outside the grid are packed as SOLID, which is how ADiag treats them and what XRef's clamped
+//read amounts to. Cells outside active tiles are never read and are left as they were
+void BuildNeighborTypes(MacGrid& mgrid, TileMask* tiles){
+    utilityCore::ProfileScope scope("BuildNeighborTypes");
+    int x = (int)mgrid.m_dimensions.x; int y = (int)mgrid.m_dimensions.y; 
+    int z = (int)mgrid.m_dimensions.z;
+    const unsigned char* a = mgrid.m_A->GetRawData();
+    unsigned short* types = mgrid.m_N->GetRawData();
+    unsigned int sx = mgrid.m_A->GetStrideX(); unsigned int sy = mgrid.m_A->GetStrideY();
+    ForEachActiveTile(tiles, -1, [=](const int* lo, const int* hi){
+        for(int i=lo[0]; i<hi[0]; ++i){
+            for(int j=lo[1]; j<hi[1]; ++j){
+                unsigned int row = i*sx + j*sy;
+                for(int k=lo[2]; k<hi[2]; ++k){
+                    unsigned int c = row+k;
+                    int cells[7] = { i>0 ? a[c-sx] : SOLID, i<x-1 ? a[c+sx] : SOLID,
+                                     j>0 ? a[c-sy] : SOLID, j<y-1 ? a[c+sy] : SOLID,
+                                     k>0 ? a[c-1] : SOLID, k<z-1 ? a[c+1] : SOLID, a[c] };
+                    unsigned short packed = 0;
+                    for(int m=0; m<7; m++){
+                        packed |= cells[m] << (m*NEIGHBOR_TYPE_BITS);
+                    }
+                    types[c] = packed;
+                }
+            }
+        }
+    });
+}
+
+//The type of one neighbor, or of the cell itself for NEIGHBOR_SELF
+int GetNeighborType(const unsigned short& types, const int& neighbor){
+    return (types >> (neighbor*NEIGHBOR_TYPE_BITS)) & NEIGHBOR_TYPE_MASK;
+}
+
+//ARef for a fluid cell and one of its neighbors
+float ARefInterior(const unsigned short& types, const int& neighbor){
+    return GetNeighborType(types, neighbor)==FLUID ? -1.0f : 0.0f;
+}
+
+float PRefInterior(const float* p, const unsigned int& n){
+    return p[n]!=FLUID ? 0.0f : p[n];
+}
+
+//ADiag for a fluid cell at linear index c
+template <bool Subcell> float ADiagInterior(const unsigned short& types, const float* l,
+                                            const unsigned int& c, const unsigned int& sx,
+                                            const unsigned int& sy){
+    float diag = 6.0;
+    unsigned int q[6] = {c-sx, c+sx, c-sy, c+sy, c-1, c+1};
+    for(int m=0; m<6; m++){
+        int type = GetNeighborType(types, m);
+        if(type==SOLID){
+            diag -= 1.0;
+        }else if(Subcell==true && type==AIR){
+            diag -= l[q[m]]/glm::min(1.0e-6f,l[c]);
+        }
+    }
+    return diag;
+}
+
+//XRef from cell c to the given neighbor at linear index n
+template <bool Subcell> float XRefInterior(const unsigned short& types, const int& neighbor,
+                                           const float* l, const float* x, const unsigned int& c,
+                                           const unsigned int& n){
+    int type = GetNeighborType(types, neighbor);
+    float air = Subcell==true ? l[n]/glm::min(1.0e-6f,l[c])*x[c] : 0.0f;
+    return type==FLUID ? x[n] : (type==SOLID ? x[c] : air);
+}
+
+//True if cells (i,j,lo[2]) through (i,j,hi[2]-1) include interior cells, which are then k0
+//through k1-1. Cells of the row outside that range are on the boundary shell
+bool GetInteriorRow(const int& i, const int& j, const int* lo, const int* hi, const int& x,
+                    const int& y, const int& z, int& k0, int& k1){
+    k0 = glm::max(lo[2], 1);
+    k1 = glm::min(hi[2], z-1);
+    return i>0 && i<x-1 && j>0 && j<y-1 && k0<k1;
+}
+
+template <bool Subcell> void BuildPreconditionerTile(Grid<float>* pc, MacGrid& mgrid, 
+                                                     const int* lo, const int* hi){
     int x = (int)mgrid.m_dimensions.x; int y = (int)mgrid.m_dimensions.y; 
     int z = (int)mgrid.m_dimensions.z;
+    int subcell = Subcell==true ? 1 : 0;
     float a = 0.25f;
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                for(unsigned int j=0; j<y; ++j){
-                    for(unsigned int k=0; k<z; ++k){
-                        if(mgrid.m_A->GetCell(i,j,k)==FLUID){   
-                            float left = ARef(mgrid.m_A,i-1,j,k,i,j,k,mgrid.m_dimensions) * 
-                                         PRef(pc,i-1,j,k,mgrid.m_dimensions);
-                            float bottom = ARef(mgrid.m_A,i,j-1,k,i,j,k,mgrid.m_dimensions) * 
-                                           PRef(pc,i,j-1,k,mgrid.m_dimensions);
-                            float back = ARef(mgrid.m_A,i,j,k-1,i,j,k,mgrid.m_dimensions) * 
-                                         PRef(pc,i,j,k-1,mgrid.m_dimensions);
-                            float diag = ADiag(mgrid.m_A, mgrid.m_L,i,j,k,mgrid.m_dimensions,
-                                               subcell);
-                            float e = diag - (left*left) - (bottom*bottom) - (back*back);
-                            if(diag>0){
-                                if( e < a*diag ){
-                                    e = diag;
-                                }
-                                pc->SetCell(i,j,k, 1.0f/glm::sqrt(e));
-                            }
+    const unsigned short* types = mgrid.m_N->GetRawData();
+    const float* l = mgrid.m_L->GetRawData();
+    float* p = pc->GetRawData();
+    unsigned int sx = mgrid.m_A->GetStrideX(); unsigned int sy = mgrid.m_A->GetStrideY();
+    //the checked path, for boundary cells
+    auto buildCell = [&](const int& i, const int& j, const int& k){
+        if(mgrid.m_A->GetCell(i,j,k)==FLUID){   
+            float left = ARef(mgrid.m_A,i-1,j,k,i,j,k,mgrid.m_dimensions) * 
+                         PRef(pc,i-1,j,k,mgrid.m_dimensions);
+            float bottom = ARef(mgrid.m_A,i,j-1,k,i,j,k,mgrid.m_dimensions) * 
+                           PRef(pc,i,j-1,k,mgrid.m_dimensions);
+            float back = ARef(mgrid.m_A,i,j,k-1,i,j,k,mgrid.m_dimensions) * 
+                         PRef(pc,i,j,k-1,mgrid.m_dimensions);
+            float diag = ADiag(mgrid.m_A, mgrid.m_L,i,j,k,mgrid.m_dimensions,subcell);
+            float e = diag - (left*left) - (bottom*bottom) - (back*back);
+            if(diag>0){
+                if( e < a*diag ){
+                    e = diag;
+                }
+                pc->SetCell(i,j,k, 1.0f/glm::sqrt(e));
+            }
+        }
+    };
+    for(int i=lo[0]; i<hi[0]; ++i){
+        for(int j=lo[1]; j<hi[1]; ++j){
+            int k0; int k1;
+            if(GetInteriorRow(i, j, lo, hi, x, y, z, k0, k1)==false){
+                for(int k=lo[2]; k<hi[2]; ++k){
+                    buildCell(i, j, k);
+                }
+                continue;
+            }
+            for(int k=lo[2]; k<k0; ++k){
+                buildCell(i, j, k);
+            }
+            unsigned int row = i*sx + j*sy;
+            for(unsigned int c=row+k0; c<row+k1; ++c){
+                unsigned short neighbors = types[c];
+                if(GetNeighborType(neighbors, NEIGHBOR_SELF)==FLUID){
+                    float left = ARefInterior(neighbors, NEIGHBOR_LEFT) * PRefInterior(p, c-sx);
+                    float bottom = ARefInterior(neighbors, NEIGHBOR_BOTTOM) * PRefInterior(p, c-sy);
+                    float back = ARefInterior(neighbors, NEIGHBOR_BACK) * PRefInterior(p, c-1);
+                    float diag = ADiagInterior<Subcell>(neighbors, l, c, sx, sy);
+                    float e = diag - (left*left) - (bottom*bottom) - (back*back);
+                    if(diag>0){
+                        if( e < a*diag ){
+                            e = diag;
                         }
+                        p[c] = 1.0f/glm::sqrt(e);
                     }
                 }
             }
+            for(int k=k1; k<hi[2]; ++k){
+                buildCell(i, j, k);
+            }
         }
-    );
+    }
+}
+
+//Does what it says
+void BuildPreconditioner(Grid<float>* pc, MacGrid& mgrid, int subcell, TileMask* tiles){
+    utilityCore::ProfileScope scope("BuildPreconditioner");
+    ForEachActiveTile(tiles, -1, [&](const int* lo, const int* hi){
+        if(subcell){
+            BuildPreconditionerTile<true>(pc, mgrid, lo, hi);
+        }else{
+            BuildPreconditionerTile<false>(pc, mgrid, lo, hi);
+        }
+    });
 }
 
 //Helper for PCG solver: read X with clamped bounds
-float XRef(Grid<int>* A, Grid<float>* L, Grid<float>* X, glm::vec3 f, glm::vec3 p, 
+float XRef(Grid<unsigned char>* A, Grid<float>* L, Grid<float>* X, glm::vec3 f, glm::vec3 p, 
            glm::vec3 dimensions, int subcell){
     int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
     int i = glm::min(glm::max(0,(int)p.x),x-1); int fi = (int)f.x;
@@ -153,183 +351,437 @@ float XRef(Grid<int>* A, Grid<float>* L, Grid<float>* X, glm::vec3 f, glm::vec3
     }
 }
 
+//The vector ops below walk raw rows of every active tile directly. All cell centered solver
+//grids are linear and share dimensions, so A's strides index every one of them. Cells outside
+//active tiles are never fluid and are left at zero
+
 // target = X + alpha*Y
-void Op(Grid<int>* A, Grid<float>* X, Grid<float>* Y, Grid<float>* target, float alpha, 
-        glm::vec3 dimensions){
-    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
-    for(unsigned int j=0; j<y; ++j){
-        for(unsigned int k=0; k<z; ++k){
-            //this parallel loop has to be the inner loop or else MSVC will barf
-            tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-                [=](const tbb::blocked_range<unsigned int>& r){
-                    for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                        if(A->GetCell(i,j,k)==FLUID){
-                            float targetval = X->GetCell(i,j,k)+alpha*Y->GetCell(i,j,k);
-                            target->SetCell(i,j,k,targetval);
-                        }else{
-                            target->SetCell(i,j,k,0.0f);
-                        }               
-                    }
+void Op(Grid<unsigned char>* A, Grid<float>* X, Grid<float>* Y, Grid<float>* target, float alpha,
+        TileMask* tiles){
+    utilityCore::ProfileScope scope("Op");
+    unsigned char* a = A->GetRawData(); float* xv = X->GetRawData(); float* yv = Y->GetRawData();
+    float* t = target->GetRawData();
+    unsigned int sx = A->GetStrideX(); unsigned int sy = A->GetStrideY();
+    ForEachActiveTile(tiles, -1, [=](const int* lo, const int* hi){
+        for(int i=lo[0]; i<hi[0]; ++i){
+            for(int j=lo[1]; j<hi[1]; ++j){
+                unsigned int row = i*sx + j*sy;
+                for(unsigned int k=row+lo[2]; k<row+hi[2]; ++k){
+                    t[k] = (a[k]==FLUID) ? xv[k]+alpha*yv[k] : 0.0f;
                 }
-            );
+            }
         }
-    }
+    });
 }
 
 // ans = x^T * x
-float Product(Grid<int>* A, Grid<float>* X, Grid<float>* Y, glm::vec3 dimensions){
-    int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
-    float result = 0.0f;
-    for(unsigned int i=0; i<x; i++){
-        for(unsigned int j=0; j<y; j++){
-            for(unsigned int k=0; k<z; k++){
-                if(A->GetCell(i,j,k)==FLUID){
-                    result += X->GetCell(i,j,k) * Y->GetCell(i,j,k);
+float Product(Grid<unsigned char>* A, Grid<float>* X, Grid<float>* Y, TileMask* tiles,
+              const bool& deterministic){
+    utilityCore::ProfileScope scope("Product");
+    unsigned char* a = A->GetRawData(); float* xv = X->GetRawData(); float* yv = Y->GetRawData();
+    unsigned int sx = A->GetStrideX(); unsigned int sy = A->GetStrideY();
+    double result = ReduceActiveTiles(tiles, deterministic, 
+                                      [=](const int* lo, const int* hi)->double{
+        double sum = 0.0;
+        for(int i=lo[0]; i<hi[0]; ++i){
+            for(int j=lo[1]; j<hi[1]; ++j){
+                unsigned int row = i*sx + j*sy;
+                for(unsigned int k=row+lo[2]; k<row+hi[2]; ++k){
+                    if(a[k]==FLUID){
+                        sum += xv[k] * yv[k];
+                    }
                 }
             }
         }
-    }
-    return result;
+        return sum;
+    });
+    return (float)result;
 }
 
-//Helper for PCG solver: target = AX
-void ComputeAx(Grid<int>* A, Grid<float>* L, Grid<float>* X, Grid<float>* target, 
-               glm::vec3 dimensions, int subcell){
+//Fused CG update: X = X + alpha*S and R = R - alpha*Z in one pass, returns R . R
+float UpdateSolutionAndResidual(Grid<unsigned char>* A, Grid<float>* X, Grid<float>* R,
+                                Grid<float>* S, Grid<float>* Z, float alpha, TileMask* tiles,
+                                const bool& deterministic){
+    utilityCore::ProfileScope scope("UpdateSolution");
+    unsigned char* a = A->GetRawData(); float* xv = X->GetRawData(); float* rv = R->GetRawData();
+    float* sv = S->GetRawData(); float* zv = Z->GetRawData();
+    unsigned int sx = A->GetStrideX(); unsigned int sy = A->GetStrideY();
+    double result = ReduceActiveTiles(tiles, deterministic, 
+                                      [=](const int* lo, const int* hi)->double{
+        double sum = 0.0;
+        for(int i=lo[0]; i<hi[0]; ++i){
+            for(int j=lo[1]; j<hi[1]; ++j){
+                unsigned int row = i*sx + j*sy;
+                for(unsigned int k=row+lo[2]; k<row+hi[2]; ++k){
+                    if(a[k]==FLUID){
+                        xv[k] = xv[k] + alpha*sv[k];
+                        rv[k] = rv[k] - alpha*zv[k];
+                        sum += rv[k] * rv[k];
+                    }else{
+                        xv[k] = 0.0f;
+                        rv[k] = 0.0f;
+                    }
+                }
+            }
+        }
+        return sum;
+    });
+    return (float)result;
+}
+
+//Helper for PCG solver: target = AX for the cells [lo,hi) of one tile, returns that tile's part
+//of target . X. Cells are summed in row order on both paths, so the product doesn't depend on
+//where the boundary shell falls
+template <bool Subcell> double ComputeAxTileStencil(Grid<unsigned char>* A,
+                                                    Grid<unsigned short>* N, Grid<float>* L,
+                                                    Grid<float>* X, Grid<float>* target,
+                                                    glm::vec3 dimensions, const int* lo,
+                                                    const int* hi){
     int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
+    int subcell = Subcell==true ? 1 : 0;
     float n = (float)glm::max(glm::max(x,y),z);
     float h = 1.0f/(n*n);
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                for(unsigned int j=0; j<y; ++j){
-                    for(unsigned int k=0; k<z; ++k){
-                        if(A->GetCell(i,j,k) == FLUID){
-                            float result = (6.0f*X->GetCell(i,j,k)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i+1,j,k), 
-                                                  dimensions, subcell)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i-1,j,k), 
-                                                  dimensions, subcell)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j+1,k), 
-                                                  dimensions, subcell)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j-1,k), 
-                                                  dimensions, subcell)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j,k+1), 
-                                                  dimensions, subcell)
-                                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j,k-1), 
-                                                  dimensions, subcell)
-                                            )/h;
-                            target->SetCell(i,j,k,result);
-                        } else {
-                            target->SetCell(i,j,k,0.0f);
-                        }
-                    }
+    const unsigned short* types = N->GetRawData(); const float* l = L->GetRawData(); 
+    const float* xv = X->GetRawData(); float* t = target->GetRawData();
+    unsigned int sx = A->GetStrideX(); unsigned int sy = A->GetStrideY();
+    double sum = 0.0;
+    //the checked path, for boundary cells
+    auto computeCell = [&](const int& i, const int& j, const int& k){
+        if(A->GetCell(i,j,k) == FLUID){
+            float result = (6.0f*X->GetCell(i,j,k)
+                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i+1,j,k),
+                                  dimensions, subcell)
+                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i-1,j,k),
+                                  dimensions, subcell)
+                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j+1,k),
+                                  dimensions, subcell)
+                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j-1,k),
+                                  dimensions, subcell)
+                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j,k+1),
+                                  dimensions, subcell)
+                            -XRef(A, L, X, glm::vec3(i,j,k), glm::vec3(i,j,k-1),
+                                  dimensions, subcell)
+                            )/h;
+            target->SetCell(i,j,k,result);
+            sum += result * X->GetCell(i,j,k);
+        } else {
+            target->SetCell(i,j,k,0.0f);
+        }
+    };
+    for(int i=lo[0]; i<hi[0]; ++i){
+        for(int j=lo[1]; j<hi[1]; ++j){
+            int k0; int k1;
+            if(GetInteriorRow(i, j, lo, hi, x, y, z, k0, k1)==false){
+                for(int k=lo[2]; k<hi[2]; ++k){
+                    computeCell(i, j, k);
                 }
+                continue;
+            }
+            for(int k=lo[2]; k<k0; ++k){
+                computeCell(i, j, k);
+            }
+            unsigned int row = i*sx + j*sy;
+            for(unsigned int c=row+k0; c<row+k1; ++c){
+                unsigned short neighbors = types[c];
+                float result = (6.0f*xv[c]
+                                -XRefInterior<Subcell>(neighbors, NEIGHBOR_RIGHT, l, xv, c, c+sx)
+                                -XRefInterior<Subcell>(neighbors, NEIGHBOR_LEFT, l, xv, c, c-sx)
+                                -XRefInterior<Subcell>(neighbors, NEIGHBOR_TOP, l, xv, c, c+sy)
+                                -XRefInterior<Subcell>(neighbors, NEIGHBOR_BOTTOM, l, xv, c, c-sy)
+                                -XRefInterior<Subcell>(neighbors, NEIGHBOR_FRONT, l, xv, c, c+1)
+                                -XRefInterior<Subcell>(neighbors, NEIGHBOR_BACK, l, xv, c, c-1)
+                                )/h;
+                bool fluid = GetNeighborType(neighbors, NEIGHBOR_SELF)==FLUID;
+                t[c] = fluid ? result : 0.0f;
+                sum += fluid ? result*xv[c] : 0.0f;
+            }
+            for(int k=k1; k<hi[2]; ++k){
+                computeCell(i, j, k);
             }
         }
-    );
+    }
+    return sum;
+}
+
+double ComputeAxTile(Grid<unsigned char>* A, Grid<unsigned short>* N, Grid<float>* L,
+                     Grid<float>* X, Grid<float>* target, glm::vec3 dimensions, int subcell,
+                     const int* lo, const int* hi){
+    if(subcell){
+        return ComputeAxTileStencil<true>(A, N, L, X, target, dimensions, lo, hi);
+    }
+    return ComputeAxTileStencil<false>(A, N, L, X, target, dimensions, lo, hi);
+}
+
+//Helper for PCG solver: target = AX
+void ComputeAx(Grid<unsigned char>* A, Grid<unsigned short>* N, Grid<float>* L, Grid<float>* X,
+               Grid<float>* target, glm::vec3 dimensions, int subcell, TileMask* tiles){
+    utilityCore::ProfileScope scope("ComputeAx");
+    ForEachActiveTile(tiles, -1, [=](const int* lo, const int* hi){
+        ComputeAxTile(A, N, L, X, target, dimensions, subcell, lo, hi);
+    });
+}
+
+//Helper for PCG solver: target = AX fused with the target . X product
+float ComputeAxProduct(Grid<unsigned char>* A, Grid<unsigned short>* N, Grid<float>* L,
+                       Grid<float>* X, Grid<float>* target, glm::vec3 dimensions, int subcell,
+                       TileMask* tiles, const bool& deterministic){
+    utilityCore::ProfileScope scope("ComputeAx");
+    double result = ReduceActiveTiles(tiles, deterministic, 
+                                      [=](const int* lo, const int* hi)->double{
+        return ComputeAxTile(A, N, L, X, target, dimensions, subcell, lo, hi);
+    });
+    return (float)result;
+}
+
+//Pressure gradient for count faces of one row, starting at face f of u and cell c of the cell
+//centered grids. The face's back cell is offset cells before its front cell
+template <bool Subcell> void SubtractPressureGradientRow(const float* p, const float* l, float* u,
+                                                         const unsigned int& c, 
+                                                         const unsigned int& f,
+                                                         const unsigned int& count,
+                                                         const unsigned int& offset,
+                                                         const float& h){
+    for(unsigned int n=0; n<count; n++){
+        unsigned int front = c+n; unsigned int back = front-offset;
+        float pf = p[front];
+        float pb = p[back];
+        if(Subcell==true){
+            float lf = l[front]; float lb = l[back];
+            bool surface = lf*lb < 0.0f;
+            float pfs = lf<0.0f ? p[front] : lf/glm::min(1.0e-3f,lb)*p[back];
+            float pbs = lb<0.0f ? p[back] : lb/glm::min(1.0e-6f,lf)*p[front];
+            pf = surface ? pfs : pf;
+            pb = surface ? pbs : pb;
+        }
+        u[f+n] -= (pf-pb)/h;
+    }
 }
 
+//Both triangular solves run as tile wavefronts. Every tile on a diagonal only reads cells of
+//tiles on earlier diagonals (forward) or later ones (backward), so the tiles of one diagonal run
+//in parallel and cells inside a tile are swept in order. That gives the same result as a serial
+//sweep with one parallel launch per diagonal instead of one per row
 void ApplyPreconditioner(Grid<float>* Z, Grid<float>* R, Grid<float>* P, Grid<float>* L, 
-                         Grid<int>* A, glm::vec3 dimensions){
+                         Grid<unsigned char>* A, Grid<unsigned short>* N, glm::vec3 dimensions,
+                         TileMask* tiles, GridPool<float>* pool){
+    Grid<float>* Q = pool->Acquire(dimensions, 0.0f);
     int x = (int)dimensions.x; int y = (int)dimensions.y; int z = (int)dimensions.z;
-    Grid<float>* Q = new Grid<float>(dimensions, 0.0f);
+    const unsigned short* types = N->GetRawData(); const float* rv = R->GetRawData(); 
+    const float* p = P->GetRawData(); float* q = Q->GetRawData(); float* zv = Z->GetRawData();
+    unsigned int sx = A->GetStrideX(); unsigned int sy = A->GetStrideY();
+    const unsigned int* wavefrontTiles = tiles->m_wavefrontTiles.data();
+    int wavefronts = (int)tiles->m_wavefrontStart.size()-1;
+    utilityCore::Profiler* profiler = utilityCore::GetProfiler();
 
     // LQ = R
-    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-        [=](const tbb::blocked_range<unsigned int>& r){
-            for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                for(unsigned int j=0; j<y; ++j){
-                    for(unsigned int k=0; k<z; ++k){
+    profiler->BeginStage("PreconditionerForward");
+    for(int w=0; w<wavefronts; w++){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(tiles->m_wavefrontStart[w],
+                                                           tiles->m_wavefrontStart[w+1]),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int t=r.begin(); t!=r.end(); ++t){
+                    int lo[3]; int hi[3];
+                    GetTileBounds(tiles, wavefrontTiles[t], -1, lo, hi);
+                    auto forwardCell = [&](const int& i, const int& j, const int& k){
                         if(A->GetCell(i,j,k) == FLUID) {
                             float left = ARef(A,i-1,j,k,i,j,k,dimensions)*
-                                         PRef(P,i-1,j,k,dimensions)*PRef(Q,i-1,j,k,dimensions);
+                                         PRef(P,i-1,j,k,dimensions)*
+                                         PRef(Q,i-1,j,k,dimensions);
                             float bottom = ARef(A,i,j-1,k,i,j,k,dimensions)*
-                                           PRef(P,i,j-1,k,dimensions)*PRef(Q,i,j-1,k,dimensions);
+                                           PRef(P,i,j-1,k,dimensions)*
+                                           PRef(Q,i,j-1,k,dimensions);
                             float back = ARef(A,i,j,k-1,i,j,k,dimensions)*
-                                         PRef(P,i,j,k-1,dimensions)*PRef(Q,i,j,k-1,dimensions);
-                            
+                                         PRef(P,i,j,k-1,dimensions)*
+                                         PRef(Q,i,j,k-1,dimensions);
                             float t = R->GetCell(i,j,k) - left - bottom - back;
                             float qVal = t * P->GetCell(i,j,k);
                             Q->SetCell(i,j,k,qVal);
                         }
+                    };
+                    for(int i=lo[0]; i<hi[0]; ++i){
+                        for(int j=lo[1]; j<hi[1]; ++j){
+                            int k0; int k1;
+                            if(GetInteriorRow(i, j, lo, hi, x, y, z, k0, k1)==false){
+                                k0 = hi[2];
+                                k1 = hi[2];
+                            }
+                            for(int k=lo[2]; k<k0; ++k){
+                                forwardCell(i, j, k);
+                            }
+                            unsigned int row = i*sx + j*sy;
+                            for(unsigned int c=row+k0; c<row+k1; ++c){
+                                unsigned short neighbors = types[c];
+                                float left = ARefInterior(neighbors, NEIGHBOR_LEFT)*
+                                             PRefInterior(p, c-sx)*PRefInterior(q, c-sx);
+                                float bottom = ARefInterior(neighbors, NEIGHBOR_BOTTOM)*
+                                               PRefInterior(p, c-sy)*PRefInterior(q, c-sy);
+                                float back = ARefInterior(neighbors, NEIGHBOR_BACK)*
+                                             PRefInterior(p, c-1)*PRefInterior(q, c-1);
+                                float t = rv[c] - left - bottom - back;
+                                bool fluid = GetNeighborType(neighbors, NEIGHBOR_SELF)==FLUID;
+                                q[c] = fluid ? t*p[c] : q[c];
+                            }
+                            for(int k=k1; k<hi[2]; ++k){
+                                forwardCell(i, j, k);
+                            }
+                        }
                     }
                 }
             }
-        }
-    );
+        );
+    }
+    profiler->EndStage();
 
     // L^T Z = Q
-    for(int j=y-1; j>=0; j--){
-        for(int k=z-1; k>=0; k--){
-            //this parallel loop has to be the inner loop or else MSVC will barf
-            tbb::parallel_for(tbb::blocked_range<int>(-1,x-1),
-                [=](const tbb::blocked_range<int>& r){
-                    for(int i=r.end(); i!=r.begin(); i--){
+    profiler->BeginStage("PreconditionerBackward");
+    for(int w=wavefronts-1; w>=0; w--){
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(tiles->m_wavefrontStart[w],
+                                                           tiles->m_wavefrontStart[w+1]),
+            [=](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int t=r.begin(); t!=r.end(); ++t){
+                    int lo[3]; int hi[3];
+                    GetTileBounds(tiles, wavefrontTiles[t], -1, lo, hi);
+                    auto backwardCell = [&](const int& i, const int& j, const int& k){
                         if(A->GetCell(i,j,k) == FLUID){
                             float right = ARef(A,i,j,k,i+1,j,k,dimensions)*
-                                          PRef(P,i,j,k,dimensions)*PRef(Z,i+1,j,k,dimensions);
+                                          PRef(P,i,j,k,dimensions)*
+                                          PRef(Z,i+1,j,k,dimensions);
                             float top = ARef(A,i,j,k,i,j+1,k,dimensions)*
-                                        PRef(P,i,j,k,dimensions)*PRef(Z,i,j+1,k,dimensions);
+                                        PRef(P,i,j,k,dimensions)*
+                                        PRef(Z,i,j+1,k,dimensions);
                             float front = ARef(A,i,j,k,i,j,k+1,dimensions)*
-                                          PRef(P,i,j,k,dimensions)*PRef(Z,i,j,k+1,dimensions);
-                        
+                                          PRef(P,i,j,k,dimensions)*
+                                          PRef(Z,i,j,k+1,dimensions);
                             float t = Q->GetCell(i,j,k) - right - top - front;
                             float zVal = t * P->GetCell(i,j,k);
                             Z->SetCell(i,j,k,zVal);
                         }
+                    };
+                    for(int i=hi[0]-1; i>=lo[0]; --i){
+                        for(int j=hi[1]-1; j>=lo[1]; --j){
+                            int k0; int k1;
+                            if(GetInteriorRow(i, j, lo, hi, x, y, z, k0, k1)==false){
+                                k0 = hi[2];
+                                k1 = hi[2];
+                            }
+                            for(int k=hi[2]-1; k>=k1; --k){
+                                backwardCell(i, j, k);
+                            }
+                            unsigned int row = i*sx + j*sy;
+                            for(int k=k1-1; k>=k0; --k){
+                                unsigned int c = row+k;
+                                unsigned short neighbors = types[c];
+                                float pc = PRefInterior(p, c);
+                                float right = ARefInterior(neighbors, NEIGHBOR_RIGHT)*pc*
+                                              PRefInterior(zv, c+sx);
+                                float top = ARefInterior(neighbors, NEIGHBOR_TOP)*pc*
+                                            PRefInterior(zv, c+sy);
+                                float front = ARefInterior(neighbors, NEIGHBOR_FRONT)*pc*
+                                              PRefInterior(zv, c+1);
+                                float t = q[c] - right - top - front;
+                                bool fluid = GetNeighborType(neighbors, NEIGHBOR_SELF)==FLUID;
+                                zv[c] = fluid ? t*p[c] : zv[c];
+                            }
+                            for(int k=k0-1; k>=lo[2]; --k){
+                                backwardCell(i, j, k);
+                            }
+                        }
                     }
                 }
-            );
-        }
+            }
+        );
     }
-    delete Q;
+    profiler->EndStage();
+    pool->Release(Q);
 }
 
-//Does what it says
-void SolveConjugateGradient(MacGrid& mgrid, Grid<float>* PC, int subcell, const bool& verbose){
+//Does what it says. If a multigrid hierarchy is given it is used in place of the MIC(0)
+//preconditioner PC
+void SolveConjugateGradient(MacGrid& mgrid, Grid<float>* PC,
+                            std::vector<MultigridLevel>* multigrid, int subcell,
+                            TileMask* tiles, const SimSettings& settings, GridPool<float>* pool,
+                            const bool& verbose){
     int x = (int)mgrid.m_dimensions.x; int y = (int)mgrid.m_dimensions.y; 
     int z = (int)mgrid.m_dimensions.z;
 
-    Grid<float>* R = new Grid<float>(mgrid.m_dimensions, 0.0f);
-    Grid<float>* Z = new Grid<float>(mgrid.m_dimensions, 0.0f);
-    Grid<float>* S = new Grid<float>(mgrid.m_dimensions, 0.0f);
+    Grid<float>* R = pool->Acquire(mgrid.m_dimensions, 0.0f);
+    Grid<float>* Z = pool->Acquire(mgrid.m_dimensions, 0.0f);
+    //S is a full copy of Z before it is first read
+    Grid<float>* S = pool->AcquireUninitialized(mgrid.m_dimensions, 0.0f);
 
     //note: we're calling pressure "mgrid.P" instead of x
 
-    ComputeAx(mgrid.m_A, mgrid.m_L, mgrid.m_P, Z, mgrid.m_dimensions, subcell); // z = apply A(x)
-    Op(mgrid.m_A, mgrid.m_D, Z, R, -1.0f, mgrid.m_dimensions);                // r = b-Ax
-    float error0 = Product(mgrid.m_A, R, R, mgrid.m_dimensions);            // error0 = product(r,r)
-
-    // z = f(r), aka preconditioner step
-    ApplyPreconditioner(Z, R, PC, mgrid.m_L, mgrid.m_A, mgrid.m_dimensions);    
-
-    //s = z. TODO: replace with VDB deep copy?
-
-    for(unsigned int j=0; j<y; ++j ){
-        for(unsigned int k=0; k<z; ++k ){
-            //this parallel loop has to be the inner loop or else MSVC will barf
-            tbb::parallel_for(tbb::blocked_range<unsigned int>(0,x),
-                [=](const tbb::blocked_range<unsigned int>& r){
-                    for(unsigned int i=r.begin(); i!=r.end(); ++i){
-                        S->SetCell(i,j,k,Z->GetCell(i,j,k));
+    //start from last step's pressure where cells are still fluid. Anything else is zeroed so
+    //stale pressure in cells that drained can't leak into the gradient
+    bool warmStart = settings.m_warmStart;
+    unsigned char* a0 = mgrid.m_A->GetRawData();
+    float* p0 = mgrid.m_P->GetRawData();
+    unsigned int sx = mgrid.m_A->GetStrideX(); unsigned int sy = mgrid.m_A->GetStrideY();
+    ForEachActiveTile(tiles, -1, [=](const int* lo, const int* hi){
+        for(int i=lo[0]; i<hi[0]; ++i){
+            for(int j=lo[1]; j<hi[1]; ++j){
+                unsigned int row = i*sx + j*sy;
+                for(unsigned int c=row+lo[2]; c<row+hi[2]; ++c){
+                    if(warmStart==false || a0[c]!=FLUID){
+                        p0[c] = 0.0f;
                     }
                 }
-            );  
+            }
         }
-    }
+    });
 
+    ComputeAx(mgrid.m_A, mgrid.m_N, mgrid.m_L, mgrid.m_P, Z, mgrid.m_dimensions, subcell,
+              tiles);                                                       // z = A(x)
+    Op(mgrid.m_A, mgrid.m_D, Z, R, -1.0f, tiles);                           // r = b-Ax
+    bool deterministic = settings.m_deterministic;
+    float error0 = Product(mgrid.m_A, R, R, tiles, deterministic);        // error0 = r.r
 
-    float eps = 1.0e-2f * (x*y*z);
-    float a = Product(mgrid.m_A, Z, R, mgrid.m_dimensions);                 // a = product(z,r)
+    // z = f(r), aka preconditioner step
+    if(multigrid!=NULL){
+        ApplyMultigridPreconditioner(*multigrid, Z, R);
+    }else{
+        ApplyPreconditioner(Z, R, PC, mgrid.m_L, mgrid.m_A, mgrid.m_N, mgrid.m_dimensions, tiles,
+                            pool);
+    }
 
-    for( int k=0; k<x*y*z; k++){
+    //s = z
+    S->Copy(Z);
+
+    //converged once the residual is small relative to the divergence, or once it is below the
+    //old per cell absolute tolerance, scaled by the fluid cells rather than the box
+    unsigned char* cellTypes = mgrid.m_A->GetRawData();
+    double fluidCells = ReduceActiveTiles(tiles, deterministic, 
+                                          [=](const int* lo, const int* hi)->double{
+        unsigned int count = 0;
+        for(int i=lo[0]; i<hi[0]; ++i){
+            for(int j=lo[1]; j<hi[1]; ++j){
+                unsigned int row = i*sx + j*sy;
+                for(unsigned int c=row+lo[2]; c<row+hi[2]; ++c){
+                    count += cellTypes[c]==FLUID;
+                }
+            }
+        }
+        return (double)count;
+    });
+    float divergence = Product(mgrid.m_A, mgrid.m_D, mgrid.m_D, tiles, deterministic); // b.b
+    float tolerance = settings.m_pcgTolerance;
+    float eps = glm::max(tolerance*tolerance*divergence, 1.0e-2f*(float)fluidCells);
+    float a = Product(mgrid.m_A, Z, R, tiles, deterministic);  // a = product(z,r)
+
+    int iterations = 0;
+    float residual = error0;
+    int maxIterations = glm::min(settings.m_pcgMaxIterations, x*y*z);
+    for( int k=0; k<maxIterations && error0>eps; k++){
         //Solve current iteration
-        ComputeAx(mgrid.m_A, mgrid.m_L, S, Z, mgrid.m_dimensions, subcell); // z = applyA(s)
-        float alpha = a/Product(mgrid.m_A, Z, S, mgrid.m_dimensions);       // alpha = a/(z . s)
-        Op(mgrid.m_A, mgrid.m_P, S, mgrid.m_P, alpha, mgrid.m_dimensions);  // x = x + alpha*s
-        Op(mgrid.m_A, R, Z, R, -alpha, mgrid.m_dimensions);                 // r = r - alpha*z;
-        float error1 = Product(mgrid.m_A, R, R, mgrid.m_dimensions);        // error1 = product(r,r)
+        // z = applyA(s), alpha = a/(z . s)
+        float alpha = a/ComputeAxProduct(mgrid.m_A, mgrid.m_N, mgrid.m_L, S, Z, mgrid.m_dimensions,
+                                         subcell, tiles, deterministic);
+        // x = x + alpha*s, r = r - alpha*z, error1 = product(r,r)
+        float error1 = UpdateSolutionAndResidual(mgrid.m_A, mgrid.m_P, R, S, Z, alpha,
+                                                 tiles, deterministic);
         error0 = glm::max(error0, error1);
+        iterations = k+1;
+        residual = error1;
         //Output progress
         float rate = 1.0f - glm::max(0.0f,glm::min(1.0f,(error1-eps)/(error0-eps)));
         // if(verbose){
@@ -339,21 +791,36 @@ void SolveConjugateGradient(MacGrid& mgrid, Grid<float>* PC, int subcell, const
         if(error1<=eps){
             break;
         }
+        if(k+1==maxIterations){
+            std::cout << "Warning: PCG hit the iteration cap of " << maxIterations 
+                      << " with residual " << error1 << std::endl;
+            break;
+        }
         //Prep next iteration
         // z = f(r)
-        ApplyPreconditioner(Z, R, PC, mgrid.m_L, mgrid.m_A, mgrid.m_dimensions);
-        float a2 = Product(mgrid.m_A, Z, R, mgrid.m_dimensions);            // a2 = product(z,r)
+        if(multigrid!=NULL){
+            ApplyMultigridPreconditioner(*multigrid, Z, R);
+        }else{
+            ApplyPreconditioner(Z, R, PC, mgrid.m_L, mgrid.m_A, mgrid.m_N, mgrid.m_dimensions,
+                                tiles, pool);
+        }
+        float a2 = Product(mgrid.m_A, Z, R, tiles, deterministic);          // a2 = z.r
         float beta = a2/a;                                                  // beta = a2/a
-        Op(mgrid.m_A, Z, S, S, beta, mgrid.m_dimensions);                   // s = z + beta*s
+        Op(mgrid.m_A, Z, S, S, beta, tiles);                                // s = z + beta*s
         a = a2;
     }
-
-    delete R;
-    delete Z;
-    delete S;
+    utilityCore::GetProfiler()->SetCounter("pcg_iterations", iterations);
+    utilityCore::GetProfiler()->SetCounter("pcg_residual", residual);
+    utilityCore::GetProfiler()->SetCounter("pcg_relative_residual", 
+                                           divergence>0.0f ? sqrt(residual/divergence) : 0.0f);
+
+    pool->Release(R);
+    pool->Release(Z);
+    pool->Release(S);
 }
 
-void Solve(MacGrid& mgrid, const int& subcell, const bool& verbose){
+void Solve(MacGrid& mgrid, const int& subcell, TileMask* tiles, const SimSettings& settings,
+           GridPool<float>* floatPool, GridPool<unsigned char>* cellPool, const bool& verbose){
 
     //if in VDB mode, force to single threaded to prevent VDB write issues. 
     //this is a kludgey fix for now.
@@ -363,15 +830,26 @@ void Solve(MacGrid& mgrid, const int& subcell, const bool& verbose){
 
     //flip divergence
     FlipGrid(mgrid.m_D, mgrid.m_dimensions);
+    BuildNeighborTypes(mgrid, tiles);
+
+    if(settings.m_preconditioner==PRECONDITIONER_MULTIGRID){
+        //build multigrid hierarchy and solve MGPCG
+        std::vector<MultigridLevel> multigrid = BuildMultigrid(mgrid, subcell, floatPool, 
+                                                               cellPool);
+        SolveConjugateGradient(mgrid, NULL, &multigrid, subcell, tiles, settings, floatPool,
+                               verbose);
+        DeleteMultigrid(multigrid, floatPool, cellPool);
+    }else{
+        //build preconditioner
+        Grid<float>* preconditioner = floatPool->Acquire(mgrid.m_dimensions, 0.0f);
+        BuildPreconditioner(preconditioner, mgrid, subcell, tiles);
 
-    //build preconditioner
-    Grid<float>* preconditioner = new Grid<float>(mgrid.m_dimensions, 0.0f);
-    BuildPreconditioner(preconditioner, mgrid, subcell);
-
-    //solve conjugate gradient
-    SolveConjugateGradient(mgrid, preconditioner, subcell, verbose);
+        //solve conjugate gradient
+        SolveConjugateGradient(mgrid, preconditioner, NULL, subcell, tiles, settings, floatPool,
+                               verbose);
 
-    delete preconditioner;
+        floatPool->Release(preconditioner);
+    }
 
     // if(mgrid.type==VDB){
     //  omp_set_num_threads(omp_get_num_procs());
@@ -0,0 +1,127 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: wedge.cpp
+// Implements wedge.hpp
+
+#include <iostream>
+#include <algorithm>
+#include "wedge.hpp"
+
+namespace fluidCore {
+
+WedgeRunner::WedgeRunner(sceneCore::SceneLoader* loader, const bool& verbose){
+    m_loader = loader;
+    m_verbose = verbose;
+}
+
+//Sims go before their scenes, and the arenas only once nothing runs in them
+WedgeRunner::~WedgeRunner(){
+    for(unsigned int v=0; v<m_sims.size(); v++){
+        delete m_sims[v];
+        delete m_scenes[v];
+        m_arenas[v]->terminate();
+        delete m_arenas[v];
+    }
+}
+
+bool WedgeRunner::Load(){
+    std::vector<sceneCore::WedgeVariant>& variants = m_loader->GetWedgeVariants();
+    sceneCore::Scene* scene = m_loader->GetScene();
+    int cores = tbb::task_scheduler_init::default_num_threads();
+    int shared = 0;
+    for(unsigned int v=0; v<variants.size(); v++){
+        if(variants[v].m_threads>0){
+            cores -= variants[v].m_threads;
+        }else{
+            shared++;
+        }
+    }
+    int share = shared>0 ? std::max(1, cores/shared) : 1;
+
+    for(unsigned int v=0; v<variants.size(); v++){
+        sceneCore::Scene* instance = scene->CreateInstance();
+        if(instance==NULL){
+            return false;
+        }
+        instance->SetExportTag(variants[v].m_name);
+        instance->SetExternalForces(variants[v].m_externalForces);
+        int threads = variants[v].m_threads>0 ? variants[v].m_threads : share;
+        std::cout << "Wedge " << variants[v].m_name << " on " << threads << " threads..."
+                  << std::endl;
+        tbb::task_arena* arena = new tbb::task_arena(threads, 0);
+        arena->initialize();
+        //grids first touch their storage on creation, so the sim is built by its own arena
+        FlipSim* sim = NULL;
+        float stepsize = m_loader->GetStepsize();
+        glm::vec3 dimensions = m_loader->GetDimensions();
+        bool verbose = m_verbose;
+        arena->execute([&](){
+            sim = new FlipSim(dimensions, variants[v].m_density, stepsize, instance,
+                              variants[v].m_simSettings, verbose);
+        });
+        m_scenes.push_back(instance);
+        m_sims.push_back(sim);
+        m_arenas.push_back(arena);
+    }
+    return true;
+}
+
+void WedgeRunner::SetCheckpointing(const std::string& path, const int& interval, 
+                                   const bool& compress){
+    std::vector<sceneCore::WedgeVariant>& variants = m_loader->GetWedgeVariants();
+    for(unsigned int v=0; v<m_sims.size(); v++){
+        std::string filename = path;
+        if(filename.empty()==false){
+            size_t extension = filename.find_last_of('.');
+            size_t directory = filename.find_last_of("/\\");
+            if(extension==std::string::npos || 
+               (directory!=std::string::npos && extension<directory)){
+                filename += "."+variants[v].m_name;
+            }else{
+                filename.insert(extension, "."+variants[v].m_name);
+            }
+        }
+        m_sims[v]->SetCheckpointing(filename, interval, compress);
+    }
+}
+
+void WedgeRunner::SetMeshFormat(const int& format){
+    for(unsigned int v=0; v<m_scenes.size(); v++){
+        m_scenes[v]->SetMeshFormat(format);
+    }
+}
+
+//Same pattern as NumaTopology::ForEachNode, every arena gets a task group whose work is spawned
+//inside it, and waiting in the arena lets the calling thread help with that variant's work
+void WedgeRunner::Run(const int& frames, const bool& dumpVDB, const bool& dumpOBJ,
+                      const bool& dumpPARTIO){
+    int variants = m_sims.size();
+    std::vector<tbb::task_group*> groups(variants);
+    for(int v=0; v<variants; v++){
+        tbb::task_group* group = new tbb::task_group();
+        groups[v] = group;
+        FlipSim* sim = m_sims[v];
+        m_arenas[v]->execute([=](){
+            group->run([=](){
+                if(sim->m_frame==0){
+                    sim->Init();
+                }
+                while(sim->m_frame<frames){
+                    sim->Step(dumpVDB, dumpOBJ, dumpPARTIO);
+                }
+                sim->GetScene()->FlushExports();
+            });
+        });
+    }
+    for(int v=0; v<variants; v++){
+        tbb::task_group* group = groups[v];
+        m_arenas[v]->execute([group](){
+            group->wait();
+        });
+        delete group;
+    }
+    std::cout << "Finished " << frames << " frames of " << variants << " wedge variants." 
+              << std::endl;
+}
+}
@@ -0,0 +1,47 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: wedge.hpp
+// Runs variants of one scene concurrently in process, each sim in its own thread limited arena
+
+#ifndef WEDGE_HPP
+#define WEDGE_HPP
+
+#include <string>
+#include <vector>
+#include <tbb/tbb.h>
+#include "flip.hpp"
+#include "../scene/sceneloader.hpp"
+
+namespace fluidCore {
+//====================================
+// Class Declarations
+//====================================
+
+//Every variant steps an instance of the loaded scene, so meshes and the static solid level set
+//are loaded and built once and shared read only. The loaded scene itself is never stepped.
+//Variants with no thread quota split the cores left over by the ones that have one
+class WedgeRunner{
+    public:
+        WedgeRunner(sceneCore::SceneLoader* loader, const bool& verbose);
+        ~WedgeRunner();
+
+        //false if the scene can't be instanced, nothing is created then
+        bool Load();
+        //variant names are inserted before the extension of path, like the frame number
+        void SetCheckpointing(const std::string& path, const int& interval, const bool& compress);
+        void SetMeshFormat(const int& format);
+        //Steps every variant to frames concurrently and flushes their exports
+        void Run(const int& frames, const bool& dumpVDB, const bool& dumpOBJ,
+                 const bool& dumpPARTIO);
+
+    private:
+        sceneCore::SceneLoader*                             m_loader;
+        bool                                                m_verbose;
+        std::vector<sceneCore::Scene*>                      m_scenes;
+        std::vector<FlipSim*>                               m_sims;
+        std::vector<tbb::task_arena*>                       m_arenas;
+};
+}
+
+#endif
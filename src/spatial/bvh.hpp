@@ -17,10 +17,15 @@
 #define SHARED
 #endif
 
+#ifndef __CUDACC__
+#include <xmmintrin.h>
+#endif
+#include <tbb/tbb.h>
 #include "aabb.hpp"
 #include "spatial.hpp"
 #include "../ray/ray.hpp"
 #include "../utilities/utilities.h"
+#include "../utilities/checkpoint.hpp"
 
 enum Axis{axis_x, axis_y, axis_z};
 
@@ -59,6 +64,36 @@ struct BvhNode {
     }
 };
 
+//SAH bins per axis and the reference count above which subtrees are built as separate tasks
+#define BVH_BINS 16
+#define BVH_PARALLEL_THRESHOLD 4096
+
+//unused child slot in a Bvh4Node
+#define BVH4_EMPTY 0x7fffffff
+//deepest stack a wide traversal can need: each pop pushes at most 4 children, the wide tree is no
+//deeper than the binary tree it was collapsed from, and BuildBvh caps that at (size-1)/3 levels
+#define BVH4_STACK_SIZE 128
+
+//4-wide node collapsed from the binary SAH tree. Bounds are stored per axis so one SSE register
+//holds the same slab of all four children. A child >= 0 is another wide node, a child < 0 is the
+//binary leaf -child, BVH4_EMPTY marks an unused slot
+struct Bvh4Node {
+    float m_min[3][4];
+    float m_max[3][4];
+    int m_children[4];
+};
+
+//Shared state for one BuildBvh call. Nodes are preallocated for the worst case of one reference
+//per leaf and handed out in pairs through m_nodeCount, references are partitioned in place so
+//every node owns a contiguous range of m_references
+struct BvhBuildState {
+    Aabb*                       m_aabbs;
+    unsigned int*               m_references;
+    BvhNode*                    m_tree;
+    tbb::atomic<unsigned int>   m_nodeCount;
+    unsigned int                m_maxDepth;
+};
+
 //====================================
 // Class Declarations
 //===================================
@@ -70,10 +105,28 @@ template <typename T> class Bvh {
         ~Bvh();
 
         void BuildBvh(const unsigned int& maxDepth);
+        //recomputes node bounds from m_basegeom without changing the hierarchy
+        void Refit();
+        //takes the hierarchy of a bvh over a geom with identical topology and refits it
+        void RefitFrom(const Bvh<T>& topology);
+        //frees the hierarchy so the bvh can be rebuilt later. References shared with a topology
+        //bvh through RefitFrom must be kept by passing freeReferences false
+        void Release(const bool& freeReferences);
+        //bytes held by the hierarchy, references are left out when shared with a topology bvh
+        unsigned long long GetMemoryUsage(const bool& references);
+        //Stores the built hierarchy, both node arrays and the references, for the bake cache.
+        //Reading replaces any hierarchy held and is false if a chunk is missing
+        void AddCacheChunks(utilityCore::Checkpoint* checkpoint);
+        bool GetCacheChunks(utilityCore::Checkpoint* checkpoint);
         HOST DEVICE void Traverse(const rayCore::Ray& r, TraverseAccumulator& result);
+        //traverses count rays, results[i] collects hits for rays[i]
+        template <typename A> void TraverseStream(const rayCore::Ray* rays, A* results, 
+                                                  const unsigned int& count);
 
         BvhNode*                    m_nodes;
         unsigned int                m_numberOfNodes;
+        Bvh4Node*                   m_wideNodes; //NULL until BuildBvh collapses the tree
+        unsigned int                m_numberOfWideNodes;
         unsigned int*               m_referenceIndices;
         unsigned int                m_numberOfReferenceIndices;
         unsigned int                m_id;
@@ -81,13 +134,18 @@ template <typename T> class Bvh {
         T                           m_basegeom;
 
     private:
-        float FindBestSplit(BvhNode& Node, std::vector<unsigned int>& references,
-                            const Axis& direction, const unsigned int& quality, Aabb* aabbs,
-                            unsigned int& leftCount, unsigned int& rightCount);
-        Axis FindLongestAxis(const Aabb& box);
-        double CalculateSplitCost(const float& split, const BvhNode& node, 
-                                  std::vector<unsigned int>& references, const Axis& direction,
-                                  Aabb* aabbs, unsigned int& leftCount, unsigned int& rightCount);
+        void TraverseWide(const rayCore::Ray& r, TraverseAccumulator& result);
+        HOST DEVICE void IntersectLeaf(const BvhNode& leaf, const rayCore::Ray& r, 
+                                       TraverseAccumulator& result);
+        void CollapseToWide();
+        void RefitWide();
+        int CollapseNode(const unsigned int& node, std::vector<Bvh4Node>& wide);
+        unsigned int BuildNode(const unsigned int& node, const unsigned int& begin,
+                               const unsigned int& end, const unsigned int& layer,
+                               BvhBuildState& state);
+        bool FindBinnedSplit(const unsigned int& begin, const unsigned int& end, 
+                             const Aabb& centroidBounds, BvhBuildState& state, int& splitAxis,
+                             int& splitBin);
 };
 }
 
@@ -7,6 +7,9 @@
 #ifndef BVH_INL
 #define BVH_INL
 
+#include <limits>
+#include <cstring>
+#include <algorithm>
 #include "bvh.hpp"
 #include "../utilities/datastructures.hpp"
 
@@ -17,6 +20,8 @@ template <typename T> Bvh<T>::Bvh(T basegeom){
     m_numberOfNodes = 0;
     m_referenceIndices = NULL;
     m_numberOfReferenceIndices = 0;
+    m_wideNodes = NULL;
+    m_numberOfWideNodes = 0;
     m_basegeom = basegeom;
 }
 
@@ -25,6 +30,8 @@ template <typename T> Bvh<T>::Bvh(){
     m_numberOfNodes = 0;
     m_referenceIndices = NULL;
     m_numberOfReferenceIndices = 0;
+    m_wideNodes = NULL;
+    m_numberOfWideNodes = 0;
 }
 
 template <typename T> Bvh<T>::~Bvh(){
@@ -37,6 +44,12 @@ template <typename T> Bvh<T>::~Bvh(){
 }
 
 template <typename T> void Bvh<T>::Traverse(const rayCore::Ray& r, TraverseAccumulator& result){
+#ifndef __CUDACC__
+    if(m_wideNodes!=NULL){
+        TraverseWide(r, result);
+        return;
+    }
+#endif
     ShortStack<BvhNode*> stack;
     stack.Push(&m_nodes[1]);
     BvhNode* current = &m_nodes[1];
@@ -75,18 +88,7 @@ template <typename T> void Bvh<T>::Traverse(const rayCore::Ray& r, TraverseAccum
                 }
             }
             if(current->IsLeaf()){
-                for(unsigned int i=0; i<current->m_numberOfReferences; i++){
-                    unsigned int primID = m_referenceIndices[current->m_referenceOffset+i];
-                    rayCore::Intersection rhit = m_basegeom.IntersectElement(primID, r); 
-                    if(rhit.m_hit){
-                        //make sure hit is actually in front of origin
-                        glm::vec3 n = glm::normalize(rhit.m_point-r.m_origin);
-                        float degree = glm::acos(glm::dot(n, r.m_direction));
-                        if(degree<(PI/2.0f) || degree!=degree){
-                            result.RecordIntersection(rhit, current->m_nodeid);
-                        }
-                    }
-                }
+                IntersectLeaf(*current, r, result);
             }
             //if stack is not empty, pop current node and pick farthest child
             if(stack.Empty()==false){
@@ -107,258 +109,466 @@ template <typename T> void Bvh<T>::Traverse(const rayCore::Ray& r, TraverseAccum
     }
 }
 
-template <typename T> void Bvh<T>::BuildBvh(const unsigned int& maxDepth){
-    //assemble aabb list
-    unsigned int numberOfAabbs = m_basegeom.GetNumberOfElements();
-    spaceCore::Aabb* aabbs = new spaceCore::Aabb[numberOfAabbs];
-    for(unsigned int i=0; i<numberOfAabbs; i++){
-        aabbs[i] = m_basegeom.GetElementAabb(i);
+//Records every primitive hit in a leaf that lies in front of the ray origin. A hit exactly at the
+//origin counts as in front
+template <typename T> void Bvh<T>::IntersectLeaf(const BvhNode& leaf, const rayCore::Ray& r, 
+                                                 TraverseAccumulator& result){
+    for(unsigned int i=0; i<leaf.m_numberOfReferences; i++){
+        unsigned int primID = m_referenceIndices[leaf.m_referenceOffset+i];
+        rayCore::Intersection rhit = m_basegeom.IntersectElement(primID, r); 
+        if(rhit.m_hit){
+            glm::vec3 toHit = rhit.m_point-r.m_origin;
+            if(glm::dot(toHit, r.m_direction)>0.0f || 
+               (toHit.x==0.0f && toHit.y==0.0f && toHit.z==0.0f)){
+                result.RecordIntersection(rhit, leaf.m_nodeid);
+            }
+        }
     }
-    //create vectors to store nodes during construction
-    std::vector<BvhNode> tree;
-    tree.reserve(std::pow(2.0f,(int)maxDepth));
-    unsigned int nodeCount = 0;
-    unsigned int layerCount = 0;
-    std::vector< std::vector<unsigned int> > currentRefs; 
-    currentRefs.reserve(std::pow(2.0f,(int)maxDepth));
-    std::vector<BvhNode*> currentLayer; 
-    std::vector<unsigned int> finalRefList;
-    //create null node to place in index 0. tree begins at index 1.
-    tree.push_back(BvhNode());
-    nodeCount++;
-//    BvhNode* nullnode = &tree[0];
-    //create root node with aabb that is combined from all input aabbs
-    tree.push_back(BvhNode());
-    nodeCount++;
-    BvhNode* root = &tree[1];
-    for(unsigned int i=0; i<numberOfAabbs; i++){
-        root->m_bounds.ExpandAabb(aabbs[i].m_min, aabbs[i].m_max);
+}
+
+//Accumulators don't shorten the ray, so every leaf the ray touches is visited and child order
+//doesn't matter
+template <typename T> void Bvh<T>::TraverseWide(const rayCore::Ray& r, 
+                                                TraverseAccumulator& result){
+    //zero direction components become tiny ones so slab products never hit 0*inf
+    __m128 origin[3];
+    __m128 inverseDirection[3];
+    for(unsigned int a=0; a<3; a++){
+        float d = r.m_direction[a];
+        if(glm::abs(d)<1e-20f){
+            d = 1e-20f;
+        }
+        origin[a] = _mm_set1_ps(r.m_origin[a]);
+        inverseDirection[a] = _mm_set1_ps(1.0f/d);
     }
-    //populate root node with all ids
-    root->m_numberOfReferences = numberOfAabbs;
-    root->m_referenceOffset = 0;
-    root->m_nodeid = 1; 
-    std::vector<unsigned int> rootreferences;
-    rootreferences.reserve(numberOfAabbs);
-    for(unsigned int i=0; i<numberOfAabbs; i++){
-        rootreferences.push_back(aabbs[i].m_id);
+    __m128 rayStart = _mm_setzero_ps();
+    __m128 rayEnd = _mm_set1_ps(std::numeric_limits<float>::max());
+
+    int stack[BVH4_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while(stackSize>0){
+        const Bvh4Node& node = m_wideNodes[stack[--stackSize]];
+        __m128 tnear = rayStart;
+        __m128 tfar = rayEnd;
+        for(unsigned int a=0; a<3; a++){
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.m_min[a]), origin[a]), 
+                                   inverseDirection[a]);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.m_max[a]), origin[a]), 
+                                   inverseDirection[a]);
+            tnear = _mm_max_ps(tnear, _mm_min_ps(t0, t1));
+            tfar = _mm_min_ps(tfar, _mm_max_ps(t0, t1));
+        }
+        int hits = _mm_movemask_ps(_mm_cmple_ps(tnear, tfar));
+        for(unsigned int c=0; c<4; c++){
+            int child = node.m_children[c];
+            if((hits & (1<<c))==0 || child==BVH4_EMPTY){
+                continue;
+            }
+            if(child<0){
+                IntersectLeaf(m_nodes[-child], r, result);
+            }else{
+                stack[stackSize++] = child;
+            }
+        }
     }
-    currentLayer.push_back(root);
-    currentRefs.push_back(rootreferences);
-    //for each layer, split nodes and move on to next layer
-    for(unsigned int layer=0; layer<maxDepth; layer++){
-        //set up temp storage buffers for next layer
-        std::vector< std::vector<unsigned int> > nextLayerRefs;
-        std::vector<BvhNode*> nextLayer;
-        //for each node in current layer, split and push result 
-        unsigned int numberOfNodesInLayer = currentLayer.size(); 
-        if(numberOfNodesInLayer>0){
-            layerCount++;
+}
+
+template <typename T> template <typename A> void Bvh<T>::TraverseStream(const rayCore::Ray* rays, 
+                                                                        A* results, 
+                                                                        const unsigned int& count){
+    for(unsigned int i=0; i<count; i++){
+        Traverse(rays[i], results[i]);
+    }
+}
+
+//Collapses the binary tree into 4-wide nodes. Each wide node takes the two children of a binary
+//node and keeps opening its largest interior child until it holds four
+template <typename T> void Bvh<T>::CollapseToWide(){
+    std::vector<Bvh4Node> wide;
+    wide.reserve(m_numberOfNodes/2+1);
+    if(m_nodes[1].IsLeaf()==true){
+        //single leaf tree, wrap it in one wide node
+        Bvh4Node root;
+        for(unsigned int c=0; c<4; c++){
+            for(unsigned int a=0; a<3; a++){
+                root.m_min[a][c] = std::numeric_limits<float>::max();
+                root.m_max[a][c] = -std::numeric_limits<float>::max();
+            }
+            root.m_children[c] = BVH4_EMPTY;
         }
-        for(unsigned int i=0; i<numberOfNodesInLayer; i++){
-            //if <20 prims or last layer, make node a leaf node
-            unsigned int refCount = currentRefs[i].size();
-            BvhNode* node = currentLayer[i];
-            if(refCount <= 5 || layer==maxDepth-1){
-                node->m_left = 0;
-                node->m_right = 0;
-                node->m_numberOfReferences = refCount;
-                node->m_referenceOffset = finalRefList.size();
-                for(unsigned int j=0; j<node->m_numberOfReferences; j++){
-                    finalRefList.push_back(currentRefs[i][j]);
-                }   
-            }else{ //else, find the best split via SAH and add children to next layer
-                //split axis should be the longest axis
-                Axis splitAxis = FindLongestAxis(node->m_bounds);
-                //call SAH and get best split candidate
-                unsigned int leftCount = 0;
-                unsigned int rightCount = 0;
-                float bestSplit = FindBestSplit(*node, currentRefs[i], splitAxis, 10, aabbs,
-                                                leftCount, rightCount);
-                if(leftCount==0 || rightCount==0){
-                    leftCount = 0;
-                    rightCount = 0;
-                    if(splitAxis==axis_x){
-                        splitAxis = axis_y;
-                    }else if(splitAxis==axis_y){
-                        splitAxis = axis_z;
-                    }else if(splitAxis==axis_z){
-                        splitAxis = axis_x;
-                    }
-                    bestSplit = FindBestSplit(*node, currentRefs[i], splitAxis, 10, aabbs,
-                                                    leftCount, rightCount);
-                }
-                if(leftCount==0 || rightCount==0){
-                    leftCount = 0;
-                    rightCount = 0;
-                    if(splitAxis==axis_x){
-                        splitAxis = axis_y;
-                    }else if(splitAxis==axis_y){
-                        splitAxis = axis_z;
-                    }else if(splitAxis==axis_z){
-                        splitAxis = axis_x;
-                    }
-                    bestSplit = FindBestSplit(*node, currentRefs[i], splitAxis, 10, aabbs,
-                                              leftCount, rightCount);
-                }
-                if(leftCount==0 || rightCount==0){
-                    node->m_left = 0;
-                    node->m_right = 0;
-                    node->m_numberOfReferences = refCount;
-                    node->m_referenceOffset = finalRefList.size();
-                    for(unsigned int j=0; j<node->m_numberOfReferences; j++){
-                        finalRefList.push_back(currentRefs[i][j]);
-                    }   
-                }else{
-                    //create left and right nodes
-                    tree.push_back(BvhNode());
-                    nodeCount++;
-                    unsigned int leftID = tree.size()-1;
-                    BvhNode* left = &tree[leftID];
-                    left->m_nodeid = leftID;
-                    tree.push_back(BvhNode());
-                    nodeCount++;
-                    unsigned int rightID = tree.size()-1;
-                    BvhNode* right = &tree[rightID];
-                    right->m_nodeid = rightID;
-                    node->m_left = leftID;
-                    node->m_right = rightID;
-                    //create lists of left and right objects based on centroid location
-                    std::vector<unsigned int> leftRefs;
-                    std::vector<unsigned int> rightRefs;
-                    leftRefs.reserve(leftCount);
-                    rightRefs.reserve(rightCount);
-                    left->m_numberOfReferences = leftCount;
-                    right->m_numberOfReferences = rightCount;
-                    for(unsigned int j=0; j<node->m_numberOfReferences; j++){
-                        unsigned int referenceIndex = currentRefs[i][j];
-                        Aabb reference = aabbs[referenceIndex];
-                        if(reference.m_centroid[splitAxis]<=bestSplit){
-                            leftRefs.push_back(referenceIndex);
-                            left->m_bounds.ExpandAabb(reference.m_min, reference.m_max);
-                        }else{
-                            rightRefs.push_back(referenceIndex);
-                            right->m_bounds.ExpandAabb(reference.m_min, reference.m_max);
-                        }
-                    }
-                    //add left and right children to next later
-                    nextLayer.push_back(left);
-                    nextLayerRefs.push_back(leftRefs);
-                    nextLayer.push_back(right); 
-                    nextLayerRefs.push_back(rightRefs);
-                    //cleanup
-                    leftRefs.clear();
-                    rightRefs.clear();
+        for(unsigned int a=0; a<3; a++){
+            root.m_min[a][0] = m_nodes[1].m_bounds.m_min[a];
+            root.m_max[a][0] = m_nodes[1].m_bounds.m_max[a];
+        }
+        root.m_children[0] = -1;
+        wide.push_back(root);
+    }else{
+        CollapseNode(1, wide);
+    }
+    m_numberOfWideNodes = wide.size();
+    m_wideNodes = new Bvh4Node[m_numberOfWideNodes];
+    copy(wide.begin(), wide.end(), m_wideNodes);
+}
+
+template <typename T> int Bvh<T>::CollapseNode(const unsigned int& node, 
+                                               std::vector<Bvh4Node>& wide){
+    unsigned int slots[4] = {m_nodes[node].m_left, m_nodes[node].m_right, 0, 0};
+    unsigned int slotCount = 2;
+    while(slotCount<4){
+        int largest = -1;
+        double largestArea = -1.0;
+        for(unsigned int i=0; i<slotCount; i++){
+            if(m_nodes[slots[i]].IsLeaf()==false){
+                double area = m_nodes[slots[i]].m_bounds.CalculateSurfaceArea();
+                if(area>largestArea){
+                    largestArea = area;
+                    largest = i;
                 }
-            }    
+            }
+        }
+        if(largest<0){
+            break;
+        }
+        unsigned int opened = slots[largest];
+        slots[largest] = m_nodes[opened].m_left;
+        slots[slotCount++] = m_nodes[opened].m_right;
+    }
+
+    int wideIndex = wide.size();
+    wide.push_back(Bvh4Node());
+    for(unsigned int c=0; c<4; c++){
+        float bmin[3]; float bmax[3];
+        int child = BVH4_EMPTY;
+        if(c<slotCount){
+            const BvhNode& b = m_nodes[slots[c]];
+            for(unsigned int a=0; a<3; a++){
+                bmin[a] = b.m_bounds.m_min[a];
+                bmax[a] = b.m_bounds.m_max[a];
+            }
+            if(m_nodes[slots[c]].IsLeaf()==true){
+                child = -(int)slots[c];
+            }else{
+                child = CollapseNode(slots[c], wide);
+            }
+        }else{
+            for(unsigned int a=0; a<3; a++){
+                bmin[a] = std::numeric_limits<float>::max();
+                bmax[a] = -std::numeric_limits<float>::max();
+            }
+        }
+        //recursion may have grown the vector, so index it again
+        Bvh4Node& w = wide[wideIndex];
+        for(unsigned int a=0; a<3; a++){
+            w.m_min[a][c] = bmin[a];
+            w.m_max[a][c] = bmax[a];
         }
-        //clear current layer's temp buffers, swap in next layer
-        currentLayer.clear();
-        unsigned int numberOfCurrentRefs = currentRefs.size();
-        for(unsigned int i=0; i<numberOfCurrentRefs; i++){
-            currentRefs[i].clear();
+        w.m_children[c] = child;
+    }
+    return wideIndex;
+}
+
+//Binned SAH build. Each node bins its references by centroid on all three axes, splits at the
+//cheapest bin boundary and partitions its reference range in place. Subtrees over
+//BVH_PARALLEL_THRESHOLD references are built as separate tasks
+template <typename T> void Bvh<T>::BuildBvh(const unsigned int& maxDepth){
+    //assemble aabb list
+    unsigned int numberOfAabbs = m_basegeom.GetNumberOfElements();
+    spaceCore::Aabb* aabbs = new spaceCore::Aabb[numberOfAabbs];
+    T* basegeom = &m_basegeom;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,numberOfAabbs),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                aabbs[i] = basegeom->GetElementAabb(i);
+            }
         }
-        currentRefs.clear();
-        currentLayer = nextLayer;
-        currentRefs = nextLayerRefs;
+    );
+
+    //null node in index 0, tree begins at index 1. a binary tree with at least one reference
+    //per leaf has at most 2n-1 nodes
+    BvhBuildState state;
+    state.m_aabbs = aabbs;
+    state.m_references = new unsigned int[numberOfAabbs];
+    state.m_tree = new BvhNode[2*numberOfAabbs+2];
+    state.m_nodeCount = 2;
+    //a wide traversal can stack 3*depth+1 children, so depth is capped to what fits on its stack
+    state.m_maxDepth = std::min(maxDepth, (unsigned int)(BVH4_STACK_SIZE-1)/3);
+    for(unsigned int i=0; i<numberOfAabbs; i++){
+        state.m_references[i] = aabbs[i].m_id;
     }
-    m_numberOfNodes = tree.size();
+    unsigned int layerCount = BuildNode(1, 0, numberOfAabbs, 0, state);
+
+    unsigned int nodeCount = state.m_nodeCount;
+    m_numberOfNodes = nodeCount;
     m_nodes = new BvhNode[m_numberOfNodes];
-    copy(tree.begin(), tree.end(), m_nodes);
-    
-    m_numberOfReferenceIndices = finalRefList.size();
-    m_referenceIndices = new unsigned int[m_numberOfReferenceIndices];
-    copy(finalRefList.begin(), finalRefList.end(), m_referenceIndices);
+    std::copy(state.m_tree, state.m_tree+nodeCount, m_nodes);
+    delete [] state.m_tree;
+    m_numberOfReferenceIndices = numberOfAabbs;
+    m_referenceIndices = state.m_references;
+    m_depth = layerCount;
 
     delete [] aabbs;
 
+#ifndef __CUDACC__
+    CollapseToWide();
+#endif
+
     std::cout << "Built BVH with " << nodeCount << " nodes and depth " << layerCount << std::endl;
 }
 
-template <typename T> float Bvh<T>::FindBestSplit(BvhNode& node, 
-                                                  std::vector<unsigned int>& references,
-                                                  const Axis& direction, 
-                                                  const unsigned int& quality, Aabb* aabbs,
-                                                  unsigned int& leftCount, 
-                                                  unsigned int& rightCount){
+//Builds the subtree rooted at node over references [begin,end) and returns its depth
+template <typename T> unsigned int Bvh<T>::BuildNode(const unsigned int& node, 
+                                                     const unsigned int& begin,
+                                                     const unsigned int& end, 
+                                                     const unsigned int& layer,
+                                                     BvhBuildState& state){
+    BvhNode& current = state.m_tree[node];
+    current.m_nodeid = node;
+    Aabb centroidBounds;
+    for(unsigned int i=begin; i<end; i++){
+        const Aabb& reference = state.m_aabbs[state.m_references[i]];
+        current.m_bounds.ExpandAabb(reference.m_min, reference.m_max);
+        centroidBounds.ExpandAabb(reference.m_centroid, reference.m_centroid);
+    }
+    //if <=5 prims, last layer or no usable split, make node a leaf node
     int splitAxis = 0;
-    if(direction==axis_y){splitAxis = 1;}
-    else if(direction==axis_z){splitAxis = 2;}
-    //create N even candidates, where N = quality
-    float* candidates = new float[quality];
-    float axisLength = node.m_bounds.m_max[splitAxis]-node.m_bounds.m_min[splitAxis];
-    float evenSplitSize = (axisLength)/float(quality+1);
-    for(unsigned int i=0; i<quality; i++){ //create even splits
-        float candidate = node.m_bounds.m_min[splitAxis] + (i+1)*evenSplitSize;
-        candidates[i] = candidate;
+    int splitBin = 0;
+    if(end-begin<=5 || layer>=state.m_maxDepth-1 || 
+       FindBinnedSplit(begin, end, centroidBounds, state, splitAxis, splitBin)==false){
+        current.m_left = 0;
+        current.m_right = 0;
+        current.m_referenceOffset = begin;
+        current.m_numberOfReferences = end-begin;
+        return layer+1;
     }
-    //Calculate all split costs and keep the lowest cost split
-    unsigned int left = 0; unsigned int right = 0;
-    unsigned int currentLeft = 0; unsigned int currentRight = 0;
-    double bestCost = CalculateSplitCost(candidates[0], node, references, direction, aabbs, 
-                                         left, right);
-    float bestSplit = candidates[0];    
-    for(unsigned int i=1; i<quality; i++){
-        double cost = CalculateSplitCost(candidates[i], node, references, direction, aabbs, 
-                                         currentLeft, currentRight);
-        if(cost<bestCost){
-            bestCost = cost;
-            bestSplit = candidates[i];
-            left = currentLeft;
-            right = currentRight;
+
+    //partition references by bin, then create left and right nodes
+    float axisMin = centroidBounds.m_min[splitAxis];
+    float binScale = float(BVH_BINS)/(centroidBounds.m_max[splitAxis]-axisMin);
+    Aabb* aabbs = state.m_aabbs;
+    unsigned int* middle = std::partition(state.m_references+begin, state.m_references+end,
+        [=](const unsigned int& reference){
+            int bin = (int)((aabbs[reference].m_centroid[splitAxis]-axisMin)*binScale);
+            return glm::min(bin, BVH_BINS-1)<splitBin;
         }
+    );
+    unsigned int mid = middle-state.m_references;
+    unsigned int leftID = state.m_nodeCount.fetch_and_add(2);
+    unsigned int rightID = leftID+1;
+    current.m_left = leftID;
+    current.m_right = rightID;
+    current.m_referenceOffset = begin;
+    current.m_numberOfReferences = end-begin;
+
+    unsigned int leftDepth = 0;
+    unsigned int rightDepth = 0;
+    if(end-begin>BVH_PARALLEL_THRESHOLD){
+        tbb::parallel_invoke(
+            [&](){ leftDepth = BuildNode(leftID, begin, mid, layer+1, state); },
+            [&](){ rightDepth = BuildNode(rightID, mid, end, layer+1, state); }
+        );
+    }else{
+        leftDepth = BuildNode(leftID, begin, mid, layer+1, state);
+        rightDepth = BuildNode(rightID, mid, end, layer+1, state);
     }
-    leftCount = left;
-    rightCount = right;
-    delete [] candidates;
-    return bestSplit;
+    return glm::max(leftDepth, rightDepth);
 }
 
-template <typename T> double Bvh<T>::CalculateSplitCost(const float& split, const BvhNode& node, 
-                                                        std::vector<unsigned int>& references, 
-                                                        const Axis& direction, Aabb* aabbs, 
-                                                        unsigned int& leftCount, 
-                                                        unsigned int& rightCount){
-    int splitAxis = 0;
-    if(direction==axis_y){splitAxis = 1;}
-    else if(direction==axis_z){splitAxis = 2;}
-    Aabb leftBox; unsigned int left = 0;
-    Aabb rightBox; unsigned int right = 0;
-    //run through all references in current node and merge into either left or right
-    for(unsigned int i=0; i<node.m_numberOfReferences; i++){
-        unsigned int referenceIndex = references[i];
-        Aabb reference = aabbs[referenceIndex];
-        if(reference.m_centroid[splitAxis]<=split){
-            left++;
-            leftBox.ExpandAabb(reference.m_min, reference.m_max);
-        }else{
-            right++;
-            rightBox.ExpandAabb(reference.m_min, reference.m_max);
+//Bins [begin,end) by centroid on each axis and finds the bin boundary with the lowest
+//areaLeft*countLeft + areaRight*countRight. Returns false if no boundary separates anything
+template <typename T> bool Bvh<T>::FindBinnedSplit(const unsigned int& begin, 
+                                                   const unsigned int& end,
+                                                   const Aabb& centroidBounds, 
+                                                   BvhBuildState& state, int& splitAxis,
+                                                   int& splitBin){
+    double bestCost = std::numeric_limits<double>::max();
+    bool found = false;
+    for(int axis=0; axis<3; axis++){
+        float axisMin = centroidBounds.m_min[axis];
+        float extent = centroidBounds.m_max[axis]-axisMin;
+        if(extent<=0.0f){
+            continue;
+        }
+        float binScale = float(BVH_BINS)/extent;
+        Aabb bins[BVH_BINS];
+        unsigned int counts[BVH_BINS] = {0};
+        for(unsigned int i=begin; i<end; i++){
+            const Aabb& reference = state.m_aabbs[state.m_references[i]];
+            int bin = glm::min((int)((reference.m_centroid[axis]-axisMin)*binScale), BVH_BINS-1);
+            bins[bin].ExpandAabb(reference.m_min, reference.m_max);
+            counts[bin]++;
+        }
+        //sweep from the right to get suffix areas, then from the left to evaluate boundaries
+        double rightArea[BVH_BINS];
+        unsigned int rightCount[BVH_BINS];
+        Aabb rightBox;
+        unsigned int count = 0;
+        for(int b=BVH_BINS-1; b>0; b--){
+            rightBox.ExpandAabb(bins[b].m_min, bins[b].m_max);
+            count += counts[b];
+            rightArea[b] = count>0 ? rightBox.CalculateSurfaceArea() : 0.0;
+            rightCount[b] = count;
+        }
+        Aabb leftBox;
+        count = 0;
+        for(int b=1; b<BVH_BINS; b++){
+            leftBox.ExpandAabb(bins[b-1].m_min, bins[b-1].m_max);
+            count += counts[b-1];
+            if(count==0 || rightCount[b]==0){
+                continue;
+            }
+            double cost = leftBox.CalculateSurfaceArea()*count + rightArea[b]*rightCount[b];
+            if(cost<bestCost){
+                bestCost = cost;
+                splitAxis = axis;
+                splitBin = b;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+//Children are always allocated after their parent, so a reverse sweep sees every child before
+//the node that owns it
+template <typename T> void Bvh<T>::Refit(){
+    BvhNode* nodes = m_nodes;
+    unsigned int* references = m_referenceIndices;
+    T* basegeom = &m_basegeom;
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(1,m_numberOfNodes),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int i=r.begin(); i!=r.end(); ++i){
+                if(nodes[i].IsLeaf()==true){
+                    nodes[i].m_bounds = Aabb();
+                    for(unsigned int j=0; j<nodes[i].m_numberOfReferences; j++){
+                        Aabb reference = basegeom->GetElementAabb(
+                                                references[nodes[i].m_referenceOffset+j]);
+                        nodes[i].m_bounds.ExpandAabb(reference.m_min, reference.m_max);
+                    }
+                }
+            }
+        }
+    );
+    for(unsigned int i=m_numberOfNodes-1; i>0; i--){
+        if(nodes[i].IsLeaf()==false){
+            nodes[i].m_bounds = nodes[nodes[i].m_left].m_bounds;
+            nodes[i].m_bounds.ExpandAabb(nodes[nodes[i].m_right].m_bounds.m_min, 
+                                         nodes[nodes[i].m_right].m_bounds.m_max);
         }
     }
-    double leftCost = left * leftBox.CalculateSurfaceArea();
-    double rightCost = right * rightBox.CalculateSurfaceArea();
-    leftCount = left; rightCount = right;
-    // std::cout << left << " "  << right << " " << fabs(leftCost-rightCost) << std::endl;
-    if(left==0 || right==0){
-        return pow(10.0f,100);
+#ifndef __CUDACC__
+    if(m_wideNodes!=NULL){
+        RefitWide();
     }else{
-        return fabs(leftCost-rightCost);
+        CollapseToWide();
     }
+#endif
 }
 
-template <typename T> Axis Bvh<T>::FindLongestAxis(const Aabb& box){
-    //find max axis and return. pretty simple.
-    float axisXlength = box.m_max.x - box.m_min.x;
-    float axisYlength = box.m_max.y - box.m_min.y; 
-    float axisZlength = box.m_max.z - box.m_min.z;
-    if(axisXlength>=axisYlength && axisXlength>=axisZlength){
-        return axis_x;
-    }else if(axisYlength>=axisXlength && axisYlength>=axisZlength){
-        return axis_y;
-    }else{
-        return axis_z;
-    }   
+//Wide nodes are also allocated after their parent, so the same reverse sweep refits them in
+//place from the binary leaves
+template <typename T> void Bvh<T>::RefitWide(){
+    for(int i=(int)m_numberOfWideNodes-1; i>=0; i--){
+        Bvh4Node& node = m_wideNodes[i];
+        for(unsigned int c=0; c<4; c++){
+            int child = node.m_children[c];
+            if(child==BVH4_EMPTY){
+                continue;
+            }
+            for(unsigned int a=0; a<3; a++){
+                if(child<0){
+                    node.m_min[a][c] = m_nodes[-child].m_bounds.m_min[a];
+                    node.m_max[a][c] = m_nodes[-child].m_bounds.m_max[a];
+                }else{
+                    const Bvh4Node& wide = m_wideNodes[child];
+                    float bmin = std::numeric_limits<float>::max();
+                    float bmax = -std::numeric_limits<float>::max();
+                    for(unsigned int w=0; w<4; w++){
+                        bmin = glm::min(bmin, wide.m_min[a][w]);
+                        bmax = glm::max(bmax, wide.m_max[a][w]);
+                    }
+                    node.m_min[a][c] = bmin;
+                    node.m_max[a][c] = bmax;
+                }
+            }
+        }
+    }
+}
+
+//The reference indices are never modified after a build, so they are shared with topology
+template <typename T> void Bvh<T>::RefitFrom(const Bvh<T>& topology){
+    m_numberOfNodes = topology.m_numberOfNodes;
+    m_nodes = new BvhNode[m_numberOfNodes];
+    std::copy(topology.m_nodes, topology.m_nodes+m_numberOfNodes, m_nodes);
+    m_numberOfWideNodes = topology.m_numberOfWideNodes;
+    if(topology.m_wideNodes!=NULL){
+        m_wideNodes = new Bvh4Node[m_numberOfWideNodes];
+        std::copy(topology.m_wideNodes, topology.m_wideNodes+m_numberOfWideNodes, m_wideNodes);
+    }
+    m_numberOfReferenceIndices = topology.m_numberOfReferenceIndices;
+    m_referenceIndices = topology.m_referenceIndices;
+    m_depth = topology.m_depth;
+    Refit();
+}
+
+template <typename T> void Bvh<T>::Release(const bool& freeReferences){
+    delete [] m_nodes;
+    m_nodes = NULL;
+    m_numberOfNodes = 0;
+    delete [] m_wideNodes;
+    m_wideNodes = NULL;
+    m_numberOfWideNodes = 0;
+    if(freeReferences==true){
+        delete [] m_referenceIndices;
+    }
+    m_referenceIndices = NULL;
+    m_numberOfReferenceIndices = 0;
+}
+
+template <typename T> unsigned long long Bvh<T>::GetMemoryUsage(const bool& references){
+    unsigned long long bytes = (unsigned long long)m_numberOfNodes*sizeof(BvhNode) +
+                               (unsigned long long)m_numberOfWideNodes*sizeof(Bvh4Node);
+    if(references==true){
+        bytes += (unsigned long long)m_numberOfReferenceIndices*sizeof(unsigned int);
+    }
+    return bytes;
+}
+
+template <typename T> void Bvh<T>::AddCacheChunks(utilityCore::Checkpoint* checkpoint){
+    checkpoint->AddValue("bvh_depth", m_depth);
+    checkpoint->AddChunk("bvh_nodes", m_nodes, (size_t)m_numberOfNodes*sizeof(BvhNode));
+    checkpoint->AddChunk("bvh_wide_nodes", m_wideNodes, 
+                         (size_t)m_numberOfWideNodes*sizeof(Bvh4Node));
+    checkpoint->AddChunk("bvh_references", m_referenceIndices, 
+                         (size_t)m_numberOfReferenceIndices*sizeof(unsigned int));
+}
+
+//Counts come from the chunk sizes, arrays are allocated the same way BuildBvh allocates them
+template <typename T> bool Bvh<T>::GetCacheChunks(utilityCore::Checkpoint* checkpoint){
+    size_t nodeBytes, wideBytes, referenceBytes;
+    unsigned int depth;
+    const char* nodes = checkpoint->GetChunk("bvh_nodes", nodeBytes);
+    const char* wideNodes = checkpoint->GetChunk("bvh_wide_nodes", wideBytes);
+    const char* references = checkpoint->GetChunk("bvh_references", referenceBytes);
+    if(checkpoint->GetValue("bvh_depth", depth)==false || nodes==NULL || wideNodes==NULL || 
+       references==NULL || nodeBytes%sizeof(BvhNode)!=0 || wideBytes%sizeof(Bvh4Node)!=0 || 
+       referenceBytes%sizeof(unsigned int)!=0){
+        return false;
+    }
+    Release(true);
+    m_depth = depth;
+    m_numberOfNodes = nodeBytes/sizeof(BvhNode);
+    m_nodes = new BvhNode[m_numberOfNodes];
+    std::memcpy((void*)m_nodes, nodes, nodeBytes);
+    m_numberOfWideNodes = wideBytes/sizeof(Bvh4Node);
+    if(m_numberOfWideNodes>0){
+        m_wideNodes = new Bvh4Node[m_numberOfWideNodes];
+        std::memcpy((void*)m_wideNodes, wideNodes, wideBytes);
+    }
+    m_numberOfReferenceIndices = referenceBytes/sizeof(unsigned int);
+    m_referenceIndices = new unsigned int[m_numberOfReferenceIndices];
+    std::memcpy(m_referenceIndices, references, referenceBytes);
+    return true;
 }
 }
 
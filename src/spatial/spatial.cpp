@@ -103,4 +103,27 @@ void DebugTraverseAccumulator::Transform(const glm::mat4& m){
         m_intersections[i] = m_intersections[i].Transform(m);
     }
 }
+
+HitListTraverseAccumulator::HitListTraverseAccumulator(){
+
+}
+
+HitListTraverseAccumulator::~HitListTraverseAccumulator(){
+
+}
+
+//Keeps only the hit points, for counting surface crossings along a ray
+void HitListTraverseAccumulator::RecordIntersection(const rayCore::Intersection& intersect,
+                                                    const unsigned int& nodeid){
+    if(intersect.m_hit==true){
+        m_points.push_back(intersect.m_point);
+    }
+}
+
+void HitListTraverseAccumulator::Transform(const glm::mat4& m){
+    unsigned int pointCount = m_points.size();
+    for(unsigned int i=0; i<pointCount; i++){
+        m_points[i] = glm::vec3(utilityCore::multiply(m, glm::vec4(m_points[i], 1.0f)));
+    }
+}
 }
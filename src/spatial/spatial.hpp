@@ -69,6 +69,18 @@ class DebugTraverseAccumulator: public TraverseAccumulator {
         std::vector<rayCore::Intersection> m_intersections;
         std::vector<unsigned int> m_nodeids;
 };
+
+class HitListTraverseAccumulator: public TraverseAccumulator {
+    public:
+        HitListTraverseAccumulator();
+        ~HitListTraverseAccumulator();
+
+        void RecordIntersection(const rayCore::Intersection& intersect,
+                                const unsigned int& nodeid);
+        void Transform(const glm::mat4& m);
+
+        std::vector<glm::vec3> m_points;
+};
 }
 
 #endif
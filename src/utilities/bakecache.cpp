@@ -0,0 +1,128 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: bakecache.cpp
+// Implements bakecache.hpp
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <direct.h>
+#endif
+#include <tbb/tbb.h>
+#include "bakecache.hpp"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+//bytes hashed per task, small inputs are hashed in one block
+#define HASH_BLOCK_SIZE (1<<20)
+
+namespace utilityCore {
+
+static unsigned long long HashBlock(const unsigned char* data, const size_t& bytes){
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    for(size_t i=0; i<bytes; i++){
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+unsigned long long HashBytes(const void* data, const size_t& bytes){
+    const unsigned char* c = (const unsigned char*)data;
+    size_t blockCount = (bytes+HASH_BLOCK_SIZE-1)/HASH_BLOCK_SIZE;
+    if(blockCount<=1){
+        return HashBlock(c, bytes);
+    }
+    std::vector<unsigned long long> blockHashes(blockCount);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0,blockCount,1),
+        [&](const tbb::blocked_range<size_t>& r){
+            for(size_t b=r.begin(); b!=r.end(); ++b){
+                size_t begin = b*HASH_BLOCK_SIZE;
+                size_t size = std::min((size_t)HASH_BLOCK_SIZE, bytes-begin);
+                blockHashes[b] = HashBlock(c+begin, size);
+            }
+        }
+    );
+    unsigned long long hash = HashValue(FNV_OFFSET_BASIS, (unsigned long long)bytes);
+    for(size_t b=0; b<blockCount; b++){
+        hash = HashCombine(hash, blockHashes[b]);
+    }
+    return hash;
+}
+
+//Boost style mix widened to 64 bits, the order of folds matters
+unsigned long long HashCombine(const unsigned long long& seed, const unsigned long long& value){
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed<<12) + (seed>>4));
+}
+
+//====================================
+// BakeCache Class
+//====================================
+
+BakeCache::BakeCache(){
+}
+
+BakeCache::~BakeCache(){
+}
+
+void BakeCache::SetDirectory(const std::string& directory){
+    m_directory = directory;
+    while(m_directory.size()>1 && m_directory[m_directory.size()-1]=='/'){
+        m_directory.erase(m_directory.size()-1);
+    }
+}
+
+bool BakeCache::IsEnabled(){
+    return m_directory.empty()==false;
+}
+
+bool BakeCache::Read(const std::string& kind, const unsigned long long& key, Checkpoint& entry){
+    if(IsEnabled()==false){
+        return false;
+    }
+    std::string filename = GetEntryName(kind, key);
+    struct stat info;
+    if(stat(filename.c_str(), &info)!=0){
+        return false;
+    }
+    unsigned long long storedKey;
+    if(entry.Read(filename)==false || entry.GetValue("bake_key", storedKey)==false || 
+       storedKey!=key){
+        entry.Clear();
+        return false;
+    }
+    std::cout << "Read " << kind << " from bake cache " << filename << std::endl;
+    return true;
+}
+
+void BakeCache::Write(const std::string& kind, const unsigned long long& key, Checkpoint& entry){
+    if(IsEnabled()==false){
+        return;
+    }
+    //best effort, an existing directory fails here and is fine
+#if defined(_WIN32)
+    _mkdir(m_directory.c_str());
+#else
+    mkdir(m_directory.c_str(), 0755);
+#endif
+    std::string filename = GetEntryName(kind, key);
+    entry.AddValue("bake_key", key);
+    //Write already warns on failure
+    if(entry.Write(filename, false)==false){
+        return;
+    }
+    std::cout << "Wrote " << kind << " to bake cache " << filename << std::endl;
+}
+
+std::string BakeCache::GetEntryName(const std::string& kind, const unsigned long long& key){
+    std::stringstream name;
+    name << m_directory << "/" << kind << "_" << std::hex << std::setw(16) << std::setfill('0')
+         << key << ".bake";
+    return name.str();
+}
+}
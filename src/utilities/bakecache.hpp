@@ -0,0 +1,56 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: bakecache.hpp
+// Content hashed on-disk cache of baked static collider data, reused between runs
+
+#ifndef BAKECACHE_HPP
+#define BAKECACHE_HPP
+
+#include <string>
+#include "checkpoint.hpp"
+
+//bumped whenever anything baked into an entry changes, so old entries stop matching
+#define BAKE_CACHE_VERSION 1
+
+namespace utilityCore {
+//====================================
+// Class Declarations
+//====================================
+
+//Entries are uncompressed checkpoints named by their kind and a 64 bit key hashed from
+//everything that went into baking them, so an entry is only found while its inputs are
+//unchanged. Reads map the file. Stale entries are never removed, just no longer looked up
+class BakeCache{
+    public:
+        BakeCache();
+        ~BakeCache();
+
+        //An empty directory disables the cache, a missing one is created on the first write
+        void SetDirectory(const std::string& directory);
+        bool IsEnabled();
+
+        //Misses are silent, false also for entries written under a different key
+        bool Read(const std::string& kind, const unsigned long long& key, Checkpoint& entry);
+        void Write(const std::string& kind, const unsigned long long& key, Checkpoint& entry);
+
+    private:
+        std::string GetEntryName(const std::string& kind, const unsigned long long& key);
+
+        std::string                                         m_directory;
+};
+
+//64 bit FNV-1a over fixed blocks hashed in parallel. Block hashes are folded in order, so the
+//result only depends on the bytes
+extern unsigned long long HashBytes(const void* data, const size_t& bytes);
+extern unsigned long long HashCombine(const unsigned long long& seed,
+                                      const unsigned long long& value);
+
+//Folds the bytes of a plain value into seed
+template <typename T> unsigned long long HashValue(const unsigned long long& seed,
+                                                   const T& value){
+    return HashCombine(seed, HashBytes(&value, sizeof(T)));
+}
+}
+
+#endif
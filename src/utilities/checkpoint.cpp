@@ -0,0 +1,276 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: checkpoint.cpp
+// Implements checkpoint.hpp
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <algorithm>
+#include <zlib.h>
+#include <tbb/tbb.h>
+#include "checkpoint.hpp"
+#include "mappedfile.hpp"
+
+namespace utilityCore {
+
+//File layout is a CheckpointFileHeader, then per chunk a CheckpointChunkHeader followed by its
+//blocks, each a CheckpointBlockHeader and the block's stored bytes
+struct CheckpointFileHeader{
+    unsigned int        m_magic;
+    unsigned int        m_version;
+    unsigned int        m_chunkCount;
+    unsigned int        m_reserved;
+};
+
+struct CheckpointChunkHeader{
+    char                m_tag[48]; //null terminated
+    unsigned long long  m_size; //uncompressed payload bytes
+    unsigned int        m_blockCount;
+    unsigned int        m_reserved;
+};
+
+struct CheckpointBlockHeader{
+    unsigned int        m_size; //uncompressed bytes
+    unsigned int        m_storedSize; //equal to m_size when the block is stored raw
+    unsigned int        m_crc; //crc32 of the uncompressed bytes
+    unsigned int        m_reserved;
+};
+
+//One block of one chunk, the unit of parallel compression and decompression
+struct CheckpointBlock{
+    char*               m_data; //uncompressed bytes inside the chunk
+    unsigned int        m_size;
+    const char*         m_stored; //stored bytes, in the file when reading
+    unsigned int        m_storedSize;
+    unsigned int        m_crc;
+    std::vector<char>   m_buffer; //compressed bytes when writing
+};
+
+static unsigned int GetBlockCount(const unsigned long long& bytes){
+    return (unsigned int)((bytes+CHECKPOINT_BLOCK_SIZE-1)/CHECKPOINT_BLOCK_SIZE);
+}
+
+//====================================
+// Checkpoint Class
+//====================================
+
+Checkpoint::Checkpoint(){
+}
+
+Checkpoint::~Checkpoint(){
+    Clear();
+}
+
+void Checkpoint::Clear(){
+    m_chunks.clear();
+}
+
+//Adding a tag that already exists replaces its data
+void Checkpoint::AddChunk(const std::string& tag, const void* data, const size_t& bytes){
+    int c = FindChunk(tag);
+    if(c<0){
+        c = m_chunks.size();
+        m_chunks.push_back(CheckpointChunk());
+        m_chunks[c].m_tag = tag.substr(0, sizeof(((CheckpointChunkHeader*)0)->m_tag)-1);
+    }
+    const char* source = (const char*)data;
+    m_chunks[c].m_data.assign(source, source+bytes);
+}
+
+const char* Checkpoint::GetChunk(const std::string& tag, size_t& bytes){
+    int c = FindChunk(tag);
+    if(c<0){
+        bytes = 0;
+        return NULL;
+    }
+    bytes = m_chunks[c].m_data.size();
+    static const char empty = 0;
+    return bytes>0 ? m_chunks[c].m_data.data() : &empty;
+}
+
+int Checkpoint::FindChunk(const std::string& tag){
+    for(unsigned int c=0; c<m_chunks.size(); c++){
+        if(m_chunks[c].m_tag==tag){
+            return c;
+        }
+    }
+    return -1;
+}
+
+bool Checkpoint::Write(const std::string& filename, const bool& compress){
+    //split every chunk into blocks and compress them all at once
+    std::vector<CheckpointBlock> blocks;
+    for(unsigned int c=0; c<m_chunks.size(); c++){
+        unsigned long long size = m_chunks[c].m_data.size();
+        unsigned int blockCount = GetBlockCount(size);
+        for(unsigned int b=0; b<blockCount; b++){
+            CheckpointBlock block;
+            block.m_data = m_chunks[c].m_data.data() + (size_t)b*CHECKPOINT_BLOCK_SIZE;
+            block.m_size = (unsigned int)std::min((unsigned long long)CHECKPOINT_BLOCK_SIZE,
+                                                  size - (unsigned long long)b*
+                                                         CHECKPOINT_BLOCK_SIZE);
+            blocks.push_back(block);
+        }
+    }
+    CheckpointBlock* blockData = blocks.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,blocks.size(),1),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                CheckpointBlock& block = blockData[b];
+                const Bytef* raw = (const Bytef*)block.m_data;
+                block.m_crc = crc32(0L, raw, block.m_size);
+                block.m_stored = block.m_data;
+                block.m_storedSize = block.m_size;
+                if(compress==false){
+                    continue;
+                }
+                uLongf storedSize = compressBound(block.m_size);
+                block.m_buffer.resize(storedSize);
+                if(compress2((Bytef*)block.m_buffer.data(), &storedSize, raw, block.m_size,
+                             Z_BEST_SPEED)==Z_OK && storedSize<block.m_size){
+                    block.m_stored = block.m_buffer.data();
+                    block.m_storedSize = storedSize;
+                }
+            }
+        }
+    );
+
+    //write to a temporary name first so a job killed mid write never leaves a truncated file
+    std::string tempName = filename+".tmp";
+    std::ofstream outputFile(tempName.c_str(), std::ios::out | std::ios::binary);
+    if(outputFile.is_open()==false){
+        std::cout << "Warning: Unable to write checkpoint " << filename << std::endl;
+        return false;
+    }
+    CheckpointFileHeader fileHeader;
+    fileHeader.m_magic = CHECKPOINT_MAGIC;
+    fileHeader.m_version = CHECKPOINT_VERSION;
+    fileHeader.m_chunkCount = m_chunks.size();
+    fileHeader.m_reserved = 0;
+    outputFile.write((const char*)&fileHeader, sizeof(CheckpointFileHeader));
+    unsigned int b = 0;
+    for(unsigned int c=0; c<m_chunks.size(); c++){
+        CheckpointChunkHeader chunkHeader;
+        std::memset(&chunkHeader, 0, sizeof(CheckpointChunkHeader));
+        std::strncpy(chunkHeader.m_tag, m_chunks[c].m_tag.c_str(), sizeof(chunkHeader.m_tag)-1);
+        chunkHeader.m_size = m_chunks[c].m_data.size();
+        chunkHeader.m_blockCount = GetBlockCount(chunkHeader.m_size);
+        outputFile.write((const char*)&chunkHeader, sizeof(CheckpointChunkHeader));
+        for(unsigned int n=0; n<chunkHeader.m_blockCount; n++, b++){
+            CheckpointBlockHeader blockHeader;
+            blockHeader.m_size = blocks[b].m_size;
+            blockHeader.m_storedSize = blocks[b].m_storedSize;
+            blockHeader.m_crc = blocks[b].m_crc;
+            blockHeader.m_reserved = 0;
+            outputFile.write((const char*)&blockHeader, sizeof(CheckpointBlockHeader));
+            outputFile.write(blocks[b].m_stored, blocks[b].m_storedSize);
+        }
+    }
+    outputFile.close();
+    if(outputFile.fail()==true){
+        std::cout << "Warning: Unable to write checkpoint " << filename << std::endl;
+        std::remove(tempName.c_str());
+        return false;
+    }
+    std::remove(filename.c_str());
+    std::rename(tempName.c_str(), filename.c_str());
+    return true;
+}
+
+//Replaces whatever the checkpoint held. On failure the checkpoint is left empty
+bool Checkpoint::Read(const std::string& filename){
+    Clear();
+    MappedFile file;
+    if(file.Open(filename)==false || file.GetSize()<sizeof(CheckpointFileHeader)){
+        std::cout << "Warning: Unable to read checkpoint " << filename << std::endl;
+        return false;
+    }
+    const char* c = file.GetData();
+    const char* end = c + file.GetSize();
+    CheckpointFileHeader fileHeader;
+    std::memcpy(&fileHeader, c, sizeof(CheckpointFileHeader));
+    c += sizeof(CheckpointFileHeader);
+    if(fileHeader.m_magic!=CHECKPOINT_MAGIC || fileHeader.m_version!=CHECKPOINT_VERSION){
+        std::cout << "Warning: " << filename << " is not a version " << CHECKPOINT_VERSION
+                  << " checkpoint" << std::endl;
+        return false;
+    }
+
+    //walk the headers to find every block, then decompress all blocks at once
+    bool valid = true;
+    std::vector<CheckpointBlock> blocks;
+    m_chunks.resize(fileHeader.m_chunkCount);
+    for(unsigned int n=0; n<fileHeader.m_chunkCount && valid; n++){
+        CheckpointChunkHeader chunkHeader;
+        valid = (size_t)(end-c)>=sizeof(CheckpointChunkHeader);
+        if(valid==false){
+            break;
+        }
+        std::memcpy(&chunkHeader, c, sizeof(CheckpointChunkHeader));
+        c += sizeof(CheckpointChunkHeader);
+        chunkHeader.m_tag[sizeof(chunkHeader.m_tag)-1] = 0;
+        m_chunks[n].m_tag = chunkHeader.m_tag;
+        m_chunks[n].m_data.resize(chunkHeader.m_size);
+        unsigned long long offset = 0;
+        for(unsigned int b=0; b<chunkHeader.m_blockCount && valid; b++){
+            CheckpointBlockHeader blockHeader;
+            valid = (size_t)(end-c)>=sizeof(CheckpointBlockHeader);
+            if(valid==false){
+                break;
+            }
+            std::memcpy(&blockHeader, c, sizeof(CheckpointBlockHeader));
+            c += sizeof(CheckpointBlockHeader);
+            valid = (size_t)(end-c)>=blockHeader.m_storedSize &&
+                    offset+blockHeader.m_size<=chunkHeader.m_size;
+            if(valid==false){
+                break;
+            }
+            CheckpointBlock block;
+            block.m_data = m_chunks[n].m_data.data() + offset;
+            block.m_size = blockHeader.m_size;
+            block.m_stored = c;
+            block.m_storedSize = blockHeader.m_storedSize;
+            block.m_crc = blockHeader.m_crc;
+            blocks.push_back(block);
+            c += blockHeader.m_storedSize;
+            offset += blockHeader.m_size;
+        }
+        valid = valid && offset==chunkHeader.m_size;
+    }
+
+    tbb::atomic<int> corrupt;
+    corrupt = 0;
+    if(valid==true){
+        CheckpointBlock* blockData = blocks.data();
+        tbb::parallel_for(tbb::blocked_range<unsigned int>(0,blocks.size(),1),
+            [&](const tbb::blocked_range<unsigned int>& r){
+                for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                    CheckpointBlock& block = blockData[b];
+                    if(block.m_storedSize==block.m_size){
+                        std::memcpy(block.m_data, block.m_stored, block.m_size);
+                    }else{
+                        uLongf size = block.m_size;
+                        if(uncompress((Bytef*)block.m_data, &size, (const Bytef*)block.m_stored,
+                                      block.m_storedSize)!=Z_OK || size!=block.m_size){
+                            corrupt = 1;
+                            continue;
+                        }
+                    }
+                    if(crc32(0L, (const Bytef*)block.m_data, block.m_size)!=block.m_crc){
+                        corrupt = 1;
+                    }
+                }
+            }
+        );
+    }
+    if(valid==false || corrupt!=0){
+        std::cout << "Warning: checkpoint " << filename << " is truncated or corrupt"
+                  << std::endl;
+        Clear();
+        return false;
+    }
+    return true;
+}
+}
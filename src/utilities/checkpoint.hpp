@@ -0,0 +1,105 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: checkpoint.hpp
+// Tagged binary chunks of sim state, written to and read from disk with optional compression
+
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstddef>
+
+#define CHECKPOINT_MAGIC 0x504b4341
+#define CHECKPOINT_VERSION 1
+//chunk payloads are split into blocks of this many bytes, compressed and checked independently
+#define CHECKPOINT_BLOCK_SIZE (4<<20)
+
+namespace utilityCore {
+//====================================
+// Struct and Class Declarations
+//====================================
+
+struct CheckpointChunk{
+    std::string                                         m_tag;
+    std::vector<char>                                   m_data;
+};
+
+//A checkpoint is an in memory list of named byte chunks. Values are stored as they are laid out
+//in memory, so files only load on machines with the same byte order and type sizes. Get calls
+//return false if a chunk is missing or has the wrong size
+class Checkpoint{
+    public:
+        Checkpoint();
+        ~Checkpoint();
+
+        void Clear();
+        void AddChunk(const std::string& tag, const void* data, const size_t& bytes);
+        const char* GetChunk(const std::string& tag, size_t& bytes);
+
+        template <typename T> void AddValue(const std::string& tag, const T& value);
+        template <typename T> void AddArray(const std::string& tag, const std::vector<T>& array);
+        template <typename T> bool GetValue(const std::string& tag, T& value);
+        template <typename T> bool GetArray(const std::string& tag, std::vector<T>& array);
+        //count elements straight into existing storage, such as a grid's raw data
+        template <typename T> bool GetArray(const std::string& tag, T* array,
+                                            const size_t& count);
+
+        //Blocks are zlib compressed in parallel when compress is set, blocks that don't shrink
+        //are stored raw. The file is written under a temporary name and renamed when complete
+        bool Write(const std::string& filename, const bool& compress);
+        bool Read(const std::string& filename);
+
+    private:
+        int FindChunk(const std::string& tag);
+
+        std::vector<CheckpointChunk>                        m_chunks;
+};
+
+//====================================
+// Template Implementations
+//====================================
+
+template <typename T> void Checkpoint::AddValue(const std::string& tag, const T& value){
+    AddChunk(tag, &value, sizeof(T));
+}
+
+template <typename T> void Checkpoint::AddArray(const std::string& tag,
+                                                const std::vector<T>& array){
+    AddChunk(tag, array.data(), array.size()*sizeof(T));
+}
+
+template <typename T> bool Checkpoint::GetValue(const std::string& tag, T& value){
+    return GetArray(tag, &value, 1);
+}
+
+template <typename T> bool Checkpoint::GetArray(const std::string& tag, std::vector<T>& array){
+    size_t bytes;
+    const char* data = GetChunk(tag, bytes);
+    if(data==NULL || bytes%sizeof(T)!=0){
+        return false;
+    }
+    array.resize(bytes/sizeof(T));
+    if(bytes>0){
+        std::memcpy(array.data(), data, bytes);
+    }
+    return true;
+}
+
+template <typename T> bool Checkpoint::GetArray(const std::string& tag, T* array,
+                                                const size_t& count){
+    size_t bytes;
+    const char* data = GetChunk(tag, bytes);
+    if(data==NULL || bytes!=count*sizeof(T)){
+        return false;
+    }
+    if(bytes>0){
+        std::memcpy(array, data, bytes);
+    }
+    return true;
+}
+}
+
+#endif
@@ -0,0 +1,96 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: mappedfile.cpp
+// Implements mappedfile.hpp
+
+#include <fstream>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "mappedfile.hpp"
+
+namespace utilityCore {
+
+//====================================
+// MappedFile Class
+//====================================
+
+MappedFile::MappedFile(){
+    m_data = NULL;
+    m_size = 0;
+    m_mapped = false;
+}
+
+MappedFile::~MappedFile(){
+    Close();
+}
+
+bool MappedFile::Open(const std::string& filename){
+    Close();
+#if !defined(_WIN32)
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd<0){
+        return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info)!=0){
+        close(fd);
+        return false;
+    }
+    m_size = (size_t)info.st_size;
+    if(m_size==0){
+        close(fd);
+        return true;
+    }
+    void* data = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    //the mapping holds its own reference to the file
+    close(fd);
+    if(data==MAP_FAILED){
+        m_size = 0;
+        return false;
+    }
+    madvise(data, m_size, MADV_SEQUENTIAL);
+    m_data = (const char*)data;
+    m_mapped = true;
+    return true;
+#else
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+    if(file.is_open()==false){
+        return false;
+    }
+    file.seekg(0, std::ios::end);
+    m_size = (size_t)file.tellg();
+    file.seekg(0, std::ios::beg);
+    m_buffer.resize(m_size);
+    if(m_size>0){
+        file.read(&m_buffer[0], m_size);
+        m_data = &m_buffer[0];
+    }
+    return true;
+#endif
+}
+
+void MappedFile::Close(){
+#if !defined(_WIN32)
+    if(m_mapped==true){
+        munmap((void*)m_data, m_size);
+    }
+#endif
+    std::vector<char>().swap(m_buffer);
+    m_data = NULL;
+    m_size = 0;
+    m_mapped = false;
+}
+
+const char* MappedFile::GetData(){
+    return m_data;
+}
+
+size_t MappedFile::GetSize(){
+    return m_size;
+}
+}
@@ -0,0 +1,40 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: mappedfile.hpp
+// Read only view of a whole file, memory mapped where the platform allows it
+
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace utilityCore {
+//====================================
+// Class Declarations
+//====================================
+
+//On Windows the file is read into a buffer instead of mapped. Either way the data stays valid
+//until Close or destruction, and is not null terminated
+class MappedFile{
+    public:
+        MappedFile();
+        ~MappedFile();
+
+        bool Open(const std::string& filename);
+        void Close();
+
+        const char* GetData();
+        size_t GetSize();
+
+    private:
+        const char*                                         m_data;
+        size_t                                              m_size;
+        bool                                                m_mapped;
+        std::vector<char>                                   m_buffer;
+};
+}
+
+#endif
@@ -0,0 +1,246 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: memorytracker.cpp
+// Implements memorytracker.hpp
+
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include "memorytracker.hpp"
+
+namespace utilityCore {
+
+static const char* g_memorySubsystemNames[MEMORY_SUBSYSTEM_COUNT] = {"grids", "particles",
+                                                                     "particle_grid", "meshes",
+                                                                     "level_sets", "viewer"};
+
+//Reads one "Name: value kB" line of /proc/self/status
+static size_t ReadProcStatus(const char* field){
+    size_t bytes = 0;
+#if defined(__linux__)
+    FILE* status = fopen("/proc/self/status", "r");
+    if(status==NULL){
+        return 0;
+    }
+    char line[256];
+    size_t length = strlen(field);
+    while(fgets(line, sizeof(line), status)!=NULL){
+        if(strncmp(line, field, length)==0 && line[length]==':'){
+            unsigned long long kilobytes = 0;
+            if(sscanf(line+length+1, "%llu", &kilobytes)==1){
+                bytes = (size_t)kilobytes*1024;
+            }
+            break;
+        }
+    }
+    fclose(status);
+#endif
+    return bytes;
+}
+
+//====================================
+// MemoryTracker Class
+//====================================
+
+MemoryTracker::MemoryTracker(){
+    for(unsigned int s=0; s<MEMORY_SUBSYSTEM_COUNT; s++){
+        m_usage[s] = 0;
+        m_framePeak[s] = 0;
+        m_runPeak[s] = 0;
+    }
+    m_total = 0;
+    m_totalFramePeak = 0;
+    m_totalRunPeak = 0;
+    m_reporting = false;
+}
+
+MemoryTracker::~MemoryTracker(){
+    CloseReport();
+}
+
+void MemoryTracker::Allocate(const memorysubsystem& subsystem, const size_t& bytes){
+    size_t usage = m_usage[subsystem].fetch_and_add(bytes) + bytes;
+    size_t total = m_total.fetch_and_add(bytes) + bytes;
+    RaisePeak(m_framePeak[subsystem], usage);
+    RaisePeak(m_runPeak[subsystem], usage);
+    RaisePeak(m_totalFramePeak, total);
+    RaisePeak(m_totalRunPeak, total);
+}
+
+void MemoryTracker::Release(const memorysubsystem& subsystem, const size_t& bytes){
+    m_usage[subsystem].fetch_and_add(-bytes);
+    m_total.fetch_and_add(-bytes);
+}
+
+size_t MemoryTracker::GetUsage(const memorysubsystem& subsystem){
+    return m_usage[subsystem];
+}
+
+size_t MemoryTracker::GetFramePeak(const memorysubsystem& subsystem){
+    return m_framePeak[subsystem];
+}
+
+size_t MemoryTracker::GetRunPeak(const memorysubsystem& subsystem){
+    return m_runPeak[subsystem];
+}
+
+size_t MemoryTracker::GetTotalUsage(){
+    return m_total;
+}
+
+size_t MemoryTracker::GetTotalFramePeak(){
+    return m_totalFramePeak;
+}
+
+size_t MemoryTracker::GetTotalRunPeak(){
+    return m_totalRunPeak;
+}
+
+const char* MemoryTracker::GetSubsystemName(const memorysubsystem& subsystem){
+    return g_memorySubsystemNames[subsystem];
+}
+
+size_t MemoryTracker::GetResidentBytes(){
+    return ReadProcStatus("VmRSS");
+}
+
+size_t MemoryTracker::GetPeakResidentBytes(){
+    return ReadProcStatus("VmHWM");
+}
+
+void MemoryTracker::OpenReport(const std::string& path){
+    m_reporting = true;
+    if(path.empty()==false){
+        m_report.open(path.c_str());
+        if(m_report.is_open()==false){
+            std::cout << "Warning: could not open memory report " << path << std::endl;
+        }
+    }
+}
+
+//The last line holds the whole run's peaks
+void MemoryTracker::CloseReport(){
+    if(m_reporting==false){
+        return;
+    }
+    size_t peaks[MEMORY_SUBSYSTEM_COUNT];
+    for(unsigned int s=0; s<MEMORY_SUBSYSTEM_COUNT; s++){
+        peaks[s] = m_runPeak[s];
+    }
+    std::stringstream line;
+    line << "{\"run_peak_mb\":" << FormatMegabytes(peaks, m_totalRunPeak)
+         << ",\"peak_rss_mb\":" << GetPeakResidentBytes()/1048576.0 << "}";
+    std::cout << "Memory run peak: " << line.str() << std::endl;
+    if(m_report.is_open()==true){
+        m_report << line.str() << std::endl;
+        m_report.close();
+    }
+    m_reporting = false;
+}
+
+bool MemoryTracker::IsReporting(){
+    return m_reporting;
+}
+
+//bytes holds one entry per subsystem
+void MemoryTracker::ReportEstimate(const size_t* bytes){
+    if(m_reporting==false){
+        return;
+    }
+    size_t total = 0;
+    for(unsigned int s=0; s<MEMORY_SUBSYSTEM_COUNT; s++){
+        total += bytes[s];
+    }
+    std::string line = "{\"estimate_mb\":"+FormatMegabytes(bytes, total)+"}";
+    std::cout << "Memory estimate: " << line << std::endl;
+    if(m_report.is_open()==true){
+        m_report << line << std::endl;
+    }
+}
+
+void MemoryTracker::EndFrame(const int& frame){
+    if(m_reporting==true){
+        size_t usage[MEMORY_SUBSYSTEM_COUNT];
+        size_t peaks[MEMORY_SUBSYSTEM_COUNT];
+        for(unsigned int s=0; s<MEMORY_SUBSYSTEM_COUNT; s++){
+            usage[s] = m_usage[s];
+            peaks[s] = m_framePeak[s];
+        }
+        std::stringstream line;
+        line << "{\"frame\":" << frame << ",\"usage_mb\":" << FormatMegabytes(usage, m_total)
+             << ",\"peak_mb\":" << FormatMegabytes(peaks, m_totalFramePeak) << ",\"rss_mb\":"
+             << GetResidentBytes()/1048576.0 << "}";
+        tbb::spin_mutex::scoped_lock lock(m_reportLock);
+        std::cout << "Memory: " << line.str() << std::endl;
+        if(m_report.is_open()==true){
+            m_report << line.str() << std::endl;
+        }
+    }
+    for(unsigned int s=0; s<MEMORY_SUBSYSTEM_COUNT; s++){
+        m_framePeak[s] = m_usage[s];
+    }
+    m_totalFramePeak = m_total;
+}
+
+//Peaks only ever grow, a lost race retries against the newer peak
+void MemoryTracker::RaisePeak(tbb::atomic<size_t>& peak, const size_t& value){
+    size_t current = peak;
+    while(value>current){
+        size_t seen = peak.compare_and_swap(value, current);
+        if(seen==current){
+            break;
+        }
+        current = seen;
+    }
+}
+
+//Subsystem names are plain identifiers, so nothing below needs escaping
+std::string MemoryTracker::FormatMegabytes(const size_t* bytes, const size_t& total){
+    std::stringstream json;
+    json << "{";
+    for(unsigned int s=0; s<MEMORY_SUBSYSTEM_COUNT; s++){
+        json << "\"" << g_memorySubsystemNames[s] << "\":" << bytes[s]/1048576.0 << ",";
+    }
+    json << "\"total\":" << total/1048576.0 << "}";
+    return json.str();
+}
+
+MemoryTracker* GetMemoryTracker(){
+    static MemoryTracker tracker;
+    return &tracker;
+}
+
+//====================================
+// MemoryRecord Class
+//====================================
+
+MemoryRecord::MemoryRecord(const memorysubsystem& subsystem){
+    m_subsystem = subsystem;
+    m_bytes = 0;
+}
+
+MemoryRecord::MemoryRecord(const MemoryRecord& record){
+    m_subsystem = record.m_subsystem;
+    m_bytes = 0;
+}
+
+MemoryRecord::~MemoryRecord(){
+    Update(0);
+}
+
+//What this record already reported stays with it
+MemoryRecord& MemoryRecord::operator=(const MemoryRecord& record){
+    return *this;
+}
+
+void MemoryRecord::Update(const size_t& bytes){
+    if(bytes>m_bytes){
+        GetMemoryTracker()->Allocate(m_subsystem, bytes-m_bytes);
+    }else if(bytes<m_bytes){
+        GetMemoryTracker()->Release(m_subsystem, m_bytes-bytes);
+    }
+    m_bytes = bytes;
+}
+}
@@ -0,0 +1,92 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: memorytracker.hpp
+// Per subsystem memory accounting with per frame and whole run high-water marks
+
+#ifndef MEMORYTRACKER_HPP
+#define MEMORYTRACKER_HPP
+
+#include <string>
+#include <fstream>
+#include <tbb/tbb.h>
+
+//Grids are counted exactly as they are allocated. The rest are containers that keep their
+//capacity between steps, so their owners report what they hold at the end of every frame
+enum memorysubsystem {MEMORY_GRIDS=0, MEMORY_PARTICLES=1, MEMORY_PARTICLE_GRID=2, MEMORY_MESHES=3,
+                      MEMORY_LEVELSETS=4, MEMORY_VIEWER=5, MEMORY_SUBSYSTEM_COUNT=6};
+
+namespace utilityCore {
+//====================================
+// Class Declarations
+//====================================
+
+//Allocate and Release are safe to call from any thread. Frame peaks are the most held since the
+//last EndFrame, run peaks the most held since the tracker was created
+class MemoryTracker{
+    public:
+        MemoryTracker();
+        ~MemoryTracker();
+
+        void Allocate(const memorysubsystem& subsystem, const size_t& bytes);
+        void Release(const memorysubsystem& subsystem, const size_t& bytes);
+
+        size_t GetUsage(const memorysubsystem& subsystem);
+        size_t GetFramePeak(const memorysubsystem& subsystem);
+        size_t GetRunPeak(const memorysubsystem& subsystem);
+        size_t GetTotalUsage();
+        size_t GetTotalFramePeak();
+        size_t GetTotalRunPeak();
+        static const char* GetSubsystemName(const memorysubsystem& subsystem);
+        //resident set of the whole process and its high-water mark, 0 where unsupported
+        static size_t GetResidentBytes();
+        static size_t GetPeakResidentBytes();
+
+        //Report lines are JSON objects, one per frame after an estimate line, printed to stdout
+        //and also written to path unless it is empty
+        void OpenReport(const std::string& path);
+        void CloseReport();
+        bool IsReporting();
+        void ReportEstimate(const size_t* bytes);
+        //writes the frame's report line if reporting, then restarts the frame peaks. Sims that
+        //step concurrently each end their own frames, their lines are written whole
+        void EndFrame(const int& frame);
+
+    private:
+        void RaisePeak(tbb::atomic<size_t>& peak, const size_t& value);
+        std::string FormatMegabytes(const size_t* bytes, const size_t& total);
+
+        tbb::atomic<size_t>                                 m_usage[MEMORY_SUBSYSTEM_COUNT];
+        tbb::atomic<size_t>                                 m_framePeak[MEMORY_SUBSYSTEM_COUNT];
+        tbb::atomic<size_t>                                 m_runPeak[MEMORY_SUBSYSTEM_COUNT];
+        tbb::atomic<size_t>                                 m_total;
+        tbb::atomic<size_t>                                 m_totalFramePeak;
+        tbb::atomic<size_t>                                 m_totalRunPeak;
+
+        bool                                                m_reporting;
+        std::ofstream                                       m_report;
+        tbb::spin_mutex                                     m_reportLock;
+};
+
+//Bytes one owner holds under a subsystem. Update reports the change since the last update and
+//the destructor releases what is left, so owners only ever say what they hold now. Copies start
+//out holding nothing
+class MemoryRecord{
+    public:
+        MemoryRecord(const memorysubsystem& subsystem);
+        MemoryRecord(const MemoryRecord& record);
+        ~MemoryRecord();
+        MemoryRecord& operator=(const MemoryRecord& record);
+
+        void Update(const size_t& bytes);
+
+    private:
+        memorysubsystem                                     m_subsystem;
+        size_t                                              m_bytes;
+};
+
+//Process wide tracker shared by the grids, sim, scene and viewer
+extern MemoryTracker* GetMemoryTracker();
+}
+
+#endif
@@ -0,0 +1,142 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: numa.cpp
+// Implements numa.hpp
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdlib>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "numa.hpp"
+
+namespace utilityCore {
+
+//Parses sysfs lists like "0-3,8-11", empty if the file is missing
+static std::vector<int> ReadSysfsList(const std::string& path){
+    std::vector<int> values;
+    std::ifstream file(path.c_str());
+    std::string list;
+    std::getline(file, list);
+    if(list.empty()==true){
+        return values;
+    }
+    std::stringstream ranges(list);
+    std::string range;
+    while(std::getline(ranges, range, ',')){
+        if(range.empty()==true){
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = std::atoi(range.substr(0, dash).c_str());
+        int last = dash==std::string::npos ? first : std::atoi(range.substr(dash+1).c_str());
+        for(int v=first; v<=last; v++){
+            values.push_back(v);
+        }
+    }
+    return values;
+}
+
+//====================================
+// NumaPinningObserver Class
+//====================================
+
+NumaPinningObserver::NumaPinningObserver(tbb::task_arena& arena, const std::vector<int>& cpus):
+    tbb::task_scheduler_observer(arena){
+    m_cpus = cpus;
+    observe(true);
+}
+
+NumaPinningObserver::~NumaPinningObserver(){
+    observe(false);
+}
+
+//Only workers are pinned, threads that call in through execute keep their own affinity
+void NumaPinningObserver::on_scheduler_entry(bool worker){
+#if defined(__linux__)
+    if(worker==false){
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(unsigned int c=0; c<m_cpus.size(); c++){
+        CPU_SET(m_cpus[c], &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+//====================================
+// NumaTopology Class
+//====================================
+
+NumaTopology::NumaTopology(){
+    m_enabled = false;
+}
+
+NumaTopology::~NumaTopology(){
+    for(unsigned int n=0; n<m_arenas.size(); n++){
+        delete m_observers[n];
+        m_arenas[n]->terminate();
+        delete m_arenas[n];
+    }
+}
+
+bool NumaTopology::Enable(){
+    if(m_enabled==true){
+        return true;
+    }
+#if defined(__linux__)
+    //memory only nodes have no cpus to run their slab and are left out
+    std::vector<int> nodes = ReadSysfsList("/sys/devices/system/node/online");
+    for(unsigned int n=0; n<nodes.size(); n++){
+        std::stringstream path;
+        path << "/sys/devices/system/node/node" << nodes[n] << "/cpulist";
+        std::vector<int> cpus = ReadSysfsList(path.str());
+        if(cpus.empty()==false){
+            m_nodeCpus.push_back(cpus);
+        }
+    }
+#endif
+    if(m_nodeCpus.size()<2){
+        std::cout << "Warning: found " << m_nodeCpus.size() << " NUMA node(s) with cpus,"
+                  << " running without NUMA placement" << std::endl;
+        m_nodeCpus.clear();
+        return false;
+    }
+    for(unsigned int n=0; n<m_nodeCpus.size(); n++){
+        tbb::task_arena* arena = new tbb::task_arena(m_nodeCpus[n].size(), 0);
+        arena->initialize();
+        m_arenas.push_back(arena);
+        m_observers.push_back(new NumaPinningObserver(*arena, m_nodeCpus[n]));
+    }
+    m_enabled = true;
+    std::cout << "NUMA placement across " << m_nodeCpus.size() << " nodes" << std::endl;
+    return true;
+}
+
+bool NumaTopology::IsEnabled(){
+    return m_enabled;
+}
+
+int NumaTopology::GetNodeCount(){
+    return m_enabled ? m_arenas.size() : 1;
+}
+
+void NumaTopology::GetNodeRange(const int& node, const unsigned int& count, unsigned int* begin,
+                                unsigned int* end){
+    unsigned long long nodes = GetNodeCount();
+    *begin = (unsigned int)(count*(unsigned long long)node/nodes);
+    *end = (unsigned int)(count*(unsigned long long)(node+1)/nodes);
+}
+
+NumaTopology* GetNumaTopology(){
+    static NumaTopology topology;
+    return &topology;
+}
+}
@@ -0,0 +1,87 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: numa.hpp
+// NUMA node detection and one pinned task arena per node for socket local grid passes
+
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include <vector>
+#include <tbb/tbb.h>
+
+namespace utilityCore {
+//====================================
+// Class Declarations
+//====================================
+
+//Pins every worker that joins its arena to the cpus of one node
+class NumaPinningObserver: public tbb::task_scheduler_observer{
+    public:
+        NumaPinningObserver(tbb::task_arena& arena, const std::vector<int>& cpus);
+        ~NumaPinningObserver();
+
+        void on_scheduler_entry(bool worker);
+
+    private:
+        std::vector<int>                                    m_cpus;
+};
+
+//Work is split across nodes by contiguous ranges, so node n always owns the same slab of a
+//grid. Grids first touch their storage through ForEachNode, which places each slab's pages on
+//the node whose arena later runs the stencil passes over it. Disabled, nothing is created and
+//callers take their usual single arena paths
+class NumaTopology{
+    public:
+        NumaTopology();
+        ~NumaTopology();
+
+        //Reads the node layout and creates the arenas, false if there is only one node. Must be
+        //called before any grid is allocated
+        bool Enable();
+        bool IsEnabled();
+        int GetNodeCount();
+        //[begin, end) of count items that node owns, nodes get equal shares in order
+        void GetNodeRange(const int& node, const unsigned int& count, unsigned int* begin,
+                          unsigned int* end);
+        //Runs fn(node) for every node inside that node's arena concurrently and waits for all of
+        //them. Safe to call from any thread, including from inside other arenas
+        template <typename F> void ForEachNode(const F& fn);
+
+    private:
+        bool                                                m_enabled;
+        std::vector<std::vector<int> >                      m_nodeCpus;
+        std::vector<tbb::task_arena*>                       m_arenas;
+        std::vector<NumaPinningObserver*>                   m_observers;
+};
+
+//Process wide topology shared by the grids and the tile passes
+extern NumaTopology* GetNumaTopology();
+
+//====================================
+// Template Implementations
+//====================================
+
+template <typename F> void NumaTopology::ForEachNode(const F& fn){
+    int nodes = m_arenas.size();
+    std::vector<tbb::task_group*> groups(nodes);
+    for(int n=0; n<nodes; n++){
+        tbb::task_group* group = new tbb::task_group();
+        groups[n] = group;
+        m_arenas[n]->execute([&fn, group, n](){
+            group->run([&fn, n](){
+                fn(n);
+            });
+        });
+    }
+    for(int n=0; n<nodes; n++){
+        tbb::task_group* group = groups[n];
+        m_arenas[n]->execute([group](){
+            group->wait();
+        });
+        delete group;
+    }
+}
+}
+
+#endif
@@ -0,0 +1,347 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: profiler.cpp
+// Implements profiler.hpp
+
+#include <iostream>
+#include <sstream>
+#include "profiler.hpp"
+#include "memorytracker.hpp"
+
+namespace utilityCore {
+
+static const char* g_profileCounterNames[PROFILE_COUNTER_COUNT] = {"rays_cast",
+                                                                  "neighbor_queries"};
+
+//====================================
+// ProfileCounts Struct
+//====================================
+
+ProfileCounts::ProfileCounts(){
+    for(unsigned int i=0; i<PROFILE_COUNTER_COUNT; i++){
+        m_counts[i] = 0;
+    }
+}
+
+//====================================
+// Profiler Class
+//====================================
+
+Profiler::Profiler(){
+    m_enabled = false;
+    m_frame = 0;
+    m_start = tbb::tick_count::now();
+    m_traceEmpty = true;
+    m_keepTotals = false;
+    m_totalFrames = 0;
+}
+
+Profiler::~Profiler(){
+    Close();
+}
+
+//Frame stats go to statsPrefix.csv, one row per stage or counter, and statsPrefix.jsonl, one
+//object per frame. tracePath gets Chrome trace events. Either may be empty to skip that output
+void Profiler::Open(const std::string& statsPrefix, const std::string& tracePath){
+    if(statsPrefix.empty()==false){
+        m_csv.open((statsPrefix+".csv").c_str());
+        m_json.open((statsPrefix+".jsonl").c_str());
+        if(m_csv.is_open()==false || m_json.is_open()==false){
+            std::cout << "Warning: could not open profile output " << statsPrefix << std::endl;
+        }else{
+            m_csv << "frame,kind,name,value" << std::endl;
+            m_enabled = true;
+        }
+    }
+    if(tracePath.empty()==false){
+        m_trace.open(tracePath.c_str());
+        if(m_trace.is_open()==false){
+            std::cout << "Warning: could not open trace output " << tracePath << std::endl;
+        }else{
+            //JSON array form, which trace viewers also accept without the closing bracket if
+            //the sim is killed before Close
+            m_trace << "[" << std::endl;
+            m_traceEmpty = true;
+            m_enabled = true;
+        }
+    }
+}
+
+void Profiler::Close(){
+    if(m_trace.is_open()==true){
+        m_trace << std::endl << "]" << std::endl;
+        m_trace.close();
+    }
+    if(m_csv.is_open()==true){
+        m_csv.close();
+    }
+    if(m_json.is_open()==true){
+        m_json.close();
+    }
+    m_enabled = m_keepTotals;
+}
+
+bool Profiler::IsEnabled(){
+    return m_enabled;
+}
+
+//Counts gathered outside of a frame, such as during sim init, are dropped here
+void Profiler::BeginFrame(const int& frame){
+    if(m_enabled==false){
+        return;
+    }
+    m_frame = frame;
+    m_stages.clear();
+    m_openStages.clear();
+    m_counters.clear();
+    m_threadCounts.clear();
+}
+
+void Profiler::EndFrame(){
+    if(m_enabled==false){
+        return;
+    }
+    while(m_openStages.empty()==false){
+        EndStage();
+    }
+
+    //fold per thread counts into the frame's named counters
+    ProfileCounts total;
+    for(tbb::enumerable_thread_specific<ProfileCounts>::iterator it=m_threadCounts.begin();
+        it!=m_threadCounts.end(); ++it){
+        for(unsigned int i=0; i<PROFILE_COUNTER_COUNT; i++){
+            total.m_counts[i] += it->m_counts[i];
+        }
+    }
+    for(unsigned int i=0; i<PROFILE_COUNTER_COUNT; i++){
+        SetCounter(g_profileCounterNames[i], (double)total.m_counts[i]);
+    }
+    m_threadCounts.clear();
+
+    //memory held now and the most held since the last frame, per subsystem
+    MemoryTracker* memory = GetMemoryTracker();
+    for(unsigned int s=0; s<MEMORY_SUBSYSTEM_COUNT; s++){
+        memorysubsystem subsystem = (memorysubsystem)s;
+        std::string name = std::string("memory_")+MemoryTracker::GetSubsystemName(subsystem);
+        SetCounter(name+"_mb", memory->GetUsage(subsystem)/1048576.0);
+        SetCounter(name+"_peak_mb", memory->GetFramePeak(subsystem)/1048576.0);
+    }
+    SetCounter("memory_total_mb", memory->GetTotalUsage()/1048576.0);
+    SetCounter("memory_total_peak_mb", memory->GetTotalFramePeak()/1048576.0);
+    SetCounter("memory_rss_mb", MemoryTracker::GetResidentBytes()/1048576.0);
+
+    //stages that ran more than once this frame are summed, in order of first appearance
+    std::vector<std::pair<std::string, double> > stageTotals;
+    for(unsigned int s=0; s<m_stages.size(); s++){
+        unsigned int t = 0;
+        while(t<stageTotals.size() && stageTotals[t].first!=m_stages[s].m_name){
+            t++;
+        }
+        if(t==stageTotals.size()){
+            stageTotals.push_back(std::make_pair(m_stages[s].m_name, 0.0));
+        }
+        stageTotals[t].second += m_stages[s].m_duration/1000.0;
+    }
+
+    if(m_keepTotals==true){
+        AddTotals(m_stageTotals, stageTotals);
+        AddTotals(m_counterTotals, m_counters);
+        m_totalFrames++;
+    }
+
+    //stage and counter names are plain identifiers, so nothing below needs escaping
+    if(m_csv.is_open()==true){
+        for(unsigned int t=0; t<stageTotals.size(); t++){
+            m_csv << m_frame << ",stage_ms," << stageTotals[t].first << ","
+                  << stageTotals[t].second << "\n";
+        }
+        for(unsigned int c=0; c<m_counters.size(); c++){
+            m_csv << m_frame << ",counter," << m_counters[c].first << ","
+                  << m_counters[c].second << "\n";
+        }
+        m_csv.flush();
+    }
+    if(m_json.is_open()==true){
+        m_json << "{\"frame\":" << m_frame << ",\"stages_ms\":{";
+        for(unsigned int t=0; t<stageTotals.size(); t++){
+            m_json << (t>0 ? "," : "") << "\"" << stageTotals[t].first << "\":"
+                   << stageTotals[t].second;
+        }
+        m_json << "},\"counters\":{";
+        for(unsigned int c=0; c<m_counters.size(); c++){
+            m_json << (c>0 ? "," : "") << "\"" << m_counters[c].first << "\":"
+                   << m_counters[c].second;
+        }
+        m_json << "}}" << std::endl;
+    }
+    if(m_trace.is_open()==true){
+        for(unsigned int s=0; s<m_stages.size(); s++){
+            std::stringstream event;
+            event.precision(15);
+            event << "{\"name\":\"" << m_stages[s].m_name << "\",\"cat\":\"sim\",\"ph\":\"X\","
+                  << "\"ts\":" << m_stages[s].m_start << ",\"dur\":" << m_stages[s].m_duration
+                  << ",\"pid\":0,\"tid\":" << m_stages[s].m_lane << ",\"args\":{\"frame\":"
+                  << m_frame << "}}";
+            WriteTraceEvent(event.str());
+        }
+        double now = GetTime();
+        for(unsigned int c=0; c<m_counters.size(); c++){
+            std::stringstream event;
+            event.precision(15);
+            event << "{\"name\":\"" << m_counters[c].first << "\",\"ph\":\"C\",\"ts\":" << now
+                  << ",\"pid\":0,\"args\":{\"value\":" << m_counters[c].second << "}}";
+            WriteTraceEvent(event.str());
+        }
+        m_trace.flush();
+    }
+}
+
+void Profiler::BeginStage(const char* name){
+    if(m_enabled==false){
+        return;
+    }
+    ProfileStage stage;
+    stage.m_name = name;
+    stage.m_start = GetTime();
+    stage.m_duration = -1.0;
+    stage.m_lane = 0;
+    tbb::spin_mutex::scoped_lock lock(m_stageLock);
+    m_openStages.push_back(m_stages.size());
+    m_stages.push_back(stage);
+}
+
+void Profiler::EndStage(){
+    if(m_enabled==false){
+        return;
+    }
+    double now = GetTime();
+    tbb::spin_mutex::scoped_lock lock(m_stageLock);
+    if(m_openStages.empty()==true){
+        return;
+    }
+    ProfileStage& stage = m_stages[m_openStages.back()];
+    stage.m_duration = now - stage.m_start;
+    m_openStages.pop_back();
+}
+
+void Profiler::AddStage(const char* name, const double& start, const double& duration, 
+                        const int& lane){
+    if(m_enabled==false){
+        return;
+    }
+    ProfileStage stage;
+    stage.m_name = name;
+    stage.m_start = start;
+    stage.m_duration = duration;
+    stage.m_lane = lane;
+    tbb::spin_mutex::scoped_lock lock(m_stageLock);
+    m_stages.push_back(stage);
+}
+
+//Setting a counter twice in one frame keeps the last value
+void Profiler::SetCounter(const std::string& name, const double& value){
+    if(m_enabled==false){
+        return;
+    }
+    for(unsigned int c=0; c<m_counters.size(); c++){
+        if(m_counters[c].first==name){
+            m_counters[c].second = value;
+            return;
+        }
+    }
+    m_counters.push_back(std::make_pair(name, value));
+}
+
+void Profiler::AddCount(const profilecounter& counter, const unsigned int& n){
+    if(m_enabled==false){
+        return;
+    }
+    m_threadCounts.local().m_counts[counter] += n;
+}
+
+void Profiler::KeepTotals(const bool& keep){
+    m_keepTotals = keep;
+    m_enabled = keep || m_csv.is_open() || m_json.is_open() || m_trace.is_open();
+}
+
+void Profiler::ResetTotals(){
+    m_totalFrames = 0;
+    m_stageTotals.clear();
+    m_counterTotals.clear();
+}
+
+int Profiler::GetTotalFrames(){
+    return m_totalFrames;
+}
+
+std::vector<std::pair<std::string, double> > Profiler::GetStageTotals(){
+    return m_stageTotals;
+}
+
+std::vector<std::pair<std::string, double> > Profiler::GetCounterTotals(){
+    return m_counterTotals;
+}
+
+//Totals keep names in order of first appearance
+void Profiler::AddTotals(std::vector<std::pair<std::string, double> >& totals,
+                         const std::vector<std::pair<std::string, double> >& values){
+    for(unsigned int v=0; v<values.size(); v++){
+        unsigned int t = 0;
+        while(t<totals.size() && totals[t].first!=values[v].first){
+            t++;
+        }
+        if(t==totals.size()){
+            totals.push_back(std::make_pair(values[v].first, 0.0));
+        }
+        totals[t].second += values[v].second;
+    }
+}
+
+double Profiler::GetTime(){
+    return (tbb::tick_count::now() - m_start).seconds()*1000000.0;
+}
+
+void Profiler::WriteTraceEvent(const std::string& event){
+    m_trace << (m_traceEmpty ? "" : ",\n") << event;
+    m_traceEmpty = false;
+}
+
+Profiler* GetProfiler(){
+    static Profiler profiler;
+    return &profiler;
+}
+
+//====================================
+// ProfileScope Class
+//====================================
+
+ProfileScope::ProfileScope(const char* name){
+    m_active = GetProfiler()->IsEnabled();
+    m_name = name;
+    m_lane = -1;
+    m_start = 0.0;
+    if(m_active==true){
+        GetProfiler()->BeginStage(name);
+    }
+}
+
+ProfileScope::ProfileScope(const char* name, const int& lane){
+    m_active = GetProfiler()->IsEnabled();
+    m_name = name;
+    m_lane = lane;
+    m_start = m_active ? GetProfiler()->GetTime() : 0.0;
+}
+
+ProfileScope::~ProfileScope(){
+    if(m_active==false){
+        return;
+    }
+    if(m_lane<0){
+        GetProfiler()->EndStage();
+    }else{
+        Profiler* profiler = GetProfiler();
+        profiler->AddStage(m_name, m_start, profiler->GetTime()-m_start, m_lane);
+    }
+}
+}
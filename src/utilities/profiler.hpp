@@ -0,0 +1,114 @@
+// Ariel: FLIP Fluid Simulator
+// Written by Yining Karl Li
+//
+// File: profiler.hpp
+// Per-frame stage timers and counters for the sim, written out as CSV/JSON and trace events
+
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <tbb/tbb.h>
+
+//Counters bumped from inside parallel loops, kept per thread and summed at the end of a frame
+enum profilecounter {PROFILE_RAYS_CAST=0, PROFILE_NEIGHBOR_QUERIES=1, PROFILE_COUNTER_COUNT=2};
+
+namespace utilityCore {
+//====================================
+// Struct and Class Declarations
+//====================================
+
+struct ProfileStage{
+    std::string     m_name;
+    double          m_start; //microseconds since the profiler was created
+    double          m_duration; //microseconds, negative while the stage is still open
+    int             m_lane; //trace row, 0 for nested stages
+};
+
+struct ProfileCounts{
+    ProfileCounts();
+
+    unsigned long long  m_counts[PROFILE_COUNTER_COUNT];
+};
+
+//Nested stages and named counters share one stack, so they may come from any thread as long as
+//no two of them run at once: the sim thread, or flow graph nodes the step's graph orders one
+//after another. Branches of the graph that can run concurrently must time themselves with a
+//lane, which goes through AddStage and records the stage whole once it finishes. AddStage and
+//AddCount are safe from any thread. Everything is a no-op until Open is called
+class Profiler{
+    public:
+        Profiler();
+        ~Profiler();
+
+        void Open(const std::string& statsPrefix, const std::string& tracePath);
+        void Close();
+        bool IsEnabled();
+
+        void BeginFrame(const int& frame);
+        void EndFrame();
+        void BeginStage(const char* name);
+        void EndStage();
+        void AddStage(const char* name, const double& start, const double& duration, 
+                      const int& lane);
+        //microseconds since the profiler was created
+        double GetTime();
+        void SetCounter(const std::string& name, const double& value);
+        void AddCount(const profilecounter& counter, const unsigned int& n);
+
+        //Sums every frame's stage times and counters in memory, for drivers that compare whole
+        //runs. Keeping totals enables the profiler even when no output is open
+        void KeepTotals(const bool& keep);
+        void ResetTotals();
+        int GetTotalFrames();
+        //summed over the frames since ResetTotals, stage times in milliseconds
+        std::vector<std::pair<std::string, double> > GetStageTotals();
+        std::vector<std::pair<std::string, double> > GetCounterTotals();
+
+    private:
+        void WriteTraceEvent(const std::string& event);
+        void AddTotals(std::vector<std::pair<std::string, double> >& totals,
+                       const std::vector<std::pair<std::string, double> >& values);
+
+        bool                                                m_enabled;
+        int                                                 m_frame;
+        tbb::tick_count                                     m_start;
+        std::vector<ProfileStage>                           m_stages;
+        std::vector<unsigned int>                           m_openStages;
+        tbb::spin_mutex                                     m_stageLock;
+        std::vector<std::pair<std::string, double> >        m_counters;
+        tbb::enumerable_thread_specific<ProfileCounts>      m_threadCounts;
+
+        std::ofstream                                       m_csv;
+        std::ofstream                                       m_json;
+        std::ofstream                                       m_trace;
+        bool                                                m_traceEmpty;
+
+        bool                                                m_keepTotals;
+        int                                                 m_totalFrames;
+        std::vector<std::pair<std::string, double> >        m_stageTotals;
+        std::vector<std::pair<std::string, double> >        m_counterTotals;
+};
+
+//Times the enclosing scope as one stage of the current frame. Scopes given a lane may run on
+//any thread alongside other stages, their stage is shown on that lane's trace row
+class ProfileScope{
+    public:
+        ProfileScope(const char* name);
+        ProfileScope(const char* name, const int& lane);
+        ~ProfileScope();
+
+    private:
+        bool                                                m_active;
+        const char*                                         m_name;
+        int                                                 m_lane; //-1 for nested stages
+        double                                              m_start;
+};
+
+//Process wide profiler shared by the sim, scene and solver
+extern Profiler* GetProfiler();
+}
+
+#endif
@@ -6,14 +6,54 @@
 
 #include <stb_image/stb_image_write.h>
 #include <sstream>
+#include <chrono>
+#include <cstring>
 #include "viewer.hpp"
 #include "../utilities/utilities.h"
 #include "../camera/cameralist.hpp"
 
 namespace viewerCore{
 
-Viewer::Viewer(){
+Viewer::Viewer(): m_memory(MEMORY_VIEWER){
     m_loaded = false;
+    m_snapshotFront = -1;
+    m_snapshotReading = -1;
+    m_snapshotSequence = 0;
+    for(unsigned int i=0; i<2; i++){
+        m_snapshots[i].m_count = 0;
+        m_snapshots[i].m_sequence = 0;
+        m_snapshots[i].m_frame = -1;
+    }
+    for(unsigned int b=0; b<CAPTURE_RING_SIZE; b++){
+        m_captureRing[b].m_pbo = 0;
+        m_captureRing[b].m_fence = NULL;
+        m_captureRing[b].m_frame = -1;
+    }
+    m_captureNext = 0;
+    m_captureReady = false;
+    m_capturedFrame = -1;
+    m_displayedFrame = -1;
+    m_capturesPending = 0;
+    m_captureArenaReady = false;
+    m_particleVbo.m_data.m_vboID = 0;
+    m_particleVbo.m_data.m_cboID = 0;
+    m_particleVbo.m_data.m_size = 0;
+    m_particleVbo.m_data.m_type = GL_POINTS;
+    m_particleVbo.m_data.m_key = "fluid";
+    glm::mat4 m;
+    for(int x=0; x<4; x++){
+        for(int y=0; y<4; y++){
+            m_particleVbo.m_data.m_transform[x][y] = m[x][y];
+        }
+    }
+    m_particleVbo.m_capacity = 0;
+    m_particleVbo.m_persistent = false;
+    m_particleVbo.m_positions = NULL;
+    m_particleVbo.m_colors = NULL;
+    m_particleVbo.m_fence = NULL;
+    m_particleVbo.m_sequence = 0;
+    m_meshVboBytes = 0;
+    m_pointBudget = DEFAULT_POINT_BUDGET;
 }
 
 Viewer::~Viewer(){
@@ -46,10 +86,10 @@ void Viewer::Load(fluidCore::FlipSim* sim, const bool& retina, const glm::vec2&
     m_drawInvalid = false;
 
     m_dumpFramebuffer = false;
-    m_dumpReady = false;
 
     m_dumpVDB = false;
     m_dumpOBJ = false;
+    m_dumpPARTIO = false;
 
     if(retina){
         m_framebufferScale = 2;
@@ -57,29 +97,35 @@ void Viewer::Load(fluidCore::FlipSim* sim, const bool& retina, const glm::vec2&
         m_framebufferScale = 1;
     }
 
-    m_bitmapData = new unsigned char[3 * (int)resolution.x*m_framebufferScale * 
-                                       (int)resolution.y*m_framebufferScale];
-
     m_pause = false;
+    m_frameLimit = -1;
+}
+
+//The sim stops stepping once it reaches frames, the viewer stays up to inspect the result
+void Viewer::SetFrameLimit(const int& frames){
+    m_frameLimit = frames;
+}
+
+void Viewer::SetPointBudget(const unsigned int& points){
+    m_pointBudget = points;
 }
 
 void Viewer::SimLoopThread(){
     if(m_sim->m_frame==0){
         m_sim->Init();
-        m_particles = m_sim->GetParticles();
-        m_siminitialized = true;
     }
+    m_particles = m_sim->GetParticles();
+    PublishParticles();
+    m_siminitialized = true;
     while(1){
-        if(!m_pause){
+        bool done = m_frameLimit>=0 && m_sim->m_frame>=m_frameLimit;
+        if(!m_pause && !done){
             m_sim->Step(m_dumpVDB, m_dumpOBJ, m_dumpPARTIO);
             m_particles = m_sim->GetParticles();
-            if(m_dumpFramebuffer && m_dumpReady){
-                m_framebufferWriteLock.lock();
-                {
-                    SaveFrame();
-                }
-                m_framebufferWriteLock.unlock();
-            }
+            PublishParticles();
+        }else{
+            //don't spin a core while paused or finished
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
         }
         m_siminitialized = true;
     }
@@ -104,104 +150,360 @@ bool Viewer::Launch(){
     } 
 }
 
-void Viewer::SaveFrame(){
-    std::string filename = m_sim->GetScene()->m_imagePath;
-    std::string frameString = utilityCore::padString(4, 
-                                                utilityCore::convertIntToString(m_sim->m_frame));
-    std::cout << filename << std::endl;
-    utilityCore::replaceString(filename, ".png", "."+frameString+".png");
+//Reads the frame just drawn into the next ring slot. Only the oldest read can occupy the next
+//slot, so waiting on it keeps captures in frame order
+void Viewer::CaptureFramebuffer(){
+    int width = (int)m_resolution.x*m_framebufferScale;
+    int height = (int)m_resolution.y*m_framebufferScale;
+    if(m_captureReady==false){
+        if(GLEW_ARB_pixel_buffer_object==true){
+            for(unsigned int b=0; b<CAPTURE_RING_SIZE; b++){
+                glGenBuffers(1, &m_captureRing[b].m_pbo);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, m_captureRing[b].m_pbo);
+                glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)width*height*3, NULL, 
+                             GL_STREAM_READ);
+            }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+        m_captureReady = true;
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    CaptureBuffer& slot = m_captureRing[m_captureNext];
+    if(slot.m_pbo==0){
+        //without pixel buffer objects the read is synchronous and only the encode is deferred
+        FrameCapture* capture = CreateCapture(m_displayedFrame);
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, capture->m_pixels.data());
+        QueueCapture(capture);
+    }else{
+        if(slot.m_fence!=NULL){
+            CollectCaptures(true);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.m_pbo);
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        slot.m_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.m_frame = m_displayedFrame;
+        m_captureNext = (m_captureNext+1)%CAPTURE_RING_SIZE;
+    }
+    m_capturedFrame = m_displayedFrame;
+}
+
+FrameCapture* Viewer::CreateCapture(const int& frame){
+    FrameCapture* capture = new FrameCapture();
+    capture->m_width = (int)m_resolution.x*m_framebufferScale;
+    capture->m_height = (int)m_resolution.y*m_framebufferScale;
+    capture->m_pixels.resize((size_t)capture->m_width*capture->m_height*3);
+    capture->m_filename = m_sim->GetScene()->m_imagePath;
+    std::string frameString = utilityCore::padString(4, utilityCore::convertIntToString(frame));
+    utilityCore::replaceString(capture->m_filename, ".png", "."+frameString+".png");
+    return capture;
+}
+
+//Slots are scanned oldest first starting from the next one to be written, and stop at the first
+//read that hasn't finished so captures are queued in order. With wait set the oldest read in
+//flight is waited on
+void Viewer::CollectCaptures(const bool& wait){
+    bool block = wait;
+    for(unsigned int i=0; i<CAPTURE_RING_SIZE; i++){
+        CaptureBuffer& slot = m_captureRing[(m_captureNext+i)%CAPTURE_RING_SIZE];
+        if(slot.m_fence==NULL){
+            continue;
+        }
+        GLenum status = glClientWaitSync(slot.m_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 
+                                         block ? 1000000000 : 0);
+        if(status!=GL_ALREADY_SIGNALED && status!=GL_CONDITION_SATISFIED){
+            return;
+        }
+        block = false;
+        glDeleteSync(slot.m_fence);
+        slot.m_fence = NULL;
+        FrameCapture* capture = CreateCapture(slot.m_frame);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.m_pbo);
+        void* pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if(pixels!=NULL){
+            std::memcpy(capture->m_pixels.data(), pixels, capture->m_pixels.size());
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if(pixels!=NULL){
+            QueueCapture(capture);
+        }else{
+            std::cout << "Warning: could not map the capture of frame " << slot.m_frame
+                      << std::endl;
+            delete capture;
+        }
+    }
+}
+
+//Same handoff as the scene's exports: the queue bounds how many frames wait in memory and the
+//arena's threads only ever take work from it
+void Viewer::QueueCapture(FrameCapture* capture){
+    if(m_captureArenaReady==false){
+        m_captureArena.initialize(CAPTURE_THREADS, 0);
+        m_captureQueue.set_capacity(CAPTURE_QUEUE_DEPTH);
+        m_captureArenaReady = true;
+    }
+    m_capturesPending++;
+    m_captureQueue.push(capture); //blocks while the queue is full
+    m_captureArena.enqueue([this](){
+        FrameCapture* next;
+        m_captureQueue.pop(next);
+        EncodeCapture(next);
+        delete next;
+        m_capturesPending--;
+    });
+}
 
-    char anim_filename[2048];
-    sprintf(anim_filename, "%s", (char*)filename.c_str());
-    stbi_write_png(anim_filename, (int)m_resolution.x*m_framebufferScale, 
-                                  (int)m_resolution.y*m_framebufferScale, 3, m_bitmapData, 
-                                  (int)m_resolution.x*m_framebufferScale * 3);
+void Viewer::EncodeCapture(FrameCapture* capture){
+    //GL reads rows bottom first, png stores them top first
+    unsigned int stride = capture->m_width*3;
+    std::vector<unsigned char> row(stride);
+    for(int y=0; y<capture->m_height/2; y++){
+        unsigned char* top = &capture->m_pixels[(size_t)y*stride];
+        unsigned char* bottom = &capture->m_pixels[(size_t)(capture->m_height-1-y)*stride];
+        std::memcpy(row.data(), top, stride);
+        std::memcpy(top, bottom, stride);
+        std::memcpy(bottom, row.data(), stride);
+    }
+    if(stbi_write_png(capture->m_filename.c_str(), capture->m_width, capture->m_height, 3, 
+                      capture->m_pixels.data(), stride)==0){
+        std::cout << "Warning: could not write " << capture->m_filename << std::endl;
+    }else{
+        std::cout << capture->m_filename << std::endl;
+    }
+}
+
+//Blocks until every queued capture has been written
+void Viewer::FlushCaptures(){
+    while(m_capturesPending>0){
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+void Viewer::ReleaseCaptureBuffers(){
+    for(unsigned int b=0; b<CAPTURE_RING_SIZE; b++){
+        if(m_captureRing[b].m_fence!=NULL){
+            glDeleteSync(m_captureRing[b].m_fence);
+            m_captureRing[b].m_fence = NULL;
+        }
+        if(m_captureRing[b].m_pbo!=0){
+            glDeleteBuffers(1, &m_captureRing[b].m_pbo);
+            m_captureRing[b].m_pbo = 0;
+        }
+    }
+    m_captureReady = false;
 }
 
 //====================================
 // Draw/Interaction Loop
 //====================================
 
-void Viewer::UpdateParticles(){
-    //rebuild particles
-    if(m_siminitialized){
-
-        m_sim->GetScene()->m_particleLock.lock();
-
-        //dummy buffer for particles
-        VboData data;
-        std::vector<glm::vec3> vertexData;
-        std::vector<glm::vec4> colorData;
-        unsigned int psize = m_particles->size();
-
-        glm::vec3 gridSize = m_sim->GetDimensions();
-        vertexData.reserve(psize);
-        colorData.reserve(psize);
-        float maxd = glm::max(glm::max(gridSize.x, gridSize.z), gridSize.y);
-
-        unsigned int lpsize = m_sim->GetScene()->GetLiquidParticleCount();
-        // lpsize = m_particles->size();
-        for(unsigned int j=0; j<lpsize; j++){
-            // if(m_particles->operator[](j)->m_type==FLUID){
-                if(!m_particles->operator[](j)->m_invalid || 
-                   (m_particles->operator[](j)->m_invalid && m_drawInvalid)){
-                    vertexData.push_back(m_particles->operator[](j)->m_p*maxd);
-                    float c = glm::length(m_particles->operator[](j)->m_u)/3.0f;
-                    c = glm::max(c, 
-                                 1.0f*glm::max((.7f-m_particles->operator[](j)->m_density),
-                                 0.0f));
-                    bool invalid = m_particles->operator[](j)->m_invalid;
+//Runs on the sim thread between steps, so the particle set is not changing underneath it
+void Viewer::PublishParticles(){
+    //if the viewer is still uploading the other buffer this frame is skipped, the viewer picks
+    //up the next one instead of the sim waiting
+    m_snapshotLock.lock();
+    int back = m_snapshotFront==0 ? 1 : 0;
+    bool busy = m_snapshotReading==back;
+    m_snapshotLock.unlock();
+    if(busy==true){
+        return;
+    }
+
+    ParticleSnapshot* snapshot = &m_snapshots[back];
+    fluidCore::ParticleSet* particles = m_particles;
+    glm::vec3 gridSize = m_sim->GetDimensions();
+    float maxd = glm::max(glm::max(gridSize.x, gridSize.z), gridSize.y);
+    unsigned int lpsize = m_sim->GetScene()->GetLiquidParticleCount();
+    bool drawInvalid = m_drawInvalid;
+    //past the point budget only every stride-th particle by id is drawn. Ids are stable across
+    //sorts, so the same subset stays on screen from frame to frame
+    unsigned int stride = 1;
+    if(m_pointBudget>0 && lpsize>m_pointBudget){
+        stride = (lpsize+m_pointBudget-1)/m_pointBudget;
+    }
 
+    //count drawn particles per block, then each block packs its particles at its offset
+    unsigned int blockCount = (lpsize+SNAPSHOT_BLOCK_SIZE-1)/SNAPSHOT_BLOCK_SIZE;
+    m_snapshotOffsets.assign(blockCount+1, 0);
+    unsigned int* offsets = m_snapshotOffsets.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,blockCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                unsigned int end = glm::min((b+1)*SNAPSHOT_BLOCK_SIZE, lpsize);
+                unsigned int count = 0;
+                for(unsigned int j=b*SNAPSHOT_BLOCK_SIZE; j<end; j++){
+                    bool drawn = (particles->m_invalid[j]==0 || drawInvalid==true) &&
+                                 particles->m_id[j]%stride==0;
+                    count += drawn ? 1 : 0;
+                }
+                offsets[b+1] = count;
+            }
+        }
+    );
+    for(unsigned int b=0; b<blockCount; b++){
+        offsets[b+1] += offsets[b];
+    }
+    unsigned int total = offsets[blockCount];
+    snapshot->m_positions.resize(total);
+    snapshot->m_colors.resize(total);
+    glm::vec3* positions = snapshot->m_positions.data();
+    glm::vec4* colors = snapshot->m_colors.data();
+    tbb::parallel_for(tbb::blocked_range<unsigned int>(0,blockCount),
+        [=](const tbb::blocked_range<unsigned int>& r){
+            for(unsigned int b=r.begin(); b!=r.end(); ++b){
+                unsigned int end = glm::min((b+1)*SNAPSHOT_BLOCK_SIZE, lpsize);
+                unsigned int o = offsets[b];
+                for(unsigned int j=b*SNAPSHOT_BLOCK_SIZE; j<end; j++){
+                    bool invalid = particles->m_invalid[j]!=0;
+                    if((invalid==true && drawInvalid==false) || particles->m_id[j]%stride!=0){
+                        continue;
+                    }
+                    positions[o] = particles->m_p[j]*maxd;
+                    float c = glm::length(particles->m_u[j])/3.0f;
+                    c = glm::max(c, 1.0f*glm::max((.7f-particles->m_density[j]), 0.0f));
                     if(invalid){
-                        colorData.push_back(glm::vec4(1,1,0,0));
-                    }else if(m_particles->operator[](j)->m_type==SOLID){
-                        colorData.push_back(glm::vec4(1,0,0,0));
+                        colors[o] = glm::vec4(1,1,0,0);
+                    }else if(particles->m_type[j]==SOLID){
+                        colors[o] = glm::vec4(1,0,0,0);
                     }else{
-                        /*if(m_particles->operator[](j)->m_temp2){
-                            colorData.push_back(glm::vec4(0,1,0,0));
-                        }else if(m_particles->operator[](j)->m_temp){
-                            colorData.push_back(glm::vec4(1,0,0,0));
-                        }else{*/
-                            colorData.push_back(glm::vec4(c,c,1,0));
-                        //}
+                        colors[o] = glm::vec4(c,c,1,0);
                     }
+                    o++;
                 }
-            // }
-        }
-        glDeleteBuffers(1, &data.m_vboID);
-        glDeleteBuffers(1, &data.m_cboID);
-        std::string key = "fluid";
-        data = CreateVBO(data, (float*)&vertexData[0], vertexData.size()*3, 
-                         (float*)&colorData[0], colorData.size()*4, GL_POINTS, key);
-        glm::mat4 m;
-        for(int x=0; x<4; x++){
-            for(int y=0; y<4; y++){
-                data.m_transform[x][y] = m[x][y];
             }
         }
-        vertexData.clear();
-        colorData.clear();
-        m_vbos.push_back(data);
+    );
+    snapshot->m_count = total;
+
+    snapshot->m_frame = m_sim->m_frame;
+
+    m_snapshotLock.lock();
+    snapshot->m_sequence = ++m_snapshotSequence;
+    m_snapshotFront = back;
+    m_snapshotLock.unlock();
+}
+
+//Uploads the newest snapshot if it hasn't been uploaded yet and keeps the points entry in the
+//draw list, which is relisted every sim frame
+void Viewer::UpdateParticles(){
+    m_snapshotLock.lock();
+    int front = m_snapshotFront;
+    m_snapshotReading = front;
+    m_snapshotLock.unlock();
+    if(front<0){
+        return;
+    }
+    if(m_snapshots[front].m_sequence!=m_particleVbo.m_sequence){
+        UploadParticles(&m_snapshots[front]);
+    }
+    m_snapshotLock.lock();
+    m_snapshotReading = -1;
+    m_snapshotLock.unlock();
+
+    std::map<std::string, int>::iterator it = m_vbokeys.find("fluid");
+    if(it==m_vbokeys.end() || it->second>=(int)m_vbos.size() || 
+       m_vbos[it->second].m_key!="fluid"){
+        m_vbos.push_back(m_particleVbo.m_data);
         m_vbokeys["fluid"] = m_vbos.size()-1;
+    }else{
+        m_vbos[it->second] = m_particleVbo.m_data;
+    }
+}
+
+void Viewer::UploadParticles(ParticleSnapshot* snapshot){
+    unsigned int count = snapshot->m_count;
+    if(count>m_particleVbo.m_capacity){
+        ResizeParticleVbo(count + count/2);
+    }
+    if(m_particleVbo.m_persistent==true){
+        //the mapping is coherent, so the copy only has to wait for the last draw to finish
+        if(m_particleVbo.m_fence!=NULL){
+            glClientWaitSync(m_particleVbo.m_fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+            glDeleteSync(m_particleVbo.m_fence);
+            m_particleVbo.m_fence = NULL;
+        }
+        std::memcpy(m_particleVbo.m_positions, snapshot->m_positions.data(), 
+                    count*sizeof(glm::vec3));
+        std::memcpy(m_particleVbo.m_colors, snapshot->m_colors.data(), count*sizeof(glm::vec4));
+    }else if(count>0){
+        glBindBuffer(GL_ARRAY_BUFFER, m_particleVbo.m_data.m_vboID);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, count*sizeof(glm::vec3), 
+                        snapshot->m_positions.data());
+        glBindBuffer(GL_ARRAY_BUFFER, m_particleVbo.m_data.m_cboID);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, count*sizeof(glm::vec4), snapshot->m_colors.data());
+    }
+    m_particleVbo.m_data.m_size = count*3;
+    m_particleVbo.m_sequence = snapshot->m_sequence;
+    m_displayedFrame = snapshot->m_frame;
+    UpdateMemoryUsage(snapshot);
+}
 
-        m_sim->GetScene()->m_particleLock.unlock();
+//The sim thread may be packing the other snapshot, so both are counted at the capacity of the
+//one being read. They grow together and are never more than a frame apart
+void Viewer::UpdateMemoryUsage(ParticleSnapshot* snapshot){
+    size_t snapshots = 2*(snapshot->m_positions.capacity()*sizeof(glm::vec3) + 
+                          snapshot->m_colors.capacity()*sizeof(glm::vec4));
+    size_t particleVbo = (size_t)m_particleVbo.m_capacity*(sizeof(glm::vec3)+sizeof(glm::vec4));
+    size_t captures = 0;
+    if(m_captureRing[0].m_pbo!=0){
+        captures = CAPTURE_RING_SIZE*(size_t)m_resolution.x*m_framebufferScale*
+                   (size_t)m_resolution.y*m_framebufferScale*3;
+    }
+    m_memory.Update(snapshots + particleVbo + m_meshVboBytes + captures);
+}
+
+//Reallocates the points buffers, the only time they are ever deleted and recreated
+void Viewer::ResizeParticleVbo(const unsigned int& capacity){
+    if(m_particleVbo.m_data.m_vboID!=0){
+        if(m_particleVbo.m_persistent==true){
+            glBindBuffer(GL_ARRAY_BUFFER, m_particleVbo.m_data.m_vboID);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            glBindBuffer(GL_ARRAY_BUFFER, m_particleVbo.m_data.m_cboID);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        }
+        if(m_particleVbo.m_fence!=NULL){
+            glDeleteSync(m_particleVbo.m_fence);
+            m_particleVbo.m_fence = NULL;
+        }
+        glDeleteBuffers(1, &m_particleVbo.m_data.m_vboID);
+        glDeleteBuffers(1, &m_particleVbo.m_data.m_cboID);
+    }
+    m_particleVbo.m_capacity = capacity;
+    m_particleVbo.m_persistent = GLEW_ARB_buffer_storage==true;
+    glGenBuffers(1, &m_particleVbo.m_data.m_vboID);
+    glGenBuffers(1, &m_particleVbo.m_data.m_cboID);
+    GLsizeiptr positionBytes = capacity*sizeof(glm::vec3);
+    GLsizeiptr colorBytes = capacity*sizeof(glm::vec4);
+    if(m_particleVbo.m_persistent==true){
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBindBuffer(GL_ARRAY_BUFFER, m_particleVbo.m_data.m_vboID);
+        glBufferStorage(GL_ARRAY_BUFFER, positionBytes, NULL, flags);
+        m_particleVbo.m_positions = (glm::vec3*)glMapBufferRange(GL_ARRAY_BUFFER, 0, 
+                                                                 positionBytes, flags);
+        glBindBuffer(GL_ARRAY_BUFFER, m_particleVbo.m_data.m_cboID);
+        glBufferStorage(GL_ARRAY_BUFFER, colorBytes, NULL, flags);
+        m_particleVbo.m_colors = (glm::vec4*)glMapBufferRange(GL_ARRAY_BUFFER, 0, colorBytes,
+                                                              flags);
+    }else{
+        glBindBuffer(GL_ARRAY_BUFFER, m_particleVbo.m_data.m_vboID);
+        glBufferData(GL_ARRAY_BUFFER, positionBytes, NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, m_particleVbo.m_data.m_cboID);
+        glBufferData(GL_ARRAY_BUFFER, colorBytes, NULL, GL_DYNAMIC_DRAW);
+        m_particleVbo.m_positions = NULL;
+        m_particleVbo.m_colors = NULL;
     }
 }
 
 void Viewer::MainLoop(){
     while (!glfwWindowShouldClose(m_window)){
 
-        if(m_currentFrame==0 && m_siminitialized==true){
-            UpdateParticles();
-        }
-
-        //check if frame has incremented; if yes, rebuild vbos
+        //check if frame has incremented; if yes, relist the mesh vbos
         if(m_currentFrame!=m_sim->m_frame){
-            m_vbos.clear();
             m_currentFrame = m_sim->m_frame;
-            UpdateParticles();
             UpdateMeshes();
         }
+        UpdateParticles();
 
         glClearColor(0.325, 0.325, 0.325, 1.0);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -257,6 +559,14 @@ void Viewer::MainLoop(){
                     }else if(m_vbos[i].m_type==GL_POINTS){
                         glPointSize(5.0f);
                         glDrawArrays(GL_POINTS, 0, m_vbos[i].m_size/3);
+                        if(m_particleVbo.m_persistent==true && 
+                           m_vbos[i].m_vboID==m_particleVbo.m_data.m_vboID){
+                            if(m_particleVbo.m_fence!=NULL){
+                                glDeleteSync(m_particleVbo.m_fence);
+                            }
+                            m_particleVbo.m_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE,
+                                                                0);
+                        }
                     }
                     glDisableClientState(GL_VERTEX_ARRAY);
                     glDisableClientState(GL_COLOR_ARRAY);
@@ -296,24 +606,22 @@ void Viewer::MainLoop(){
 
         glPopMatrix();
 
+        //the back buffer is read before the swap, once per sim frame that reaches the screen
+        CollectCaptures(false);
+        if(m_dumpFramebuffer==true && m_displayedFrame>=0 && m_displayedFrame!=m_capturedFrame){
+            CaptureFramebuffer();
+        }
+
         glfwSwapBuffers(m_window);
         glfwPollEvents();
         UpdateInputs();
-
-        if(m_dumpFramebuffer==true){
-            m_framebufferWriteLock.lock();
-            {
-                for(unsigned int i=0; i<m_resolution.y*m_framebufferScale; ++i){
-                    glReadPixels(0,i,(int)m_resolution.x*m_framebufferScale, 1, GL_RGB, 
-                                 GL_UNSIGNED_BYTE, 
-                                 m_bitmapData + ((int)m_resolution.x*m_framebufferScale * 3 * 
-                                 (((int)m_resolution.y*m_framebufferScale-1)-i)));
-                }
-            }
-            m_framebufferWriteLock.unlock();
-            m_dumpReady = true; 
-        }
     }
+    for(unsigned int b=0; b<CAPTURE_RING_SIZE; b++){
+        CollectCaptures(true);
+    }
+    FlushCaptures();
+    ReleaseCaptureBuffers();
+    ReleaseMeshVbos();
     glfwDestroyWindow(m_window);
     glfwTerminate();
 }
@@ -425,7 +733,6 @@ void Viewer::UpdateInputs(){
     }else if(glfwGetKey(m_window, GLFW_KEY_R) == GLFW_PRESS){
         if(m_cam.m_currentKey!=GLFW_KEY_R){
             m_dumpFramebuffer = !m_dumpFramebuffer;
-            m_dumpReady = false;
             m_cam.m_currentKey = GLFW_KEY_R;
             if(m_dumpFramebuffer){
                 std::cout << "\nFramebuffer recording ON.\n" << std::endl;
@@ -486,64 +793,51 @@ void Viewer::UpdateInputs(){
     }
 }
 
+//Lists every mesh in frame for drawing, uploading only the meshes whose frame changed
 void Viewer::UpdateMeshes(){
-    //buffer for sim bounding box
+    m_vbos.clear();
+
+    //the sim bounding box never changes, so it is tessellated once
     std::string key = "boundingbox";
-    glm::vec3 res = m_sim->GetDimensions();
-    geomCore::CubeGen cubebuilder;
-    objCore::Obj* simboundingbox = new objCore::Obj();
-    cubebuilder.Tesselate(simboundingbox, glm::vec3(0), res);
-    VboData data = CreateVBOFromObj(simboundingbox, glm::vec4(.2,.2,.2,0), key);
-    glm::mat4 m;
-    for(int x=0; x<4; x++){
-        for(int y=0; y<4; y++){
-            data.m_transform[x][y] = m[x][y];
-        }
+    std::map<std::string, MeshVbo>::iterator box = m_meshVbos.find(key);
+    if(box==m_meshVbos.end()){
+        MeshVbo& mesh = m_meshVbos[key];
+        mesh.m_data.m_vboID = 0;
+        mesh.m_data.m_cboID = 0;
+        mesh.m_data.m_key = key;
+        mesh.m_capacity = 0;
+        mesh.m_lerpWeight = 0.0f;
+        geomCore::CubeGen cubebuilder;
+        objCore::Obj simboundingbox;
+        cubebuilder.Tesselate(&simboundingbox, glm::vec3(0), m_sim->GetDimensions());
+        std::vector<glm::vec3> vertices;
+        GLenum type;
+        TessellateObj(&simboundingbox, &simboundingbox, 0.0f, vertices, type);
+        UploadMeshVbo(mesh, vertices, type, glm::vec4(.2,.2,.2,0), GL_STATIC_DRAW);
+        mesh.m_meshFrame = 0;
+        box = m_meshVbos.find(key);
     }
-    m_vbos.push_back(data);
+    ListMeshVbo(box->second, glm::mat4());
     m_vbokeys["boundingbox"] = m_vbos.size()-1;
 
+    //lazily loaded mesh frames can't be evicted while they are copied into vbos
+    m_sim->GetScene()->m_meshFrameLock.lock();
+
     std::vector<geomCore::Geom*> solids = m_sim->GetScene()->GetSolidGeoms();
     unsigned int numberOfSolidObjects = solids.size();
     for(unsigned int i=0; i<numberOfSolidObjects; i++){
         key = "solid_"+utilityCore::convertIntToString(i);
-        if(solids[i]->GetType()==MESH){
-            if(CreateVBOFromMeshContainer(dynamic_cast<geomCore::MeshContainer*>
-                                          (solids[i]->m_geom), (float)m_currentFrame, 
-                                          glm::vec4(1,0,0,.75), key, data)==true){
-                m_vbos.push_back(data);
-                m_vbokeys[key] = m_vbos.size()-1;
-            }
-        }else if(solids[i]->GetType()==ANIMMESH){
-            if(CreateVBOFromAnimmeshContainer(dynamic_cast<geomCore::AnimatedMeshContainer*>
-                                              (solids[i]->m_geom), (float)m_currentFrame, 
-                                              glm::vec4(1,0,0,.75), key, data)==true){
-                m_vbos.push_back(data);
-                m_vbokeys[key] = m_vbos.size()-1;
-            }
-        }
+        UpdateMeshVbo(solids[i], glm::vec4(1,0,0,.75), key);
     }
 
     std::vector<geomCore::Geom*> liquids = m_sim->GetScene()->GetLiquidGeoms();
     unsigned int numberOfLiquidObjects = liquids.size();
     for(unsigned int i=0; i<numberOfLiquidObjects; i++){
         key = "liquid_"+utilityCore::convertIntToString(i);
-        if(liquids[i]->GetType()==MESH){
-            if(CreateVBOFromMeshContainer(dynamic_cast<geomCore::MeshContainer*>
-                                          (liquids[i]->m_geom), (float)m_currentFrame, 
-                                          glm::vec4(0,0,1,.75), key, data)==true){
-                m_vbos.push_back(data);
-                m_vbokeys[key] = m_vbos.size()-1;
-            }
-        }else if(liquids[i]->GetType()==ANIMMESH){
-            if(CreateVBOFromAnimmeshContainer(dynamic_cast<geomCore::AnimatedMeshContainer*>
-                                              (liquids[i]->m_geom), (float)m_currentFrame, 
-                                              glm::vec4(0,0,1,.75), key, data)==true){
-                m_vbos.push_back(data);
-                m_vbokeys[key] = m_vbos.size()-1;
-            }
-        }
+        UpdateMeshVbo(liquids[i], glm::vec4(0,0,1,.75), key);
     }
+
+    m_sim->GetScene()->m_meshFrameLock.unlock();
 }
 
 //====================================
@@ -590,178 +884,150 @@ bool Viewer::Init(){
     return true;
 }
 
-VboData Viewer::CreateVBO(VboData& data, float* vertices, const unsigned int& vertexcount, 
-                          float* colors, const unsigned int& colorcount, const GLenum& type, 
-                          const std::string& key){
-    data.m_size = vertexcount;
-    glGenBuffers(1, &data.m_vboID);
-    glGenBuffers(1, &data.m_cboID);
-    //bind vbo
-    glBindBuffer(GL_ARRAY_BUFFER, data.m_vboID);
-    glBufferData(GL_ARRAY_BUFFER, data.m_size*sizeof(float), vertices, GL_STATIC_DRAW);
-    //bind cbo
-    glBindBuffer(GL_ARRAY_BUFFER, data.m_cboID);
-    glBufferData(GL_ARRAY_BUFFER, colorcount*sizeof(float), colors, GL_STATIC_DRAW);
-
-    data.m_type = type;
-    data.m_key = key;
-    return data;
-}
-
-bool Viewer::CreateVBOFromMeshContainer(geomCore::MeshContainer* o, const float& frame, 
-                                        const glm::vec4& color, const std::string& key,
-                                        VboData& data){
+//Lists geom's mesh if it is in frame, false if it isn't or isn't a mesh. Plain meshes are
+//re-tessellated only when their mesh frame changes, animated meshes also when their keyframe
+//weight does
+bool Viewer::UpdateMeshVbo(geomCore::Geom* geom, const glm::vec4& color, const std::string& key){
+    float frame = (float)m_currentFrame;
     glm::mat4 transform;
     glm::mat4 inversetransform;
-    if(o->GetTransforms(frame, transform, inversetransform)==false){
+    int meshFrame;
+    float lerpWeight = 0.0f;
+    bool dynamic = true;
+    objCore::Obj* o0 = NULL;
+    objCore::Obj* o1 = NULL;
+    if(geom->GetType()==MESH){
+        geomCore::MeshContainer* o = dynamic_cast<geomCore::MeshContainer*>(geom->m_geom);
+        if(o->GetTransforms(frame, transform, inversetransform)==false){
+            return false;
+        }
+        meshFrame = o->GetMeshFrameIndex(frame);
+        dynamic = o->m_numberOfFrames>1;
+        o0 = &o->GetMeshFrame(frame)->m_basegeom;
+        o1 = o0;
+    }else if(geom->GetType()==ANIMMESH){
+        geomCore::AnimatedMeshContainer* o = 
+            dynamic_cast<geomCore::AnimatedMeshContainer*>(geom->m_geom);
+        if(o->GetTransforms(frame, transform, inversetransform)==false){
+            return false;
+        }
+        meshFrame = o->GetMeshFrameIndex(frame);
+        lerpWeight = o->GetInterpolationWeight(frame);
+        objCore::InterpolatedObj* io = &o->GetMeshFrame(frame)->m_basegeom;
+        o0 = io->m_obj0;
+        o1 = io->m_obj1;
+    }else{
         return false;
     }
-    data = CreateVBOFromObj(&o->GetMeshFrame(frame)->m_basegeom, color, key);
+
+    std::map<std::string, MeshVbo>::iterator it = m_meshVbos.find(key);
+    if(it==m_meshVbos.end()){
+        MeshVbo& mesh = m_meshVbos[key];
+        mesh.m_data.m_vboID = 0;
+        mesh.m_data.m_cboID = 0;
+        mesh.m_data.m_key = key;
+        mesh.m_meshFrame = -1;
+        mesh.m_lerpWeight = 0.0f;
+        mesh.m_capacity = 0;
+        it = m_meshVbos.find(key);
+    }
+    MeshVbo& mesh = it->second;
+    if(mesh.m_meshFrame!=meshFrame || mesh.m_lerpWeight!=lerpWeight){
+        std::vector<glm::vec3> vertices;
+        GLenum type;
+        TessellateObj(o0, o1, lerpWeight, vertices, type);
+        UploadMeshVbo(mesh, vertices, type, color, dynamic ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
+        mesh.m_meshFrame = meshFrame;
+        mesh.m_lerpWeight = lerpWeight;
+    }
+    ListMeshVbo(mesh, transform);
+    m_vbokeys[key] = m_vbos.size()-1;
+    return true;
+}
+
+void Viewer::ListMeshVbo(MeshVbo& mesh, const glm::mat4& transform){
     for(int x=0; x<4; x++){
         for(int y=0; y<4; y++){
-            data.m_transform[x][y] = transform[x][y];
+            mesh.m_data.m_transform[x][y] = transform[x][y];
         }
     }
-    return true;
+    m_vbos.push_back(mesh.m_data);
 }
 
-bool Viewer::CreateVBOFromAnimmeshContainer(geomCore::AnimatedMeshContainer* o, const float& frame,
-                                            const glm::vec4& color, const std::string& key,
-                                            VboData& data){
-    glm::mat4 transform;
-    glm::mat4 inversetransform;
-    if(o->GetTransforms(frame, transform, inversetransform)==false){
-        return false;
+//Meshes whose first poly is a quad are drawn as quads with triangles repeating their first
+//corner, any other mesh as triangles with its quads split in two
+void Viewer::TessellateObj(objCore::Obj* o0, objCore::Obj* o1, const float& lerpWeight,
+                           std::vector<glm::vec3>& vertices, GLenum& type){
+    vertices.clear();
+    type = GL_TRIANGLES;
+    if(o0->m_numberOfPolys==0){
+        return;
     }
-    //get objs that we need and interp weight
-    objCore::InterpolatedObj* io = &o->GetMeshFrame(frame)->m_basegeom;
-    objCore::Obj* o0 = io->m_obj0;
-    objCore::Obj* o1 = io->m_obj1;
-    float lerpWeight = o->GetInterpolationWeight(frame);
-
-    //build vertex buffers
-    std::vector<glm::vec3> vertexData;
-    std::vector<glm::vec4> colorData;
-
     glm::uvec4 fcheck = o0->m_polyVertexIndices[0];
     if(int(fcheck[3])-1>0){
-        for(unsigned int i=0; i<o0->m_numberOfPolys; i++){
-            glm::uvec4 f = o0->m_polyVertexIndices[i];
-            glm::vec3 p0 = o0->m_vertices[int(f[0])-1] * (1.0f-lerpWeight) +
-                           o1->m_vertices[int(f[0])-1] * lerpWeight;
-            glm::vec3 p1 = o0->m_vertices[int(f[1])-1] * (1.0f-lerpWeight) +
-                           o1->m_vertices[int(f[1])-1] * lerpWeight;
-            glm::vec3 p2 = o0->m_vertices[int(f[2])-1] * (1.0f-lerpWeight) +
-                           o1->m_vertices[int(f[2])-1] * lerpWeight;
-            glm::vec3 p3 = o0->m_vertices[int(f[3])-1] * (1.0f-lerpWeight) +
-                           o1->m_vertices[int(f[3])-1] * lerpWeight;
-            if(int(f[3])-1>=0){
-                p3 = p0;
-            }
-            vertexData.push_back(p0);
-            vertexData.push_back(p1);
-            vertexData.push_back(p2);
-            vertexData.push_back(p3);      
-        }
-        unsigned int vcount = vertexData.size();
-        for(unsigned int i=0; i<vcount; i++){
-            colorData.push_back(color);
-        }
-        data = CreateVBO(data, (float*)&vertexData[0], vertexData.size()*3, (float*)&colorData[0],
-                         colorData.size()*4, GL_QUADS, key);
-        colorData.clear();
-    }else{
-        for(unsigned int i=0; i<o0->m_numberOfPolys; i++){
-            glm::uvec4 f = o0->m_polyVertexIndices[i];
-            glm::vec3 p0 = o0->m_vertices[int(f[0])-1] * (1.0f-lerpWeight) +
-                           o1->m_vertices[int(f[0])-1] * lerpWeight;
-            glm::vec3 p1 = o0->m_vertices[int(f[1])-1] * (1.0f-lerpWeight) +
-                           o1->m_vertices[int(f[1])-1] * lerpWeight;
-            glm::vec3 p2 = o0->m_vertices[int(f[2])-1] * (1.0f-lerpWeight) +
-                           o1->m_vertices[int(f[2])-1] * lerpWeight;
-            vertexData.push_back(p0);
-            vertexData.push_back(p1);
-            vertexData.push_back(p2);  
-            if(int(f[3])-1>=0){
-                glm::vec3 p3 = o0->m_vertices[int(f[3])-1] * (1.0f-lerpWeight) +
-                               o1->m_vertices[int(f[3])-1] * lerpWeight;
-                vertexData.push_back(p3);
-                vertexData.push_back(p1);
-                vertexData.push_back(p2); 
-            }    
-        }
-        unsigned int vcount = vertexData.size();
-        for(unsigned int i=0; i<vcount; i++){
-            colorData.push_back(color);
-        }
-        data = CreateVBO(data, (float*)&vertexData[0], vertexData.size()*3, (float*)&colorData[0],
-                         colorData.size()*4, GL_TRIANGLES, key); 
-        colorData.clear();
-    }
-    vertexData.clear();
-    //build transform
-    for(int x=0; x<4; x++){
-        for(int y=0; y<4; y++){
-            data.m_transform[x][y] = transform[x][y];
+        type = GL_QUADS;
+    }
+    vertices.reserve(o0->m_numberOfPolys*(type==GL_QUADS ? 4 : 6));
+    for(unsigned int i=0; i<o0->m_numberOfPolys; i++){
+        glm::uvec4 f = o0->m_polyVertexIndices[i];
+        unsigned int corners = int(f[3])-1>=0 ? 4 : 3;
+        glm::vec3 p[4];
+        for(unsigned int c=0; c<corners; c++){
+            p[c] = o0->m_vertices[int(f[c])-1] * (1.0f-lerpWeight) +
+                   o1->m_vertices[int(f[c])-1] * lerpWeight;
+        }
+        vertices.push_back(p[0]);
+        vertices.push_back(p[1]);
+        vertices.push_back(p[2]);
+        if(type==GL_QUADS){
+            vertices.push_back(corners==4 ? p[3] : p[0]);
+        }else if(corners==4){
+            vertices.push_back(p[3]);
+            vertices.push_back(p[1]);
+            vertices.push_back(p[2]);
         }
     }
-    return true;
 }
 
-VboData Viewer::CreateVBOFromObj(objCore::Obj* o, const glm::vec4& color, const std::string& key){
-    VboData data;
-    std::vector<glm::vec3> vertexData;
-    std::vector<glm::vec4> colorData;
+//Overwrites the vertex buffer in place while the vertices fit, the color buffer only changes
+//when the buffers are reallocated since every vertex of a mesh has the same color
+void Viewer::UploadMeshVbo(MeshVbo& mesh, const std::vector<glm::vec3>& vertices, 
+                           const GLenum& type, const glm::vec4& color, const GLenum& usage){
+    unsigned int count = vertices.size();
+    if(mesh.m_data.m_vboID==0 || count>mesh.m_capacity){
+        if(mesh.m_data.m_vboID!=0){
+            glDeleteBuffers(1, &mesh.m_data.m_vboID);
+            glDeleteBuffers(1, &mesh.m_data.m_cboID);
+            m_meshVboBytes -= (size_t)mesh.m_capacity*(sizeof(glm::vec3)+sizeof(glm::vec4));
+        }
+        std::vector<glm::vec4> colors(count, color);
+        glGenBuffers(1, &mesh.m_data.m_vboID);
+        glGenBuffers(1, &mesh.m_data.m_cboID);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.m_data.m_vboID);
+        glBufferData(GL_ARRAY_BUFFER, count*sizeof(glm::vec3), 
+                     count>0 ? vertices.data() : NULL, usage);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.m_data.m_cboID);
+        glBufferData(GL_ARRAY_BUFFER, count*sizeof(glm::vec4), 
+                     count>0 ? colors.data() : NULL, GL_STATIC_DRAW);
+        mesh.m_capacity = count;
+        m_meshVboBytes += (size_t)count*(sizeof(glm::vec3)+sizeof(glm::vec4));
+    }else if(count>0){
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.m_data.m_vboID);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, count*sizeof(glm::vec3), vertices.data());
+    }
+    mesh.m_data.m_size = count*3;
+    mesh.m_data.m_type = type;
+}
 
-    glm::uvec4 fcheck = o->m_polyVertexIndices[0];
-    if(int(fcheck[3])-1>0){
-        for(unsigned int i=0; i<o->m_numberOfPolys; i++){
-            glm::uvec4 f = o->m_polyVertexIndices[i];
-            glm::vec3 p0 = o->m_vertices[int(f[0])-1];
-            glm::vec3 p1 = o->m_vertices[int(f[1])-1];
-            glm::vec3 p2 = o->m_vertices[int(f[2])-1];
-            glm::vec3 p3 = o->m_vertices[int(f[3])-1];
-            if(f[3]-1<0){
-                p3 = p0;
-            }
-            vertexData.push_back(p0);
-            vertexData.push_back(p1);
-            vertexData.push_back(p2);
-            vertexData.push_back(p3);      
-        }
-        unsigned int vcount = vertexData.size();
-        for(unsigned int i=0; i<vcount; i++){
-            colorData.push_back(color);
-        }
-        data = CreateVBO(data, (float*)&vertexData[0], vertexData.size()*3, (float*)&colorData[0],
-                         colorData.size()*4, GL_QUADS, key);
-        colorData.clear();
-    }else{
-        for(unsigned int i=0; i<o->m_numberOfPolys; i++){
-            glm::uvec4 f = o->m_polyVertexIndices[i];
-            glm::vec3 p0 = o->m_vertices[int(f[0])-1];
-            glm::vec3 p1 = o->m_vertices[int(f[1])-1];
-            glm::vec3 p2 = o->m_vertices[int(f[2])-1];
-            vertexData.push_back(p0);
-            vertexData.push_back(p1);
-            vertexData.push_back(p2);  
-            if(int(f[3])-1>=0){
-                glm::vec3 p3 = o->m_vertices[f[3]-1];
-                vertexData.push_back(p3);
-                vertexData.push_back(p1);
-                vertexData.push_back(p2); 
-            }    
-        }
-        unsigned int vcount = vertexData.size();
-        for(unsigned int i=0; i<vcount; i++){
-            colorData.push_back(color);
-        }
-        data = CreateVBO(data, (float*)&vertexData[0], vertexData.size()*3, (float*)&colorData[0],
-                         colorData.size()*4, GL_TRIANGLES, key); 
-        colorData.clear();
-    }
-    vertexData.clear();
-    return data;
+void Viewer::ReleaseMeshVbos(){
+    for(std::map<std::string, MeshVbo>::iterator it=m_meshVbos.begin(); it!=m_meshVbos.end();
+        ++it){
+        glDeleteBuffers(1, &it->second.m_data.m_vboID);
+        glDeleteBuffers(1, &it->second.m_data.m_cboID);
+    }
+    m_meshVbos.clear();
+    m_vbos.clear();
+    m_meshVboBytes = 0;
 }
 
 //====================================
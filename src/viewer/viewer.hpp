@@ -22,6 +22,16 @@
 #include <map>
 #include "../sim/flip.hpp"
 
+//particles per task when the sim thread packs a snapshot
+#define SNAPSHOT_BLOCK_SIZE 4096
+//framebuffer readbacks that may be in flight at once
+#define CAPTURE_RING_SIZE 3
+//captured frames waiting to be encoded, capturing blocks the draw loop once this many are queued
+#define CAPTURE_QUEUE_DEPTH 4
+#define CAPTURE_THREADS 2
+//liquid particles drawn at most, larger sims draw a stable subset picked by particle id
+#define DEFAULT_POINT_BUDGET 4000000
+
 namespace viewerCore {
 
 struct VboData{
@@ -33,6 +43,54 @@ struct VboData{
     GLfloat         m_transform[4][4];
 };
 
+//GPU copy of one scene mesh, kept for the whole session. Static meshes upload once, a mesh whose
+//frame or keyframe weight changes rewrites only its vertex buffer, in place while the vertex
+//count fits
+struct MeshVbo{
+    VboData         m_data;
+    int             m_meshFrame; //mesh frame index uploaded, -1 before the first upload
+    float           m_lerpWeight; //keyframe weight uploaded, animated meshes only
+    unsigned int    m_capacity; //vertices the buffers hold
+};
+
+//Drawable copy of one sim frame's liquid particles, positions already scaled to grid units
+struct ParticleSnapshot{
+    std::vector<glm::vec3>  m_positions;
+    std::vector<glm::vec4>  m_colors;
+    unsigned int            m_count;
+    unsigned int            m_sequence; //bumped on every publish
+    int                     m_frame; //sim frame the particles were taken from
+};
+
+//Points buffers that live for the whole session and only grow. With ARB_buffer_storage both stay
+//persistently mapped and snapshots are copied straight into them, otherwise they are refilled
+//with glBufferSubData
+struct ParticleVbo{
+    VboData         m_data;
+    unsigned int    m_capacity; //particles
+    bool            m_persistent;
+    glm::vec3*      m_positions; //mapped storage, NULL unless persistent
+    glm::vec4*      m_colors;
+    GLsync          m_fence; //last draw that read the buffers
+    unsigned int    m_sequence; //snapshot currently uploaded
+};
+
+//One slot of the readback ring. Frames are read into a pixel pack buffer and only mapped once
+//the fence behind the read has passed, so the draw loop never waits on the transfer
+struct CaptureBuffer{
+    GLuint          m_pbo; //0 when pixel buffer objects are unsupported
+    GLsync          m_fence; //NULL while the slot is free
+    int             m_frame;
+};
+
+//A captured frame waiting for the encode arena, rows bottom first as GL reads them
+struct FrameCapture{
+    std::vector<unsigned char>  m_pixels;
+    std::string                 m_filename;
+    int                         m_width;
+    int                         m_height;
+};
+
 //Used just for tracking OpenGL viewport camera position/keeping in sync with rendercam
 struct GLCamera{
     glm::vec2       m_mouseOld;
@@ -69,6 +127,9 @@ class Viewer{
         ~Viewer();
 
         bool Launch();
+        void SetFrameLimit(const int& frames);
+        //0 draws every particle
+        void SetPointBudget(const unsigned int& points);
         void Load(fluidCore::FlipSim* sim, const bool& retina);
         void Load(fluidCore::FlipSim* sim, const bool& retina, const glm::vec2& resolution, 
                   const glm::vec3& camrotate, const glm::vec3& camtranslate, 
@@ -86,19 +147,34 @@ class Viewer{
         void UpdateParticles();
         void UpdateMeshes();
 
-        //VBO stuff
-        VboData CreateVBO(VboData& data, float* vertices, const unsigned int& vertexcount, 
-                          float* colors, const unsigned int& colorcount, const GLenum& type, 
-                          const std::string& key);
-        VboData CreateVBOFromObj(objCore::Obj* o, const glm::vec4& color, const std::string& key);
-        bool CreateVBOFromMeshContainer(geomCore::MeshContainer* o, const float& frame, 
-                                        const glm::vec4& color, const std::string& key,
-                                        VboData& data);
-        bool CreateVBOFromAnimmeshContainer(geomCore::AnimatedMeshContainer* o, const float& frame,
-                                            const glm::vec4& color, const std::string& key,
-                                            VboData& data);
-
-        void SaveFrame();
+        //Particle handoff. The sim thread packs a snapshot into the buffer the viewer isn't
+        //reading and publishes it by swapping the front index, so neither thread waits on the
+        //other for more than the swap
+        void PublishParticles();
+        void UploadParticles(ParticleSnapshot* snapshot);
+        void ResizeParticleVbo(const unsigned int& capacity);
+        void UpdateMemoryUsage(ParticleSnapshot* snapshot);
+
+        //VBO stuff. Mesh vbos are cached by key in m_meshVbos and listed in m_vbos while their
+        //geom is in frame
+        bool UpdateMeshVbo(geomCore::Geom* geom, const glm::vec4& color, const std::string& key);
+        void ListMeshVbo(MeshVbo& mesh, const glm::mat4& transform);
+        //o1 is blended in by lerpWeight, pass o0 twice for a plain mesh
+        void TessellateObj(objCore::Obj* o0, objCore::Obj* o1, const float& lerpWeight,
+                           std::vector<glm::vec3>& vertices, GLenum& type);
+        void UploadMeshVbo(MeshVbo& mesh, const std::vector<glm::vec3>& vertices, 
+                           const GLenum& type, const glm::vec4& color, const GLenum& usage);
+        void ReleaseMeshVbos();
+
+        //Framebuffer dumps. Every sim frame that reaches the screen is read back once and
+        //encoded to png on the capture arena, the sim thread never takes part
+        void CaptureFramebuffer();
+        FrameCapture* CreateCapture(const int& frame);
+        void CollectCaptures(const bool& wait);
+        void QueueCapture(FrameCapture* capture);
+        void EncodeCapture(FrameCapture* capture);
+        void FlushCaptures();
+        void ReleaseCaptureBuffers();
 
         //Interface callbacks
         static void ErrorCallback(int error, const char* description);      
@@ -109,11 +185,12 @@ class Viewer{
         bool                                            m_runrender;
         glm::vec2                                       m_resolution;
         GLFWwindow*                                     m_window;
-        std::vector<VboData>                            m_vbos;
+        std::vector<VboData>                            m_vbos; //draw list
+        std::map<std::string, MeshVbo>                  m_meshVbos;
         std::map<std::string, int>                      m_vbokeys;
         std::map<std::string, glm::vec2>                m_frameranges;
         GLCamera                                        m_cam;
-        std::vector<fluidCore::Particle*>*              m_particles;
+        fluidCore::ParticleSet*                         m_particles;
         std::vector<rayCore::Ray>                       m_rays;
         std::vector<glm::vec3>                          m_rayendpoints;
 
@@ -122,18 +199,37 @@ class Viewer{
         bool                                            m_drawobjects;
         bool                                            m_drawInvalid;
         
-        unsigned char*                                  m_bitmapData;
         bool                                            m_dumpFramebuffer;
-        bool                                            m_dumpReady;
         bool                                            m_pause;
-        tbb::mutex                                      m_framebufferWriteLock;
         int                                             m_framebufferScale;
 
+        CaptureBuffer                                   m_captureRing[CAPTURE_RING_SIZE];
+        unsigned int                                    m_captureNext; //slot of the next read
+        bool                                            m_captureReady; //ring allocated
+        int                                             m_capturedFrame; //-1 before the first
+        int                                             m_displayedFrame; //-1 before the first
+        tbb::task_arena                                 m_captureArena;
+        tbb::concurrent_bounded_queue<FrameCapture*>    m_captureQueue;
+        tbb::atomic<int>                                m_capturesPending;
+        bool                                            m_captureArenaReady;
+
         bool                                            m_dumpVDB;
         bool                                            m_dumpOBJ;
         bool                                            m_dumpPARTIO;
 
+        ParticleSnapshot                                m_snapshots[2];
+        std::vector<unsigned int>                       m_snapshotOffsets;
+        int                                             m_snapshotFront; //-1 until published
+        int                                             m_snapshotReading; //-1 when idle
+        unsigned int                                    m_snapshotSequence;
+        tbb::spin_mutex                                 m_snapshotLock;
+        ParticleVbo                                     m_particleVbo;
+        size_t                                          m_meshVboBytes; //cached mesh vbos
+        unsigned int                                    m_pointBudget;
+        utilityCore::MemoryRecord                       m_memory;
+
         unsigned int                                    m_currentFrame;
+        int                                             m_frameLimit; //-1 steps forever
 };
 }
 